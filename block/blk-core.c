@@ -1785,6 +1785,7 @@ struct request *blk_peek_request(struct request_queue *q)
 			 * not be passed by new incoming requests
 			 */
 			rq->cmd_flags |= REQ_STARTED;
+			elv_latency_issued(q, rq);
 			trace_block_rq_issue(q, rq);
 		}
 
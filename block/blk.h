@@ -68,6 +68,15 @@ static inline struct request *__elv_next_request(struct request_queue *q)
 	}
 }
 
+#ifdef CONFIG_ELV_LATENCY_HIST
+void elv_latency_issued(struct request_queue *q, struct request *rq);
+#else
+static inline void elv_latency_issued(struct request_queue *q,
+				      struct request *rq)
+{
+}
+#endif
+
 static inline void elv_activate_rq(struct request_queue *q, struct request *rq)
 {
 	struct elevator_queue *e = q->elevator;
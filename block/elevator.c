@@ -35,6 +35,7 @@
 #include <linux/blktrace_api.h>
 #include <linux/hash.h>
 #include <linux/uaccess.h>
+#include <linux/ktime.h>
 
 #include <trace/events/block.h>
 
@@ -216,6 +217,9 @@ static struct elevator_queue *elevator_alloc(struct request_queue *q,
 
 	eq->ops = &e->ops;
 	eq->elevator_type = e;
+#ifdef CONFIG_ELV_LATENCY_HIST
+	eq->queue = q;
+#endif
 	kobject_init(&eq->kobj, &elv_ktype);
 	mutex_init(&eq->sysfs_lock);
 
@@ -595,6 +599,75 @@ void elv_quiesce_end(struct request_queue *q)
 	queue_flag_clear(QUEUE_FLAG_ELVSWITCH, q);
 }
 
+#ifdef CONFIG_ELV_LATENCY_HIST
+static const char *elv_lat_class_names[ELV_LAT_NR_CLASSES] = {
+	[ELV_LAT_ASYNC_READ]	= "async_read",
+	[ELV_LAT_ASYNC_WRITE]	= "async_write",
+	[ELV_LAT_SYNC_READ]	= "sync_read",
+	[ELV_LAT_SYNC_WRITE]	= "sync_write",
+};
+
+static void elv_latency_add(struct elv_latency_hist *hist,
+			    struct request *rq, unsigned long us)
+{
+	int class = (rq_is_sync(rq) ? ELV_LAT_SYNC_READ : ELV_LAT_ASYNC_READ) +
+		    rq_data_dir(rq);
+	int bucket = us ? min(fls_long(us) - 1, ELV_LAT_BUCKETS - 1) : 0;
+
+	hist->count[class][bucket]++;
+	hist->total_us[class] += us;
+}
+
+static unsigned long elv_latency_us(u64 from, u64 to)
+{
+	u64 ns = to - from;
+
+	do_div(ns, NSEC_PER_USEC);
+	return ns;
+}
+
+/* A requeued request starts waiting again */
+static inline void elv_latency_queued(struct request *rq)
+{
+	rq->elv_insert_ns = ktime_to_ns(ktime_get());
+	rq->elv_issue_ns = 0;
+}
+
+/* Called by blk_peek_request() when the driver first sees @rq */
+void elv_latency_issued(struct request_queue *q, struct request *rq)
+{
+	if (!rq->elv_insert_ns || !blk_fs_request(rq))
+		return;
+
+	rq->elv_issue_ns = ktime_to_ns(ktime_get());
+	elv_latency_add(&q->elevator->queue_lat, rq,
+			elv_latency_us(rq->elv_insert_ns, rq->elv_issue_ns));
+}
+
+static void elv_latency_completed(struct request_queue *q, struct request *rq)
+{
+	unsigned long service_us;
+
+	if (!rq->elv_issue_ns)
+		return;
+
+	service_us = elv_latency_us(rq->elv_issue_ns, ktime_to_ns(ktime_get()));
+	elv_latency_add(&q->elevator->dispatch_lat, rq, service_us);
+	trace_block_rq_latency(q, rq,
+			elv_latency_us(rq->elv_insert_ns, rq->elv_issue_ns),
+			service_us);
+}
+#else
+static inline void elv_latency_queued(struct request *rq)
+{
+}
+
+static inline void elv_latency_completed(struct request_queue *q,
+					 struct request *rq)
+{
+}
+#endif
+
 void elv_insert(struct request_queue *q, struct request *rq, int where)
 {
 	struct list_head *pos;
@@ -604,6 +677,7 @@ void elv_insert(struct request_queue *q, struct request *rq, int where)
 	trace_block_rq_insert(q, rq);
 
 	rq->q = q;
+	elv_latency_queued(rq);
 
 	switch (where) {
 	case ELEVATOR_INSERT_FRONT:
@@ -828,6 +902,7 @@ void elv_completed_request(struct request_queue *q, struct request *rq)
 	 * request is released from the driver, io must be done
 	 */
 	if (blk_account_rq(rq)) {
+		elv_latency_completed(q, rq);
 		q->in_flight[rq_is_sync(rq)]--;
 		if (blk_sorted_rq(rq) && e->ops->elevator_completed_req_fn)
 			e->ops->elevator_completed_req_fn(q, rq);
@@ -899,6 +974,83 @@ static struct kobj_type elv_ktype = {
 	.release	= elevator_release,
 };
 
+#ifdef CONFIG_ELV_LATENCY_HIST
+static ssize_t
+elv_latency_show(struct elevator_queue *e, struct elv_latency_hist *from,
+		 char *page)
+{
+	struct request_queue *q = e->queue;
+	unsigned long nr[ELV_LAT_NR_CLASSES] = { 0 };
+	struct elv_latency_hist snap, *hist = &snap;
+	ssize_t len = 0;
+	int class, bucket;
+
+	/* Format a consistent copy, not the live counters */
+	spin_lock_irq(q->queue_lock);
+	snap = *from;
+	spin_unlock_irq(q->queue_lock);
+
+	len += sprintf(page + len, "%-8s", "usecs");
+	for (class = 0; class < ELV_LAT_NR_CLASSES; class++)
+		len += sprintf(page + len, " %12s", elv_lat_class_names[class]);
+	len += sprintf(page + len, "\n");
+
+	for (bucket = 0; bucket < ELV_LAT_BUCKETS; bucket++) {
+		len += sprintf(page + len, "%-8lu", bucket ? 1UL << bucket : 0);
+		for (class = 0; class < ELV_LAT_NR_CLASSES; class++) {
+			len += sprintf(page + len, " %12lu",
+				       hist->count[class][bucket]);
+			nr[class] += hist->count[class][bucket];
+		}
+		len += sprintf(page + len, "\n");
+	}
+
+	len += sprintf(page + len, "%-8s", "mean");
+	for (class = 0; class < ELV_LAT_NR_CLASSES; class++) {
+		u64 mean = hist->total_us[class];
+
+		if (nr[class])
+			do_div(mean, nr[class]);
+		len += sprintf(page + len, " %12llu",
+			       (unsigned long long)mean);
+	}
+	len += sprintf(page + len, "\n");
+
+	return len;
+}
+
+static ssize_t elv_queue_latency_show(struct elevator_queue *e, char *page)
+{
+	return elv_latency_show(e, &e->queue_lat, page);
+}
+
+static ssize_t elv_dispatch_latency_show(struct elevator_queue *e, char *page)
+{
+	return elv_latency_show(e, &e->dispatch_lat, page);
+}
+
+/* Any write clears both histograms */
+static ssize_t
+elv_latency_reset(struct elevator_queue *e, const char *page, size_t count)
+{
+	struct request_queue *q = e->queue;
+
+	spin_lock_irq(q->queue_lock);
+	memset(&e->queue_lat, 0, sizeof(e->queue_lat));
+	memset(&e->dispatch_lat, 0, sizeof(e->dispatch_lat));
+	spin_unlock_irq(q->queue_lock);
+	return count;
+}
+
+static struct elv_fs_entry elv_latency_attrs[] = {
+	__ATTR(queue_latency, S_IRUGO|S_IWUSR, elv_queue_latency_show,
+	       elv_latency_reset),
+	__ATTR(dispatch_latency, S_IRUGO|S_IWUSR, elv_dispatch_latency_show,
+	       elv_latency_reset),
+	__ATTR_NULL
+};
+#endif
+
 int elv_register_queue(struct request_queue *q)
 {
 	struct elevator_queue *e = q->elevator;
@@ -907,6 +1059,14 @@ int elv_register_queue(struct request_queue *q)
 	error = kobject_add(&e->kobj, &q->kobj, "%s", "iosched");
 	if (!error) {
 		struct elv_fs_entry *attr = e->elevator_type->elevator_attrs;
+#ifdef CONFIG_ELV_LATENCY_HIST
+		struct elv_fs_entry *lat;
+
+		for (lat = elv_latency_attrs; lat->attr.name; lat++) {
+			if (sysfs_create_file(&e->kobj, &lat->attr))
+				break;
+		}
+#endif
 		if (attr) {
 			while (attr->attr.name) {
 				if (sysfs_create_file(&e->kobj, &attr->attr))
@@ -12,6 +12,17 @@
  * Asynchronous and synchronous requests are not treated separately, but
  * we relay on deadlines to ensure fairness.
  *
+ * Reads are preferred over writes, and expired reads are served before
+ * expired writes, so an app launch does not queue up behind a writeback
+ * burst. Writes still make progress: after writes_starved read batches
+ * in a row, a write batch goes out.
+ *
+ * Each dispatch sends out a batch: the chosen request plus the requests
+ * that continue it on disk, in the same direction. The batch is sized so
+ * that it keeps the device busy for about batch_usecs, using the average
+ * service time measured on completion, and holds at most fifo_batch
+ * requests.
+ *
  */
 #include <linux/blkdev.h>
 #include <linux/elevator.h>
@@ -19,6 +30,8 @@
 #include <linux/module.h>
 #include <linux/init.h>
 #include <linux/slab.h>
+#include <linux/rbtree.h>
+#include <linux/ktime.h>
 
 enum { ASYNC, SYNC };
 
@@ -30,28 +43,64 @@ static const int async_read_expire = 4 * HZ;	/* ditto for async, these limits ar
 static const int async_write_expire = 16 * HZ;	/* ditto for async, these limits are SOFT! */
 
 static const int writes_starved = 2;		/* max times reads can starve a write */
-static const int fifo_batch = 1;		/* # of sequential requests treated as one
+static const int fifo_batch = 16;		/* max # of sequential requests treated as one
 						   by the above parameters. For throughput. */
+static const int batch_usecs = 2000;		/* device time a batch should take */
 
 /* Elevator data */
 struct sio_data {
 	/* Request queues */
 	struct list_head fifo_list[2][2];
 
+	/* Requests sorted by sector, to find the ones that continue a batch */
+	struct rb_root sort_list[2];
+
 	/* Attributes */
-	unsigned int batched;
 	unsigned int starved;
 
+	/* Average device time per request, in usecs */
+	unsigned long service_us;
+	unsigned long last_completion;
+
 	/* Settings */
 	int fifo_expire[2][2];
 	int fifo_batch;
 	int writes_starved;
+	int batch_usecs;
 };
 
+static inline void
+sio_dispatch_request(struct sio_data *sd, struct request *rq);
+
+static void
+sio_add_rq_rb(struct sio_data *sd, struct request *rq)
+{
+	struct rb_root *root = &sd->sort_list[rq_data_dir(rq)];
+	struct request *alias;
+
+	/* Only one request per sector fits in the tree, send the old one out */
+	while (unlikely(alias = elv_rb_add(root, rq)))
+		sio_dispatch_request(sd, alias);
+}
+
+static void
+sio_merged_request(struct request_queue *q, struct request *rq, int type)
+{
+	struct sio_data *sd = q->elevator->elevator_data;
+
+	/* A front merge moved the start of the request, reposition it */
+	if (type == ELEVATOR_FRONT_MERGE) {
+		elv_rb_del(&sd->sort_list[rq_data_dir(rq)], rq);
+		sio_add_rq_rb(sd, rq);
+	}
+}
+
 static void
 sio_merged_requests(struct request_queue *q, struct request *rq,
 		    struct request *next)
 {
+	struct sio_data *sd = q->elevator->elevator_data;
+
 	/*
 	 * If next expires before rq, assign its expire time to rq
 	 * and move into next position (next will be deleted) in fifo.
@@ -65,6 +114,7 @@ sio_merged_requests(struct request_queue *q, struct request *rq,
 
 	/* Delete next request */
 	rq_fifo_clear(next);
+	elv_rb_del(&sd->sort_list[rq_data_dir(next)], next);
 }
 
 static void
@@ -80,6 +130,38 @@ sio_add_request(struct request_queue *q, struct request *rq)
 	 */
 	rq_set_fifo_time(rq, jiffies + sd->fifo_expire[sync][data_dir]);
 	list_add_tail(&rq->queuelist, &sd->fifo_list[sync][data_dir]);
+	sio_add_rq_rb(sd, rq);
+}
+
+static void
+sio_activate_request(struct request_queue *q, struct request *rq)
+{
+	/* The device starts on the request, remember when */
+	rq->elevator_private = (void *) (unsigned long) ktime_to_us(ktime_get());
+}
+
+static void
+sio_completed_request(struct request_queue *q, struct request *rq)
+{
+	struct sio_data *sd = q->elevator->elevator_data;
+	unsigned long now = ktime_to_us(ktime_get());
+	unsigned long start = (unsigned long) rq->elevator_private;
+	long delta;
+
+	/*
+	 * With several requests in flight the device works on them one
+	 * after another, so only the time since the previous completion
+	 * was spent on this one.
+	 */
+	if ((long) (sd->last_completion - start) > 0)
+		start = sd->last_completion;
+	sd->last_completion = now;
+
+	/* Average over the last 8 or so requests */
+	delta = (long) (now - start) - (long) sd->service_us;
+	sd->service_us += delta / 8;
+	if (!sd->service_us)
+		sd->service_us = 1;
 }
 
 static int
@@ -112,30 +194,30 @@ sio_expired_request(struct sio_data *sd, int sync, int data_dir)
 }
 
 static struct request *
-sio_choose_expired_request(struct sio_data *sd)
+sio_choose_expired_request(struct sio_data *sd, int data_dir)
 {
 	struct request *rq;
 
 	/*
 	 * Check expired requests.
-	 * Asynchronous requests have priority over synchronous.
-	 * Write requests have priority over read.
+	 * Synchronous requests have priority over asynchronous.
+	 * Requests in data_dir (reads, unless writes are starved)
+	 * have priority over the other direction.
 	 */
-	rq = sio_expired_request(sd, ASYNC, WRITE);
+	rq = sio_expired_request(sd, SYNC, data_dir);
 	if (rq)
 		return rq;
-	rq = sio_expired_request(sd, ASYNC, READ);
+	rq = sio_expired_request(sd, ASYNC, data_dir);
 	if (rq)
 		return rq;
 
-	rq = sio_expired_request(sd, SYNC, WRITE);
+	rq = sio_expired_request(sd, SYNC, !data_dir);
 	if (rq)
 		return rq;
-	rq = sio_expired_request(sd, SYNC, READ);
+	rq = sio_expired_request(sd, ASYNC, !data_dir);
 	if (rq)
 		return rq;
 
-
 	return NULL;
 }
 
@@ -172,44 +254,68 @@ sio_dispatch_request(struct sio_data *sd, struct request *rq)
 	 * and dispatch it.
 	 */
 	rq_fifo_clear(rq);
+	elv_rb_del(&sd->sort_list[rq_data_dir(rq)], rq);
 	elv_dispatch_add_tail(rq->q, rq);
+}
 
-	sd->batched++;
+static inline int
+sio_writes_pending(struct sio_data *sd)
+{
+	return !list_empty(&sd->fifo_list[SYNC][WRITE]) ||
+	       !list_empty(&sd->fifo_list[ASYNC][WRITE]);
+}
 
-	if (rq_data_dir(rq))
-		sd->starved = 0;
-	else
-		sd->starved++;
+static int
+sio_batch_size(struct sio_data *sd)
+{
+	unsigned long nr;
+
+	/* Nothing completed yet, or batching disabled */
+	if (!sd->service_us || sd->fifo_batch <= 1)
+		return max(sd->fifo_batch, 1);
+
+	nr = sd->batch_usecs / sd->service_us;
+	return clamp_t(unsigned long, nr, 1, sd->fifo_batch);
 }
 
 static int
 sio_dispatch_requests(struct request_queue *q, int force)
 {
 	struct sio_data *sd = q->elevator->elevator_data;
-	struct request *rq = NULL;
+	struct request *rq, *next;
 	int data_dir = READ;
+	int nr, batch;
 
-	/*
-	 * Retrieve any expired request after a batch of
-	 * sequential requests.
-	 */
-	if (sd->batched > sd->fifo_batch) {
-		sd->batched = 0;
-		rq = sio_choose_expired_request(sd);
-	}
+	/* Reads have had their turn, let writes through */
+	if (sd->starved > sd->writes_starved && sio_writes_pending(sd))
+		data_dir = WRITE;
 
-	/* Retrieve request */
+	/* Retrieve any expired request, then the oldest one */
+	rq = sio_choose_expired_request(sd, data_dir);
 	if (!rq) {
-		if (sd->starved > sd->writes_starved)
-			data_dir = WRITE;
-
 		rq = sio_choose_request(sd, data_dir);
 		if (!rq)
 			return 0;
 	}
 
-	/* Dispatch request */
-	sio_dispatch_request(sd, rq);
+	data_dir = rq_data_dir(rq);
+	if (data_dir == WRITE)
+		sd->starved = 0;
+	else if (sio_writes_pending(sd))
+		sd->starved++;
+
+	/*
+	 * Dispatch the request together with the ones that continue
+	 * it on disk, as one batch.
+	 */
+	batch = sio_batch_size(sd);
+	nr = 0;
+	do {
+		next = elv_rb_find(&sd->sort_list[data_dir], blk_rq_pos(rq) +
+				   blk_rq_sectors(rq));
+		sio_dispatch_request(sd, rq);
+		rq = next;
+	} while (rq && ++nr < batch);
 
 	return 1;
 }
@@ -258,13 +364,20 @@ sio_init_queue(struct request_queue *q)
 	INIT_LIST_HEAD(&sd->fifo_list[ASYNC][READ]);
 	INIT_LIST_HEAD(&sd->fifo_list[ASYNC][WRITE]);
 
+	sd->sort_list[READ] = RB_ROOT;
+	sd->sort_list[WRITE] = RB_ROOT;
+
 	/* Initialize data */
-	sd->batched = 0;
+	sd->starved = 0;
+	sd->service_us = 0;
+	sd->last_completion = 0;
 	sd->fifo_expire[SYNC][READ] = sync_read_expire;
 	sd->fifo_expire[SYNC][WRITE] = sync_write_expire;
 	sd->fifo_expire[ASYNC][READ] = async_read_expire;
 	sd->fifo_expire[ASYNC][WRITE] = async_write_expire;
 	sd->fifo_batch = fifo_batch;
+	sd->writes_starved = writes_starved;
+	sd->batch_usecs = batch_usecs;
 
 	return sd;
 }
@@ -317,6 +430,8 @@ SHOW_FUNCTION(sio_async_read_expire_show, sd->fifo_expire[ASYNC][READ], 1);
 SHOW_FUNCTION(sio_async_write_expire_show, sd->fifo_expire[ASYNC][WRITE], 1);
 SHOW_FUNCTION(sio_fifo_batch_show, sd->fifo_batch, 0);
 SHOW_FUNCTION(sio_writes_starved_show, sd->writes_starved, 0);
+SHOW_FUNCTION(sio_batch_usecs_show, sd->batch_usecs, 0);
+SHOW_FUNCTION(sio_service_usecs_show, sd->service_us, 0);
 #undef SHOW_FUNCTION
 
 #define STORE_FUNCTION(__FUNC, __PTR, MIN, MAX, __CONV)			\
@@ -341,6 +456,7 @@ STORE_FUNCTION(sio_async_read_expire_store, &sd->fifo_expire[ASYNC][READ], 0, IN
 STORE_FUNCTION(sio_async_write_expire_store, &sd->fifo_expire[ASYNC][WRITE], 0, INT_MAX, 1);
 STORE_FUNCTION(sio_fifo_batch_store, &sd->fifo_batch, 0, INT_MAX, 0);
 STORE_FUNCTION(sio_writes_starved_store, &sd->writes_starved, 0, INT_MAX, 0);
+STORE_FUNCTION(sio_batch_usecs_store, &sd->batch_usecs, 0, INT_MAX, 0);
 #undef STORE_FUNCTION
 
 #define DD_ATTR(name) \
@@ -354,17 +470,22 @@ static struct elv_fs_entry sio_attrs[] = {
 	DD_ATTR(async_write_expire),
 	DD_ATTR(fifo_batch),
 	DD_ATTR(writes_starved),
+	DD_ATTR(batch_usecs),
+	__ATTR(service_usecs, S_IRUGO, sio_service_usecs_show, NULL),
 	__ATTR_NULL
 };
 
 static struct elevator_type iosched_sio = {
 	.ops = {
+		.elevator_merged_fn		= sio_merged_request,
 		.elevator_merge_req_fn		= sio_merged_requests,
 		.elevator_dispatch_fn		= sio_dispatch_requests,
 		.elevator_add_req_fn		= sio_add_request,
 		.elevator_queue_empty_fn	= sio_queue_empty,
 		.elevator_former_req_fn		= sio_former_request,
 		.elevator_latter_req_fn		= sio_latter_request,
+		.elevator_activate_req_fn	= sio_activate_request,
+		.elevator_completed_req_fn	= sio_completed_request,
 		.elevator_init_fn		= sio_init_queue,
 		.elevator_exit_fn		= sio_exit_queue,
 	},
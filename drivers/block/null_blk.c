@@ -0,0 +1,262 @@
+/*
+ * Null block device with a simple service time model.
+ *
+ * Requests go through the I/O scheduler like on any request based device
+ * and are completed, without moving any data, after the time a device
+ * with a fixed per-request overhead and a given transfer rate would take.
+ * The device serves one request at a time, like an eMMC card, and accepts
+ * up to hw_queue_depth of them. This makes it possible to compare I/O
+ * schedulers on replayed traces (see tools/iosched-bench) without the
+ * noise of real flash.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.
+ */
+
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/init.h>
+#include <linux/blkdev.h>
+#include <linux/genhd.h>
+#include <linux/hrtimer.h>
+#include <linux/log2.h>
+#include <linux/slab.h>
+
+static int nr_devices = 1;
+module_param(nr_devices, int, S_IRUGO);
+MODULE_PARM_DESC(nr_devices, "Number of devices to register");
+
+static int gb = 4;
+module_param(gb, int, S_IRUGO);
+MODULE_PARM_DESC(gb, "Size of each device in GB");
+
+static int bs = 512;
+module_param(bs, int, S_IRUGO);
+MODULE_PARM_DESC(bs, "Logical block size in bytes");
+
+static int hw_queue_depth = 1;
+module_param(hw_queue_depth, int, S_IRUGO);
+MODULE_PARM_DESC(hw_queue_depth, "Requests the device accepts at once");
+
+static unsigned long completion_nsec = 100000;
+module_param(completion_nsec, ulong, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(completion_nsec, "Per-request overhead in ns");
+
+static unsigned int read_kbps = 40000;
+module_param(read_kbps, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(read_kbps, "Read rate in KB/s, 0 for no transfer time");
+
+static unsigned int write_kbps = 15000;
+module_param(write_kbps, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(write_kbps, "Write rate in KB/s, 0 for no transfer time");
+
+struct nullb_cmd {
+	struct request *rq;
+	ktime_t done;		/* when the device completes it */
+};
+
+struct nullb {
+	struct request_queue *q;
+	struct gendisk *disk;
+	spinlock_t lock;	/* queue lock, protects the fields below */
+	/* started requests, in completion order */
+	struct nullb_cmd *cmds;
+	unsigned int head;
+	unsigned int nr_cmds;
+	ktime_t busy_until;	/* when the device is done with cmds */
+	struct hrtimer timer;
+	int in_timer;		/* timer restarts itself, don't start it */
+};
+
+static int nullb_major;
+static struct nullb *nullbs;
+
+static u64 nullb_service_ns(struct request *rq)
+{
+	unsigned int kbps = rq_data_dir(rq) == WRITE ? write_kbps : read_kbps;
+	u64 ns = completion_nsec;
+
+	if (kbps) {
+		u64 xfer = (u64)blk_rq_bytes(rq) * (NSEC_PER_SEC / 1024);
+
+		do_div(xfer, kbps);
+		ns += xfer;
+	}
+	return ns;
+}
+
+static void nullb_complete(struct nullb *nullb, ktime_t now)
+{
+	while (nullb->nr_cmds) {
+		struct nullb_cmd *cmd = &nullb->cmds[nullb->head];
+
+		if (cmd->done.tv64 > now.tv64)
+			break;
+		__blk_end_request_all(cmd->rq, 0);
+		nullb->head = (nullb->head + 1) % hw_queue_depth;
+		nullb->nr_cmds--;
+	}
+}
+
+static enum hrtimer_restart nullb_timer_fn(struct hrtimer *timer)
+{
+	struct nullb *nullb = container_of(timer, struct nullb, timer);
+	enum hrtimer_restart ret = HRTIMER_NORESTART;
+	unsigned long flags;
+
+	spin_lock_irqsave(&nullb->lock, flags);
+	nullb_complete(nullb, ktime_get());
+	nullb->in_timer = 1;
+	__blk_run_queue(nullb->q);
+	nullb->in_timer = 0;
+	if (nullb->nr_cmds) {
+		hrtimer_set_expires(timer, nullb->cmds[nullb->head].done);
+		ret = HRTIMER_RESTART;
+	}
+	spin_unlock_irqrestore(&nullb->lock, flags);
+
+	return ret;
+}
+
+static void nullb_request_fn(struct request_queue *q)
+{
+	struct nullb *nullb = q->queuedata;
+	struct request *rq;
+
+	while (nullb->nr_cmds < hw_queue_depth &&
+	       (rq = blk_fetch_request(q)) != NULL) {
+		struct nullb_cmd *cmd;
+		ktime_t now;
+		u64 ns;
+
+		if (!blk_fs_request(rq)) {
+			__blk_end_request_all(rq, -EIO);
+			continue;
+		}
+
+		ns = nullb_service_ns(rq);
+		if (!ns) {
+			__blk_end_request_all(rq, 0);
+			continue;
+		}
+
+		now = ktime_get();
+		if (nullb->busy_until.tv64 < now.tv64)
+			nullb->busy_until = now;
+		nullb->busy_until = ktime_add_ns(nullb->busy_until, ns);
+
+		cmd = &nullb->cmds[(nullb->head + nullb->nr_cmds) %
+				   hw_queue_depth];
+		cmd->rq = rq;
+		cmd->done = nullb->busy_until;
+		if (!nullb->nr_cmds++ && !nullb->in_timer)
+			hrtimer_start(&nullb->timer, cmd->done,
+				      HRTIMER_MODE_ABS);
+	}
+}
+
+static struct block_device_operations nullb_fops = {
+	.owner = THIS_MODULE,
+};
+
+static int nullb_add(struct nullb *nullb, int index)
+{
+	struct gendisk *disk;
+
+	spin_lock_init(&nullb->lock);
+	hrtimer_init(&nullb->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	nullb->timer.function = nullb_timer_fn;
+
+	nullb->cmds = kcalloc(hw_queue_depth, sizeof(*nullb->cmds),
+			      GFP_KERNEL);
+	if (!nullb->cmds)
+		return -ENOMEM;
+
+	nullb->q = blk_init_queue(nullb_request_fn, &nullb->lock);
+	if (!nullb->q)
+		goto free_cmds;
+	nullb->q->queuedata = nullb;
+	blk_queue_logical_block_size(nullb->q, bs);
+	blk_queue_physical_block_size(nullb->q, bs);
+	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, nullb->q);
+
+	disk = nullb->disk = alloc_disk(1);
+	if (!disk)
+		goto cleanup_queue;
+	disk->major = nullb_major;
+	disk->first_minor = index;
+	disk->fops = &nullb_fops;
+	disk->private_data = nullb;
+	disk->queue = nullb->q;
+	sprintf(disk->disk_name, "nullb%d", index);
+	set_capacity(disk, (sector_t)gb << (30 - 9));
+	add_disk(disk);
+
+	return 0;
+
+cleanup_queue:
+	blk_cleanup_queue(nullb->q);
+free_cmds:
+	kfree(nullb->cmds);
+	return -ENOMEM;
+}
+
+static void nullb_del(struct nullb *nullb)
+{
+	del_gendisk(nullb->disk);
+	blk_cleanup_queue(nullb->q);
+	hrtimer_cancel(&nullb->timer);
+	put_disk(nullb->disk);
+	kfree(nullb->cmds);
+}
+
+static int __init nullb_init(void)
+{
+	int i, ret;
+
+	if (nr_devices < 1 || hw_queue_depth < 1 ||
+	    bs < 512 || bs > PAGE_SIZE || !is_power_of_2(bs))
+		return -EINVAL;
+
+	nullb_major = register_blkdev(0, "nullb");
+	if (nullb_major < 0)
+		return nullb_major;
+
+	nullbs = kcalloc(nr_devices, sizeof(*nullbs), GFP_KERNEL);
+	if (!nullbs) {
+		ret = -ENOMEM;
+		goto unregister;
+	}
+
+	for (i = 0; i < nr_devices; i++) {
+		ret = nullb_add(&nullbs[i], i);
+		if (ret)
+			goto del;
+	}
+
+	pr_info("null_blk: %d device(s) of %dGB\n", nr_devices, gb);
+	return 0;
+
+del:
+	while (i--)
+		nullb_del(&nullbs[i]);
+	kfree(nullbs);
+unregister:
+	unregister_blkdev(nullb_major, "nullb");
+	return ret;
+}
+
+static void __exit nullb_exit(void)
+{
+	int i;
+
+	for (i = 0; i < nr_devices; i++)
+		nullb_del(&nullbs[i]);
+	kfree(nullbs);
+	unregister_blkdev(nullb_major, "nullb");
+}
+
+module_init(nullb_init);
+module_exit(nullb_exit);
+
+MODULE_DESCRIPTION("Null block device with a service time model");
+MODULE_LICENSE("GPL");
@@ -20,6 +20,7 @@
 #include <linux/init.h>
 #include <linux/notifier.h>
 #include <linux/cpufreq.h>
+#include <linux/cpufreq_sampling.h>
 #include <linux/delay.h>
 #include <linux/interrupt.h>
 #include <linux/spinlock.h>
@@ -1585,19 +1586,89 @@ EXPORT_SYMBOL(cpufreq_unregister_notifier);
  *********************************************************************/
 
 
-int __cpufreq_driver_target(struct cpufreq_policy *policy,
-			    unsigned int target_freq,
-			    unsigned int relation)
+#ifdef CONFIG_CPU_FREQ_STAT_TRACE
+/* The request each policy's driver is carrying out, by policy->cpu */
+static DEFINE_PER_CPU(struct cpufreq_request, cpufreq_request);
+
+/*
+ * Serializes the requests on a policy, by policy->cpu. Not every caller of
+ * __cpufreq_driver_target() holds the policy rwsem: the sampling work of a
+ * governor can race with its CPUFREQ_GOV_LIMITS, and one would overwrite
+ * the request of the other while the driver carries that out.
+ */
+static DEFINE_PER_CPU(struct mutex, cpufreq_request_mutex);
+
+/**
+ * cpufreq_get_request - the target request in progress on a policy
+ * @cpu: the policy's CPU
+ *
+ * For the transition notifiers, to tell which governor decision led to a
+ * transition. NULL when the transition does not come from a request.
+ */
+const struct cpufreq_request *cpufreq_get_request(unsigned int cpu)
+{
+	struct cpufreq_request *req = &per_cpu(cpufreq_request, cpu);
+
+	return req->active ? req : NULL;
+}
+EXPORT_SYMBOL_GPL(cpufreq_get_request);
+
+/* Records the request for cpufreq_get_request() while the driver runs */
+static int cpufreq_driver_request(struct cpufreq_policy *policy,
+				  unsigned int target_freq,
+				  unsigned int relation, void *caller)
+{
+	struct cpufreq_request *req = &per_cpu(cpufreq_request, policy->cpu);
+	struct mutex *mutex = &per_cpu(cpufreq_request_mutex, policy->cpu);
+	/* The sample the governor is acting on, if it is */
+	const struct cpufreq_sample *s = cpufreq_sampling_current(policy->cpu);
+	int retval;
+
+	mutex_lock(mutex);
+	req->governor = policy->governor ? policy->governor->name : NULL;
+	req->caller = caller;
+	req->target = target_freq;
+	req->relation = relation;
+	req->load = s ? s->load : -1;
+	req->boosted = s ? s->boosted : 0;
+	req->active = 1;
+	retval = cpufreq_driver->target(policy, target_freq, relation);
+	req->active = 0;
+	mutex_unlock(mutex);
+
+	return retval;
+}
+#else
+static inline int cpufreq_driver_request(struct cpufreq_policy *policy,
+					 unsigned int target_freq,
+					 unsigned int relation, void *caller)
+{
+	return cpufreq_driver->target(policy, target_freq, relation);
+}
+#endif
+
+static int cpufreq_target_request(struct cpufreq_policy *policy,
+				  unsigned int target_freq,
+				  unsigned int relation, void *caller)
 {
 	int retval = -EINVAL;
 
 	dprintk("target for CPU %u: %u kHz, relation %u\n", policy->cpu,
 		target_freq, relation);
 	if (cpu_online(policy->cpu) && cpufreq_driver->target)
-		retval = cpufreq_driver->target(policy, target_freq, relation);
+		retval = cpufreq_driver_request(policy, target_freq, relation,
+						caller);
 
 	return retval;
 }
+
+int __cpufreq_driver_target(struct cpufreq_policy *policy,
+			    unsigned int target_freq,
+			    unsigned int relation)
+{
+	return cpufreq_target_request(policy, target_freq, relation,
+				      __builtin_return_address(0));
+}
 EXPORT_SYMBOL_GPL(__cpufreq_driver_target);
 
 int cpufreq_driver_target(struct cpufreq_policy *policy,
@@ -1613,7 +1684,8 @@ int cpufreq_driver_target(struct cpufreq_policy *policy,
 	if (unlikely(lock_policy_rwsem_write(policy->cpu)))
 		goto fail;
 
-	ret = __cpufreq_driver_target(policy, target_freq, relation);
+	ret = cpufreq_target_request(policy, target_freq, relation,
+				     __builtin_return_address(0));
 
 	unlock_policy_rwsem_write(policy->cpu);
 
@@ -2203,6 +2275,9 @@ static int __init cpufreq_core_init(void)
 	for_each_possible_cpu(cpu) {
 		per_cpu(policy_cpu, cpu) = -1;
 		init_rwsem(&per_cpu(cpu_policy_rwsem, cpu));
+#ifdef CONFIG_CPU_FREQ_STAT_TRACE
+		mutex_init(&per_cpu(cpufreq_request_mutex, cpu));
+#endif
 	}
 
 	cpufreq_global_kobject = kobject_create_and_add("cpufreq",
@@ -161,6 +161,12 @@ struct cpufreq_governor cpufreq_gov_interactive = {
 	.owner = THIS_MODULE,
 };
 
+/*
+ * Not on the sampling core (linux/cpufreq_sampling.h) yet: the load since
+ * the last frequency change below needs idle time from target_set_time on,
+ * and cpufreq_interactive_idle_start() needs a timer armed on a CPU that
+ * enters idle, neither of which the core provides.
+ */
 static void cpufreq_interactive_timer(unsigned long data)
 {
 	unsigned int delta_idle;
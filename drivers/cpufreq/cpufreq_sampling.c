@@ -0,0 +1,554 @@
+/*
+ * drivers/cpufreq/cpufreq_sampling.c
+ *
+ * Load sampling shared by the cpufreq governors.
+ *
+ * A governor using this does not keep timers, idle hooks or idle time
+ * bookkeeping of its own. Each policy it runs on gets one deferrable work
+ * item on the policy's CPU, which every rate_us measures the load of the
+ * policy's CPUs once and hands the result to the governor's ->sample().
+ *
+ * Being deferrable, the work does not wake an idle CPU. Beyond that, once
+ * all CPUs of a policy are idle at the policy's minimum speed there is
+ * nothing left for a governor to lower, so sampling is parked until one of
+ * them leaves idle, and the next window starts there.
+ *
+ * Touchscreen and touchpad events can pulse a boost: the policies are
+ * sampled at once and for input_boost_ms the samples carry ->boosted, so
+ * that a governor can raise the speed before the load shows.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/cpu.h>
+#include <linux/cpufreq.h>
+#include <linux/cpufreq_sampling.h>
+#include <linux/input.h>
+#include <linux/jiffies.h>
+#include <linux/kernel_stat.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/tick.h>
+#include <linux/workqueue.h>
+
+static unsigned int input_boost_ms;
+module_param(input_boost_ms, uint, 0644);
+MODULE_PARM_DESC(input_boost_ms, "Length of the boost on input, in ms; "
+		 "0 disables");
+
+struct cpufreq_sampling_cpu {
+	/* The current window of this CPU */
+	u64 prev_wall;
+	u64 prev_idle;
+	u64 prev_iowait;
+	cputime64_t prev_nice;
+	unsigned int load;		/* of the last window, percent */
+	int idle;			/* between IDLE_START and IDLE_END */
+	struct cpufreq_sampling_cpu *owner;	/* the policy CPU's entry */
+
+	/*
+	 * Used in the policy CPU's entry only. The lock also covers the
+	 * windows of all CPUs of the policy.
+	 */
+	spinlock_t lock;
+	struct cpufreq_policy *policy;
+	struct cpufreq_sampler *sampler;
+	struct delayed_work work;
+	unsigned int cpu;
+	unsigned int enabled:1;
+	unsigned int parked:1;
+
+	/* The sample being handed to the governor, and who is handing it */
+	struct cpufreq_sample cur_sample;
+	struct task_struct *sample_task;
+};
+
+static DEFINE_PER_CPU(struct cpufreq_sampling_cpu, cpufreq_sampling_cpu);
+
+/*
+ * RT, so a ramp up is not delayed behind the load that asked for it, like the
+ * "ksmartass_up" thread the samplers used to have.
+ */
+static struct workqueue_struct *cpufreq_sampling_wq;
+
+/* End of the last input boost pulse, in jiffies */
+static unsigned long boost_until = INITIAL_JIFFIES;
+
+static u64 get_cpu_idle_time_jiffy(unsigned int cpu, u64 *wall)
+{
+	cputime64_t idle_time;
+	cputime64_t cur_wall_time;
+	cputime64_t busy_time;
+
+	cur_wall_time = jiffies64_to_cputime64(get_jiffies_64());
+	busy_time = cputime64_add(kstat_cpu(cpu).cpustat.user,
+			kstat_cpu(cpu).cpustat.system);
+
+	busy_time = cputime64_add(busy_time, kstat_cpu(cpu).cpustat.irq);
+	busy_time = cputime64_add(busy_time, kstat_cpu(cpu).cpustat.softirq);
+	busy_time = cputime64_add(busy_time, kstat_cpu(cpu).cpustat.steal);
+	busy_time = cputime64_add(busy_time, kstat_cpu(cpu).cpustat.nice);
+
+	idle_time = cputime64_sub(cur_wall_time, busy_time);
+	if (wall)
+		*wall = (u64)jiffies_to_usecs(cur_wall_time);
+
+	return (u64)jiffies_to_usecs(idle_time);
+}
+
+static u64 get_cpu_idle_time(unsigned int cpu, u64 *wall)
+{
+	u64 idle_time = get_cpu_idle_time_us(cpu, wall);
+
+	if (idle_time == -1ULL)
+		return get_cpu_idle_time_jiffy(cpu, wall);
+
+	return idle_time;
+}
+
+static u64 get_cpu_iowait_time(unsigned int cpu)
+{
+	u64 iowait_time = get_cpu_iowait_time_us(cpu, NULL);
+
+	if (iowait_time == -1ULL)
+		return 0;
+
+	return iowait_time;
+}
+
+/* Start a new window on the CPU. Called with the policy's lock held. */
+static void cpufreq_sampling_rebase(unsigned int cpu)
+{
+	struct cpufreq_sampling_cpu *sc = &per_cpu(cpufreq_sampling_cpu, cpu);
+
+	sc->prev_idle = get_cpu_idle_time(cpu, &sc->prev_wall);
+	sc->prev_iowait = get_cpu_iowait_time(cpu);
+	sc->prev_nice = kstat_cpu(cpu).cpustat.nice;
+}
+
+/*
+ * Close the window of the CPU and start the next one. Returns the window's
+ * length; its idle time and the time it ended go to *idle_us and *now_us.
+ * Called with the policy's lock held.
+ */
+static unsigned int cpufreq_sampling_measure(unsigned int cpu,
+					     struct cpufreq_sampler *sampler,
+					     unsigned int *idle_us,
+					     u64 *now_us)
+{
+	struct cpufreq_sampling_cpu *sc = &per_cpu(cpufreq_sampling_cpu, cpu);
+	u64 cur_wall, cur_idle, cur_iowait;
+	cputime64_t cur_nice;
+	unsigned int wall, idle, iowait;
+
+	cur_idle = get_cpu_idle_time(cpu, &cur_wall);
+	cur_iowait = get_cpu_iowait_time(cpu);
+	cur_nice = kstat_cpu(cpu).cpustat.nice;
+
+	wall = (unsigned int)(cur_wall - sc->prev_wall);
+	idle = (unsigned int)(cur_idle - sc->prev_idle);
+	iowait = (unsigned int)(cur_iowait - sc->prev_iowait);
+
+	if (sampler->ignore_nice) {
+		/*
+		 * Assumption: nice time between sampling periods will
+		 * be less than 2^32 jiffies for 32 bit sys
+		 */
+		unsigned long nice_jiffies = (unsigned long)
+			cputime64_to_jiffies64(cputime64_sub(cur_nice,
+							     sc->prev_nice));
+
+		idle += jiffies_to_usecs(nice_jiffies);
+	}
+
+	/*
+	 * Waiting for IO can mean the CPU is performance critical rather
+	 * than idle; the governor says which it takes it for.
+	 */
+	if (sampler->io_is_busy && idle >= iowait)
+		idle -= iowait;
+
+	sc->prev_wall = cur_wall;
+	sc->prev_idle = cur_idle;
+	sc->prev_iowait = cur_iowait;
+	sc->prev_nice = cur_nice;
+
+	if (idle > wall)
+		idle = wall;
+	sc->load = wall ? 100 * (wall - idle) / wall : 0;
+
+	*idle_us = idle;
+	*now_us = cur_wall;
+	return wall;
+}
+
+static int cpufreq_sampling_delay(struct cpufreq_sampler *sampler)
+{
+	int delay = usecs_to_jiffies(sampler->rate_us);
+
+	/* We want all CPUs to do sampling nearly on same jiffy */
+	if (delay < 1)
+		delay = 1;
+	return delay - jiffies % delay;
+}
+
+static void cpufreq_sampling_work(struct work_struct *work)
+{
+	struct cpufreq_sampling_cpu *pc =
+		container_of(work, struct cpufreq_sampling_cpu, work.work);
+	struct cpufreq_sample s = { .load = 0 };
+	unsigned int j, wall, idle;
+	u64 now;
+
+	spin_lock(&pc->lock);
+	if (!pc->enabled) {
+		spin_unlock(&pc->lock);
+		return;
+	}
+
+	/* The policy runs at the speed its busiest CPU needs */
+	for_each_cpu(j, pc->policy->cpus) {
+		wall = cpufreq_sampling_measure(j, pc->sampler, &idle, &now);
+		if (j == pc->cpu)
+			s.time_us = now;
+		if (!wall || (s.window_us &&
+			      per_cpu(cpufreq_sampling_cpu, j).load < s.load))
+			continue;
+		s.load = per_cpu(cpufreq_sampling_cpu, j).load;
+		s.window_us = wall;
+		s.idle_us = idle;
+	}
+	spin_unlock(&pc->lock);
+
+	s.boosted = input_boost_ms && time_before(jiffies, boost_until);
+	if (s.window_us || s.boosted) {
+		pc->cur_sample = s;
+		pc->sample_task = current;
+		pc->sampler->sample(pc->policy, &s);
+		pc->sample_task = NULL;
+	}
+
+	spin_lock(&pc->lock);
+	if (pc->enabled)
+		queue_delayed_work_on(pc->cpu, cpufreq_sampling_wq, &pc->work,
+				      cpufreq_sampling_delay(pc->sampler));
+	spin_unlock(&pc->lock);
+}
+
+/*
+ * IDLE_START and IDLE_END come from the idle loop of the CPU, with
+ * preemption disabled.
+ */
+static int cpufreq_sampling_idle_notifier(struct notifier_block *nb,
+					  unsigned long val, void *data)
+{
+	struct cpufreq_sampling_cpu *sc =
+		&per_cpu(cpufreq_sampling_cpu, smp_processor_id());
+	struct cpufreq_sampling_cpu *pc = sc->owner;
+	unsigned int j;
+
+	if (!pc)
+		return 0;
+
+	spin_lock(&pc->lock);
+	if (!pc->enabled)
+		goto out;
+
+	switch (val) {
+	case IDLE_START:
+		sc->idle = 1;
+		if (pc->parked || pc->policy->cur != pc->policy->min)
+			break;
+		for_each_cpu(j, pc->policy->cpus)
+			if (!per_cpu(cpufreq_sampling_cpu, j).idle)
+				goto out;
+		/* If the work is already on its way, let it run */
+		if (__cancel_delayed_work(&pc->work))
+			pc->parked = 1;
+		break;
+	case IDLE_END:
+		sc->idle = 0;
+		if (!pc->parked)
+			break;
+		pc->parked = 0;
+		for_each_cpu(j, pc->policy->cpus)
+			cpufreq_sampling_rebase(j);
+		queue_delayed_work_on(pc->cpu, cpufreq_sampling_wq, &pc->work,
+				      cpufreq_sampling_delay(pc->sampler));
+		break;
+	}
+out:
+	spin_unlock(&pc->lock);
+	return 0;
+}
+
+static struct notifier_block cpufreq_sampling_idle_nb = {
+	.notifier_call = cpufreq_sampling_idle_notifier,
+};
+
+/**
+ * cpufreq_sampling_start - start sampling a policy for its governor
+ * @policy: the policy, from CPUFREQ_GOV_START
+ * @sampler: the governor's callback and sampling parameters
+ *
+ * The first window starts now and ends @sampler->rate_us later.
+ */
+int cpufreq_sampling_start(struct cpufreq_policy *policy,
+			   struct cpufreq_sampler *sampler)
+{
+	struct cpufreq_sampling_cpu *pc =
+		&per_cpu(cpufreq_sampling_cpu, policy->cpu);
+	unsigned int j;
+
+	if (!cpufreq_sampling_wq)
+		return -ENODEV;
+
+	spin_lock(&pc->lock);
+	if (pc->enabled) {
+		spin_unlock(&pc->lock);
+		return -EBUSY;
+	}
+	pc->policy = policy;
+	pc->sampler = sampler;
+	pc->cpu = policy->cpu;
+	pc->parked = 0;
+	pc->enabled = 1;
+	for_each_cpu(j, policy->cpus) {
+		struct cpufreq_sampling_cpu *sc =
+			&per_cpu(cpufreq_sampling_cpu, j);
+
+		sc->idle = 0;
+		sc->load = 0;
+		cpufreq_sampling_rebase(j);
+		sc->owner = pc;
+	}
+	queue_delayed_work_on(pc->cpu, cpufreq_sampling_wq, &pc->work,
+			      cpufreq_sampling_delay(sampler));
+	spin_unlock(&pc->lock);
+	return 0;
+}
+EXPORT_SYMBOL_GPL(cpufreq_sampling_start);
+
+/**
+ * cpufreq_sampling_stop - stop sampling a policy
+ * @policy: the policy, from CPUFREQ_GOV_STOP
+ *
+ * Waits for a ->sample() call in progress, so the governor may tear down
+ * what that uses once this returns.
+ */
+void cpufreq_sampling_stop(struct cpufreq_policy *policy)
+{
+	struct cpufreq_sampling_cpu *pc =
+		&per_cpu(cpufreq_sampling_cpu, policy->cpu);
+	unsigned int j;
+
+	spin_lock(&pc->lock);
+	pc->enabled = 0;
+	pc->parked = 0;
+	spin_unlock(&pc->lock);
+
+	cancel_delayed_work_sync(&pc->work);
+
+	/* policy->cpus may have changed since the start */
+	for_each_possible_cpu(j)
+		if (per_cpu(cpufreq_sampling_cpu, j).owner == pc)
+			per_cpu(cpufreq_sampling_cpu, j).owner = NULL;
+}
+EXPORT_SYMBOL_GPL(cpufreq_sampling_stop);
+
+/**
+ * cpufreq_sampling_reset - start a new window on all CPUs of a policy
+ * @policy: the policy
+ *
+ * For a governor that measures from a point of its own, like a frequency
+ * change, rather than from the last sample. The timing of the samples
+ * does not change.
+ */
+void cpufreq_sampling_reset(struct cpufreq_policy *policy)
+{
+	struct cpufreq_sampling_cpu *pc =
+		&per_cpu(cpufreq_sampling_cpu, policy->cpu);
+	unsigned int j;
+
+	spin_lock(&pc->lock);
+	if (pc->enabled)
+		for_each_cpu(j, pc->policy->cpus)
+			cpufreq_sampling_rebase(j);
+	spin_unlock(&pc->lock);
+}
+EXPORT_SYMBOL_GPL(cpufreq_sampling_reset);
+
+/**
+ * cpufreq_sampling_load - load of a CPU in its last window, in percent
+ * @cpu: the CPU
+ */
+unsigned int cpufreq_sampling_load(unsigned int cpu)
+{
+	return per_cpu(cpufreq_sampling_cpu, cpu).load;
+}
+EXPORT_SYMBOL_GPL(cpufreq_sampling_load);
+
+/**
+ * cpufreq_sampling_current - the sample a governor is acting on
+ * @cpu: the policy's CPU
+ *
+ * Non-NULL only when called from within the ->sample() callback of the
+ * policy, e.g. by the cpufreq core on a frequency change the governor
+ * makes there, to tell the load behind it.
+ */
+const struct cpufreq_sample *cpufreq_sampling_current(unsigned int cpu)
+{
+	struct cpufreq_sampling_cpu *pc = &per_cpu(cpufreq_sampling_cpu, cpu);
+
+	return pc->sample_task == current ? &pc->cur_sample : NULL;
+}
+EXPORT_SYMBOL_GPL(cpufreq_sampling_current);
+
+#ifdef CONFIG_INPUT
+/* Sample every policy now, so its governor sees the boost */
+static void cpufreq_sampling_boost(struct work_struct *work)
+{
+	unsigned int cpu, j;
+
+	for_each_online_cpu(cpu) {
+		struct cpufreq_sampling_cpu *pc =
+			&per_cpu(cpufreq_sampling_cpu, cpu);
+
+		spin_lock(&pc->lock);
+		if (pc->enabled && pc->parked) {
+			pc->parked = 0;
+			for_each_cpu(j, pc->policy->cpus)
+				cpufreq_sampling_rebase(j);
+			queue_delayed_work_on(cpu, cpufreq_sampling_wq,
+					      &pc->work, 0);
+		} else if (pc->enabled && __cancel_delayed_work(&pc->work)) {
+			queue_delayed_work_on(cpu, cpufreq_sampling_wq,
+					      &pc->work, 0);
+		}
+		spin_unlock(&pc->lock);
+	}
+}
+
+static DECLARE_WORK(cpufreq_sampling_boost_work, cpufreq_sampling_boost);
+
+static void cpufreq_sampling_input_event(struct input_handle *handle,
+					 unsigned int type,
+					 unsigned int code, int value)
+{
+	unsigned long boost = msecs_to_jiffies(input_boost_ms);
+
+	if (!boost || type != EV_SYN || code != SYN_REPORT)
+		return;
+
+	/*
+	 * A touch reports many times a second. While more than half of the
+	 * pulse is left, it is not worth sampling again.
+	 */
+	if (time_before(jiffies + boost / 2, boost_until))
+		return;
+
+	boost_until = jiffies + boost;
+	queue_work(cpufreq_sampling_wq, &cpufreq_sampling_boost_work);
+}
+
+static int cpufreq_sampling_input_connect(struct input_handler *handler,
+					  struct input_dev *dev,
+					  const struct input_device_id *id)
+{
+	struct input_handle *handle;
+	int error;
+
+	handle = kzalloc(sizeof(struct input_handle), GFP_KERNEL);
+	if (!handle)
+		return -ENOMEM;
+
+	handle->dev = dev;
+	handle->handler = handler;
+	handle->name = "cpufreq_sampling";
+
+	error = input_register_handle(handle);
+	if (error)
+		goto err_free;
+
+	error = input_open_device(handle);
+	if (error)
+		goto err_unregister;
+
+	return 0;
+
+err_unregister:
+	input_unregister_handle(handle);
+err_free:
+	kfree(handle);
+	return error;
+}
+
+static void cpufreq_sampling_input_disconnect(struct input_handle *handle)
+{
+	input_close_device(handle);
+	input_unregister_handle(handle);
+	kfree(handle);
+}
+
+static const struct input_device_id cpufreq_sampling_ids[] = {
+	{
+		.flags = INPUT_DEVICE_ID_MATCH_EVBIT |
+			 INPUT_DEVICE_ID_MATCH_ABSBIT,
+		.evbit = { BIT_MASK(EV_ABS) },
+		.absbit = { [BIT_WORD(ABS_MT_POSITION_X)] =
+			    BIT_MASK(ABS_MT_POSITION_X) |
+			    BIT_MASK(ABS_MT_POSITION_Y) },
+	}, /* multi-touch touchscreen */
+	{
+		.flags = INPUT_DEVICE_ID_MATCH_KEYBIT |
+			 INPUT_DEVICE_ID_MATCH_ABSBIT,
+		.keybit = { [BIT_WORD(BTN_TOUCH)] = BIT_MASK(BTN_TOUCH) },
+		.absbit = { [BIT_WORD(ABS_X)] =
+			    BIT_MASK(ABS_X) | BIT_MASK(ABS_Y) },
+	}, /* touchpad */
+	{ },
+};
+
+static struct input_handler cpufreq_sampling_input_handler = {
+	.event		= cpufreq_sampling_input_event,
+	.connect	= cpufreq_sampling_input_connect,
+	.disconnect	= cpufreq_sampling_input_disconnect,
+	.name		= "cpufreq_sampling",
+	.id_table	= cpufreq_sampling_ids,
+};
+#endif /* CONFIG_INPUT */
+
+static int __init cpufreq_sampling_init(void)
+{
+	unsigned int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct cpufreq_sampling_cpu *pc =
+			&per_cpu(cpufreq_sampling_cpu, cpu);
+
+		spin_lock_init(&pc->lock);
+		INIT_DELAYED_WORK_DEFERRABLE(&pc->work, cpufreq_sampling_work);
+	}
+
+	cpufreq_sampling_wq = create_rt_workqueue("kcpufreq_sampling");
+	if (!cpufreq_sampling_wq) {
+		printk(KERN_ERR "Creation of kcpufreq_sampling failed\n");
+		return -ENOMEM;
+	}
+
+	idle_notifier_register(&cpufreq_sampling_idle_nb);
+#ifdef CONFIG_INPUT
+	if (input_register_handler(&cpufreq_sampling_input_handler))
+		printk(KERN_WARNING "cpufreq_sampling: no input boost\n");
+#endif
+	return 0;
+}
+
+/* Linked ahead of the governors, which may be started from fs_initcall on */
+fs_initcall(cpufreq_sampling_init);
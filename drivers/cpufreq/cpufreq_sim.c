@@ -0,0 +1,253 @@
+/*
+ * Simulated cpufreq driver for comparing governors.
+ *
+ * Each CPU gets its own policy over a configurable frequency table. Nothing
+ * is actually clocked: a transition only takes the configured switch time
+ * and then takes effect in the driver's books. For every CPU the driver
+ * accounts the cycles it was clocked for, the sum of frequency x time,
+ * which is the energy proxy the governors are compared by. Together with a
+ * load replayer that turns recorded work into busy time at the simulated
+ * frequency (see tools/cpufreq-bench), this gives reproducible governor
+ * runs without a device.
+ *
+ * Another cpufreq driver must not be registered, so on a target build this
+ * as a module and use it in place of the platform driver.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.
+ */
+
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/init.h>
+#include <linux/cpufreq.h>
+#include <linux/delay.h>
+#include <linux/hrtimer.h>
+#include <linux/percpu.h>
+#include <linux/spinlock.h>
+
+#include <asm/div64.h>
+
+#define CPUFREQ_SIM_MAX_FREQS	32
+
+#define dprintk(msg...) \
+		cpufreq_debug_printk(CPUFREQ_DEBUG_DRIVER, "cpufreq-sim", msg)
+
+/* The 7x30 table */
+static char *sim_freqs = "134400,184320,249600,364800,460800,576000,652800,"
+			 "768000,1024000,1113600,1209600,1305600,1401600,1516800";
+module_param_named(freqs, sim_freqs, charp, S_IRUGO);
+MODULE_PARM_DESC(freqs, "Comma separated frequencies in kHz, ascending");
+
+static unsigned int transition_us = 50;
+module_param(transition_us, uint, S_IRUGO);
+MODULE_PARM_DESC(transition_us, "Time a frequency switch takes, in us");
+
+static struct cpufreq_frequency_table
+	cpufreq_sim_table[CPUFREQ_SIM_MAX_FREQS + 1];
+
+struct cpufreq_sim_cpu {
+	spinlock_t lock;	/* protects the fields below */
+	unsigned int cur;	/* kHz */
+	ktime_t since;		/* when cur took effect */
+	u64 khz_us;		/* clocked at the earlier frequencies */
+	unsigned long transitions;
+};
+
+static DEFINE_PER_CPU(struct cpufreq_sim_cpu, cpufreq_sim_cpu);
+
+static void cpufreq_sim_account(struct cpufreq_sim_cpu *sc, ktime_t now)
+{
+	s64 us = ktime_us_delta(now, sc->since);
+
+	if (us > 0)
+		sc->khz_us += (u64)sc->cur * us;
+	sc->since = now;
+}
+
+static void cpufreq_sim_set(unsigned int cpu, unsigned int freq)
+{
+	struct cpufreq_sim_cpu *sc = &per_cpu(cpufreq_sim_cpu, cpu);
+	unsigned long flags;
+
+	spin_lock_irqsave(&sc->lock, flags);
+	cpufreq_sim_account(sc, ktime_get());
+	sc->cur = freq;
+	sc->transitions++;
+	spin_unlock_irqrestore(&sc->lock, flags);
+}
+
+/* Like a PLL and regulator switch, this holds up the caller */
+static void cpufreq_sim_switch_delay(void)
+{
+	if (transition_us >= 1000)
+		msleep(DIV_ROUND_UP(transition_us, 1000));
+	else if (transition_us)
+		udelay(transition_us);
+}
+
+static int cpufreq_sim_target(struct cpufreq_policy *policy,
+			      unsigned int target_freq,
+			      unsigned int relation)
+{
+	struct cpufreq_freqs freqs;
+	int index;
+
+	if (cpufreq_frequency_table_target(policy, cpufreq_sim_table,
+					   target_freq, relation, &index))
+		return -EINVAL;
+
+	freqs.old = policy->cur;
+	freqs.new = cpufreq_sim_table[index].frequency;
+	freqs.cpu = policy->cpu;
+	if (freqs.old == freqs.new)
+		return 0;
+
+	dprintk("CPU[%d] target %u relation %u selected %u\n",
+		policy->cpu, target_freq, relation, freqs.new);
+
+	cpufreq_notify_transition(&freqs, CPUFREQ_PRECHANGE);
+	cpufreq_sim_switch_delay();
+	cpufreq_sim_set(policy->cpu, freqs.new);
+	cpufreq_notify_transition(&freqs, CPUFREQ_POSTCHANGE);
+	return 0;
+}
+
+static int cpufreq_sim_verify(struct cpufreq_policy *policy)
+{
+	return cpufreq_frequency_table_verify(policy, cpufreq_sim_table);
+}
+
+static unsigned int cpufreq_sim_get(unsigned int cpu)
+{
+	return per_cpu(cpufreq_sim_cpu, cpu).cur;
+}
+
+static int cpufreq_sim_cpu_init(struct cpufreq_policy *policy)
+{
+	struct cpufreq_sim_cpu *sc = &per_cpu(cpufreq_sim_cpu, policy->cpu);
+	unsigned long flags;
+	int ret;
+
+	ret = cpufreq_frequency_table_cpuinfo(policy, cpufreq_sim_table);
+	if (ret)
+		return ret;
+	cpufreq_frequency_table_get_attr(cpufreq_sim_table, policy->cpu);
+
+	/* Come up at the top, like a CPU out of the boot loader */
+	spin_lock_irqsave(&sc->lock, flags);
+	sc->cur = policy->cpuinfo.max_freq;
+	sc->since = ktime_get();
+	spin_unlock_irqrestore(&sc->lock, flags);
+
+	policy->cur = sc->cur;
+	policy->cpuinfo.transition_latency = transition_us * NSEC_PER_USEC;
+	return 0;
+}
+
+static int cpufreq_sim_cpu_exit(struct cpufreq_policy *policy)
+{
+	cpufreq_frequency_table_put_attr(policy->cpu);
+	return 0;
+}
+
+/* Cycles clocked since the driver came up, frequency x time */
+static ssize_t show_sim_cycles(struct cpufreq_policy *policy, char *buf)
+{
+	struct cpufreq_sim_cpu *sc = &per_cpu(cpufreq_sim_cpu, policy->cpu);
+	unsigned long flags;
+	u64 cycles;
+
+	spin_lock_irqsave(&sc->lock, flags);
+	cpufreq_sim_account(sc, ktime_get());
+	cycles = sc->khz_us;
+	spin_unlock_irqrestore(&sc->lock, flags);
+
+	do_div(cycles, 1000);
+	return sprintf(buf, "%llu\n", (unsigned long long)cycles);
+}
+cpufreq_freq_attr_ro(sim_cycles);
+
+static ssize_t show_sim_transitions(struct cpufreq_policy *policy, char *buf)
+{
+	return sprintf(buf, "%lu\n",
+		       per_cpu(cpufreq_sim_cpu, policy->cpu).transitions);
+}
+cpufreq_freq_attr_ro(sim_transitions);
+
+static struct freq_attr *cpufreq_sim_attr[] = {
+	&cpufreq_freq_attr_scaling_available_freqs,
+	&sim_cycles,
+	&sim_transitions,
+	NULL,
+};
+
+static struct cpufreq_driver cpufreq_sim_driver = {
+	/* Nothing really changes speed, udelay() needs no rescaling */
+	.flags		= CPUFREQ_CONST_LOOPS,
+	.init		= cpufreq_sim_cpu_init,
+	.exit		= cpufreq_sim_cpu_exit,
+	.verify		= cpufreq_sim_verify,
+	.target		= cpufreq_sim_target,
+	.get		= cpufreq_sim_get,
+	.name		= "cpufreq-sim",
+	.owner		= THIS_MODULE,
+	.attr		= cpufreq_sim_attr,
+};
+
+static int __init cpufreq_sim_parse_freqs(void)
+{
+	const char *p = sim_freqs;
+	unsigned int i = 0;
+	unsigned long khz;
+	char *end;
+
+	while (*p) {
+		khz = simple_strtoul(p, &end, 10);
+		if (end == p || (*end && *end != ',') || !khz ||
+		    i == CPUFREQ_SIM_MAX_FREQS ||
+		    (i && khz <= cpufreq_sim_table[i - 1].frequency)) {
+			pr_err("cpufreq-sim: bad frequency table \"%s\"\n",
+			       sim_freqs);
+			return -EINVAL;
+		}
+		cpufreq_sim_table[i].index = i;
+		cpufreq_sim_table[i].frequency = khz;
+		i++;
+		p = *end ? end + 1 : end;
+	}
+	if (!i) {
+		pr_err("cpufreq-sim: empty frequency table\n");
+		return -EINVAL;
+	}
+	cpufreq_sim_table[i].index = i;
+	cpufreq_sim_table[i].frequency = CPUFREQ_TABLE_END;
+	return 0;
+}
+
+static int __init cpufreq_sim_init(void)
+{
+	int cpu, ret;
+
+	ret = cpufreq_sim_parse_freqs();
+	if (ret)
+		return ret;
+
+	for_each_possible_cpu(cpu)
+		spin_lock_init(&per_cpu(cpufreq_sim_cpu, cpu).lock);
+
+	ret = cpufreq_register_driver(&cpufreq_sim_driver);
+	if (ret)
+		pr_err("cpufreq-sim: cannot register: %d\n", ret);
+	return ret;
+}
+
+static void __exit cpufreq_sim_exit(void)
+{
+	cpufreq_unregister_driver(&cpufreq_sim_driver);
+}
+
+module_init(cpufreq_sim_init);
+module_exit(cpufreq_sim_exit);
+
+MODULE_DESCRIPTION("Simulated cpufreq driver for governor comparisons");
+MODULE_LICENSE("GPL");
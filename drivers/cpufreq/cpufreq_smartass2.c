@@ -27,10 +27,9 @@
 #include <linux/cpu.h>
 #include <linux/cpumask.h>
 #include <linux/cpufreq.h>
+#include <linux/cpufreq_sampling.h>
 #include <linux/sched.h>
 #include <linux/tick.h>
-#include <linux/timer.h>
-#include <linux/workqueue.h>
 #include <linux/moduleparam.h>
 #include <asm/cputime.h>
 #include <linux/earlysuspend.h>
@@ -126,32 +125,25 @@ static u64 boost_pulse_time;
 
 /*************** End of tunables ***************/
 
-static void (*pm_idle_old)(void);
 static atomic_t active_count = ATOMIC_INIT(0);
 
 struct smartass_info_s {
 	struct cpufreq_policy *cur_policy;
 	struct cpufreq_frequency_table *freq_table;
-	struct timer_list timer;
-	u64 time_in_idle;
-	u64 idle_exit_time;
 	u64 freq_change_time;
-	u64 freq_change_time_in_idle;
 	int cur_cpu_load;
-	int old_freq;
-	int ramp_dir;
 	unsigned int enable;
 	int ideal_speed;
 };
 static DEFINE_PER_CPU(struct smartass_info_s, smartass_info);
 
-/* Workqueues handle frequency scaling */
-static struct workqueue_struct *up_wq;
-static struct workqueue_struct *down_wq;
-static struct work_struct freq_scale_work;
+/* The load is sampled, and the frequency scaled, by the sampling core */
+static void cpufreq_smartass_sample(struct cpufreq_policy *policy,
+				    const struct cpufreq_sample *s);
 
-static cpumask_t work_cpumask;
-static spinlock_t cpumask_lock;
+static struct cpufreq_sampler smartass_sampler = {
+	.sample = cpufreq_smartass_sample,
+};
 
 static unsigned int suspended;
 
@@ -212,27 +204,6 @@ inline static unsigned int validate_freq(struct cpufreq_policy *policy, int freq
 	return freq;
 }
 
-inline static void reset_timer(unsigned long cpu, struct smartass_info_s *this_smartass) {
-	this_smartass->time_in_idle = get_cpu_idle_time_us(cpu, &this_smartass->idle_exit_time);
-	mod_timer(&this_smartass->timer, jiffies + sample_rate_jiffies);
-}
-
-inline static void work_cpumask_set(unsigned long cpu) {
-	unsigned long flags;
-	spin_lock_irqsave(&cpumask_lock, flags);
-	cpumask_set_cpu(cpu, &work_cpumask);
-	spin_unlock_irqrestore(&cpumask_lock, flags);
-}
-
-inline static int work_cpumask_test_and_clear(unsigned long cpu) {
-	unsigned long flags;
-	int res = 0;
-	spin_lock_irqsave(&cpumask_lock, flags);
-	res = cpumask_test_and_clear_cpu(cpu, &work_cpumask);
-	spin_unlock_irqrestore(&cpumask_lock, flags);
-	return res;
-}
-
 inline static int target_freq(struct cpufreq_policy *policy, struct smartass_info_s *this_smartass,
 			      int new_freq, int old_freq, int prefered_relation) {
 	int index, target;
@@ -282,215 +253,110 @@ inline static int target_freq(struct cpufreq_policy *policy, struct smartass_inf
 	return target;
 }
 
-static void cpufreq_smartass_timer(unsigned long cpu)
+// Whether a boost pulse written to boost_pulse is still on
+static int smartass_boost_pulse(void)
 {
-	u64 delta_idle;
-	u64 delta_time;
-	int cpu_load;
-	int old_freq;
-	u64 update_time;
-	u64 now_idle;
-	int queued_work = 0;
-	struct smartass_info_s *this_smartass = &per_cpu(smartass_info, cpu);
-	struct cpufreq_policy *policy = this_smartass->cur_policy;
-
-	now_idle = get_cpu_idle_time_us(cpu, &update_time);
-	old_freq = policy->cur;
-
-	if (this_smartass->idle_exit_time == 0 || update_time == this_smartass->idle_exit_time)
-		return;
-
-	delta_idle = cputime64_sub(now_idle, this_smartass->time_in_idle);
-	delta_time = cputime64_sub(update_time, this_smartass->idle_exit_time);
+	if (boost_pulse > 0) {
+		u64 now = ktime_to_us(ktime_get());
+		if (now <= boost_pulse_time + boost_pulse)
+			return boost_enabled > 0;
+		// Reset boost pulse
+		boost_pulse = 0;
+	}
+	return 0;
+}
 
-	// If timer ran less than 1ms after short-term sample started, retry.
-	if (delta_time < 1000) {
-		if (!timer_pending(&this_smartass->timer))
-			reset_timer(cpu,this_smartass);
-		return;
+static void cpufreq_smartass_sample(struct cpufreq_policy *policy,
+				    const struct cpufreq_sample *s)
+{
+	struct smartass_info_s *this_smartass = &per_cpu(smartass_info, policy->cpu);
+	int cpu_load = s->load;
+	int old_freq = policy->cur;
+	int new_freq;
+	int ramp_dir = 0;
+	unsigned int relation = CPUFREQ_RELATION_L;
+	u64 since_change = s->time_us - this_smartass->freq_change_time;
+
+	if ((s->boosted || smartass_boost_pulse()) &&
+	    old_freq < this_smartass->ideal_speed) {
+		// Jump to ideal frequency, skipping the normal logic
+		new_freq = this_smartass->ideal_speed;
+		relation = CPUFREQ_RELATION_H;
+		dprintk(SMARTASS_DEBUG_ALG,"smartassQ @ %d boost %d\n",
+			old_freq,new_freq);
+		goto out;
 	}
 
-	if (delta_idle > delta_time)
-		cpu_load = 0;
-	else
-		cpu_load = 100 * (unsigned int)(delta_time - delta_idle) / (unsigned int)delta_time;
+	// If the window is less than 1ms long, wait for the next one.
+	if (s->window_us < 1000)
+		return;
 
-	dprintk(SMARTASS_DEBUG_LOAD,"smartassT @ %d: load %d (delta_time %llu)\n",
-		old_freq,cpu_load,delta_time);
+	dprintk(SMARTASS_DEBUG_LOAD,"smartassT @ %d: load %d (delta_time %u)\n",
+		old_freq,cpu_load,s->window_us);
 
 	this_smartass->cur_cpu_load = cpu_load;
-	this_smartass->old_freq = old_freq;
 
 	// Scale up if load is above max or if there where no idle cycles since coming out of idle,
 	// additionally, if we are at or above the ideal_speed, verify we have been at this frequency
 	// for at least up_rate_us:
-	if (cpu_load > max_cpu_load || delta_idle == 0)
+	if (cpu_load > max_cpu_load || s->idle_us == 0)
 	{
 		if (old_freq < policy->max &&
-			 (old_freq < this_smartass->ideal_speed || delta_idle == 0 ||
-			  cputime64_sub(update_time, this_smartass->freq_change_time) >= up_rate_us))
-		{
-			dprintk(SMARTASS_DEBUG_ALG,"smartassT @ %d ramp up: load %d (delta_idle %llu)\n",
-				old_freq,cpu_load,delta_idle);
-			this_smartass->ramp_dir = 1;
-			work_cpumask_set(cpu);
-			queue_work(up_wq, &freq_scale_work);
-			queued_work = 1;
-		}
-		else this_smartass->ramp_dir = 0;
+			 (old_freq < this_smartass->ideal_speed || s->idle_us == 0 ||
+			  since_change >= up_rate_us))
+			ramp_dir = 1;
 	}
 	// Similarly for scale down: load should be below min and if we are at or below ideal
 	// frequency we require that we have been at this frequency for at least down_rate_us:
 	else if (cpu_load < min_cpu_load && old_freq > policy->min &&
 		 (old_freq > this_smartass->ideal_speed ||
-		  cputime64_sub(update_time, this_smartass->freq_change_time) >= down_rate_us))
-	{
-		dprintk(SMARTASS_DEBUG_ALG,"smartassT @ %d ramp down: load %d (delta_idle %llu)\n",
-			old_freq,cpu_load,delta_idle);
-		this_smartass->ramp_dir = -1;
-		work_cpumask_set(cpu);
-		queue_work(down_wq, &freq_scale_work);
-		queued_work = 1;
-	}
-	else this_smartass->ramp_dir = 0;
-
-	// To avoid unnecessary load when the CPU is already at high load, we don't
-	// reset ourselves if we are at max speed. If and when there are idle cycles,
-	// the idle loop will activate the timer.
-	// Additionally, if we queued some work, the work task will reset the timer
-	// after it has done its adjustments.
-	if (!queued_work && old_freq < policy->max)
-		reset_timer(cpu,this_smartass);
-}
-
-static void cpufreq_idle(void)
-{
-	struct smartass_info_s *this_smartass = &per_cpu(smartass_info, smp_processor_id());
-	struct cpufreq_policy *policy = this_smartass->cur_policy;
-
-	if (!this_smartass->enable) {
-		pm_idle_old();
-		return;
+		  since_change >= down_rate_us))
+		ramp_dir = -1;
+
+	if (ramp_dir > 0 && nr_running() > 1) {
+		// ramp up logic:
+		if (old_freq < this_smartass->ideal_speed)
+			new_freq = this_smartass->ideal_speed;
+		else if (ramp_up_step) {
+			new_freq = old_freq + ramp_up_step;
+			relation = CPUFREQ_RELATION_H;
+		}
+		else {
+			new_freq = policy->max;
+			relation = CPUFREQ_RELATION_H;
+		}
+		dprintk(SMARTASS_DEBUG_ALG,"smartassQ @ %d ramp up: load %d (idle %u) ideal=%d\n",
+			old_freq,cpu_load,s->idle_us,this_smartass->ideal_speed);
 	}
-
-	if (policy->cur == policy->min && timer_pending(&this_smartass->timer))
-		del_timer(&this_smartass->timer);
-
-	pm_idle_old();
-
-	if (!timer_pending(&this_smartass->timer))
-		reset_timer(smp_processor_id(), this_smartass);
-}
-
-/* We use the same work function to sale up and down */
-static void cpufreq_smartass_freq_change_time_work(struct work_struct *work)
-{
-	unsigned int cpu;
-	int new_freq;
-	int old_freq;
-	int ramp_dir;
-	struct smartass_info_s *this_smartass;
-	struct cpufreq_policy *policy;
-	unsigned int relation = CPUFREQ_RELATION_L;
-	unsigned int boosted;
-
-	for_each_possible_cpu(cpu) {
-		this_smartass = &per_cpu(smartass_info, cpu);
-		if (!work_cpumask_test_and_clear(cpu))
-			continue;
-
-		ramp_dir = this_smartass->ramp_dir;
-		this_smartass->ramp_dir = 0;
-
-		old_freq = this_smartass->old_freq;
-		policy = this_smartass->cur_policy;
-
-		// boost pulse
-		boosted = 0;
-		if (boost_pulse > 0) {
-			u64 now = ktime_to_us(ktime_get());
-			if (now <= boost_pulse_time + boost_pulse) {
-				// boost logic:
-				if (boost_enabled > 0 &&
-					old_freq < this_smartass->ideal_speed) {
-					// Jump to ideal frequency
-					new_freq = this_smartass->ideal_speed;
-					relation = CPUFREQ_RELATION_H;
-					// Skip normal logic
-					boosted = 1;
-					dprintk(SMARTASS_DEBUG_ALG,"smartassQ @ %d boost %d\n",
-						old_freq,new_freq);
-				}
-			}
-			else {
-				// Reset boost pulse
-				boost_pulse = 0;
-			}
+	else if (ramp_dir < 0) {
+		// ramp down logic:
+		if (old_freq > this_smartass->ideal_speed) {
+			new_freq = this_smartass->ideal_speed;
+			relation = CPUFREQ_RELATION_H;
 		}
-
-		if (boosted == 0) {
-			if (old_freq != policy->cur) {
-				// frequency was changed by someone else?
-				printk(KERN_WARNING "Smartass: frequency changed by 3rd party: %d to %d\n",
-						old_freq,policy->cur);
-				new_freq = old_freq;
-			}
-			else if (ramp_dir > 0 && nr_running() > 1) {
-				// ramp up logic:
-				if (old_freq < this_smartass->ideal_speed)
-					new_freq = this_smartass->ideal_speed;
-				else if (ramp_up_step) {
-					new_freq = old_freq + ramp_up_step;
-					relation = CPUFREQ_RELATION_H;
-				}
-				else {
-					new_freq = policy->max;
-					relation = CPUFREQ_RELATION_H;
-				}
-				dprintk(SMARTASS_DEBUG_ALG,"smartassQ @ %d ramp up: ramp_dir=%d ideal=%d\n",
-					old_freq,ramp_dir,this_smartass->ideal_speed);
-			}
-			else if (ramp_dir < 0) {
-				// ramp down logic:
-				if (old_freq > this_smartass->ideal_speed) {
-					new_freq = this_smartass->ideal_speed;
-					relation = CPUFREQ_RELATION_H;
-				}
-				else if (ramp_down_step)
-					new_freq = old_freq - ramp_down_step;
-				else {
-					// Load heuristics: Adjust new_freq such that, assuming a linear
-					// scaling of load vs. frequency, the load in the new frequency
-					// will be max_cpu_load:
-					new_freq = old_freq * this_smartass->cur_cpu_load / max_cpu_load;
-					if (new_freq > old_freq) // min_cpu_load > max_cpu_load ?!
-						new_freq = old_freq -1;
-				}
-				dprintk(SMARTASS_DEBUG_ALG,"smartassQ @ %d ramp down: ramp_dir=%d ideal=%d\n",
-					old_freq,ramp_dir,this_smartass->ideal_speed);
-			}
-			else { // ramp_dir==0 ?! Could the timer change its mind about a queued ramp up/down
-				// before the work task gets to run?
-				// This may also happen if we refused to ramp up because the nr_running()==1
-				new_freq = old_freq;
-				dprintk(SMARTASS_DEBUG_ALG,"smartassQ @ %d nothing: ramp_dir=%d nr_running=%lu\n",
-					old_freq,ramp_dir,nr_running());
-			}
+		else if (ramp_down_step)
+			new_freq = old_freq - ramp_down_step;
+		else {
+			// Load heuristics: Adjust new_freq such that, assuming a linear
+			// scaling of load vs. frequency, the load in the new frequency
+			// will be max_cpu_load:
+			new_freq = old_freq * cpu_load / max_cpu_load;
+			if (new_freq > old_freq) // min_cpu_load > max_cpu_load ?!
+				new_freq = old_freq -1;
 		}
+		dprintk(SMARTASS_DEBUG_ALG,"smartassQ @ %d ramp down: load %d (idle %u) ideal=%d\n",
+			old_freq,cpu_load,s->idle_us,this_smartass->ideal_speed);
+	}
+	else // nothing to do, or we refused to ramp up because nr_running()==1
+		return;
 
-		// do actual ramp up (returns 0, if frequency change failed):
-		new_freq = target_freq(policy,this_smartass,new_freq,old_freq,relation);
-		if (new_freq)
-			this_smartass->freq_change_time_in_idle =
-				get_cpu_idle_time_us(cpu,&this_smartass->freq_change_time);
-
-		// reset timer:
-		if (new_freq < policy->max)
-			reset_timer(cpu,this_smartass);
-		// if we are maxed out, it is pointless to use the timer
-		// (idle cycles wake up the timer when the timer comes)
-		else if (timer_pending(&this_smartass->timer))
-			del_timer(&this_smartass->timer);
+out:
+	// do actual ramp up (returns 0, if frequency change failed):
+	new_freq = target_freq(policy,this_smartass,new_freq,old_freq,relation);
+	if (new_freq) {
+		// measure the load at the new frequency from now on
+		this_smartass->freq_change_time = s->time_us;
+		cpufreq_sampling_reset(policy);
 	}
 }
 
@@ -613,8 +479,10 @@ static ssize_t store_sample_rate_jiffies(struct kobject *kobj, struct attribute
 	res = strict_strtoul(buf, 0, &input);
 	if (res < 0)
 		return -EINVAL;
-	if (input > 0 && input <= 1000)
+	if (input > 0 && input <= 1000) {
 		sample_rate_jiffies = input;
+		smartass_sampler.rate_us = jiffies_to_usecs(input);
+	}
 	return count;
 }
 
@@ -790,23 +658,29 @@ static int cpufreq_governor_smartass(struct cpufreq_policy *new_policy,
 
 		smp_wmb();
 
-		// Do not register the idle hook and create sysfs
-		// entries if we have already done so.
+		// Do not create sysfs entries if we have already done so.
 		if (atomic_inc_return(&active_count) <= 1) {
 			rc = sysfs_create_group(cpufreq_global_kobject,
 						&smartass_attr_group);
 			if (rc)
-				return rc;
-
-			pm_idle_old = pm_idle;
-			pm_idle = cpufreq_idle;
+				goto err_dec;
 		}
 
-		if (this_smartass->cur_policy->cur < new_policy->max && !timer_pending(&this_smartass->timer))
-			reset_timer(cpu,this_smartass);
+		rc = cpufreq_sampling_start(new_policy, &smartass_sampler);
+		if (rc)
+			goto err_sysfs;
 
 		break;
 
+err_sysfs:
+		if (atomic_read(&active_count) <= 1)
+			sysfs_remove_group(cpufreq_global_kobject,
+					   &smartass_attr_group);
+err_dec:
+		atomic_dec(&active_count);
+		this_smartass->enable = 0;
+		return rc;
+
 	case CPUFREQ_GOV_LIMITS:
 		smartass_update_min_max(this_smartass,new_policy,suspended);
 
@@ -821,23 +695,16 @@ static int cpufreq_governor_smartass(struct cpufreq_policy *new_policy,
 						new_policy->min, CPUFREQ_RELATION_L);
 		}
 
-		if (this_smartass->cur_policy->cur < new_policy->max && !timer_pending(&this_smartass->timer))
-			reset_timer(cpu,this_smartass);
-
 		break;
 
 	case CPUFREQ_GOV_STOP:
 		this_smartass->enable = 0;
 		smp_wmb();
-		del_timer(&this_smartass->timer);
-		flush_work(&freq_scale_work);
-		this_smartass->idle_exit_time = 0;
+		cpufreq_sampling_stop(new_policy);
 
-		if (atomic_dec_return(&active_count) <= 1) {
+		if (atomic_dec_return(&active_count) <= 1)
 			sysfs_remove_group(cpufreq_global_kobject,
 					   &smartass_attr_group);
-			pm_idle = pm_idle_old;
-		}
 		break;
 	}
 
@@ -863,16 +730,15 @@ static void smartass_suspend(int cpu, int suspend)
 					CPUFREQ_RELATION_L);
 	} else {
 		// to avoid wakeup issues with quick sleep/wakeup don't change actual frequency when entering sleep
-		// to allow some time to settle down. Instead we just reset our statistics (and reset the timer).
-		// Eventually, the timer will adjust the frequency if necessary.
+		// to allow some time to settle down. Instead we just reset our statistics (and the sampling window).
+		// Eventually, the sampling will adjust the frequency if necessary.
 
-		this_smartass->freq_change_time_in_idle =
-			get_cpu_idle_time_us(cpu,&this_smartass->freq_change_time);
+		get_cpu_idle_time_us(cpu,&this_smartass->freq_change_time);
 
 		dprintk(SMARTASS_DEBUG_JUMPS,"SmartassS: suspending at %d\n",policy->cur);
 	}
 
-	reset_timer(smp_processor_id(),this_smartass);
+	cpufreq_sampling_reset(policy);
 }
 
 static void smartass_early_suspend(struct early_suspend *handler) {
@@ -912,6 +778,7 @@ static int __init cpufreq_smartass_init(void)
 	sleep_wakeup_freq = DEFAULT_SLEEP_WAKEUP_FREQ;
 	awake_ideal_freq = DEFAULT_AWAKE_IDEAL_FREQ;
 	sample_rate_jiffies = DEFAULT_SAMPLE_RATE_JIFFIES;
+	smartass_sampler.rate_us = jiffies_to_usecs(sample_rate_jiffies);
 	ramp_up_step = DEFAULT_RAMP_UP_STEP;
 	ramp_down_step = DEFAULT_RAMP_DOWN_STEP;
 	max_cpu_load = DEFAULT_MAX_CPU_LOAD;
@@ -919,8 +786,6 @@ static int __init cpufreq_smartass_init(void)
 	boost_enabled = DEFAULT_BOOST_ENABLED;
 	boost_pulse = 0;
 
-	spin_lock_init(&cpumask_lock);
-
 	suspended = 0;
 
 	/* Initalize per-cpu data: */
@@ -928,27 +793,10 @@ static int __init cpufreq_smartass_init(void)
 		this_smartass = &per_cpu(smartass_info, i);
 		this_smartass->enable = 0;
 		this_smartass->cur_policy = 0;
-		this_smartass->ramp_dir = 0;
-		this_smartass->time_in_idle = 0;
-		this_smartass->idle_exit_time = 0;
 		this_smartass->freq_change_time = 0;
-		this_smartass->freq_change_time_in_idle = 0;
 		this_smartass->cur_cpu_load = 0;
-		// intialize timer:
-		init_timer_deferrable(&this_smartass->timer);
-		this_smartass->timer.function = cpufreq_smartass_timer;
-		this_smartass->timer.data = i;
-		work_cpumask_test_and_clear(i);
 	}
 
-	// Scale up is high priority
-	up_wq = create_rt_workqueue("ksmartass_up");
-	down_wq = create_workqueue("ksmartass_down");
-	if (!up_wq || !down_wq)
-		return -ENOMEM;
-
-	INIT_WORK(&freq_scale_work, cpufreq_smartass_freq_change_time_work);
-
 	register_early_suspend(&smartass_power_suspend);
 
 	return cpufreq_register_governor(&cpufreq_gov_smartass2);
@@ -963,8 +811,6 @@ module_init(cpufreq_smartass_init);
 static void __exit cpufreq_smartass_exit(void)
 {
 	cpufreq_unregister_governor(&cpufreq_gov_smartass2);
-	destroy_workqueue(up_wq);
-	destroy_workqueue(down_wq);
 }
 
 module_exit(cpufreq_smartass_exit);
@@ -19,10 +19,56 @@
 #include <linux/kobject.h>
 #include <linux/spinlock.h>
 #include <linux/notifier.h>
+#include <linux/slab.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/hrtimer.h>
 #include <asm/cputime.h>
 
 static spinlock_t cpufreq_stats_lock;
 
+#ifdef CONFIG_CPU_FREQ_STAT_TRACE
+/* Latency buckets: below 16us, 32us, ... 4096us, and the rest */
+#define CPUFREQ_STATS_LAT_BUCKETS	10
+/* Number of recent transitions kept, a power of 2 */
+#define CPUFREQ_STATS_DECISIONS		256
+
+struct cpufreq_stats_latency {
+	unsigned int count;
+	unsigned int max_us;
+	u64 total_us;
+	unsigned int hist[CPUFREQ_STATS_LAT_BUCKETS];
+};
+
+/* A transition, and the governor request that led to it */
+struct cpufreq_stats_decision {
+	u64 time_us;			/* when it completed */
+	void *caller;			/* NULL if not from a request */
+	unsigned int old;
+	unsigned int new;
+	unsigned int target;
+	unsigned int latency_us;
+	int load;			/* -1 if not known */
+	unsigned int relation:1;
+	unsigned int boosted:1;
+	char governor[CPUFREQ_NAME_LEN];
+};
+
+struct cpufreq_stats_trace {
+	u64 *residency_us;		/* ktime based time_in_state */
+	unsigned int *entries;		/* times each state was entered */
+	ktime_t last_time;
+	ktime_t pre_time;		/* PRECHANGE of the transition */
+	struct cpufreq_stats_latency *latency;	/* [from][to] */
+	struct cpufreq_stats_decision pending;
+	struct cpufreq_stats_decision *decisions;
+	unsigned int next_decision;
+	struct dentry *dir;
+};
+
+static struct dentry *cpufreq_stats_debugfs;
+#endif
+
 #define CPUFREQ_STATDEVICE_ATTR(_name, _mode, _show) \
 static struct freq_attr _attr_##_name = {\
 	.attr = {.name = __stringify(_name), .mode = _mode, }, \
@@ -41,6 +87,9 @@ struct cpufreq_stats {
 #ifdef CONFIG_CPU_FREQ_STAT_DETAILS
 	unsigned int *trans_table;
 #endif
+#ifdef CONFIG_CPU_FREQ_STAT_TRACE
+	struct cpufreq_stats_trace *trace;
+#endif
 };
 
 static DEFINE_PER_CPU(struct cpufreq_stats *, cpufreq_stats_table);
@@ -50,6 +99,103 @@ struct cpufreq_stats_attribute {
 	ssize_t(*show) (struct cpufreq_stats *, char *);
 };
 
+#ifdef CONFIG_CPU_FREQ_STAT_TRACE
+/* Called with cpufreq_stats_lock held */
+static void cpufreq_stats_trace_update(struct cpufreq_stats *stat)
+{
+	struct cpufreq_stats_trace *trace = stat->trace;
+	ktime_t now = ktime_get();
+
+	if (!trace)
+		return;
+	trace->residency_us[stat->last_index] +=
+		ktime_us_delta(now, trace->last_time);
+	trace->last_time = now;
+}
+
+/* The request being carried out is noted when the transition starts */
+static void cpufreq_stats_trace_prechange(struct cpufreq_stats *stat,
+					  struct cpufreq_freqs *freq)
+{
+	const struct cpufreq_request *req = cpufreq_get_request(stat->cpu);
+	struct cpufreq_stats_decision *d;
+
+	spin_lock(&cpufreq_stats_lock);
+	if (!stat->trace) {
+		spin_unlock(&cpufreq_stats_lock);
+		return;
+	}
+	d = &stat->trace->pending;
+	memset(d, 0, sizeof(*d));
+	d->old = freq->old;
+	d->load = -1;
+	if (req) {
+		d->caller = req->caller;
+		d->target = req->target;
+		d->relation = req->relation == CPUFREQ_RELATION_H;
+		d->load = req->load;
+		d->boosted = req->boosted;
+		if (req->governor)
+			strlcpy(d->governor, req->governor,
+				sizeof(d->governor));
+	}
+	stat->trace->pre_time = ktime_get();
+	spin_unlock(&cpufreq_stats_lock);
+}
+
+/* Called with cpufreq_stats_lock held */
+static void cpufreq_stats_trace_transition(struct cpufreq_stats *stat,
+					   struct cpufreq_freqs *freq,
+					   int old_index, int new_index)
+{
+	struct cpufreq_stats_trace *trace = stat->trace;
+	struct cpufreq_stats_latency *lat;
+	struct cpufreq_stats_decision *d;
+	ktime_t now = ktime_get();
+	unsigned int us;
+
+	if (!trace)
+		return;
+
+	trace->entries[new_index]++;
+
+	/* Without a PRECHANGE for this transition there is no latency */
+	if (!trace->pre_time.tv64 || trace->pending.old != freq->old)
+		return;
+	us = (unsigned int)ktime_us_delta(now, trace->pre_time);
+	trace->pre_time.tv64 = 0;
+
+	lat = &trace->latency[old_index * stat->max_state + new_index];
+	lat->count++;
+	lat->total_us += us;
+	if (us > lat->max_us)
+		lat->max_us = us;
+	lat->hist[min(fls(us >> 4), CPUFREQ_STATS_LAT_BUCKETS - 1)]++;
+
+	d = &trace->decisions[trace->next_decision++ &
+			      (CPUFREQ_STATS_DECISIONS - 1)];
+	*d = trace->pending;
+	d->time_us = ktime_to_us(now);
+	d->new = freq->new;
+	d->latency_us = us;
+}
+#else
+static inline void cpufreq_stats_trace_update(struct cpufreq_stats *stat)
+{
+}
+
+static inline void cpufreq_stats_trace_prechange(struct cpufreq_stats *stat,
+						 struct cpufreq_freqs *freq)
+{
+}
+
+static inline void cpufreq_stats_trace_transition(struct cpufreq_stats *stat,
+						  struct cpufreq_freqs *freq,
+						  int old_index, int new_index)
+{
+}
+#endif
+
 static int cpufreq_stats_update(unsigned int cpu)
 {
 	struct cpufreq_stats *stat;
@@ -63,6 +209,7 @@ static int cpufreq_stats_update(unsigned int cpu)
 			cputime64_add(stat->time_in_state[stat->last_index],
 				      cputime_sub(cur_time, stat->last_time));
 	stat->last_time = cur_time;
+	cpufreq_stats_trace_update(stat);
 	spin_unlock(&cpufreq_stats_lock);
 	return 0;
 }
@@ -155,6 +302,188 @@ static struct attribute_group stats_attr_group = {
 	.name = "stats"
 };
 
+#ifdef CONFIG_CPU_FREQ_STAT_TRACE
+/*
+ * The debugfs files are looked up by CPU, under cpufreq_stats_lock, so that
+ * an open file does not keep a freed table in use.
+ */
+static struct cpufreq_stats *cpufreq_stats_trace_get(struct seq_file *m)
+{
+	struct cpufreq_stats *stat;
+
+	spin_lock(&cpufreq_stats_lock);
+	stat = per_cpu(cpufreq_stats_table, (unsigned long)m->private);
+	if (stat && stat->trace)
+		return stat;
+	spin_unlock(&cpufreq_stats_lock);
+	return NULL;
+}
+
+static int cpufreq_stats_residency_show(struct seq_file *m, void *unused)
+{
+	struct cpufreq_stats *stat;
+	int i;
+
+	cpufreq_stats_update((unsigned long)m->private);
+	stat = cpufreq_stats_trace_get(m);
+	if (!stat)
+		return 0;
+	seq_printf(m, "%9s %14s %9s\n", "freq", "time_us", "entries");
+	for (i = 0; i < stat->state_num; i++)
+		seq_printf(m, "%9u %14llu %9u\n", stat->freq_table[i],
+			   (unsigned long long)stat->trace->residency_us[i],
+			   stat->trace->entries[i]);
+	spin_unlock(&cpufreq_stats_lock);
+	return 0;
+}
+
+static int cpufreq_stats_latency_show(struct seq_file *m, void *unused)
+{
+	struct cpufreq_stats *stat;
+	struct cpufreq_stats_latency *lat;
+	int i, j, k;
+
+	stat = cpufreq_stats_trace_get(m);
+	if (!stat)
+		return 0;
+	seq_printf(m, "%9s %9s %7s %7s %7s ", "from", "to", "count",
+		   "avg_us", "max_us");
+	for (k = 0; k < CPUFREQ_STATS_LAT_BUCKETS - 1; k++)
+		seq_printf(m, " <%-5u", 16 << k);
+	seq_printf(m, " >=%u\n", 16 << (k - 1));
+
+	for (i = 0; i < stat->state_num; i++) {
+		for (j = 0; j < stat->state_num; j++) {
+			u64 avg;
+
+			lat = &stat->trace->latency[i * stat->max_state + j];
+			if (!lat->count)
+				continue;
+			avg = lat->total_us;
+			do_div(avg, lat->count);
+			seq_printf(m, "%9u %9u %7u %7llu %7u ",
+				   stat->freq_table[i], stat->freq_table[j],
+				   lat->count, (unsigned long long)avg,
+				   lat->max_us);
+			for (k = 0; k < CPUFREQ_STATS_LAT_BUCKETS; k++)
+				seq_printf(m, " %6u", lat->hist[k]);
+			seq_putc(m, '\n');
+		}
+	}
+	spin_unlock(&cpufreq_stats_lock);
+	return 0;
+}
+
+static int cpufreq_stats_decisions_show(struct seq_file *m, void *unused)
+{
+	struct cpufreq_stats *stat;
+	struct cpufreq_stats_decision *d;
+	unsigned int i, n;
+
+	stat = cpufreq_stats_trace_get(m);
+	if (!stat)
+		return 0;
+	seq_printf(m, "# time_us from to latency_us governor load boosted "
+		   "target relation caller\n");
+	n = min_t(unsigned int, stat->trace->next_decision,
+		  CPUFREQ_STATS_DECISIONS);
+	/* Oldest first */
+	for (i = stat->trace->next_decision - n;
+	     i != stat->trace->next_decision; i++) {
+		d = &stat->trace->decisions[i & (CPUFREQ_STATS_DECISIONS - 1)];
+		seq_printf(m, "%llu %u %u %u %s ",
+			   (unsigned long long)d->time_us, d->old, d->new,
+			   d->latency_us, d->governor[0] ? d->governor : "-");
+		if (d->load >= 0)
+			seq_printf(m, "%d %u ", d->load, d->boosted);
+		else
+			seq_printf(m, "- %u ", d->boosted);
+		if (d->caller)
+			seq_printf(m, "%u %c %pS\n", d->target,
+				   d->relation ? 'H' : 'L', d->caller);
+		else
+			seq_printf(m, "- - -\n");
+	}
+	spin_unlock(&cpufreq_stats_lock);
+	return 0;
+}
+
+#define CPUFREQ_STATS_DEBUGFS_FOPS(_name)				\
+static int cpufreq_stats_##_name##_open(struct inode *inode,		\
+					struct file *file)		\
+{									\
+	return single_open(file, cpufreq_stats_##_name##_show,		\
+			   inode->i_private);				\
+}									\
+static const struct file_operations cpufreq_stats_##_name##_fops = {	\
+	.open		= cpufreq_stats_##_name##_open,			\
+	.read		= seq_read,					\
+	.llseek		= seq_lseek,					\
+	.release	= single_release,				\
+};
+
+CPUFREQ_STATS_DEBUGFS_FOPS(residency);
+CPUFREQ_STATS_DEBUGFS_FOPS(latency);
+CPUFREQ_STATS_DEBUGFS_FOPS(decisions);
+
+static void cpufreq_stats_trace_free(struct cpufreq_stats_trace *trace)
+{
+	if (!trace)
+		return;
+	debugfs_remove_recursive(trace->dir);
+	kfree(trace->residency_us);
+	kfree(trace->latency);
+	kfree(trace->decisions);
+	kfree(trace);
+}
+
+/* Tracing is optional: without memory for it, the stats go on without */
+static struct cpufreq_stats_trace *cpufreq_stats_trace_create(
+		struct cpufreq_stats *stat)
+{
+	struct cpufreq_stats_trace *trace;
+	void *data = (void *)(unsigned long)stat->cpu;
+	unsigned int count = stat->max_state;
+	char name[16];
+
+	trace = kzalloc(sizeof(struct cpufreq_stats_trace), GFP_KERNEL);
+	if (!trace)
+		return NULL;
+
+	trace->residency_us = kzalloc(count * (sizeof(u64) + sizeof(int)),
+				      GFP_KERNEL);
+	trace->latency = kzalloc(count * count *
+				 sizeof(struct cpufreq_stats_latency),
+				 GFP_KERNEL);
+	trace->decisions = kzalloc(CPUFREQ_STATS_DECISIONS *
+				   sizeof(struct cpufreq_stats_decision),
+				   GFP_KERNEL);
+	if (!trace->residency_us || !trace->latency || !trace->decisions)
+		goto err;
+	trace->entries = (unsigned int *)(trace->residency_us + count);
+	trace->last_time = ktime_get();
+
+	if (cpufreq_stats_debugfs) {
+		snprintf(name, sizeof(name), "cpu%u", stat->cpu);
+		trace->dir = debugfs_create_dir(name, cpufreq_stats_debugfs);
+		if (trace->dir) {
+			debugfs_create_file("residency", 0444, trace->dir,
+					    data, &cpufreq_stats_residency_fops);
+			debugfs_create_file("trans_latency", 0444, trace->dir,
+					    data, &cpufreq_stats_latency_fops);
+			debugfs_create_file("decisions", 0444, trace->dir,
+					    data, &cpufreq_stats_decisions_fops);
+		}
+	}
+	return trace;
+err:
+	cpufreq_stats_trace_free(trace);
+	printk(KERN_WARNING "cpufreq_stats: no memory to trace cpu%u\n",
+	       stat->cpu);
+	return NULL;
+}
+#endif
+
 static int freq_table_get_index(struct cpufreq_stats *stat, unsigned int freq)
 {
 	int index;
@@ -170,11 +499,17 @@ static int freq_table_get_index(struct cpufreq_stats *stat, unsigned int freq)
 static void cpufreq_stats_free_table(unsigned int cpu)
 {
 	struct cpufreq_stats *stat = per_cpu(cpufreq_stats_table, cpu);
+
+	spin_lock(&cpufreq_stats_lock);
+	per_cpu(cpufreq_stats_table, cpu) = NULL;
+	spin_unlock(&cpufreq_stats_lock);
 	if (stat) {
+#ifdef CONFIG_CPU_FREQ_STAT_TRACE
+		cpufreq_stats_trace_free(stat->trace);
+#endif
 		kfree(stat->time_in_state);
 		kfree(stat);
 	}
-	per_cpu(cpufreq_stats_table, cpu) = NULL;
 }
 
 /* must be called early in the CPU removal sequence (before
@@ -197,6 +532,9 @@ static int cpufreq_stats_create_table(struct cpufreq_policy *policy,
 	struct cpufreq_policy *data;
 	unsigned int alloc_size;
 	unsigned int cpu = policy->cpu;
+#ifdef CONFIG_CPU_FREQ_STAT_TRACE
+	struct cpufreq_stats_trace *trace;
+#endif
 	if (per_cpu(cpufreq_stats_table, cpu))
 		return -EBUSY;
 	stat = kzalloc(sizeof(struct cpufreq_stats), GFP_KERNEL);
@@ -248,9 +586,15 @@ static int cpufreq_stats_create_table(struct cpufreq_policy *policy,
 			stat->freq_table[j++] = freq;
 	}
 	stat->state_num = j;
+#ifdef CONFIG_CPU_FREQ_STAT_TRACE
+	trace = cpufreq_stats_trace_create(stat);
+#endif
 	spin_lock(&cpufreq_stats_lock);
 	stat->last_time = get_jiffies_64();
 	stat->last_index = freq_table_get_index(stat, policy->cur);
+#ifdef CONFIG_CPU_FREQ_STAT_TRACE
+	stat->trace = trace;
+#endif
 	spin_unlock(&cpufreq_stats_lock);
 	cpufreq_cpu_put(data);
 	return 0;
@@ -287,13 +631,18 @@ static int cpufreq_stat_notifier_trans(struct notifier_block *nb,
 	struct cpufreq_stats *stat;
 	int old_index, new_index;
 
-	if (val != CPUFREQ_POSTCHANGE)
+	if (val != CPUFREQ_PRECHANGE && val != CPUFREQ_POSTCHANGE)
 		return 0;
 
 	stat = per_cpu(cpufreq_stats_table, freq->cpu);
 	if (!stat)
 		return 0;
 
+	if (val == CPUFREQ_PRECHANGE) {
+		cpufreq_stats_trace_prechange(stat, freq);
+		return 0;
+	}
+
 	old_index = stat->last_index;
 	new_index = freq_table_get_index(stat, freq->new);
 
@@ -310,6 +659,7 @@ static int cpufreq_stat_notifier_trans(struct notifier_block *nb,
 	stat->trans_table[old_index * stat->max_state + new_index]++;
 #endif
 	stat->total_trans++;
+	cpufreq_stats_trace_transition(stat, freq, old_index, new_index);
 	spin_unlock(&cpufreq_stats_lock);
 	return 0;
 }
@@ -357,6 +707,9 @@ static int __init cpufreq_stats_init(void)
 	unsigned int cpu;
 
 	spin_lock_init(&cpufreq_stats_lock);
+#ifdef CONFIG_CPU_FREQ_STAT_TRACE
+	cpufreq_stats_debugfs = debugfs_create_dir("cpufreq_stats", NULL);
+#endif
 	ret = cpufreq_register_notifier(&notifier_policy_block,
 				CPUFREQ_POLICY_NOTIFIER);
 	if (ret)
@@ -389,6 +742,9 @@ static void __exit cpufreq_stats_exit(void)
 		cpufreq_stats_free_table(cpu);
 		cpufreq_stats_free_sysfs(cpu);
 	}
+#ifdef CONFIG_CPU_FREQ_STAT_TRACE
+	debugfs_remove_recursive(cpufreq_stats_debugfs);
+#endif
 }
 
 MODULE_AUTHOR("Zou Nan hai <nanhai.zou@intel.com>");
@@ -0,0 +1,116 @@
+/*
+ * Binder tracepoints. They look into the private structures of binder.c,
+ * so this header is only included from there, after their definitions.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM binder
+
+#if !defined(_BINDER_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _BINDER_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/*
+ * The life of a call is binder_transaction (the sender's BC_TRANSACTION),
+ * binder_transaction_received (a target thread took it off its todo
+ * list), binder_reply (the target's BC_REPLY) and another
+ * binder_transaction_received for the reply. Records are matched by the
+ * transaction ids. The latencies are measured from the binder_transaction
+ * of the call.
+ */
+TRACE_EVENT(binder_transaction,
+	TP_PROTO(struct binder_transaction *t, int reply, int target_node),
+	TP_ARGS(t, reply, target_node),
+
+	TP_STRUCT__entry(
+		__field(int,		debug_id		)
+		__field(int,		reply			)
+		__field(int,		target_node		)
+		__field(int,		to_proc			)
+		__field(int,		to_thread		)
+		__field(unsigned int,	code			)
+		__field(unsigned int,	flags			)
+		__field(size_t,		data_size		)
+		__field(size_t,		offsets_size		)
+	),
+
+	TP_fast_assign(
+		__entry->debug_id	= t->debug_id;
+		__entry->reply		= reply;
+		__entry->target_node	= target_node;
+		__entry->to_proc	= t->to_proc->pid;
+		__entry->to_thread	= t->to_thread ? t->to_thread->pid : 0;
+		__entry->code		= t->code;
+		__entry->flags		= t->flags;
+		__entry->data_size	= t->buffer->data_size;
+		__entry->offsets_size	= t->buffer->offsets_size;
+	),
+
+	TP_printk("transaction=%d dest_node=%d dest_proc=%d dest_thread=%d reply=%d flags=0x%x code=0x%x size=%zd:%zd",
+		  __entry->debug_id, __entry->target_node, __entry->to_proc,
+		  __entry->to_thread, __entry->reply, __entry->flags,
+		  __entry->code, __entry->data_size, __entry->offsets_size)
+);
+
+TRACE_EVENT(binder_transaction_received,
+	TP_PROTO(struct binder_transaction *t, s64 sent_ns, s64 latency_us),
+	TP_ARGS(t, sent_ns, latency_us),
+
+	TP_STRUCT__entry(
+		__field(int,		debug_id		)
+		__field(s64,		sent_ns			)
+		__field(s64,		latency_us		)
+		__field(size_t,		data_size		)
+		__field(size_t,		offsets_size		)
+	),
+
+	TP_fast_assign(
+		__entry->debug_id	= t->debug_id;
+		__entry->sent_ns	= sent_ns;
+		__entry->latency_us	= latency_us;
+		__entry->data_size	= t->buffer->data_size;
+		__entry->offsets_size	= t->buffer->offsets_size;
+	),
+
+	TP_printk("transaction=%d sent=%lld wakeup_us=%lld size=%zd:%zd",
+		  __entry->debug_id, __entry->sent_ns, __entry->latency_us,
+		  __entry->data_size, __entry->offsets_size)
+);
+
+TRACE_EVENT(binder_reply,
+	TP_PROTO(struct binder_transaction *t,
+		 struct binder_transaction *in_reply_to, s64 latency_us),
+	TP_ARGS(t, in_reply_to, latency_us),
+
+	TP_STRUCT__entry(
+		__field(int,		debug_id		)
+		__field(int,		call_id			)
+		__field(s64,		call_sent_ns		)
+		__field(s64,		latency_us		)
+		__field(size_t,		data_size		)
+		__field(size_t,		offsets_size		)
+	),
+
+	TP_fast_assign(
+		__entry->debug_id	= t->debug_id;
+		__entry->call_id	= in_reply_to->debug_id;
+		__entry->call_sent_ns	= ktime_to_ns(in_reply_to->start_time);
+		__entry->latency_us	= latency_us;
+		__entry->data_size	= t->buffer->data_size;
+		__entry->offsets_size	= t->buffer->offsets_size;
+	),
+
+	TP_printk("transaction=%d call=%d call_sent=%lld call_us=%lld size=%zd:%zd",
+		  __entry->debug_id, __entry->call_id, __entry->call_sent_ns,
+		  __entry->latency_us, __entry->data_size,
+		  __entry->offsets_size)
+);
+
+#endif /* _BINDER_TRACE_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE binder_trace
+#include <trace/define_trace.h>
@@ -24,6 +24,12 @@
 #include <linux/uaccess.h>
 #include <linux/poll.h>
 #include <linux/time.h>
+#include <linux/percpu.h>
+#include <linux/slab.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
 #include "logger.h"
 
 #include <asm/ioctls.h>
@@ -32,32 +38,52 @@
  * struct logger_log - represents a specific log, such as 'main' or 'radio'
  *
  * This structure lives from module insertion until module removal, so it does
- * not need additional reference counting. The structure is protected by the
- * mutex 'mutex'.
+ * not need additional reference counting.
+ *
+ * Writers never sleep on the log. Each one copies its entry into a per-cpu
+ * staging buffer, reserves space at hdr->reserve under the spinlock 'lock',
+ * copies the entry into the ring without the lock and then commits it by
+ * moving hdr->w_off past it. Commits happen in reservation order, so readers
+ * only ever see complete entries below hdr->w_off. The offsets, the readers'
+ * offsets and the stats are protected by 'lock', except hdr->w_off which only
+ * the committing writer changes. The mutex 'mutex' serializes readers.
+ *
+ * The offsets in 'hdr' are free-running, see struct logger_mmap_header, the
+ * readers' offsets are into the ring.
  */
 struct logger_log {
 	unsigned char 		*buffer;/* the ring buffer itself */
 	struct miscdevice	misc;	/* misc device representing the log */
 	wait_queue_head_t	wq;	/* wait queue for readers */
 	struct list_head	readers; /* this log's readers */
-	struct mutex		mutex;	/* mutex protecting buffer */
-	size_t			w_off;	/* current write head offset */
-	size_t			head;	/* new readers start here */
+	struct mutex		mutex;	/* mutex serializing readers */
+	spinlock_t		lock;	/* lock protecting the offsets */
+	struct logger_mmap_header *hdr;	/* offsets, page before the buffer */
 	size_t			size;	/* size of the log */
+	struct logger_stats	stats;	/* counters, see logger.h */
+	atomic_t		commit_waits; /* stats.commit_waits */
 };
 
 /*
  * struct logger_reader - a logging device open for reading
  *
  * This object lives from open to release, so we don't need additional
- * reference counting. The structure is protected by log->mutex.
+ * reference counting. The structure is protected by log->lock.
  */
 struct logger_reader {
 	struct logger_log	*log;	/* associated log */
 	struct list_head	list;	/* entry in logger_log's list */
 	size_t			r_off;	/* current read head offset */
+	unsigned long		lapped;	/* times a writer moved r_off */
 };
 
+/* entries are staged here, outside of the log, before they are reserved */
+union logger_staging {
+	struct logger_entry	entry;
+	unsigned char		buf[LOGGER_ENTRY_MAX_LEN];
+};
+static DEFINE_PER_CPU(union logger_staging, logger_staging);
+
 /* logger_offset - returns index 'n' into the log via (optimized) modulus */
 #define logger_offset(n)	((n) & (log->size - 1))
 
@@ -88,7 +114,7 @@ static inline struct logger_log *file_get_log(struct file *file)
  * get_entry_len - Grabs the length of the payload of the next entry starting
  * from 'off'.
  *
- * Caller needs to hold log->mutex.
+ * Caller needs to hold log->lock.
  */
 static __u32 get_entry_len(struct logger_log *log, size_t off)
 {
@@ -107,13 +133,13 @@ static __u32 get_entry_len(struct logger_log *log, size_t off)
 }
 
 /*
- * do_read_log_to_user - reads exactly 'count' bytes from 'log' into the
- * user-space buffer 'buf'. Returns 'count' on success.
+ * do_read_log_to_user - reads exactly 'count' bytes at 'off' from 'log' into
+ * the user-space buffer 'buf'. Returns 'count' on success.
  *
- * Caller must hold log->mutex.
+ * Caller must hold log->mutex but not log->lock, writers may overwrite the
+ * bytes while they are copied.
  */
-static ssize_t do_read_log_to_user(struct logger_log *log,
-				   struct logger_reader *reader,
+static ssize_t do_read_log_to_user(struct logger_log *log, size_t off,
 				   char __user *buf,
 				   size_t count)
 {
@@ -121,11 +147,11 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 
 	/*
 	 * We read from the log in two disjoint operations. First, we read from
-	 * the current read head offset up to 'count' bytes or to the end of
-	 * the log, whichever comes first.
+	 * the read offset up to 'count' bytes or to the end of the log,
+	 * whichever comes first.
 	 */
-	len = min(count, log->size - reader->r_off);
-	if (copy_to_user(buf, log->buffer + reader->r_off, len))
+	len = min(count, log->size - off);
+	if (copy_to_user(buf, log->buffer + off, len))
 		return -EFAULT;
 
 	/*
@@ -136,8 +162,6 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 		if (copy_to_user(buf + len, log->buffer, count - len))
 			return -EFAULT;
 
-	reader->r_off = logger_offset(reader->r_off + count);
-
 	return count;
 }
 
@@ -158,6 +182,8 @@ static ssize_t logger_read(struct file *file, char __user *buf,
 {
 	struct logger_reader *reader = file->private_data;
 	struct logger_log *log = reader->log;
+	unsigned long lapped;
+	size_t off;
 	ssize_t ret;
 	DEFINE_WAIT(wait);
 
@@ -165,9 +191,9 @@ start:
 	while (1) {
 		prepare_to_wait(&log->wq, &wait, TASK_INTERRUPTIBLE);
 
-		mutex_lock(&log->mutex);
-		ret = (log->w_off == reader->r_off);
-		mutex_unlock(&log->mutex);
+		spin_lock(&log->lock);
+		ret = (logger_offset(log->hdr->w_off) == reader->r_off);
+		spin_unlock(&log->lock);
 		if (!ret)
 			break;
 
@@ -189,22 +215,44 @@ start:
 		return ret;
 
 	mutex_lock(&log->mutex);
+	spin_lock(&log->lock);
 
 	/* is there still something to read or did we race? */
-	if (unlikely(log->w_off == reader->r_off)) {
+	if (unlikely(logger_offset(log->hdr->w_off) == reader->r_off)) {
+		spin_unlock(&log->lock);
 		mutex_unlock(&log->mutex);
 		goto start;
 	}
+	/* pairs with the barrier in logger_commit() */
+	smp_rmb();
 
 	/* get the size of the next entry */
-	ret = get_entry_len(log, reader->r_off);
+	off = reader->r_off;
+	lapped = reader->lapped;
+	ret = get_entry_len(log, off);
+	spin_unlock(&log->lock);
 	if (count < ret) {
 		ret = -EINVAL;
 		goto out;
 	}
 
 	/* get exactly one entry from the log */
-	ret = do_read_log_to_user(log, reader, buf, ret);
+	ret = do_read_log_to_user(log, off, buf, ret);
+	if (ret < 0)
+		goto out;
+
+	/*
+	 * If a writer lapped us during the copy the entry may be torn, read
+	 * again from where fix_up_readers() left us.
+	 */
+	spin_lock(&log->lock);
+	if (unlikely(reader->lapped != lapped)) {
+		spin_unlock(&log->lock);
+		mutex_unlock(&log->mutex);
+		goto start;
+	}
+	reader->r_off = logger_offset(off + ret);
+	spin_unlock(&log->lock);
 
 out:
 	mutex_unlock(&log->mutex);
@@ -214,11 +262,13 @@ out:
 
 /*
  * get_next_entry - return the offset of the first valid entry at least 'len'
- * bytes after 'off'.
+ * bytes after 'off'. If 'entries' is not NULL, the number of entries skipped
+ * is added to it.
  *
- * Caller must hold log->mutex.
+ * Caller must hold log->lock.
  */
-static size_t get_next_entry(struct logger_log *log, size_t off, size_t len)
+static size_t get_next_entry(struct logger_log *log, size_t off, size_t len,
+			     __u64 *entries)
 {
 	size_t count = 0;
 
@@ -226,6 +276,8 @@ static size_t get_next_entry(struct logger_log *log, size_t off, size_t len)
 		size_t nr = get_entry_len(log, off);
 		off = logger_offset(off + nr);
 		count += nr;
+		if (entries)
+			(*entries)++;
 	} while (count < len);
 
 	return off;
@@ -250,69 +302,143 @@ static inline int clock_interval(size_t a, size_t b, size_t c)
 
 /*
  * fix_up_readers - walk the list of all readers and "fix up" any who were
- * lapped by the writer; also do the same for the default "start head".
- * We do this by "pulling forward" the readers and start head to the first
- * entry after the new write head.
+ * lapped by the writer reserving 'len' bytes at 'old'; also do the same for
+ * the default "start head". We do this by "pulling forward" the readers and
+ * start head to the first entry after the new reserve offset.
  *
- * The caller needs to hold log->mutex.
+ * The caller needs to hold log->lock.
  */
-static void fix_up_readers(struct logger_log *log, size_t len)
+static void fix_up_readers(struct logger_log *log, size_t old, size_t len)
 {
-	size_t old = log->w_off;
 	size_t new = logger_offset(old + len);
+	size_t head = logger_offset(log->hdr->head);
 	struct logger_reader *reader;
 
-	if (clock_interval(old, new, log->head))
-		log->head = get_next_entry(log, log->head, len);
+	if (clock_interval(old, new, head))
+		log->hdr->head += logger_offset(get_next_entry(log, head, len,
+					&log->stats.overwritten) - head);
 
 	list_for_each_entry(reader, &log->readers, list)
-		if (clock_interval(old, new, reader->r_off))
-			reader->r_off = get_next_entry(log, reader->r_off, len);
+		if (clock_interval(old, new, reader->r_off)) {
+			reader->r_off = get_next_entry(log, reader->r_off, len,
+						       NULL);
+			reader->lapped++;
+			log->stats.readers_lapped++;
+		}
 }
 
 /*
- * do_write_log - writes 'len' bytes from 'buf' to 'log'
+ * logger_reserve - reserves 'len' bytes at the end of 'log' and returns
+ * their offset in 'off'.
  *
- * The caller needs to hold log->mutex.
+ * Returns zero on success, or -ENOSPC if the space, or the entries that
+ * fix_up_readers() has to walk past it, are still being written by others.
  */
-static void do_write_log(struct logger_log *log, const void *buf, size_t count)
+static int logger_reserve(struct logger_log *log, size_t len, size_t *off)
+{
+	size_t busy;
+
+	if (!spin_trylock(&log->lock)) {
+		spin_lock(&log->lock);
+		log->stats.contended++;
+	}
+
+	busy = logger_offset(log->hdr->reserve - ACCESS_ONCE(log->hdr->w_off));
+	if (unlikely(busy + len + LOGGER_ENTRY_MAX_LEN > log->size)) {
+		log->stats.dropped++;
+		spin_unlock(&log->lock);
+		return -ENOSPC;
+	}
+
+	/*
+	 * Fix up any readers, pulling them forward to the first readable
+	 * entry after (what will be) the new reserve offset, before we start
+	 * to clobber the entries they are on.
+	 */
+	*off = logger_offset(log->hdr->reserve);
+	fix_up_readers(log, *off, len);
+	log->hdr->reserve += len;
+	/* mmap() readers must see the reservation before the entry changes */
+	smp_wmb();
+	log->stats.entries++;
+	log->stats.bytes += len;
+
+	spin_unlock(&log->lock);
+
+	return 0;
+}
+
+/*
+ * do_write_log - writes 'count' bytes from 'buf' to 'log' at 'off'
+ *
+ * The caller needs to have reserved the space.
+ */
+static void do_write_log(struct logger_log *log, size_t off, const void *buf,
+			 size_t count)
 {
 	size_t len;
 
-	len = min(count, log->size - log->w_off);
-	memcpy(log->buffer + log->w_off, buf, len);
+	len = min(count, log->size - off);
+	memcpy(log->buffer + off, buf, len);
 
 	if (count != len)
 		memcpy(log->buffer, buf + len, count - len);
+}
 
-	log->w_off = logger_offset(log->w_off + count);
+/*
+ * logger_commit - makes the 'len' bytes reserved at 'off' visible to readers
+ *
+ * Entries are committed in the order they were reserved, so this waits for
+ * the writers that reserved space before us. They run with preemption
+ * disabled from reserve to commit, as we do, so the wait is short.
+ */
+static void logger_commit(struct logger_log *log, size_t off, size_t len)
+{
+	if (unlikely(logger_offset(ACCESS_ONCE(log->hdr->w_off)) != off)) {
+		atomic_inc(&log->commit_waits);
+		while (logger_offset(ACCESS_ONCE(log->hdr->w_off)) != off)
+			cpu_relax();
+	}
 
+	/* the entry must be in place before readers see the new offset */
+	smp_wmb();
+	log->hdr->w_off += len;
 }
 
 /*
- * do_write_log_user - writes 'len' bytes from the user-space buffer 'buf' to
- * the log 'log'
- *
- * The caller needs to hold log->mutex.
+ * copy_entry_from_user - copies 'count' bytes of payload from the user-space
+ * vector 'iov' to 'buf'. With 'atomic' set this does not sleep and fails if
+ * the user pages are not resident.
  *
- * Returns 'count' on success, negative error code on failure.
+ * Returns zero on success, -EFAULT on failure.
  */
-static ssize_t do_write_log_from_user(struct logger_log *log,
-				      const void __user *buf, size_t count)
+static int copy_entry_from_user(void *buf, const struct iovec *iov,
+				unsigned long nr_segs, size_t count,
+				int atomic)
 {
-	size_t len;
+	while (count && nr_segs-- > 0) {
+		size_t len;
+		unsigned long left;
 
-	len = min(count, log->size - log->w_off);
-	if (len && copy_from_user(log->buffer + log->w_off, buf, len))
-		return -EFAULT;
+		/* figure out how much of this vector we can keep */
+		len = min_t(size_t, iov->iov_len, count);
+		if (unlikely(!access_ok(VERIFY_READ, iov->iov_base, len)))
+			return -EFAULT;
 
-	if (count != len)
-		if (copy_from_user(log->buffer, buf + len, count - len))
+		if (atomic)
+			left = __copy_from_user_inatomic(buf, iov->iov_base,
+							 len);
+		else
+			left = __copy_from_user(buf, iov->iov_base, len);
+		if (unlikely(left))
 			return -EFAULT;
 
-	log->w_off = logger_offset(log->w_off + count);
+		buf += len;
+		count -= len;
+		iov++;
+	}
 
-	return count;
+	return 0;
 }
 
 /*
@@ -324,60 +450,69 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 			 unsigned long nr_segs, loff_t ppos)
 {
 	struct logger_log *log = file_get_log(iocb->ki_filp);
-	size_t orig = log->w_off;
-	struct logger_entry header;
+	struct logger_entry *entry, *slow = NULL;
 	struct timespec now;
-	ssize_t ret = 0;
+	size_t count, len, off;
+	int ret;
 
 	now = current_kernel_time();
 
-	header.pid = current->tgid;
-	header.tid = current->pid;
-	header.sec = now.tv_sec;
-	header.nsec = now.tv_nsec;
-	header.len = min_t(size_t, iocb->ki_left, LOGGER_ENTRY_MAX_PAYLOAD);
+	count = min_t(size_t, iocb->ki_left, LOGGER_ENTRY_MAX_PAYLOAD);
 
 	/* null writes succeed, return zero */
-	if (unlikely(!header.len))
+	if (unlikely(!count))
 		return 0;
 
-	mutex_lock(&log->mutex);
-
 	/*
-	 * Fix up any readers, pulling them forward to the first readable
-	 * entry after (what will be) the new write offset. We do this now
-	 * because if we partially fail, we can end up with clobbered log
-	 * entries that encroach on readable buffer.
+	 * Stage the entry in this cpu's buffer. If the payload is not resident
+	 * we cannot fault it in there, so copy it into a temporary buffer and
+	 * come back with preemption disabled.
 	 */
-	fix_up_readers(log, sizeof(struct logger_entry) + header.len);
-
-	do_write_log(log, &header, sizeof(struct logger_entry));
-
-	while (nr_segs-- > 0) {
-		size_t len;
-		ssize_t nr;
-
-		/* figure out how much of this vector we can keep */
-		len = min_t(size_t, iov->iov_len, header.len - ret);
-
-		/* write out this segment's payload */
-		nr = do_write_log_from_user(log, iov->iov_base, len);
-		if (unlikely(nr < 0)) {
-			log->w_off = orig;
-			mutex_unlock(&log->mutex);
-			return nr;
+	entry = &get_cpu_var(logger_staging).entry;
+	pagefault_disable();
+	ret = copy_entry_from_user(entry->msg, iov, nr_segs, count, 1);
+	pagefault_enable();
+	if (unlikely(ret)) {
+		put_cpu_var(logger_staging);
+		slow = kmalloc(sizeof(struct logger_entry) + count, GFP_KERNEL);
+		if (!slow)
+			return -ENOMEM;
+		ret = copy_entry_from_user(slow->msg, iov, nr_segs, count, 0);
+		if (ret) {
+			kfree(slow);
+			return ret;
 		}
+		entry = slow;
+		preempt_disable();
+	}
 
-		iov++;
-		ret += nr;
+	entry->len = count;
+	entry->__pad = 0;
+	entry->pid = current->tgid;
+	entry->tid = current->pid;
+	entry->sec = now.tv_sec;
+	entry->nsec = now.tv_nsec;
+
+	len = sizeof(struct logger_entry) + count;
+	ret = logger_reserve(log, len, &off);
+	if (likely(!ret)) {
+		do_write_log(log, off, entry, len);
+		logger_commit(log, off, len);
 	}
 
-	mutex_unlock(&log->mutex);
+	if (slow) {
+		preempt_enable();
+		kfree(slow);
+	} else
+		put_cpu_var(logger_staging);
+
+	if (unlikely(ret))
+		return ret;
 
 	/* wake up any blocked readers */
 	wake_up_interruptible(&log->wq);
 
-	return ret;
+	return count;
 }
 
 static struct logger_log *get_log_from_minor(int);
@@ -408,12 +543,13 @@ static int logger_open(struct inode *inode, struct file *file)
 			return -ENOMEM;
 
 		reader->log = log;
+		reader->lapped = 0;
 		INIT_LIST_HEAD(&reader->list);
 
-		mutex_lock(&log->mutex);
-		reader->r_off = log->head;
+		spin_lock(&log->lock);
+		reader->r_off = logger_offset(log->hdr->head);
 		list_add_tail(&reader->list, &log->readers);
-		mutex_unlock(&log->mutex);
+		spin_unlock(&log->lock);
 
 		file->private_data = reader;
 	} else
@@ -431,7 +567,11 @@ static int logger_release(struct inode *ignored, struct file *file)
 {
 	if (file->f_mode & FMODE_READ) {
 		struct logger_reader *reader = file->private_data;
+		struct logger_log *log = reader->log;
+
+		spin_lock(&log->lock);
 		list_del(&reader->list);
+		spin_unlock(&log->lock);
 		kfree(reader);
 	}
 
@@ -446,6 +586,9 @@ static int logger_release(struct inode *ignored, struct file *file)
  * guarantee that the log is readable without blocking, as there is a small
  * chance that the writer can lap the reader in the interim between poll()
  * returning and the read() request.
+ *
+ * Readers of the mmap()ed log tell us where they caught up with
+ * LOGGER_SET_READ_OFF before they poll.
  */
 static unsigned int logger_poll(struct file *file, poll_table *wait)
 {
@@ -461,21 +604,63 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 
 	poll_wait(file, &log->wq, wait);
 
-	mutex_lock(&log->mutex);
-	if (log->w_off != reader->r_off)
+	spin_lock(&log->lock);
+	if (logger_offset(log->hdr->w_off) != reader->r_off)
 		ret |= POLLIN | POLLRDNORM;
-	mutex_unlock(&log->mutex);
+	spin_unlock(&log->lock);
 
 	return ret;
 }
 
+/*
+ * is_entry_boundary - is the free-running offset 'off' the start of an entry
+ * still in the log, or 'w_off' itself? Walks the entries from the head, so a
+ * reader can't be pointed into the middle of an entry.
+ *
+ * Caller must hold log->lock.
+ */
+static int is_entry_boundary(struct logger_log *log, size_t w_off, __u32 off)
+{
+	__u32 pos = log->hdr->head;
+
+	if ((__u32)(w_off - off) > (__u32)(w_off - pos))
+		return 0;
+
+	while (pos != off && pos != (__u32)w_off)
+		pos += get_entry_len(log, logger_offset(pos));
+
+	return pos == off;
+}
+
+/* logger_get_stats - returns a snapshot of the counters of 'log' */
+static void logger_get_stats(struct logger_log *log, struct logger_stats *stats)
+{
+	spin_lock(&log->lock);
+	*stats = log->stats;
+	spin_unlock(&log->lock);
+	stats->commit_waits = atomic_read(&log->commit_waits);
+}
+
 static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
 	struct logger_log *log = file_get_log(file);
 	struct logger_reader *reader;
+	size_t w_off;
 	long ret = -ENOTTY;
 
-	mutex_lock(&log->mutex);
+	if (cmd == LOGGER_GET_STATS) {
+		struct logger_stats stats;
+
+		logger_get_stats(log, &stats);
+		if (copy_to_user((void __user *)arg, &stats, sizeof(stats)))
+			return -EFAULT;
+		return 0;
+	}
+
+	spin_lock(&log->lock);
+	w_off = ACCESS_ONCE(log->hdr->w_off);
+	/* pairs with the barrier in logger_commit() */
+	smp_rmb();
 
 	switch (cmd) {
 	case LOGGER_GET_LOG_BUF_SIZE:
@@ -487,10 +672,7 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
-		if (log->w_off >= reader->r_off)
-			ret = log->w_off - reader->r_off;
-		else
-			ret = (log->size - reader->r_off) + log->w_off;
+		ret = logger_offset(w_off - reader->r_off);
 		break;
 	case LOGGER_GET_NEXT_ENTRY_LEN:
 		if (!(file->f_mode & FMODE_READ)) {
@@ -498,7 +680,7 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
-		if (log->w_off != reader->r_off)
+		if (logger_offset(w_off) != reader->r_off)
 			ret = get_entry_len(log, reader->r_off);
 		else
 			ret = 0;
@@ -509,17 +691,51 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		list_for_each_entry(reader, &log->readers, list)
-			reader->r_off = log->w_off;
-		log->head = log->w_off;
+			reader->r_off = logger_offset(w_off);
+		log->hdr->head = w_off;
+		ret = 0;
+		break;
+	case LOGGER_SET_READ_OFF:
+		if (!(file->f_mode & FMODE_READ)) {
+			ret = -EBADF;
+			break;
+		}
+		if (!is_entry_boundary(log, w_off, arg)) {
+			ret = -EINVAL;
+			break;
+		}
+		reader = file->private_data;
+		reader->r_off = logger_offset(arg);
 		ret = 0;
 		break;
 	}
 
-	mutex_unlock(&log->mutex);
+	spin_unlock(&log->lock);
 
 	return ret;
 }
 
+/*
+ * logger_mmap - the log's mmap file operation
+ *
+ * Maps the header page followed by the ring buffer, read-only, so readers
+ * can consume entries without a copy or a system call per entry.
+ */
+static int logger_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct logger_log *log = file_get_log(file);
+
+	if (vma->vm_pgoff != 0 ||
+	    vma->vm_end - vma->vm_start != PAGE_SIZE + log->size)
+		return -EINVAL;
+
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
+
+	return remap_vmalloc_range(vma, log->hdr, 0);
+}
+
 static const struct file_operations logger_fops = {
 	.owner = THIS_MODULE,
 	.read = logger_read,
@@ -527,19 +743,18 @@ static const struct file_operations logger_fops = {
 	.poll = logger_poll,
 	.unlocked_ioctl = logger_ioctl,
 	.compat_ioctl = logger_ioctl,
+	.mmap = logger_mmap,
 	.open = logger_open,
 	.release = logger_release,
 };
 
 /*
  * Defines a log structure with name 'NAME' and a size of 'SIZE' bytes, which
- * must be a power of two, greater than LOGGER_ENTRY_MAX_LEN, and less than
- * LONG_MAX minus LOGGER_ENTRY_MAX_LEN.
+ * must be a power of two, at least PAGE_SIZE, greater than
+ * LOGGER_ENTRY_MAX_LEN, and less than LONG_MAX minus LOGGER_ENTRY_MAX_LEN.
  */
 #define DEFINE_LOGGER_DEVICE(VAR, NAME, SIZE) \
-static unsigned char _buf_ ## VAR[SIZE]; \
 static struct logger_log VAR = { \
-	.buffer = _buf_ ## VAR, \
 	.misc = { \
 		.minor = MISC_DYNAMIC_MINOR, \
 		.name = NAME, \
@@ -549,9 +764,9 @@ static struct logger_log VAR = { \
 	.wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .wq), \
 	.readers = LIST_HEAD_INIT(VAR .readers), \
 	.mutex = __MUTEX_INITIALIZER(VAR .mutex), \
-	.w_off = 0, \
-	.head = 0, \
+	.lock = __SPIN_LOCK_UNLOCKED(VAR .lock), \
 	.size = SIZE, \
+	.commit_waits = ATOMIC_INIT(0), \
 };
 
 DEFINE_LOGGER_DEVICE(log_main, LOGGER_LOG_MAIN, 256*1024)
@@ -572,20 +787,72 @@ static struct logger_log *get_log_from_minor(int minor)
 	return NULL;
 }
 
+static int logger_stats_show(struct seq_file *m, void *unused)
+{
+	struct logger_log *log = m->private;
+	struct logger_stats stats;
+
+	logger_get_stats(log, &stats);
+	seq_printf(m, "entries: %llu\n", stats.entries);
+	seq_printf(m, "bytes: %llu\n", stats.bytes);
+	seq_printf(m, "overwritten: %llu\n", stats.overwritten);
+	seq_printf(m, "dropped: %llu\n", stats.dropped);
+	seq_printf(m, "readers lapped: %llu\n", stats.readers_lapped);
+	seq_printf(m, "contended: %llu\n", stats.contended);
+	seq_printf(m, "commit waits: %llu\n", stats.commit_waits);
+	return 0;
+}
+
+static int logger_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, logger_stats_show, inode->i_private);
+}
+
+static const struct file_operations logger_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = logger_stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static struct dentry *logger_debugfs_dir;
+
+/*
+ * init_log - allocates the header page and the ring buffer of 'log' and
+ * registers its device. Both come from one vmalloc_user() area, the header
+ * first, so logger_mmap() can map them with remap_vmalloc_range().
+ */
 static int __init init_log(struct logger_log *log)
 {
 	int ret;
 
+	log->hdr = vmalloc_user(PAGE_SIZE + log->size);
+	if (!log->hdr) {
+		printk(KERN_ERR "logger: failed to allocate log '%s'!\n",
+		       log->misc.name);
+		return -ENOMEM;
+	}
+	log->hdr->size = log->size;
+	log->buffer = (unsigned char *) log->hdr + PAGE_SIZE;
+
 	ret = misc_register(&log->misc);
 	if (unlikely(ret)) {
 		printk(KERN_ERR "logger: failed to register misc "
 		       "device for log '%s'!\n", log->misc.name);
+		vfree(log->hdr);
+		log->hdr = NULL;
 		return ret;
 	}
 
 	printk(KERN_INFO "logger: created %luK log '%s'\n",
 	       (unsigned long) log->size >> 10, log->misc.name);
 
+	if (logger_debugfs_dir)
+		debugfs_create_file(log->misc.name, S_IRUGO,
+				    logger_debugfs_dir, log,
+				    &logger_stats_fops);
+
 	return 0;
 }
 
@@ -593,6 +860,8 @@ static int __init logger_init(void)
 {
 	int ret;
 
+	logger_debugfs_dir = debugfs_create_dir("logger", NULL);
+
 	ret = init_log(&log_main);
 	if (unlikely(ret))
 		goto out;
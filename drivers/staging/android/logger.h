@@ -30,6 +30,38 @@ struct logger_entry {
 	char		msg[0];	/* the entry's payload */
 };
 
+/*
+ * struct logger_stats - the counters of a log, returned by LOGGER_GET_STATS
+ * and shown in debugfs under logger/
+ */
+struct logger_stats {
+	__u64		entries;	/* entries written */
+	__u64		bytes;		/* bytes written, headers included */
+	__u64		overwritten;	/* entries overwritten by writers */
+	__u64		dropped;	/* entries dropped, the log was busy */
+	__u64		readers_lapped;	/* times a reader lost entries */
+	__u64		contended;	/* writers that spun on the log lock */
+	__u64		commit_waits;	/* writers that waited to commit */
+};
+
+/*
+ * struct logger_mmap_header - the first page of a log mapped with mmap(),
+ * followed by the ring buffer of 'size' bytes.
+ *
+ * The offsets are free-running byte counts, offset 'off' is at byte
+ * (off & (size - 1)) of the ring. The entries in [head, w_off) are complete.
+ * Writers may be overwriting those starting before reserve - size, so a
+ * reader checks after using an entry at 'off' that reserve - off <= size
+ * still holds, and otherwise starts over from head. Read w_off before the
+ * entries and reserve after them, with read barriers in between.
+ */
+struct logger_mmap_header {
+	__u32		size;		/* size of the ring buffer */
+	__u32		w_off;		/* end of the committed entries */
+	__u32		head;		/* start of the oldest entry */
+	__u32		reserve;	/* end of the space being written */
+};
+
 #define LOGGER_LOG_RADIO	"log_radio"	/* radio-related messages */
 #define LOGGER_LOG_EVENTS	"log_events"	/* system/hardware events */
 #define LOGGER_LOG_SYSTEM	"log_system"	/* system/framework messages */
@@ -45,5 +77,7 @@ struct logger_entry {
 #define LOGGER_GET_LOG_LEN		_IO(__LOGGERIO, 2) /* used log len */
 #define LOGGER_GET_NEXT_ENTRY_LEN	_IO(__LOGGERIO, 3) /* next entry len */
 #define LOGGER_FLUSH_LOG		_IO(__LOGGERIO, 4) /* flush log */
+#define LOGGER_GET_STATS		_IOR(__LOGGERIO, 5, struct logger_stats)
+#define LOGGER_SET_READ_OFF		_IO(__LOGGERIO, 6) /* mmap reader caught up */
 
 #endif /* _LINUX_LOGGER_H */
@@ -12,6 +12,17 @@
  * and kill processes with a oom_adj value of 0 or higher when the free memory
  * drops below 1024 pages.
  *
+ * The thresholds are checked each time page reclaim reports memory pressure
+ * (see mm/vmpressure.c), and the victim is taken from an index of processes
+ * by oom_adj rather than by walking the whole process list.
+ *
+ * A task is ranked by what killing it frees: its anonymous pages, its swap
+ * entries and the ashmem areas only it holds. Write 1 to
+ * /sys/module/lowmemorykiller/parameters/kill_policy to kill the task that
+ * frees the most per unit of oom_adj instead of strictly by oom_adj. The
+ * lowmemorykiller:lowmem_kill and lowmem_reaped trace events give the
+ * expected and the actually freed pages of each kill.
+ *
  * The driver considers memory used for caches to be free, but if a large
  * percentage of the cached memory is locked this can be very inaccurate
  * and processes may not get killed until the normal oom killer is triggered.
@@ -37,6 +48,12 @@
 #include <linux/rcupdate.h>
 #include <linux/notifier.h>
 #include <linux/swap.h>
+#include <linux/spinlock.h>
+#include <linux/vmpressure.h>
+#include <linux/ashmem.h>
+
+#define CREATE_TRACE_POINTS
+#include <trace/events/lowmemorykiller.h>
 
 #define SEC_ADJUST_LMK
 
@@ -58,7 +75,46 @@ static int lowmem_minfree[6] = {
 };
 static int lowmem_minfree_size = 4;
 
+/*
+ * How a victim is chosen among the tasks at or above the threshold's
+ * oom_adj (the kill_policy parameter):
+ *
+ * LOWMEM_POLICY_ADJ: the task of highest oom_adj that frees the most.
+ * LOWMEM_POLICY_FREED_PER_ADJ: the task that frees the most per unit of
+ *	importance, importance being the distance of its oom_adj from
+ *	OOM_ADJUST_MAX + 1. A large task of lower oom_adj can then be
+ *	preferred to several small ones of higher oom_adj.
+ */
+enum {
+	LOWMEM_POLICY_ADJ,
+	LOWMEM_POLICY_FREED_PER_ADJ,
+};
+static uint32_t lowmem_kill_policy = LOWMEM_POLICY_ADJ;
+
+/*
+ * Candidates ranked on their mm counters before their ashmem areas, which
+ * cannot be looked at under lowmem_index_lock, are added in.
+ */
+#define LOWMEM_CANDIDATES	8
+
+/* What killing a task is expected to free, in pages */
+struct lowmem_cost {
+	struct task_struct *tsk;
+	int oom_adj;
+	unsigned long rss;
+	unsigned long swap;		/* swap entries, e.g. in zram */
+	unsigned long ashmem_pinned;
+	unsigned long ashmem_unpinned;
+	unsigned long expected;
+	unsigned long score;		/* per kill_policy, higher is killed */
+};
+
+/* Last kill, protected by lowmem_index_lock */
+static struct task_struct *lowmem_deathpending;
 static unsigned long lowmem_deathpending_timeout;
+static unsigned long lowmem_kill_time;
+static unsigned long lowmem_kill_expected;
+static long lowmem_kill_avail;	/* free pages + free swap at kill time */
 
 #define lowmem_print(level, x...)			\
 	do {						\
@@ -66,16 +122,287 @@ static unsigned long lowmem_deathpending_timeout;
 			printk(x);			\
 	} while (0)
 
-static int lowmem_shrink(int nr_to_scan, gfp_t gfp_mask)
+/*
+ * Thread group leaders indexed by oom_adj, so that a victim is found by
+ * looking at the highest non-empty bucket instead of walking every process.
+ * The hooks below keep it in sync with fork, exit, exec and oom_adj writes.
+ */
+#define LOWMEM_NR_BUCKETS	(OOM_ADJUST_MAX - OOM_DISABLE + 1)
+
+static struct list_head lowmem_buckets[LOWMEM_NR_BUCKETS];
+/*
+ * Nests inside tasklist_lock and siglock, which are taken from interrupts:
+ * always taken with interrupts disabled.
+ */
+static DEFINE_SPINLOCK(lowmem_index_lock);
+/* Tasks forked before lowmem_init() are added by it */
+static int lowmem_index_ready;
+
+static struct list_head *lowmem_bucket(int oom_adj)
+{
+	oom_adj = clamp(oom_adj, OOM_DISABLE, OOM_ADJUST_MAX);
+	return &lowmem_buckets[oom_adj - OOM_DISABLE];
+}
+
+/* Called with tasklist_lock held for writing */
+void lowmem_task_add(struct task_struct *tsk)
+{
+	unsigned long flags;
+
+	if (!lowmem_index_ready)
+		return;
+
+	spin_lock_irqsave(&lowmem_index_lock, flags);
+	list_add_tail(&tsk->lowmem_node, lowmem_bucket(tsk->signal->oom_adj));
+	spin_unlock_irqrestore(&lowmem_index_lock, flags);
+}
+
+static long lowmem_avail_pages(void)
+{
+	return global_page_state(NR_FREE_PAGES) + nr_swap_pages;
+}
+
+/* Called with tasklist_lock held for writing */
+void lowmem_task_del(struct task_struct *tsk)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&lowmem_index_lock, flags);
+	list_del_init(&tsk->lowmem_node);
+	if (lowmem_deathpending == tsk) {
+		/* The victim's mm and files are gone by now */
+		trace_lowmem_reaped(tsk, lowmem_kill_expected,
+				    lowmem_avail_pages() - lowmem_kill_avail,
+				    jiffies_to_msecs(jiffies - lowmem_kill_time));
+		lowmem_deathpending = NULL;
+	}
+	spin_unlock_irqrestore(&lowmem_index_lock, flags);
+}
+
+/*
+ * A non-leader thread took over its thread group in exec. Called with
+ * tasklist_lock held for writing.
+ */
+void lowmem_task_replace(struct task_struct *old, struct task_struct *new)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&lowmem_index_lock, flags);
+	if (!list_empty(&old->lowmem_node))
+		list_replace_init(&old->lowmem_node, &new->lowmem_node);
+	if (lowmem_deathpending == old)
+		lowmem_deathpending = new;
+	spin_unlock_irqrestore(&lowmem_index_lock, flags);
+}
+
+/* Called with the task's siglock held after signal->oom_adj was written */
+void lowmem_task_adj_changed(struct task_struct *tsk)
+{
+	struct task_struct *leader = tsk->group_leader;
+	unsigned long flags;
+
+	spin_lock_irqsave(&lowmem_index_lock, flags);
+	if (!list_empty(&leader->lowmem_node))
+		list_move_tail(&leader->lowmem_node,
+			       lowmem_bucket(tsk->signal->oom_adj));
+	spin_unlock_irqrestore(&lowmem_index_lock, flags);
+}
+
+static unsigned long lowmem_score(unsigned long pages, int oom_adj)
+{
+	if (lowmem_kill_policy == LOWMEM_POLICY_FREED_PER_ADJ)
+		return pages / (OOM_ADJUST_MAX + 1 - oom_adj);
+	return pages;
+}
+
+/* Tasks taken from the index per hold of lowmem_index_lock */
+#define LOWMEM_SCAN_BATCH	16
+
+/*
+ * Takes references on up to LOWMEM_SCAN_BATCH tasks of the index, from
+ * position *pos of bucket *oom_adj downwards to @min_adj, and advances the
+ * cursor past them. Only the list is walked under the lock, with interrupts
+ * off, the tasks are looked at by the caller. Tasks that move between
+ * buckets meanwhile may be missed or seen twice. Returns the number taken.
+ */
+static int lowmem_collect(int min_adj, int *oom_adj, int *pos,
+			  struct task_struct **batch, int *batch_adj)
 {
 	struct task_struct *tsk;
-	struct task_struct *selected = NULL;
-	int rem = 0;
-	int tasksize;
+	unsigned long flags;
+	int n = 0;
+	int i;
+
+	spin_lock_irqsave(&lowmem_index_lock, flags);
+	for (; *oom_adj >= min_adj; (*oom_adj)--, *pos = 0) {
+		i = 0;
+		list_for_each_entry(tsk, lowmem_bucket(*oom_adj), lowmem_node) {
+			if (i++ < *pos)
+				continue;
+			(*pos)++;
+			if (tsk->flags & PF_KTHREAD)
+				continue;
+			get_task_struct(tsk);
+			batch[n] = tsk;
+			batch_adj[n] = *oom_adj;
+			if (++n == LOWMEM_SCAN_BATCH)
+				goto out;
+		}
+	}
+out:
+	spin_unlock_irqrestore(&lowmem_index_lock, flags);
+	return n;
+}
+
+/*
+ * Ranks @tsk among the @nr candidates in @cand on its anonymous and swapped
+ * pages. Returns 1 if it was kept, taking over the reference the caller
+ * holds, and 0 if the caller has to drop it.
+ */
+static int lowmem_rank(struct task_struct *tsk, int oom_adj,
+		       struct lowmem_cost *cand, int *nr)
+{
+	struct task_struct *p;
+	struct lowmem_cost *c;
+	unsigned long rss, swap, score;
+	int i;
+
+	for (i = 0; i < *nr; i++)
+		if (cand[i].tsk == tsk)
+			return 0;
+
+	rcu_read_lock();
+	p = find_lock_task_mm(tsk);
+	if (!p) {
+		rcu_read_unlock();
+		return 0;
+	}
+	rss = get_mm_rss(p->mm);
+	swap = get_mm_counter(p->mm, swap_ents);
+	score = lowmem_score(get_mm_counter(p->mm, anon_rss) + swap, oom_adj);
+	task_unlock(p);
+	rcu_read_unlock();
+	if (rss + swap == 0)
+		return 0;
+
+	if (*nr < LOWMEM_CANDIDATES) {
+		c = &cand[(*nr)++];
+	} else {
+		c = &cand[0];
+		for (i = 1; i < *nr; i++)
+			if (cand[i].score < c->score)
+				c = &cand[i];
+		if (score <= c->score)
+			return 0;
+		put_task_struct(c->tsk);
+	}
+	c->tsk = tsk;
+	c->oom_adj = oom_adj;
+	c->rss = rss;
+	c->swap = swap;
+	c->score = score;
+	return 1;
+}
+
+/*
+ * Fills @cand with up to LOWMEM_CANDIDATES tasks, with references held,
+ * ranked on their anonymous and swapped pages. With LOWMEM_POLICY_ADJ only
+ * the highest bucket at or above @min_adj with a candidate is looked at,
+ * otherwise all of them are. Returns the number of candidates.
+ */
+static int lowmem_candidates(int min_adj, struct lowmem_cost *cand)
+{
+	struct task_struct *batch[LOWMEM_SCAN_BATCH];
+	int batch_adj[LOWMEM_SCAN_BATCH];
+	int oom_adj = OOM_ADJUST_MAX;
+	int pos = 0;
+	int nr = 0;
+	int n;
+	int i;
+
+	min_adj = max(min_adj, OOM_DISABLE);
+
+	while ((n = lowmem_collect(min_adj, &oom_adj, &pos, batch,
+				   batch_adj))) {
+		for (i = 0; i < n; i++) {
+			/* Candidates of LOWMEM_POLICY_ADJ share one oom_adj */
+			if (nr && lowmem_kill_policy == LOWMEM_POLICY_ADJ &&
+			    batch_adj[i] < cand[0].oom_adj) {
+				put_task_struct(batch[i]);
+				continue;
+			}
+			if (!lowmem_rank(batch[i], batch_adj[i], cand, &nr))
+				put_task_struct(batch[i]);
+		}
+		if (nr && lowmem_kill_policy == LOWMEM_POLICY_ADJ)
+			min_adj = cand[0].oom_adj;
+	}
+
+	return nr;
+}
+
+/*
+ * Killing a task frees its anonymous memory, its swap entries and the
+ * ashmem areas only it holds. Its file pages stay in the page cache.
+ */
+static void lowmem_cost(struct lowmem_cost *c)
+{
+	struct task_struct *p;
+	unsigned long anon = 0;
+
+	rcu_read_lock();
+	p = find_lock_task_mm(c->tsk);
+	if (p) {
+		anon = get_mm_counter(p->mm, anon_rss);
+		task_unlock(p);
+	}
+	rcu_read_unlock();
+	ashmem_task_footprint(c->tsk, &c->ashmem_pinned, &c->ashmem_unpinned);
+
+	c->expected = anon + c->swap + c->ashmem_pinned + c->ashmem_unpinned;
+	c->score = lowmem_score(c->expected, c->oom_adj);
+}
+
+/* Returns the victim, with a reference held, or NULL */
+static struct task_struct *lowmem_select(int min_adj,
+					 struct lowmem_cost *selected)
+{
+	struct lowmem_cost cand[LOWMEM_CANDIDATES];
+	struct lowmem_cost *best = NULL;
+	int nr;
+	int i;
+
+	nr = lowmem_candidates(min_adj, cand);
+	for (i = 0; i < nr; i++) {
+		struct lowmem_cost *c = &cand[i];
+
+		lowmem_cost(c);
+		lowmem_print(2, "select %d (%s), adj %d, size %lu, swap %lu, "
+			     "ashmem %lu+%lu, score %lu\n",
+			     c->tsk->pid, c->tsk->comm, c->oom_adj, c->rss,
+			     c->swap, c->ashmem_pinned, c->ashmem_unpinned,
+			     c->score);
+		if (!best || c->score > best->score ||
+		    (c->score == best->score && c->oom_adj > best->oom_adj))
+			best = c;
+	}
+	for (i = 0; i < nr; i++)
+		if (&cand[i] != best)
+			put_task_struct(cand[i].tsk);
+
+	if (!best)
+		return NULL;
+	*selected = *best;
+	return best->tsk;
+}
+
+static void lowmem_scan(void)
+{
+	struct task_struct *selected;
+	struct lowmem_cost cost;
+	unsigned long flags;
 	int i;
 	int min_adj = OOM_ADJUST_MAX + 1;
-	int selected_tasksize = 0;
-	int selected_oom_adj;
 	int array_size = ARRAY_SIZE(lowmem_adj);
 	int other_free = global_page_state(NR_FREE_PAGES) - totalreserve_pages;
 #ifdef SEC_ADJUST_LMK
@@ -102,124 +429,93 @@ static int lowmem_shrink(int nr_to_scan, gfp_t gfp_mask)
 			break;
 		}
 	}
-#ifdef SEC_ADJUST_LMK
 	if (min_adj == OOM_ADJUST_MAX + 1)
-		return 0;
-#endif
-	if (nr_to_scan > 0)
-		lowmem_print(3, "lowmem_shrink %d, %x, ofree %d %d, ma %d\n",
-			     nr_to_scan, gfp_mask, other_free, other_file,
-			     min_adj);
-	rem = global_page_state(NR_ACTIVE_ANON) +
-		global_page_state(NR_ACTIVE_FILE) +
-		global_page_state(NR_INACTIVE_ANON) +
-		global_page_state(NR_INACTIVE_FILE);
-#ifdef SEC_ADJUST_LMK
-	if (nr_to_scan <= 0)
-#else
-	if (nr_to_scan <= 0 || min_adj == OOM_ADJUST_MAX + 1)
-#endif
-	{
-		lowmem_print(5, "lowmem_shrink %d, %x, return %d\n",
-			     nr_to_scan, gfp_mask, rem);
-		return rem;
-	}
-	selected_oom_adj = min_adj;
+		return;
 
-	rcu_read_lock();
-	for_each_process(tsk) {
-		struct task_struct *p;
-		int oom_adj;
-
-		if (tsk->flags & PF_KTHREAD)
-			continue;
-
-		p = find_lock_task_mm(tsk);
-		if (!p)
-			continue;
-
-		if (test_tsk_thread_flag(p, TIF_MEMDIE) &&
-			time_before_eq(jiffies, lowmem_deathpending_timeout)) {
-				task_unlock(p);
-				rcu_read_unlock();
-				return 0;
-		}
+	lowmem_print(3, "lowmem_scan ofree %d %d, ma %d\n",
+		     other_free, other_file, min_adj);
 
-		oom_adj = p->signal->oom_adj;
-		if (oom_adj < min_adj) {
-			task_unlock(p);
-			continue;
-		}
-		tasksize = get_mm_rss(p->mm);
-		task_unlock(p);
-		if (tasksize <= 0)
-			continue;
-		if (selected) {
-			if (oom_adj < selected_oom_adj)
-				continue;
-			if (oom_adj == selected_oom_adj &&
-			    tasksize <= selected_tasksize)
-				continue;
-		}
-		selected = p;
-		selected_tasksize = tasksize;
-		selected_oom_adj = oom_adj;
-		lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
-			     p->pid, p->comm, oom_adj, tasksize);
+	spin_lock_irqsave(&lowmem_index_lock, flags);
+	if (lowmem_deathpending &&
+	    time_before_eq(jiffies, lowmem_deathpending_timeout)) {
+		spin_unlock_irqrestore(&lowmem_index_lock, flags);
+		lowmem_print(DEBUG_LEVEL_DEATHPENDING,
+			     "lowmem_scan: death pending\n");
+		return;
 	}
-	if (selected) {
-		
-		if (fatal_signal_pending(selected)) {
-			pr_warning("process %d is suffering a slow death\n",
-				selected->pid);
-			read_unlock(&tasklist_lock);
-			return rem;
-		}
+	spin_unlock_irqrestore(&lowmem_index_lock, flags);
+
+	selected = lowmem_select(min_adj, &cost);
+	if (!selected)
+		return;
 
-		lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d\n",
-			     selected->pid, selected->comm,
-			     selected_oom_adj, selected_tasksize);
-		lowmem_deathpending_timeout = jiffies + HZ;
-		send_sig(SIGKILL, selected, 0);
-		set_tsk_thread_flag(selected, TIF_MEMDIE);
-		rem -= selected_tasksize;
+	if (fatal_signal_pending(selected)) {
+		pr_warning("process %d is suffering a slow death\n",
+			   selected->pid);
+		put_task_struct(selected);
+		return;
 	}
-#ifdef SEC_ADJUST_LMK
-	else
-		rem = -1;
-#endif
 
-	lowmem_print(4, "lowmem_shrink %d, %x, return %d\n",
-		     nr_to_scan, gfp_mask, rem);
-	rcu_read_unlock();
-	return rem;
+	lowmem_print(1, "send sigkill to %d (%s), adj %d, size %lu, "
+		     "expected %lu\n", selected->pid, selected->comm,
+		     cost.oom_adj, cost.rss, cost.expected);
+	trace_lowmem_kill(selected, cost.oom_adj, cost.rss, cost.swap,
+			  cost.ashmem_pinned, cost.ashmem_unpinned,
+			  cost.expected);
+	spin_lock_irqsave(&lowmem_index_lock, flags);
+	lowmem_deathpending = selected;
+	lowmem_deathpending_timeout = jiffies + HZ;
+	lowmem_kill_time = jiffies;
+	lowmem_kill_expected = cost.expected;
+	lowmem_kill_avail = lowmem_avail_pages();
+	spin_unlock_irqrestore(&lowmem_index_lock, flags);
+	send_sig(SIGKILL, selected, 0);
+	set_tsk_thread_flag(selected, TIF_MEMDIE);
+	put_task_struct(selected);
 }
 
-static struct shrinker lowmem_shrinker = {
-	.shrink = lowmem_shrink,
-	.seeks = DEFAULT_SEEKS * 16
+/*
+ * Runs from process context each time reclaim completes a vmpressure
+ * window, i.e. only while the VM is actually reclaiming.
+ */
+static int lowmem_vmpressure(struct notifier_block *nb, unsigned long level,
+			     void *data)
+{
+	lowmem_print(5, "lowmem_vmpressure level %lu, pressure %ld\n",
+		     level, (long)data);
+	lowmem_scan();
+	return NOTIFY_OK;
+}
+
+static struct notifier_block lowmem_vmpressure_nb = {
+	.notifier_call = lowmem_vmpressure,
 };
 
 static int __init lowmem_init(void)
 {
-	register_shrinker(&lowmem_shrinker);
-	return 0;
-}
+	struct task_struct *tsk;
+	int i;
 
-static void __exit lowmem_exit(void)
-{
-	unregister_shrinker(&lowmem_shrinker);
+	for (i = 0; i < LOWMEM_NR_BUCKETS; i++)
+		INIT_LIST_HEAD(&lowmem_buckets[i]);
+
+	write_lock_irq(&tasklist_lock);
+	lowmem_index_ready = 1;
+	for_each_process(tsk)
+		lowmem_task_add(tsk);
+	write_unlock_irq(&tasklist_lock);
+
+	return vmpressure_register_notifier(&lowmem_vmpressure_nb);
 }
 
-module_param_named(cost, lowmem_shrinker.seeks, int, S_IRUGO | S_IWUSR);
 module_param_array_named(adj, lowmem_adj, int, &lowmem_adj_size,
 			 S_IRUGO | S_IWUSR);
 module_param_array_named(minfree, lowmem_minfree, uint, &lowmem_minfree_size,
 			 S_IRUGO | S_IWUSR);
 module_param_named(debug_level, lowmem_debug_level, uint, S_IRUGO | S_IWUSR);
+module_param_named(kill_policy, lowmem_kill_policy, uint, S_IRUGO | S_IWUSR);
 
 module_init(lowmem_init);
-module_exit(lowmem_exit);
 
 MODULE_LICENSE("GPL");
 
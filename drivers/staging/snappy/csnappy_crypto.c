@@ -0,0 +1,105 @@
+/*
+ * Cryptographic API.
+ *
+ * Snappy compression, built on the csnappy implementation.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/crypto.h>
+#include <linux/vmalloc.h>
+
+#include "csnappy.h"
+
+struct snappy_ctx {
+	void *workmem;
+};
+
+static int snappy_init(struct crypto_tfm *tfm)
+{
+	struct snappy_ctx *ctx = crypto_tfm_ctx(tfm);
+
+	ctx->workmem = vmalloc(CSNAPPY_WORKMEM_BYTES);
+	if (!ctx->workmem)
+		return -ENOMEM;
+
+	return 0;
+}
+
+static void snappy_exit(struct crypto_tfm *tfm)
+{
+	struct snappy_ctx *ctx = crypto_tfm_ctx(tfm);
+
+	vfree(ctx->workmem);
+}
+
+static int snappy_compress(struct crypto_tfm *tfm, const u8 *src,
+			   unsigned int slen, u8 *dst, unsigned int *dlen)
+{
+	struct snappy_ctx *ctx = crypto_tfm_ctx(tfm);
+	char *end;
+
+	/* csnappy does not check the output size: require the worst case */
+	if (*dlen < csnappy_max_compressed_length(slen))
+		return -EINVAL;
+
+	end = csnappy_compress_fragment((const char *)src, slen, (char *)dst,
+			ctx->workmem, CSNAPPY_WORKMEM_BYTES_POWER_OF_TWO);
+
+	*dlen = end - (char *)dst;
+	return 0;
+}
+
+static int snappy_decompress(struct crypto_tfm *tfm, const u8 *src,
+			     unsigned int slen, u8 *dst, unsigned int *dlen)
+{
+	uint32_t tmp_len = *dlen;
+	int err;
+
+	err = csnappy_decompress_noheader((const char *)src, slen,
+			(char *)dst, &tmp_len);
+
+	if (err != CSNAPPY_E_OK)
+		return -EINVAL;
+
+	*dlen = tmp_len;
+	return 0;
+}
+
+static struct crypto_alg alg = {
+	.cra_name		= "snappy",
+	.cra_flags		= CRYPTO_ALG_TYPE_COMPRESS,
+	.cra_ctxsize		= sizeof(struct snappy_ctx),
+	.cra_module		= THIS_MODULE,
+	.cra_list		= LIST_HEAD_INIT(alg.cra_list),
+	.cra_init		= snappy_init,
+	.cra_exit		= snappy_exit,
+	.cra_u			= { .compress = {
+	.coa_compress		= snappy_compress,
+	.coa_decompress		= snappy_decompress } }
+};
+
+static int __init snappy_mod_init(void)
+{
+	return crypto_register_alg(&alg);
+}
+
+static void __exit snappy_mod_fini(void)
+{
+	crypto_unregister_alg(&alg);
+}
+
+module_init(snappy_mod_init);
+module_exit(snappy_mod_fini);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("Snappy Compression Algorithm");
@@ -0,0 +1,1278 @@
+/*
+ * Compressed cache for clean page cache pages and for swap
+ *
+ * zcache is a cleancache and a frontswap backend. Pages handed to it are
+ * compressed and kept in RAM:
+ *
+ * - Clean file pages that reclaim drops from the page cache; a later
+ *   read of the same page is served from here instead of from the disk.
+ *   Everything in that pool is clean, so when it is full, or when the VM
+ *   asks through the shrinker, the least recently filled frames are
+ *   simply dropped along with the pages they hold.
+ *
+ * - Swapped out pages, which do not reach the swap device as long as
+ *   their pool has room. As it nears its bound, the least recently
+ *   stored pages are written back to the swap device in the background.
+ *
+ * Compressed pages are stored two to a page frame ("zbud" pages), one
+ * from each end of the frame. Each of the two uses has its own bounded
+ * pool of frames.
+ *
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#define KMSG_COMPONENT "zcache"
+#define pr_fmt(fmt) KMSG_COMPONENT ": " fmt
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/cleancache.h>
+#include <linux/crypto.h>
+#include <linux/frontswap.h>
+#include <linux/highmem.h>
+#include <linux/list.h>
+#include <linux/mm.h>
+#include <linux/pagemap.h>
+#include <linux/percpu.h>
+#include <linux/rbtree.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+#include <linux/swap.h>
+#include <linux/swapops.h>
+#include <linux/workqueue.h>
+#include <linux/writeback.h>
+
+#include <asm/div64.h>
+
+/* Free space in a zbud page is tracked in chunks */
+#define ZBUD_CHUNK_SHIFT	6
+#define ZBUD_CHUNK_SIZE		(1 << ZBUD_CHUNK_SHIFT)
+#define ZBUD_NCHUNKS		(PAGE_SIZE >> ZBUD_CHUNK_SHIFT)
+
+/*
+ * Never dip into the emergency reserves or retry for the cache: pages
+ * are put from reclaim, clean ones with the mapping's tree_lock held.
+ */
+#define ZCACHE_GFP_MASK	(GFP_NOWAIT | __GFP_NORETRY | __GFP_NOWARN | \
+			 __GFP_NOMEMALLOC)
+
+static int zcache_enabled = 1;
+module_param_named(enabled, zcache_enabled, int, 0444);
+MODULE_PARM_DESC(enabled, "Register the backends at boot");
+
+static char *zcache_compressor = "lzo";
+module_param_named(compressor, zcache_compressor, charp, 0444);
+MODULE_PARM_DESC(compressor, "Crypto API compressor: lzo or snappy");
+
+static unsigned int zcache_max_zsize_percent = 75;
+module_param_named(max_zsize_percent, zcache_max_zsize_percent, uint, 0644);
+MODULE_PARM_DESC(max_zsize_percent,
+		 "Pages compressing to more than this share of a page "
+		 "are not kept");
+
+/*------------------------------ zbud pages -----------------------------*/
+
+/* A page frame holding up to two compressed pages, one at each end */
+struct zbud_page {
+	struct page *page;
+	struct list_head lru;		/* on pool->lru, oldest first */
+	struct list_head unbuddied;	/* on pool->unbuddied[] if one is free */
+	void *slot[2];			/* owners; 0 at the start, 1 at the end */
+	unsigned short size[2];		/* compressed sizes */
+};
+
+/* The zbud pages of one user, under that user's lock */
+struct zbud_pool {
+	struct list_head lru;		/* by last fill, oldest first */
+	struct list_head unbuddied[ZBUD_NCHUNKS];	/* by free chunks */
+	unsigned long pages;
+};
+
+static struct kmem_cache *zbud_page_cache;
+
+static void zbud_pool_init(struct zbud_pool *pool)
+{
+	int i;
+
+	INIT_LIST_HEAD(&pool->lru);
+	for (i = 0; i < ZBUD_NCHUNKS; i++)
+		INIT_LIST_HEAD(&pool->unbuddied[i]);
+	pool->pages = 0;
+}
+
+static unsigned zbud_chunks(unsigned size)
+{
+	return (size + ZBUD_CHUNK_SIZE - 1) >> ZBUD_CHUNK_SHIFT;
+}
+
+static u8 *zbud_data(struct zbud_page *zbpg, int slot)
+{
+	u8 *base = page_address(zbpg->page);
+
+	if (slot)
+		return base + PAGE_SIZE - zbpg->size[1];
+	return base;
+}
+
+static int zbud_free_slot(struct zbud_page *zbpg)
+{
+	return zbpg->slot[0] ? 1 : 0;
+}
+
+/* Files zbpg by the free space it has left, if it has a free slot */
+static void zbud_set_unbuddied(struct zbud_pool *pool,
+			       struct zbud_page *zbpg)
+{
+	int used = zbpg->slot[0] ? 0 : 1;
+
+	list_del_init(&zbpg->unbuddied);
+	if (zbpg->slot[used] && !zbpg->slot[!used])
+		list_add_tail(&zbpg->unbuddied,
+			      &pool->unbuddied[ZBUD_NCHUNKS -
+					zbud_chunks(zbpg->size[used])]);
+}
+
+/* Returns a zbud page with a free slot of at least size bytes */
+static struct zbud_page *zbud_find(struct zbud_pool *pool, unsigned size)
+{
+	unsigned i;
+
+	for (i = zbud_chunks(size); i < ZBUD_NCHUNKS; i++) {
+		if (!list_empty(&pool->unbuddied[i]))
+			return list_first_entry(&pool->unbuddied[i],
+						struct zbud_page, unbuddied);
+	}
+	return NULL;
+}
+
+/* Returns a new, empty, zbud page, off every list */
+static struct zbud_page *zbud_new(struct zbud_pool *pool)
+{
+	struct zbud_page *zbpg;
+
+	zbpg = kmem_cache_alloc(zbud_page_cache, ZCACHE_GFP_MASK);
+	if (!zbpg)
+		return NULL;
+	zbpg->page = alloc_page(ZCACHE_GFP_MASK);
+	if (!zbpg->page) {
+		kmem_cache_free(zbud_page_cache, zbpg);
+		return NULL;
+	}
+	INIT_LIST_HEAD(&zbpg->lru);
+	INIT_LIST_HEAD(&zbpg->unbuddied);
+	zbpg->slot[0] = zbpg->slot[1] = NULL;
+	zbpg->size[0] = zbpg->size[1] = 0;
+	pool->pages++;
+	return zbpg;
+}
+
+static void zbud_free(struct zbud_pool *pool, struct zbud_page *zbpg)
+{
+	list_del(&zbpg->lru);
+	list_del(&zbpg->unbuddied);
+	__free_page(zbpg->page);
+	kmem_cache_free(zbud_page_cache, zbpg);
+	pool->pages--;
+}
+
+/* Stores size bytes of data for owner in a free slot of zbpg */
+static void zbud_fill(struct zbud_pool *pool, struct zbud_page *zbpg,
+		      int slot, void *owner, const u8 *data, unsigned size)
+{
+	zbpg->slot[slot] = owner;
+	zbpg->size[slot] = size;
+	memcpy(zbud_data(zbpg, slot), data, size);
+	list_move_tail(&zbpg->lru, &pool->lru);
+	zbud_set_unbuddied(pool, zbpg);
+}
+
+/* Empties a slot, and frees zbpg if that was the last one in use */
+static void zbud_release(struct zbud_pool *pool, struct zbud_page *zbpg,
+			 int slot)
+{
+	zbpg->slot[slot] = NULL;
+	zbpg->size[slot] = 0;
+	if (!zbpg->slot[0] && !zbpg->slot[1])
+		zbud_free(pool, zbpg);
+	else
+		zbud_set_unbuddied(pool, zbpg);
+}
+
+/*----------------------------- compression -----------------------------*/
+
+/* Per cpu compression context, used with preemption disabled */
+struct zcache_cpu {
+	struct crypto_comp *tfm;
+	u8 *dst;			/* worst case output, 2 pages */
+};
+static DEFINE_PER_CPU(struct zcache_cpu, zcache_cpu);
+
+/*
+ * Compresses page into zc->dst. Returns the compressed size, or 0 if the
+ * page did not compress well enough to be worth keeping.
+ */
+static unsigned zcache_compress(struct zcache_cpu *zc, struct page *page)
+{
+	unsigned int dlen = PAGE_SIZE * 2;
+	u8 *src;
+	int ret;
+
+	src = kmap_atomic(page, KM_USER0);
+	ret = crypto_comp_compress(zc->tfm, src, PAGE_SIZE, zc->dst, &dlen);
+	kunmap_atomic(src, KM_USER0);
+
+	if (ret || dlen > PAGE_SIZE ||
+	    dlen > PAGE_SIZE * zcache_max_zsize_percent / 100)
+		return 0;
+	return dlen;
+}
+
+static int zcache_decompress(struct zcache_cpu *zc, struct zbud_page *zbpg,
+			     int slot, struct page *page)
+{
+	unsigned int dlen = PAGE_SIZE;
+	u8 *dst;
+	int ret;
+
+	dst = kmap_atomic(page, KM_USER0);
+	ret = crypto_comp_decompress(zc->tfm, zbud_data(zbpg, slot),
+				     zbpg->size[slot], dst, &dlen);
+	kunmap_atomic(dst, KM_USER0);
+
+	if (ret || dlen != PAGE_SIZE) {
+		pr_err("decompression failed: %d, %u bytes\n", ret, dlen);
+		return -1;
+	}
+	return 0;
+}
+
+/*------------------------------ cleancache -----------------------------*/
+
+#ifdef CONFIG_CLEANCACHE
+
+#define ZCACHE_MAX_POOLS	32
+
+static unsigned int zcache_max_pool_percent = 10;
+module_param_named(max_pool_percent, zcache_max_pool_percent, uint, 0644);
+MODULE_PARM_DESC(max_pool_percent,
+		 "Maximum share of RAM for clean page cache pages");
+
+/* The cached pages of one file */
+struct zcache_obj {
+	struct rb_node rb_node;		/* in pool->objs, by key */
+	struct cleancache_filekey key;
+	struct rb_root entries;
+	struct zcache_pool *pool;
+};
+
+/* One compressed page */
+struct zcache_entry {
+	struct rb_node rb_node;		/* in obj->entries, by index */
+	pgoff_t index;
+	struct zcache_obj *obj;
+	struct zbud_page *zbpg;
+	unsigned char slot;
+};
+
+/* One per cleancache-enabled filesystem */
+struct zcache_pool {
+	struct rb_root objs;
+};
+
+/* zcache_lock protects everything below, and is taken with irqs off */
+static DEFINE_SPINLOCK(zcache_lock);
+static struct zcache_pool *zcache_pools[ZCACHE_MAX_POOLS];
+static struct zbud_pool zcache_zbud;
+
+static struct kmem_cache *zcache_entry_cache;
+static struct kmem_cache *zcache_obj_cache;
+
+/* Statistics, exported in /sys/kernel/mm/zcache */
+static unsigned long zcache_get_hits;
+static unsigned long zcache_get_misses;
+static unsigned long zcache_puts;
+static unsigned long zcache_put_rejects;	/* did not compress enough */
+static unsigned long zcache_put_nomem;
+static unsigned long zcache_flushes;
+static unsigned long zcache_evicted_pages;	/* dropped to make room */
+static unsigned long zcache_stored_pages;
+static unsigned long zcache_compr_data_size;	/* bytes */
+
+static unsigned long zcache_max_pool_pages(void)
+{
+	return totalram_pages * zcache_max_pool_percent / 100;
+}
+
+/* Takes entry out of its file and frees it, leaving its zbud slot as is */
+static void zcache_entry_free(struct zcache_entry *entry)
+{
+	struct zcache_obj *obj = entry->obj;
+
+	rb_erase(&entry->rb_node, &obj->entries);
+	if (RB_EMPTY_ROOT(&obj->entries)) {
+		rb_erase(&obj->rb_node, &obj->pool->objs);
+		kmem_cache_free(zcache_obj_cache, obj);
+	}
+	zcache_stored_pages--;
+	zcache_compr_data_size -= entry->zbpg->size[entry->slot];
+	kmem_cache_free(zcache_entry_cache, entry);
+}
+
+/* Frees an entry, and its zbud page if that is now empty */
+static void zcache_entry_drop(struct zcache_entry *entry)
+{
+	struct zbud_page *zbpg = entry->zbpg;
+	int slot = entry->slot;
+
+	zcache_entry_free(entry);
+	zbud_release(&zcache_zbud, zbpg, slot);
+}
+
+/*
+ * Drops the pages held by the least recently filled zbud page. The
+ * emptied frame is returned off every list, for reuse, or NULL if the
+ * pool is empty.
+ */
+static struct zbud_page *zcache_evict_lru(void)
+{
+	struct zbud_page *zbpg;
+	int i;
+
+	if (list_empty(&zcache_zbud.lru))
+		return NULL;
+	zbpg = list_first_entry(&zcache_zbud.lru, struct zbud_page, lru);
+	for (i = 0; i < 2; i++) {
+		if (zbpg->slot[i]) {
+			zcache_entry_free(zbpg->slot[i]);
+			zbpg->slot[i] = NULL;
+			zbpg->size[i] = 0;
+			zcache_evicted_pages++;
+		}
+	}
+	list_del_init(&zbpg->lru);
+	list_del_init(&zbpg->unbuddied);
+	return zbpg;
+}
+
+static struct zcache_pool *zcache_get_pool(int pool_id)
+{
+	if (pool_id < 0 || pool_id >= ZCACHE_MAX_POOLS)
+		return NULL;
+	return zcache_pools[pool_id];
+}
+
+/*
+ * Looks up the file with the given key. If there is none, *link and
+ * *parent are where it would be inserted.
+ */
+static struct zcache_obj *zcache_obj_find(struct zcache_pool *pool,
+					  struct cleancache_filekey *key,
+					  struct rb_node ***link,
+					  struct rb_node **parent)
+{
+	struct rb_node **p = &pool->objs.rb_node;
+	struct zcache_obj *obj;
+	int cmp;
+
+	*parent = NULL;
+	while (*p) {
+		*parent = *p;
+		obj = rb_entry(*p, struct zcache_obj, rb_node);
+		cmp = memcmp(key, &obj->key, sizeof(*key));
+		if (cmp < 0)
+			p = &(*p)->rb_left;
+		else if (cmp > 0)
+			p = &(*p)->rb_right;
+		else
+			return obj;
+	}
+	*link = p;
+	return NULL;
+}
+
+static struct zcache_entry *zcache_entry_find(struct zcache_obj *obj,
+					      pgoff_t index,
+					      struct rb_node ***link,
+					      struct rb_node **parent)
+{
+	struct rb_node **p = &obj->entries.rb_node;
+	struct zcache_entry *entry;
+
+	*parent = NULL;
+	while (*p) {
+		*parent = *p;
+		entry = rb_entry(*p, struct zcache_entry, rb_node);
+		if (index < entry->index)
+			p = &(*p)->rb_left;
+		else if (index > entry->index)
+			p = &(*p)->rb_right;
+		else
+			return entry;
+	}
+	*link = p;
+	return NULL;
+}
+
+static struct zcache_entry *zcache_lookup(struct zcache_pool *pool,
+					  struct cleancache_filekey *key,
+					  pgoff_t index)
+{
+	struct rb_node **link, *parent;
+	struct zcache_obj *obj;
+
+	obj = zcache_obj_find(pool, key, &link, &parent);
+	if (!obj)
+		return NULL;
+	return zcache_entry_find(obj, index, &link, &parent);
+}
+
+/* Drops every page of obj, which goes with the last of them */
+static void zcache_obj_flush(struct zcache_obj *obj)
+{
+	struct rb_node *node, *next;
+
+	for (node = rb_first(&obj->entries); node; node = next) {
+		next = rb_next(node);
+		zcache_flushes++;
+		zcache_entry_drop(rb_entry(node, struct zcache_entry,
+					   rb_node));
+	}
+}
+
+/*
+ * Stores a compressed page. Any older copy must already be gone. Room is
+ * a free slot of a zbud page, a new zbud page or, once the pool is at its
+ * limit, the least recently filled one. Returns 0, or -ENOMEM.
+ */
+static int zcache_store(struct zcache_pool *pool,
+			struct cleancache_filekey *key, pgoff_t index,
+			const u8 *data, unsigned size)
+{
+	struct rb_node **link, *parent;
+	struct zcache_obj *obj;
+	struct zcache_entry *entry;
+	struct zbud_page *zbpg;
+
+	/* Make room first, evicting may change the trees */
+	zbpg = zbud_find(&zcache_zbud, size);
+	if (!zbpg && zcache_zbud.pages < zcache_max_pool_pages())
+		zbpg = zbud_new(&zcache_zbud);
+	if (!zbpg)
+		zbpg = zcache_evict_lru();
+	if (!zbpg)
+		return -ENOMEM;
+
+	obj = zcache_obj_find(pool, key, &link, &parent);
+	if (!obj) {
+		obj = kmem_cache_alloc(zcache_obj_cache, ZCACHE_GFP_MASK);
+		if (!obj)
+			goto nomem;
+		obj->key = *key;
+		obj->entries = RB_ROOT;
+		obj->pool = pool;
+		rb_link_node(&obj->rb_node, parent, link);
+		rb_insert_color(&obj->rb_node, &pool->objs);
+	}
+
+	entry = kmem_cache_alloc(zcache_entry_cache, ZCACHE_GFP_MASK);
+	if (!entry) {
+		if (RB_EMPTY_ROOT(&obj->entries)) {
+			rb_erase(&obj->rb_node, &pool->objs);
+			kmem_cache_free(zcache_obj_cache, obj);
+		}
+		goto nomem;
+	}
+	zcache_entry_find(obj, index, &link, &parent);
+	entry->index = index;
+	entry->obj = obj;
+	entry->zbpg = zbpg;
+	entry->slot = zbud_free_slot(zbpg);
+	rb_link_node(&entry->rb_node, parent, link);
+	rb_insert_color(&entry->rb_node, &obj->entries);
+
+	zbud_fill(&zcache_zbud, zbpg, entry->slot, entry, data, size);
+	zcache_stored_pages++;
+	zcache_compr_data_size += size;
+	return 0;
+
+nomem:
+	/* An empty frame is off every list, give it back */
+	if (!zbpg->slot[0] && !zbpg->slot[1])
+		zbud_free(&zcache_zbud, zbpg);
+	return -ENOMEM;
+}
+
+static int zcache_init_fs(size_t pagesize)
+{
+	struct zcache_pool *pool;
+	unsigned long flags;
+	int pool_id;
+
+	if (pagesize != PAGE_SIZE)
+		return -1;
+
+	pool = kmalloc(sizeof(*pool), GFP_KERNEL);
+	if (!pool)
+		return -1;
+	pool->objs = RB_ROOT;
+
+	spin_lock_irqsave(&zcache_lock, flags);
+	for (pool_id = 0; pool_id < ZCACHE_MAX_POOLS; pool_id++) {
+		if (!zcache_pools[pool_id]) {
+			zcache_pools[pool_id] = pool;
+			break;
+		}
+	}
+	spin_unlock_irqrestore(&zcache_lock, flags);
+
+	if (pool_id == ZCACHE_MAX_POOLS) {
+		kfree(pool);
+		return -1;
+	}
+	return pool_id;
+}
+
+/* Nothing is shared between kernels here, a shared fs gets its own pool */
+static int zcache_init_shared_fs(char *uuid, size_t pagesize)
+{
+	return zcache_init_fs(pagesize);
+}
+
+/*
+ * Gets are exclusive: the page is dropped once it is back in the page
+ * cache, and will be put again when reclaim next evicts it.
+ */
+static int zcache_get_page(int pool_id, struct cleancache_filekey key,
+			   pgoff_t index, struct page *page)
+{
+	struct zcache_pool *pool;
+	struct zcache_entry *entry;
+	unsigned long flags;
+	int ret = -1;
+
+	spin_lock_irqsave(&zcache_lock, flags);
+	pool = zcache_get_pool(pool_id);
+	entry = pool ? zcache_lookup(pool, &key, index) : NULL;
+	if (entry) {
+		ret = zcache_decompress(&__get_cpu_var(zcache_cpu),
+					entry->zbpg, entry->slot, page);
+		zcache_entry_drop(entry);
+	}
+	if (ret)
+		zcache_get_misses++;
+	else
+		zcache_get_hits++;
+	spin_unlock_irqrestore(&zcache_lock, flags);
+	return ret;
+}
+
+/* Called from reclaim with the mapping's tree_lock held */
+static void zcache_put_page(int pool_id, struct cleancache_filekey key,
+			    pgoff_t index, struct page *page)
+{
+	struct zcache_pool *pool;
+	struct zcache_entry *entry;
+	struct zcache_cpu *zc;
+	unsigned long flags;
+	unsigned size;
+
+	local_irq_save(flags);
+	zc = &__get_cpu_var(zcache_cpu);
+	size = zcache_compress(zc, page);
+
+	spin_lock(&zcache_lock);
+	pool = zcache_get_pool(pool_id);
+	if (!pool)
+		goto out;
+
+	/* Whatever happens to this copy, an older one is stale */
+	entry = zcache_lookup(pool, &key, index);
+	if (entry)
+		zcache_entry_drop(entry);
+
+	if (!size)
+		zcache_put_rejects++;
+	else if (zcache_store(pool, &key, index, zc->dst, size))
+		zcache_put_nomem++;
+	else
+		zcache_puts++;
+out:
+	spin_unlock(&zcache_lock);
+	local_irq_restore(flags);
+}
+
+static void zcache_flush_page(int pool_id, struct cleancache_filekey key,
+			      pgoff_t index)
+{
+	struct zcache_pool *pool;
+	struct zcache_entry *entry;
+	unsigned long flags;
+
+	spin_lock_irqsave(&zcache_lock, flags);
+	pool = zcache_get_pool(pool_id);
+	entry = pool ? zcache_lookup(pool, &key, index) : NULL;
+	if (entry) {
+		zcache_flushes++;
+		zcache_entry_drop(entry);
+	}
+	spin_unlock_irqrestore(&zcache_lock, flags);
+}
+
+static void zcache_flush_inode(int pool_id, struct cleancache_filekey key)
+{
+	struct rb_node **link, *parent;
+	struct zcache_pool *pool;
+	struct zcache_obj *obj;
+	unsigned long flags;
+
+	spin_lock_irqsave(&zcache_lock, flags);
+	pool = zcache_get_pool(pool_id);
+	obj = pool ? zcache_obj_find(pool, &key, &link, &parent) : NULL;
+	if (obj)
+		zcache_obj_flush(obj);
+	spin_unlock_irqrestore(&zcache_lock, flags);
+}
+
+static void zcache_flush_fs(int pool_id)
+{
+	struct zcache_pool *pool;
+	struct rb_node *node;
+	unsigned long flags;
+
+	spin_lock_irqsave(&zcache_lock, flags);
+	pool = zcache_get_pool(pool_id);
+	if (pool) {
+		while ((node = rb_first(&pool->objs)))
+			zcache_obj_flush(rb_entry(node, struct zcache_obj,
+						  rb_node));
+		zcache_pools[pool_id] = NULL;
+	}
+	spin_unlock_irqrestore(&zcache_lock, flags);
+	kfree(pool);
+}
+
+static struct cleancache_ops zcache_cleancache_ops = {
+	.init_fs = zcache_init_fs,
+	.init_shared_fs = zcache_init_shared_fs,
+	.get_page = zcache_get_page,
+	.put_page = zcache_put_page,
+	.flush_page = zcache_flush_page,
+	.flush_inode = zcache_flush_inode,
+	.flush_fs = zcache_flush_fs,
+};
+
+/* The pool is counted, and given back, in zbud pages */
+static int zcache_shrink(int nr_to_scan, gfp_t gfp_mask)
+{
+	struct zbud_page *zbpg;
+	unsigned long flags;
+	int ret;
+
+	spin_lock_irqsave(&zcache_lock, flags);
+	while (nr_to_scan-- > 0) {
+		zbpg = zcache_evict_lru();
+		if (!zbpg)
+			break;
+		zbud_free(&zcache_zbud, zbpg);
+	}
+	ret = zcache_zbud.pages;
+	spin_unlock_irqrestore(&zcache_lock, flags);
+	return ret;
+}
+
+static struct shrinker zcache_shrinker = {
+	.shrink = zcache_shrink,
+	.seeks = DEFAULT_SEEKS,
+};
+
+#endif /* CONFIG_CLEANCACHE */
+
+/*------------------------------ frontswap ------------------------------*/
+
+#ifdef CONFIG_FRONTSWAP
+
+/* A writeback run gives up after this many pages could not be written */
+#define ZSWAP_WB_MAX_FAILS	16
+
+static unsigned int zswap_max_pool_percent = 20;
+module_param_named(swap_max_pool_percent, zswap_max_pool_percent, uint,
+		   0644);
+MODULE_PARM_DESC(swap_max_pool_percent,
+		 "Maximum share of RAM for swapped out pages");
+
+/* One compressed swap page */
+struct zswap_entry {
+	struct rb_node rb_node;		/* in zswap_trees[type], by offset */
+	struct list_head lru;		/* on zswap_lru, oldest first */
+	pgoff_t offset;
+	unsigned type;
+	struct zbud_page *zbpg;
+	unsigned char slot;
+};
+
+/* zswap_lock protects everything below */
+static DEFINE_SPINLOCK(zswap_lock);
+static struct rb_root zswap_trees[MAX_SWAPFILES];
+static LIST_HEAD(zswap_lru);
+static struct zbud_pool zswap_zbud;
+
+static struct kmem_cache *zswap_entry_cache;
+static struct workqueue_struct *zswap_wb_wq;
+static void zswap_writeback_work(struct work_struct *work);
+static DECLARE_WORK(zswap_wb_work, zswap_writeback_work);
+
+/* Statistics, exported in /sys/kernel/mm/frontswap */
+static unsigned long zswap_stored_pages;
+static unsigned long zswap_compr_data_size;	/* bytes */
+static unsigned long zswap_put_rejects;		/* did not compress enough */
+static unsigned long zswap_pool_full;		/* no room for the page */
+static unsigned long zswap_written_back;
+static unsigned long zswap_writeback_fails;
+
+static unsigned long zswap_max_pool_pages(void)
+{
+	return totalram_pages * zswap_max_pool_percent / 100;
+}
+
+/*
+ * Writeback starts once the pool is within a sixteenth of its bound and
+ * takes it down to an eighth below, so that puts rarely find it full.
+ */
+static unsigned long zswap_high_pages(void)
+{
+	unsigned long max = zswap_max_pool_pages();
+
+	return max - max / 16;
+}
+
+static unsigned long zswap_low_pages(void)
+{
+	unsigned long max = zswap_max_pool_pages();
+
+	return max - max / 8;
+}
+
+/*
+ * Looks up a swap slot's page. If there is none, *link and *parent are
+ * where it would be inserted.
+ */
+static struct zswap_entry *zswap_lookup(unsigned type, pgoff_t offset,
+					struct rb_node ***link,
+					struct rb_node **parent)
+{
+	struct rb_node **p = &zswap_trees[type].rb_node;
+	struct zswap_entry *entry;
+
+	*parent = NULL;
+	while (*p) {
+		*parent = *p;
+		entry = rb_entry(*p, struct zswap_entry, rb_node);
+		if (offset < entry->offset)
+			p = &(*p)->rb_left;
+		else if (offset > entry->offset)
+			p = &(*p)->rb_right;
+		else
+			return entry;
+	}
+	*link = p;
+	return NULL;
+}
+
+static void zswap_entry_drop(struct zswap_entry *entry)
+{
+	rb_erase(&entry->rb_node, &zswap_trees[entry->type]);
+	list_del(&entry->lru);
+	zswap_stored_pages--;
+	zswap_compr_data_size -= entry->zbpg->size[entry->slot];
+	zbud_release(&zswap_zbud, entry->zbpg, entry->slot);
+	kmem_cache_free(zswap_entry_cache, entry);
+}
+
+/* The trees are static, there is nothing to set up per swap device */
+static void zswap_init(unsigned type)
+{
+}
+
+/*
+ * Unlike the clean pool, a full swap pool cannot make room by dropping
+ * pages: the put fails and the page goes to the swap device.
+ */
+static int zswap_put_page(unsigned type, pgoff_t offset, struct page *page)
+{
+	struct rb_node **link, *parent;
+	struct zswap_entry *entry;
+	struct zbud_page *zbpg;
+	struct zcache_cpu *zc;
+	unsigned size;
+	int wake, ret = -1;
+
+	if (type >= MAX_SWAPFILES)
+		return -1;
+
+	zc = &get_cpu_var(zcache_cpu);
+	size = zcache_compress(zc, page);
+
+	spin_lock(&zswap_lock);
+	/* The frontend forgets the older copy if this put fails */
+	entry = zswap_lookup(type, offset, &link, &parent);
+	if (entry) {
+		zswap_entry_drop(entry);
+		zswap_lookup(type, offset, &link, &parent);
+	}
+
+	if (!size) {
+		zswap_put_rejects++;
+		goto out;
+	}
+
+	zbpg = zbud_find(&zswap_zbud, size);
+	if (!zbpg && zswap_zbud.pages < zswap_max_pool_pages())
+		zbpg = zbud_new(&zswap_zbud);
+	entry = zbpg ? kmem_cache_alloc(zswap_entry_cache, ZCACHE_GFP_MASK) :
+		       NULL;
+	if (!entry) {
+		if (zbpg && !zbpg->slot[0] && !zbpg->slot[1])
+			zbud_free(&zswap_zbud, zbpg);
+		zswap_pool_full++;
+		goto out;
+	}
+	entry->offset = offset;
+	entry->type = type;
+	entry->zbpg = zbpg;
+	entry->slot = zbud_free_slot(zbpg);
+	rb_link_node(&entry->rb_node, parent, link);
+	rb_insert_color(&entry->rb_node, &zswap_trees[type]);
+	list_add_tail(&entry->lru, &zswap_lru);
+
+	zbud_fill(&zswap_zbud, zbpg, entry->slot, entry, zc->dst, size);
+	zswap_stored_pages++;
+	zswap_compr_data_size += size;
+	ret = 0;
+out:
+	wake = zswap_zbud.pages >= zswap_high_pages();
+	spin_unlock(&zswap_lock);
+	put_cpu_var(zcache_cpu);
+
+	if (wake)
+		queue_work(zswap_wb_wq, &zswap_wb_work);
+	return ret;
+}
+
+/* Gets leave the page in the pool, the swap slot still refers to it */
+static int zswap_get_page(unsigned type, pgoff_t offset, struct page *page)
+{
+	struct rb_node **link, *parent;
+	struct zswap_entry *entry;
+	int ret = -1;
+
+	if (type >= MAX_SWAPFILES)
+		return -1;
+
+	spin_lock(&zswap_lock);
+	entry = zswap_lookup(type, offset, &link, &parent);
+	if (entry) {
+		ret = zcache_decompress(&get_cpu_var(zcache_cpu),
+					entry->zbpg, entry->slot, page);
+		put_cpu_var(zcache_cpu);
+	}
+	spin_unlock(&zswap_lock);
+	return ret;
+}
+
+static void zswap_flush_page(unsigned type, pgoff_t offset)
+{
+	struct rb_node **link, *parent;
+	struct zswap_entry *entry;
+
+	if (type >= MAX_SWAPFILES)
+		return;
+
+	spin_lock(&zswap_lock);
+	entry = zswap_lookup(type, offset, &link, &parent);
+	if (entry)
+		zswap_entry_drop(entry);
+	spin_unlock(&zswap_lock);
+}
+
+static void zswap_flush_area(unsigned type)
+{
+	struct rb_node *node;
+
+	if (type >= MAX_SWAPFILES)
+		return;
+
+	spin_lock(&zswap_lock);
+	while ((node = rb_first(&zswap_trees[type])))
+		zswap_entry_drop(rb_entry(node, struct zswap_entry, rb_node));
+	spin_unlock(&zswap_lock);
+}
+
+static struct frontswap_ops zswap_frontswap_ops = {
+	.init = zswap_init,
+	.put_page = zswap_put_page,
+	.get_page = zswap_get_page,
+	.flush_page = zswap_flush_page,
+	.flush_area = zswap_flush_area,
+};
+
+/*
+ * Moves one page from the pool to the swap device. The page is brought
+ * into the swap cache first, filled from the pool by swap_readpage(), so
+ * that once its pool copy is dropped readers find it there until the
+ * write has completed. Returns 0 if the write was started.
+ */
+static int zswap_writeback_entry(unsigned type, pgoff_t offset)
+{
+	swp_entry_t swp = swp_entry(type, offset);
+	struct swap_info_struct *sis = get_swap_info_struct(type);
+	struct writeback_control wbc = {
+		.sync_mode = WB_SYNC_NONE,
+	};
+	struct page *page;
+
+	page = read_swap_cache_async(swp, GFP_KERNEL | __GFP_NOWARN, NULL, 0);
+	if (!page)
+		return -ENOMEM;
+
+	lock_page(page);
+	/*
+	 * Leave the page alone if it no longer belongs to this swap slot,
+	 * if it is redirtied or being written anyway, or if the slot left
+	 * frontswap in the meantime.
+	 */
+	if (!PageSwapCache(page) || page_private(page) != swp.val ||
+	    !PageUptodate(page) || PageDirty(page) || PageWriteback(page) ||
+	    !frontswap_test(sis, offset)) {
+		unlock_page(page);
+		page_cache_release(page);
+		return -EBUSY;
+	}
+
+	__frontswap_flush_page(type, offset);
+	/* Have reclaim pick the page up as soon as it is written */
+	SetPageReclaim(page);
+	__swap_writepage(page, &wbc);
+	page_cache_release(page);
+	return 0;
+}
+
+/*
+ * Writes the least recently stored pages back to the swap device until
+ * the pool is down to its low mark.
+ */
+static void zswap_writeback_work(struct work_struct *work)
+{
+	struct zswap_entry *entry;
+	unsigned type;
+	pgoff_t offset;
+	int fails = 0;
+
+	while (fails < ZSWAP_WB_MAX_FAILS) {
+		spin_lock(&zswap_lock);
+		if (zswap_zbud.pages <= zswap_low_pages() ||
+		    list_empty(&zswap_lru)) {
+			spin_unlock(&zswap_lock);
+			break;
+		}
+		entry = list_first_entry(&zswap_lru, struct zswap_entry, lru);
+		/* Should it stay, the others are tried before it again */
+		list_move_tail(&entry->lru, &zswap_lru);
+		type = entry->type;
+		offset = entry->offset;
+		spin_unlock(&zswap_lock);
+
+		if (zswap_writeback_entry(type, offset)) {
+			zswap_writeback_fails++;
+			fails++;
+		} else {
+			zswap_written_back++;
+		}
+		cond_resched();
+	}
+}
+
+#endif /* CONFIG_FRONTSWAP */
+
+/*-------------------------------- sysfs --------------------------------*/
+
+#ifdef CONFIG_SYSFS
+
+#define ZCACHE_ATTR_RO(_name, _val)					\
+static ssize_t _name##_show(struct kobject *kobj,			\
+			    struct kobj_attribute *attr, char *buf)	\
+{									\
+	return sprintf(buf, "%lu\n", (unsigned long)(_val));		\
+}									\
+static struct kobj_attribute _name##_attr = __ATTR_RO(_name)
+
+/* Uncompressed over compressed size of what is stored, "0.00" if empty */
+static ssize_t zcache_ratio_show(char *buf, unsigned long pages,
+				 unsigned long compr)
+{
+	u64 ratio = (u64)pages * PAGE_SIZE * 100;
+	unsigned long r;
+
+	if (compr)
+		do_div(ratio, compr);
+	else
+		ratio = 0;
+	r = ratio;
+	return sprintf(buf, "%lu.%02lu\n", r / 100, r % 100);
+}
+
+#ifdef CONFIG_CLEANCACHE
+
+ZCACHE_ATTR_RO(get_hits, zcache_get_hits);
+ZCACHE_ATTR_RO(get_misses, zcache_get_misses);
+ZCACHE_ATTR_RO(puts, zcache_puts);
+ZCACHE_ATTR_RO(put_rejects, zcache_put_rejects);
+ZCACHE_ATTR_RO(put_nomem, zcache_put_nomem);
+ZCACHE_ATTR_RO(flushes, zcache_flushes);
+ZCACHE_ATTR_RO(evicted_pages, zcache_evicted_pages);
+ZCACHE_ATTR_RO(stored_pages, zcache_stored_pages);
+ZCACHE_ATTR_RO(pool_pages, zcache_zbud.pages);
+ZCACHE_ATTR_RO(orig_data_size, zcache_stored_pages << PAGE_SHIFT);
+ZCACHE_ATTR_RO(compr_data_size, zcache_compr_data_size);
+
+static ssize_t compr_ratio_show(struct kobject *kobj,
+				struct kobj_attribute *attr, char *buf)
+{
+	return zcache_ratio_show(buf, zcache_stored_pages,
+				 zcache_compr_data_size);
+}
+static struct kobj_attribute compr_ratio_attr = __ATTR_RO(compr_ratio);
+
+static ssize_t compressor_show(struct kobject *kobj,
+			       struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%s\n", zcache_compressor);
+}
+static struct kobj_attribute compressor_attr = __ATTR_RO(compressor);
+
+static struct attribute *zcache_attrs[] = {
+	&get_hits_attr.attr,
+	&get_misses_attr.attr,
+	&puts_attr.attr,
+	&put_rejects_attr.attr,
+	&put_nomem_attr.attr,
+	&flushes_attr.attr,
+	&evicted_pages_attr.attr,
+	&stored_pages_attr.attr,
+	&pool_pages_attr.attr,
+	&orig_data_size_attr.attr,
+	&compr_data_size_attr.attr,
+	&compr_ratio_attr.attr,
+	&compressor_attr.attr,
+	NULL,
+};
+
+static struct attribute_group zcache_attr_group = {
+	.attrs = zcache_attrs,
+	.name = "zcache",
+};
+
+#endif /* CONFIG_CLEANCACHE */
+
+#ifdef CONFIG_FRONTSWAP
+
+/*
+ * Added to the frontend's own /sys/kernel/mm/frontswap, next to its
+ * put and get counts.
+ */
+ZCACHE_ATTR_RO(zcache_pool_pages, zswap_zbud.pages);
+ZCACHE_ATTR_RO(zcache_pool_limit_pages, zswap_max_pool_pages());
+ZCACHE_ATTR_RO(zcache_stored_pages, zswap_stored_pages);
+ZCACHE_ATTR_RO(zcache_compr_data_size, zswap_compr_data_size);
+ZCACHE_ATTR_RO(zcache_put_rejects, zswap_put_rejects);
+ZCACHE_ATTR_RO(zcache_pool_full, zswap_pool_full);
+ZCACHE_ATTR_RO(zcache_written_back, zswap_written_back);
+ZCACHE_ATTR_RO(zcache_writeback_fails, zswap_writeback_fails);
+
+static ssize_t zcache_compr_ratio_show(struct kobject *kobj,
+				       struct kobj_attribute *attr, char *buf)
+{
+	return zcache_ratio_show(buf, zswap_stored_pages,
+				 zswap_compr_data_size);
+}
+static struct kobj_attribute zcache_compr_ratio_attr =
+	__ATTR_RO(zcache_compr_ratio);
+
+static struct attribute *zswap_attrs[] = {
+	&zcache_pool_pages_attr.attr,
+	&zcache_pool_limit_pages_attr.attr,
+	&zcache_stored_pages_attr.attr,
+	&zcache_compr_data_size_attr.attr,
+	&zcache_compr_ratio_attr.attr,
+	&zcache_put_rejects_attr.attr,
+	&zcache_pool_full_attr.attr,
+	&zcache_written_back_attr.attr,
+	&zcache_writeback_fails_attr.attr,
+	NULL,
+};
+
+static void zswap_sysfs_init(void)
+{
+	struct attribute **attr;
+	int ret;
+
+	for (attr = zswap_attrs; *attr; attr++) {
+		ret = sysfs_add_file_to_group(mm_kobj, *attr, "frontswap");
+		if (ret) {
+			pr_warning("cannot add %s to the frontswap sysfs "
+				   "group: %d\n", (*attr)->name, ret);
+			break;
+		}
+	}
+}
+
+#endif /* CONFIG_FRONTSWAP */
+
+#endif /* CONFIG_SYSFS */
+
+/*-------------------------------- init ---------------------------------*/
+
+static void zcache_cpu_free(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct zcache_cpu *zc = &per_cpu(zcache_cpu, cpu);
+
+		if (!IS_ERR_OR_NULL(zc->tfm))
+			crypto_free_comp(zc->tfm);
+		zc->tfm = NULL;
+		kfree(zc->dst);
+		zc->dst = NULL;
+	}
+}
+
+static int zcache_cpu_init(const char *name)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct zcache_cpu *zc = &per_cpu(zcache_cpu, cpu);
+
+		zc->tfm = crypto_alloc_comp(name, 0, 0);
+		if (IS_ERR(zc->tfm)) {
+			int err = PTR_ERR(zc->tfm);
+
+			zc->tfm = NULL;
+			zcache_cpu_free();
+			return err;
+		}
+		zc->dst = kmalloc(PAGE_SIZE * 2, GFP_KERNEL);
+		if (!zc->dst) {
+			zcache_cpu_free();
+			return -ENOMEM;
+		}
+	}
+	return 0;
+}
+
+#ifdef CONFIG_CLEANCACHE
+static int __init zcache_cleancache_init(void)
+{
+	struct cleancache_ops old_ops;
+	int ret;
+
+	zcache_entry_cache = KMEM_CACHE(zcache_entry, 0);
+	zcache_obj_cache = KMEM_CACHE(zcache_obj, 0);
+	if (!zcache_entry_cache || !zcache_obj_cache) {
+		if (zcache_obj_cache)
+			kmem_cache_destroy(zcache_obj_cache);
+		if (zcache_entry_cache)
+			kmem_cache_destroy(zcache_entry_cache);
+		return -ENOMEM;
+	}
+	zbud_pool_init(&zcache_zbud);
+
+	register_shrinker(&zcache_shrinker);
+	old_ops = cleancache_register_ops(&zcache_cleancache_ops);
+	if (old_ops.init_fs)
+		pr_warning("replacing an earlier cleancache backend\n");
+
+#ifdef CONFIG_SYSFS
+	ret = sysfs_create_group(mm_kobj, &zcache_attr_group);
+	if (ret)
+		pr_warning("cannot create sysfs group: %d\n", ret);
+#endif
+	pr_info("cleancache enabled, %s, up to %u%% of RAM\n",
+		zcache_compressor, zcache_max_pool_percent);
+	return 0;
+}
+#endif /* CONFIG_CLEANCACHE */
+
+#ifdef CONFIG_FRONTSWAP
+static int __init zcache_frontswap_init(void)
+{
+	struct frontswap_ops old_ops;
+	int i;
+
+	zswap_entry_cache = KMEM_CACHE(zswap_entry, 0);
+	if (!zswap_entry_cache)
+		return -ENOMEM;
+	zswap_wb_wq = create_singlethread_workqueue("zswap_wb");
+	if (!zswap_wb_wq) {
+		kmem_cache_destroy(zswap_entry_cache);
+		return -ENOMEM;
+	}
+	for (i = 0; i < MAX_SWAPFILES; i++)
+		zswap_trees[i] = RB_ROOT;
+	zbud_pool_init(&zswap_zbud);
+
+	old_ops = frontswap_register_ops(&zswap_frontswap_ops);
+	if (old_ops.init)
+		pr_warning("replacing an earlier frontswap backend\n");
+
+#ifdef CONFIG_SYSFS
+	zswap_sysfs_init();
+#endif
+	pr_info("frontswap enabled, %s, up to %u%% of RAM\n",
+		zcache_compressor, zswap_max_pool_percent);
+	return 0;
+}
+#endif /* CONFIG_FRONTSWAP */
+
+static int __init zcache_init(void)
+{
+	int ret;
+
+	if (!zcache_enabled)
+		return 0;
+
+	zbud_page_cache = KMEM_CACHE(zbud_page, 0);
+	if (!zbud_page_cache)
+		return -ENOMEM;
+
+	ret = zcache_cpu_init(zcache_compressor);
+	if (ret && strcmp(zcache_compressor, "lzo")) {
+		pr_warning("compressor %s unavailable (%d), using lzo\n",
+			   zcache_compressor, ret);
+		zcache_compressor = "lzo";
+		ret = zcache_cpu_init(zcache_compressor);
+	}
+	if (ret) {
+		pr_err("cannot allocate compressor: %d\n", ret);
+		kmem_cache_destroy(zbud_page_cache);
+		return ret;
+	}
+
+	/* Either backend can do without the other */
+#ifdef CONFIG_CLEANCACHE
+	ret = zcache_cleancache_init();
+	if (ret)
+		pr_err("cannot register the cleancache backend: %d\n", ret);
+#endif
+#ifdef CONFIG_FRONTSWAP
+	ret = zcache_frontswap_init();
+	if (ret)
+		pr_err("cannot register the frontswap backend: %d\n", ret);
+#endif
+	return 0;
+}
+module_init(zcache_init)
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("Compressed cache for clean page cache and swap pages");
@@ -0,0 +1,225 @@
+/*
+ * Compression streams for zram
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#define KMSG_COMPONENT "zram"
+#define pr_fmt(fmt) KMSG_COMPONENT ": " fmt
+
+#include <linux/kernel.h>
+#include <linux/crypto.h>
+#include <linux/err.h>
+#include <linux/gfp.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#include "zcomp.h"
+
+/* Algorithms selectable through the comp_algorithm attribute */
+static const char * const zcomp_names[ZCOMP_NR_ALGS] = {
+	[ZCOMP_LZO]	= "lzo",
+	[ZCOMP_SNAPPY]	= "snappy",
+	[ZCOMP_DEFLATE]	= "deflate",
+};
+
+const char *zcomp_name(int alg)
+{
+	return zcomp_names[alg];
+}
+
+/*
+ * Returns the id of the algorithm named @buf (which may carry a trailing
+ * newline, as written to sysfs), or -EINVAL if it is unknown.
+ */
+int zcomp_lookup(const char *buf)
+{
+	int alg;
+	size_t len = strlen(buf);
+
+	if (len && buf[len - 1] == '\n')
+		len--;
+
+	for (alg = 0; alg < ZCOMP_NR_ALGS; alg++) {
+		if (strlen(zcomp_names[alg]) == len &&
+		    !strncmp(buf, zcomp_names[alg], len))
+			return alg;
+	}
+
+	return -EINVAL;
+}
+
+/*
+ * Writes the list of algorithms to @buf, the one in use being shown in
+ * square brackets like the I/O scheduler attribute does.
+ */
+ssize_t zcomp_available_show(int cur, char *buf)
+{
+	ssize_t sz = 0;
+	int alg;
+
+	for (alg = 0; alg < ZCOMP_NR_ALGS; alg++) {
+		if (alg == cur)
+			sz += sprintf(buf + sz, "[%s] ", zcomp_names[alg]);
+		else
+			sz += sprintf(buf + sz, "%s ", zcomp_names[alg]);
+	}
+	sz += sprintf(buf + sz, "\n");
+
+	return sz;
+}
+
+static void zcomp_strm_free(struct zcomp_strm *zstrm)
+{
+	if (!IS_ERR_OR_NULL(zstrm->tfm))
+		crypto_free_comp(zstrm->tfm);
+	free_pages((unsigned long)zstrm->buffer, 1);
+	kfree(zstrm);
+}
+
+/*
+ * Allocate a new stream. The compressed output of an incompressible page
+ * may be larger than PAGE_SIZE, so the buffer spans two pages. Each stream
+ * has its own transform: the compressors keep per-tfm state (working
+ * memory, zlib streams) and must not be shared between concurrent users.
+ */
+static struct zcomp_strm *zcomp_strm_alloc(struct zcomp *comp, gfp_t flags)
+{
+	struct zcomp_strm *zstrm;
+
+	zstrm = kzalloc(sizeof(*zstrm), flags);
+	if (!zstrm)
+		return NULL;
+
+	zstrm->tfm = crypto_alloc_comp(zcomp_names[comp->alg], 0, 0);
+	zstrm->buffer = (void *)__get_free_pages(flags | __GFP_ZERO, 1);
+	if (IS_ERR(zstrm->tfm) || !zstrm->buffer) {
+		zcomp_strm_free(zstrm);
+		return NULL;
+	}
+
+	return zstrm;
+}
+
+/*
+ * Get an idle stream, sleeping until another user releases one if all
+ * are busy. Nothing is allocated here: crypto_alloc_comp() cannot be told
+ * to stay out of the I/O path, so all streams exist from zcomp_create()
+ * on. May sleep, so must not be called from atomic context.
+ */
+struct zcomp_strm *zcomp_strm_find(struct zcomp *comp)
+{
+	struct zcomp_strm *zstrm;
+
+	while (1) {
+		spin_lock(&comp->strm_lock);
+		if (!list_empty(&comp->idle_strm)) {
+			zstrm = list_entry(comp->idle_strm.next,
+					struct zcomp_strm, list);
+			list_del(&zstrm->list);
+			spin_unlock(&comp->strm_lock);
+			return zstrm;
+		}
+		spin_unlock(&comp->strm_lock);
+
+		wait_event(comp->strm_wait, !list_empty(&comp->idle_strm));
+	}
+}
+
+void zcomp_strm_release(struct zcomp *comp, struct zcomp_strm *zstrm)
+{
+	spin_lock(&comp->strm_lock);
+	list_add(&zstrm->list, &comp->idle_strm);
+	spin_unlock(&comp->strm_lock);
+
+	wake_up(&comp->strm_wait);
+}
+
+/*
+ * Compress one page from @src into zstrm->buffer. The compressed length is
+ * returned in @dst_len.
+ */
+int zcomp_compress(struct zcomp *comp, struct zcomp_strm *zstrm,
+		const unsigned char *src, size_t *dst_len)
+{
+	int ret;
+	unsigned int dlen = 2 * PAGE_SIZE;
+
+	ret = crypto_comp_compress(zstrm->tfm, src, PAGE_SIZE,
+				zstrm->buffer, &dlen);
+	*dst_len = dlen;
+
+	return ret;
+}
+
+/*
+ * Decompress @src_len bytes into the page pointed to by @dst. Some
+ * algorithms keep decompression state in the tfm, so a stream is needed
+ * here as well.
+ */
+int zcomp_decompress(struct zcomp *comp, struct zcomp_strm *zstrm,
+		const unsigned char *src, size_t src_len, unsigned char *dst)
+{
+	unsigned int dlen = PAGE_SIZE;
+
+	return crypto_comp_decompress(zstrm->tfm, src, src_len, dst, &dlen);
+}
+
+void zcomp_destroy(struct zcomp *comp)
+{
+	struct zcomp_strm *zstrm;
+
+	while (!list_empty(&comp->idle_strm)) {
+		zstrm = list_entry(comp->idle_strm.next,
+				struct zcomp_strm, list);
+		list_del(&zstrm->list);
+		zcomp_strm_free(zstrm);
+	}
+	kfree(comp);
+}
+
+/*
+ * Create a stream pool for algorithm @alg allowing up to @max_strm
+ * concurrent users. All streams are allocated here, from process context:
+ * if memory runs short the pool makes do with fewer, as long as there is
+ * at least one.
+ */
+struct zcomp *zcomp_create(int alg, int max_strm)
+{
+	struct zcomp *comp;
+	struct zcomp_strm *zstrm;
+	int i;
+
+	comp = kzalloc(sizeof(*comp), GFP_KERNEL);
+	if (!comp)
+		return NULL;
+
+	spin_lock_init(&comp->strm_lock);
+	INIT_LIST_HEAD(&comp->idle_strm);
+	init_waitqueue_head(&comp->strm_wait);
+	comp->alg = alg;
+	comp->max_strm = max(max_strm, 1);
+
+	for (i = 0; i < comp->max_strm; i++) {
+		zstrm = zcomp_strm_alloc(comp, GFP_KERNEL);
+		if (!zstrm)
+			break;
+		list_add(&zstrm->list, &comp->idle_strm);
+		comp->avail_strm++;
+	}
+
+	if (!comp->avail_strm) {
+		kfree(comp);
+		return NULL;
+	}
+	if (comp->avail_strm < comp->max_strm)
+		pr_info("Only %d of %d %s streams could be allocated\n",
+			comp->avail_strm, comp->max_strm, zcomp_names[alg]);
+
+	return comp;
+}
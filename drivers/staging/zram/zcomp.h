@@ -0,0 +1,74 @@
+/*
+ * Compression streams for zram
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _ZCOMP_H_
+#define _ZCOMP_H_
+
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+
+struct crypto_comp;
+
+/*
+ * Compression algorithms, reached through the crypto compress API.
+ * The id of the algorithm is recorded with every stored object, so at
+ * most four algorithms fit (see ZRAM_COMP_SHIFT in zram_drv.h).
+ */
+enum zcomp_alg {
+	ZCOMP_LZO,
+	ZCOMP_SNAPPY,
+	ZCOMP_DEFLATE,
+	ZCOMP_NR_ALGS,
+};
+
+/*
+ * One compression context: a scratch buffer large enough to hold the
+ * worst case compressed output of a page, plus the compressor transform.
+ * Only one user may use a stream at a time.
+ */
+struct zcomp_strm {
+	/* compression/decompression buffer (2 pages) */
+	void *buffer;
+	struct crypto_comp *tfm;
+	/* entry in zcomp->idle_strm */
+	struct list_head list;
+};
+
+/*
+ * Pool of compression streams for one algorithm. Up to max_strm streams
+ * are created with the pool, so that concurrent writers compress in
+ * parallel instead of serializing on a single buffer.
+ */
+struct zcomp {
+	spinlock_t strm_lock;		/* protects idle_strm and avail_strm */
+	struct list_head idle_strm;
+	wait_queue_head_t strm_wait;
+	int avail_strm;			/* streams allocated */
+	int max_strm;
+	int alg;			/* enum zcomp_alg */
+};
+
+const char *zcomp_name(int alg);
+int zcomp_lookup(const char *buf);
+ssize_t zcomp_available_show(int cur, char *buf);
+
+struct zcomp *zcomp_create(int alg, int max_strm);
+void zcomp_destroy(struct zcomp *comp);
+
+struct zcomp_strm *zcomp_strm_find(struct zcomp *comp);
+void zcomp_strm_release(struct zcomp *comp, struct zcomp_strm *zstrm);
+
+int zcomp_compress(struct zcomp *comp, struct zcomp_strm *zstrm,
+		const unsigned char *src, size_t *dst_len);
+int zcomp_decompress(struct zcomp *comp, struct zcomp_strm *zstrm,
+		const unsigned char *src, size_t src_len, unsigned char *dst);
+
+#endif
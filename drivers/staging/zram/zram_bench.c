@@ -0,0 +1,257 @@
+/*
+ * Swap-out throughput benchmark for zram
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ *
+ * Writes page sized bios to a zram device from 1..max_writers concurrent
+ * kernel threads, mimicking swap-out, and reports the throughput seen for
+ * each writer count. Usage:
+ *
+ *	echo $((64*1024*1024)) > /sys/block/zram0/disksize
+ *	insmod zram_bench.ko device=/dev/block/zram0 max_writers=4
+ *
+ * Results are printed to the kernel log. Like tcrypt, the module always
+ * fails to load so it can be run again without an rmmod.
+ */
+
+#define KMSG_COMPONENT "zram_bench"
+#define pr_fmt(fmt) KMSG_COMPONENT ": " fmt
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/completion.h>
+#include <linux/err.h>
+#include <linux/fs.h>
+#include <linux/highmem.h>
+#include <linux/kthread.h>
+#include <linux/random.h>
+#include <linux/sched.h>
+#include <linux/time.h>
+
+#include "zram_drv.h"
+
+static char *device = "/dev/block/zram0";
+static unsigned int max_writers = 4;
+static unsigned int nr_pages = 4096;
+
+struct zram_bench_writer {
+	struct block_device *bdev;
+	sector_t first_sector;
+	unsigned int nr_pages;
+	int err;
+	struct completion *start;
+	atomic_t *running;
+	struct completion *done;
+};
+
+static void zram_bench_end_io(struct bio *bio, int err)
+{
+	complete(bio->bi_private);
+}
+
+/*
+ * Fill a page with data that compresses to roughly half its size: the
+ * first half is random, the second half zero. The page index is stored
+ * in the first word so no two pages are identical.
+ */
+static void zram_bench_fill(struct page *page, unsigned int index)
+{
+	unsigned char *mem;
+
+	mem = kmap(page);
+	get_random_bytes(mem, PAGE_SIZE / 2);
+	memset(mem + PAGE_SIZE / 2, 0, PAGE_SIZE / 2);
+	*(unsigned int *)mem = index;
+	kunmap(page);
+}
+
+static int zram_bench_write_page(struct block_device *bdev,
+				struct page *page, sector_t sector)
+{
+	struct bio *bio;
+	DECLARE_COMPLETION_ONSTACK(wait);
+	int err = 0;
+
+	bio = bio_alloc(GFP_KERNEL, 1);
+	if (!bio)
+		return -ENOMEM;
+
+	bio->bi_bdev = bdev;
+	bio->bi_sector = sector;
+	bio->bi_end_io = zram_bench_end_io;
+	bio->bi_private = &wait;
+	bio_add_page(bio, page, PAGE_SIZE, 0);
+
+	submit_bio(WRITE, bio);
+	wait_for_completion(&wait);
+
+	if (!test_bit(BIO_UPTODATE, &bio->bi_flags))
+		err = -EIO;
+	bio_put(bio);
+
+	return err;
+}
+
+static int zram_bench_writer_fn(void *data)
+{
+	struct zram_bench_writer *w = data;
+	struct page *page;
+	unsigned int i;
+
+	page = alloc_page(GFP_KERNEL);
+	if (!page) {
+		w->err = -ENOMEM;
+		goto out;
+	}
+
+	wait_for_completion(w->start);
+
+	for (i = 0; i < w->nr_pages; i++) {
+		sector_t sector = w->first_sector +
+				((sector_t)i << SECTORS_PER_PAGE_SHIFT);
+
+		zram_bench_fill(page, i);
+		w->err = zram_bench_write_page(w->bdev, page, sector);
+		if (w->err)
+			break;
+	}
+
+	__free_page(page);
+out:
+	if (atomic_dec_and_test(w->running))
+		complete(w->done);
+	return 0;
+}
+
+static int zram_bench_run(struct block_device *bdev, unsigned int writers,
+			unsigned int pages)
+{
+	struct zram_bench_writer *w;
+	struct task_struct *task;
+	DECLARE_COMPLETION_ONSTACK(start);
+	DECLARE_COMPLETION_ONSTACK(done);
+	atomic_t running;
+	struct timespec ts, te;
+	u64 usecs, kbytes;
+	unsigned int i;
+	int err = 0;
+
+	w = kcalloc(writers, sizeof(*w), GFP_KERNEL);
+	if (!w)
+		return -ENOMEM;
+
+	atomic_set(&running, writers);
+
+	for (i = 0; i < writers; i++) {
+		w[i].bdev = bdev;
+		w[i].first_sector = (sector_t)i * pages <<
+					SECTORS_PER_PAGE_SHIFT;
+		w[i].nr_pages = pages;
+		w[i].start = &start;
+		w[i].running = &running;
+		w[i].done = &done;
+
+		task = kthread_run(zram_bench_writer_fn, &w[i],
+				"zram_bench/%u", i);
+		if (IS_ERR(task)) {
+			/* Account for the writers that will never run */
+			w[i].err = PTR_ERR(task);
+			if (atomic_sub_and_test(writers - i, &running))
+				complete(&done);
+			break;
+		}
+	}
+
+	getnstimeofday(&ts);
+	complete_all(&start);
+	wait_for_completion(&done);
+	getnstimeofday(&te);
+
+	for (i = 0; i < writers; i++) {
+		if (w[i].err) {
+			err = w[i].err;
+			break;
+		}
+	}
+	kfree(w);
+
+	if (err) {
+		pr_err("%u writers: failed, err=%d\n", writers, err);
+		return err;
+	}
+
+	te = timespec_sub(te, ts);
+	usecs = max_t(u64, timespec_to_ns(&te) / NSEC_PER_USEC, 1);
+	kbytes = (u64)writers * pages * (PAGE_SIZE / 1024);
+
+	pr_info("%u writers: %llu KB in %llu us, %llu KB/s\n",
+		writers, kbytes, usecs,
+		div64_u64(kbytes * USEC_PER_SEC, usecs));
+
+	return 0;
+}
+
+static int __init zram_bench_init(void)
+{
+	struct block_device *bdev;
+	u64 capacity;
+	unsigned int writers, pages;
+	int err = 0;
+
+	if (!max_writers || !nr_pages)
+		return -EINVAL;
+
+	bdev = open_bdev_exclusive(device, FMODE_READ | FMODE_WRITE,
+				&device);
+	if (IS_ERR(bdev)) {
+		pr_err("Cannot open %s\n", device);
+		return PTR_ERR(bdev);
+	}
+
+	capacity = get_capacity(bdev->bd_disk) >> SECTORS_PER_PAGE_SHIFT;
+
+	for (writers = 1; writers <= max_writers; writers++) {
+		/* Writers use disjoint ranges: shrink them to fit the disk */
+		pages = min_t(u64, nr_pages, div_u64(capacity, writers));
+		if (!pages) {
+			pr_err("%s is too small for %u writers\n",
+				device, writers);
+			break;
+		}
+
+		err = zram_bench_run(bdev, writers, pages);
+		if (err)
+			break;
+	}
+
+	close_bdev_exclusive(bdev, FMODE_READ | FMODE_WRITE);
+
+	/*
+	 * We intentionally return -EAGAIN so the module is not kept
+	 * loaded; the benchmark can be rerun with another insmod.
+	 */
+	return err ? err : -EAGAIN;
+}
+
+static void __exit zram_bench_exit(void)
+{
+}
+
+module_param(device, charp, 0);
+MODULE_PARM_DESC(device, "zram block device to write to");
+module_param(max_writers, uint, 0);
+MODULE_PARM_DESC(max_writers, "Run with 1..max_writers concurrent writers");
+module_param(nr_pages, uint, 0);
+MODULE_PARM_DESC(nr_pages, "Pages written by each writer per run");
+
+module_init(zram_bench_init);
+module_exit(zram_bench_exit);
+
+MODULE_LICENSE("Dual BSD/GPL");
+MODULE_DESCRIPTION("zram swap-out throughput benchmark");
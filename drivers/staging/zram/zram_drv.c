@@ -21,63 +21,28 @@
 #include <linux/bitops.h>
 #include <linux/blkdev.h>
 #include <linux/buffer_head.h>
+#include <linux/cpumask.h>
 #include <linux/device.h>
+#include <linux/fs.h>
 #include <linux/genhd.h>
 #include <linux/highmem.h>
+#include <linux/jhash.h>
+#include <linux/log2.h>
+#include <linux/mempool.h>
 #include <linux/slab.h>
 #include <linux/string.h>
 #include <linux/vmalloc.h>
 
 #include "zram_drv.h"
 
-#if defined(CONFIG_ZRAM_LZO)
-#include <linux/lzo.h>
-#define WMSIZE		LZO1X_MEM_COMPRESS
-#define COMPRESS(s, sl, d, dl, wm)	\
-	lzo1x_1_compress(s, sl, d, dl, wm)
-#define DECOMPRESS(s, sl, d, dl)	\
-	lzo1x_decompress_safe(s, sl, d, dl)
-#elif defined(CONFIG_ZRAM_SNAPPY)
-#include "../snappy/csnappy.h" /* if built in drivers/staging */
-#define WMSIZE_ORDER	((PAGE_SHIFT > 14) ? (15) : (PAGE_SHIFT+1))
-#define WMSIZE		(1 << WMSIZE_ORDER)
-static int
-snappy_compress_(
-	const unsigned char *src,
-	size_t src_len,
-	unsigned char *dst,
-	size_t *dst_len,
-	void *workmem)
-{
-	const unsigned char *end = csnappy_compress_fragment(
-		src, (uint32_t)src_len, dst, workmem, WMSIZE_ORDER);
-	*dst_len = end - dst;
-	return 0;
-}
-static int
-snappy_decompress_(
-	const unsigned char *src,
-	size_t src_len,
-	unsigned char *dst,
-	size_t *dst_len)
-{
-	uint32_t dst_len_ = (uint32_t)*dst_len;
-	int ret = csnappy_decompress_noheader(src, src_len, dst, &dst_len_);
-	*dst_len = (size_t)dst_len_;
-	return ret;
-}
-#define COMPRESS(s, sl, d, dl, wm)	\
-	snappy_compress_(s, sl, d, dl, wm)
-#define DECOMPRESS(s, sl, d, dl)	\
-	snappy_decompress_(s, sl, d, dl)
-#else
-#error either CONFIG_ZRAM_LZO or CONFIG_ZRAM_SNAPPY must be defined
-#endif
-
-
 /* Globals */
 static int zram_major;
 struct zram *devices;
+static struct kmem_cache *zram_entry_cache;
+/* Bounce pages for partial I/O */
+static mempool_t *zram_page_pool;
+/* Runs deferred slot frees, and bios waiting for backing_dev */
+static struct workqueue_struct *zram_wq;
 
 /* Module params (documentation at end) */
 unsigned int num_devices;
@@ -129,21 +94,119 @@ static void zram_clear_flag(struct zram *zram, u32 index,
 	zram->table[index].flags &= ~BIT(flag);
 }
 
-static int page_zero_filled(void *ptr)
+static int zram_get_comp(struct zram *zram, u32 index)
+{
+	return (zram->table[index].flags & ZRAM_COMP_MASK) >> ZRAM_COMP_SHIFT;
+}
+
+static void zram_set_comp(struct zram *zram, u32 index, int alg)
+{
+	zram->table[index].flags &= ~ZRAM_COMP_MASK;
+	zram->table[index].flags |= alg << ZRAM_COMP_SHIFT;
+}
+
+/*
+ * Checks whether the page is a single word repeated (zero pages being the
+ * common case) and if so returns that word in @element.
+ */
+static int page_same_filled(void *ptr, unsigned long *element)
 {
 	unsigned int pos;
 	unsigned long *page;
 
 	page = (unsigned long *)ptr;
 
-	for (pos = 0; pos != PAGE_SIZE / sizeof(*page); pos++) {
-		if (page[pos])
+	for (pos = 1; pos != PAGE_SIZE / sizeof(*page); pos++) {
+		if (page[pos] != page[0])
 			return 0;
 	}
 
+	*element = page[0];
 	return 1;
 }
 
+static void zram_fill_page(void *ptr, unsigned long len,
+			   unsigned long element)
+{
+	unsigned long *page = ptr;
+	unsigned int pos;
+
+	if (!element) {
+		memset(ptr, 0, len);
+		return;
+	}
+
+	for (pos = 0; pos != len / sizeof(*page); pos++)
+		page[pos] = element;
+}
+
+static u32 zram_checksum(void *ptr)
+{
+	return jhash2(ptr, PAGE_SIZE / sizeof(u32), 0);
+}
+
+static struct hlist_head *zram_dedup_bucket(struct zram *zram, u32 checksum)
+{
+	return &zram->dedup_hash[checksum & ((1 << zram->dedup_hash_bits) - 1)];
+}
+
+/*
+ * Does @entry hold the same contents as the page at @mem? Compressed
+ * objects are decompressed into the second half of the stream buffer we
+ * hold, so only those stored with the current algorithm are candidates.
+ */
+static int zram_dedup_match(struct zram *zram, struct zram_entry *entry,
+			    void *mem, int alg, struct zcomp_strm *zstrm)
+{
+	int ret;
+	unsigned char *cmem, *uncmem;
+
+	if (entry->flags & BIT(ZRAM_UNCOMPRESSED)) {
+		cmem = zs_map_object(zram->mem_pool, entry->handle, NULL);
+		ret = !memcmp(mem, cmem, PAGE_SIZE);
+		zs_unmap_object(zram->mem_pool, cmem, NULL);
+		return ret;
+	}
+
+	if ((entry->flags & ZRAM_COMP_MASK) >> ZRAM_COMP_SHIFT != alg)
+		return 0;
+
+	uncmem = zstrm->buffer + PAGE_SIZE;
+	cmem = zs_map_object(zram->mem_pool, entry->handle, zstrm->buffer);
+	ret = zcomp_decompress(zram->comps[alg], zstrm,
+			cmem + sizeof(struct zobj_header), entry->size, uncmem);
+	zs_unmap_object(zram->mem_pool, cmem, zstrm->buffer);
+
+	return !ret && !memcmp(mem, uncmem, PAGE_SIZE);
+}
+
+/*
+ * Look for a stored object with the same contents as @mem. Must be called
+ * with zram->lock held, at least for reading. The returned entry has an
+ * extra reference, which the caller hands over to a table entry.
+ */
+static struct zram_entry *zram_dedup_find(struct zram *zram, void *mem,
+					  u32 checksum, int alg,
+					  struct zcomp_strm *zstrm)
+{
+	struct zram_entry *entry;
+	struct hlist_node *pos;
+
+	hlist_for_each_entry(entry, pos, zram_dedup_bucket(zram, checksum),
+			     node) {
+		if (entry->checksum != checksum)
+			continue;
+		if (!zram_dedup_match(zram, entry, mem, alg, zstrm))
+			continue;
+
+		/* Several readers may get here at once */
+		atomic_inc(&entry->refcount);
+		return entry;
+	}
+
+	return NULL;
+}
+
 static u64 zram_default_disksize_bytes(void)
 {
 #if 0
@@ -162,59 +225,189 @@ static void zram_set_disksize(struct zram *zram, u64 size_bytes)
 static void zram_free_page(struct zram *zram, size_t index)
 {
 	u32 clen;
-	void *obj;
+	struct zram_entry *entry = zram->table[index].entry;
 
-	struct page *page = zram->table[index].page;
-	u32 offset = zram->table[index].offset;
+	/* Tells zram_writeback() the page it is writing out went away */
+	zram_clear_flag(zram, index, ZRAM_UNDER_WB);
 
-	if (unlikely(!page)) {
-		/*
-		 * No memory is allocated for zero filled pages.
-		 * Simply clear zero page flag.
-		 */
-		if (zram_test_flag(zram, index, ZRAM_ZERO)) {
-			zram_clear_flag(zram, index, ZRAM_ZERO);
-			zram_stat_dec(&zram->stats.pages_zero);
-		}
+#ifdef CONFIG_ZRAM_WRITEBACK
+	if (zram_test_flag(zram, index, ZRAM_WB)) {
+		zram_clear_flag(zram, index, ZRAM_WB);
+		clear_bit(zram->table[index].blk, zram->block_bitmap);
+		zram_stat_dec(&zram->stats.pages_wb);
+		zram->table[index].blk = 0;
 		return;
 	}
+#endif
+
+	/*
+	 * No memory is allocated for same filled pages.
+	 * Simply clear the flag.
+	 */
+	if (zram_test_flag(zram, index, ZRAM_ZERO)) {
+		zram_clear_flag(zram, index, ZRAM_ZERO);
+		zram_stat_dec(&zram->stats.pages_zero);
+		return;
+	}
+
+	if (zram_test_flag(zram, index, ZRAM_SAME)) {
+		zram_clear_flag(zram, index, ZRAM_SAME);
+		zram_stat_dec(&zram->stats.pages_same);
+		zram->table[index].element = 0;
+		return;
+	}
+
+	if (unlikely(!entry))
+		return;
+
+	clen = zram->table[index].size;
 
 	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
-		clen = PAGE_SIZE;
-		__free_page(page);
 		zram_clear_flag(zram, index, ZRAM_UNCOMPRESSED);
 		zram_stat_dec(&zram->stats.pages_expand);
-		goto out;
+	} else if (clen <= PAGE_SIZE / 2)
+		zram_stat_dec(&zram->stats.good_compress);
+
+	zram_stat_dec(&zram->stats.pages_stored);
+
+	/* The object goes away with the last page using it */
+	if (atomic_dec_and_test(&entry->refcount)) {
+		hlist_del(&entry->node);
+		zs_free(zram->mem_pool, entry->handle);
+		kmem_cache_free(zram_entry_cache, entry);
+		zram_stat64_sub(zram, &zram->stats.compr_size, clen);
+	} else
+		zram_stat_dec(&zram->stats.pages_dedup);
+
+	zram->table[index].entry = NULL;
+	zram->table[index].size = 0;
+	zram_set_comp(zram, index, 0);
+}
+
+/* Point table entry @index to @entry, whose reference it takes over */
+static void zram_set_entry(struct zram *zram, u32 index,
+			   struct zram_entry *entry)
+{
+	zram->table[index].entry = entry;
+	zram->table[index].size = entry->size;
+	zram->table[index].flags |= entry->flags;
+
+	zram_stat_inc(&zram->stats.pages_stored);
+	if (entry->flags & BIT(ZRAM_UNCOMPRESSED))
+		zram_stat_inc(&zram->stats.pages_expand);
+	else if (entry->size <= PAGE_SIZE / 2)
+		zram_stat_inc(&zram->stats.good_compress);
+}
+
+#ifdef CONFIG_ZRAM_WRITEBACK
+static u32 zram_now(void)
+{
+	struct timespec ts;
+
+	ktime_get_ts(&ts);
+	return ts.tv_sec;
+}
+
+static void zram_touch(struct zram *zram, u32 index)
+{
+	zram->table[index].ac_time = zram_now();
+}
+
+static void zram_bdev_end_io(struct bio *bio, int err)
+{
+	complete(bio->bi_private);
+}
+
+/*
+ * Synchronously transfer @nr pages from/to consecutive blocks of
+ * backing_dev starting at @blk, using as few bios as the queue allows.
+ */
+static int zram_bdev_rw(struct zram *zram, int rw, struct page **pages,
+			int nr, unsigned long blk)
+{
+	int i = 0, ret = 0;
+	struct bio *bio;
+	DECLARE_COMPLETION_ONSTACK(wait);
+
+	while (!ret && i < nr) {
+		bio = bio_alloc(GFP_NOIO, nr - i);
+		if (!bio)
+			return -ENOMEM;
+
+		bio->bi_bdev = zram->backing_bdev;
+		bio->bi_sector = (sector_t)(blk + i) << SECTORS_PER_PAGE_SHIFT;
+		bio->bi_end_io = zram_bdev_end_io;
+		bio->bi_private = &wait;
+
+		while (i < nr &&
+		       bio_add_page(bio, pages[i], PAGE_SIZE, 0) == PAGE_SIZE)
+			i++;
+
+		if (!bio->bi_vcnt) {
+			bio_put(bio);
+			return -EIO;
+		}
+
+		submit_bio(rw, bio);
+		wait_for_completion(&wait);
+		INIT_COMPLETION(wait);
+
+		if (!test_bit(BIO_UPTODATE, &bio->bi_flags))
+			ret = -EIO;
+		bio_put(bio);
 	}
 
-	obj = kmap_atomic(page, KM_USER0) + offset;
-	clen = xv_get_object_size(obj) - sizeof(struct zobj_header);
-	kunmap_atomic(obj, KM_USER0);
+	return ret;
+}
+
+/*
+ * Read a written back page into @page. From within
+ * generic_make_request(), the bio we would submit is only started after
+ * we return, so waiting for it would deadlock: the request is then
+ * retried from zram_deferred_work() instead.
+ */
+static int zram_read_from_bdev(struct zram *zram, u32 index,
+			       struct page *page)
+{
+	int ret;
 
-	xv_free(zram->mem_pool, page, offset);
-	if (clen <= PAGE_SIZE / 2)
-		zram_stat_dec(&zram->stats.good_compress);
+	if (current->bio_tail)
+		return -EAGAIN;
 
-out:
-	zram_stat64_sub(zram, &zram->stats.compr_size, clen);
-	zram_stat_dec(&zram->stats.pages_stored);
+	ret = zram_bdev_rw(zram, READ, &page, 1, zram->table[index].blk);
+	if (!ret)
+		zram_stat64_inc(zram, &zram->stats.num_wb_reads);
+
+	return ret;
+}
+#else
+static inline void zram_touch(struct zram *zram, u32 index)
+{
+}
 
-	zram->table[index].page = NULL;
-	zram->table[index].offset = 0;
+static inline int zram_read_from_bdev(struct zram *zram, u32 index,
+				      struct page *page)
+{
+	return -EIO;
 }
+#endif
 
-static void handle_zero_page(struct bio_vec *bvec)
+static void handle_same_page(struct bio_vec *bvec, unsigned long element)
 {
 	struct page *page = bvec->bv_page;
 	void *user_mem;
 
 	user_mem = kmap_atomic(page, KM_USER0);
-	memset(user_mem + bvec->bv_offset, 0, bvec->bv_len);
+	zram_fill_page(user_mem + bvec->bv_offset, bvec->bv_len, element);
 	kunmap_atomic(user_mem, KM_USER0);
 
 	flush_dcache_page(page);
 }
 
+/*
+ * Incompressible pages are PAGE_SIZE objects, which zsmalloc always
+ * keeps within a single page, so they never need a bounce buffer.
+ */
 static void handle_uncompressed_page(struct zram *zram, struct bio_vec *bvec,
 				     u32 index, int offset)
 {
@@ -222,10 +415,11 @@ static void handle_uncompressed_page(struct zram *zram, struct bio_vec *bvec,
 	unsigned char *user_mem, *cmem;
 
 	user_mem = kmap_atomic(page, KM_USER0);
-	cmem = kmap_atomic(zram->table[index].page, KM_USER1);
+	cmem = zs_map_object(zram->mem_pool, zram->table[index].entry->handle,
+			NULL);
 
 	memcpy(user_mem + bvec->bv_offset, cmem + offset, bvec->bv_len);
-	kunmap_atomic(cmem, KM_USER1);
+	zs_unmap_object(zram->mem_pool, cmem, NULL);
 	kunmap_atomic(user_mem, KM_USER0);
 
 	flush_dcache_page(page);
@@ -236,27 +430,65 @@ static inline int is_partial_io(struct bio_vec *bvec)
 	return bvec->bv_len != PAGE_SIZE;
 }
 
+static int handle_wb_page(struct zram *zram, struct bio_vec *bvec, u32 index,
+			  int offset)
+{
+	int ret;
+	struct page *page;
+	unsigned char *user_mem, *mem;
+
+	if (!is_partial_io(bvec)) {
+		ret = zram_read_from_bdev(zram, index, bvec->bv_page);
+		if (!ret)
+			flush_dcache_page(bvec->bv_page);
+		return ret;
+	}
+
+	page = mempool_alloc(zram_page_pool, GFP_NOIO);
+	ret = zram_read_from_bdev(zram, index, page);
+	if (!ret) {
+		user_mem = kmap_atomic(bvec->bv_page, KM_USER0);
+		mem = kmap_atomic(page, KM_USER1);
+		memcpy(user_mem + bvec->bv_offset, mem + offset, bvec->bv_len);
+		kunmap_atomic(mem, KM_USER1);
+		kunmap_atomic(user_mem, KM_USER0);
+		flush_dcache_page(bvec->bv_page);
+	}
+	mempool_free(page, zram_page_pool);
+
+	return ret;
+}
+
 static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
 			  u32 index, int offset, struct bio *bio)
 {
 	int ret;
-	size_t clen;
 	struct page *page;
 	struct zobj_header *zheader;
+	struct zcomp *comp;
+	struct zcomp_strm *zstrm;
 	unsigned char *user_mem, *cmem, *uncmem = NULL;
 
 	page = bvec->bv_page;
 
 	if (zram_test_flag(zram, index, ZRAM_ZERO)) {
-		handle_zero_page(bvec);
+		handle_same_page(bvec, 0);
+		return 0;
+	}
+
+	if (zram_test_flag(zram, index, ZRAM_SAME)) {
+		handle_same_page(bvec, zram->table[index].element);
 		return 0;
 	}
 
+	if (unlikely(zram_test_flag(zram, index, ZRAM_WB)))
+		return handle_wb_page(zram, bvec, index, offset);
+
 	/* Requested page is not present in compressed area */
-	if (unlikely(!zram->table[index].page)) {
+	if (unlikely(!zram->table[index].entry)) {
 		pr_debug("Read before write: sector=%lu, size=%u",
 			 (ulong)(bio->bi_sector), bio->bi_size);
-		handle_zero_page(bvec);
+		handle_same_page(bvec, 0);
 		return 0;
 	}
 
@@ -266,36 +498,35 @@ static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
 		return 0;
 	}
 
-	if (is_partial_io(bvec)) {
-		/* Use  a temporary buffer to decompress the page */
-		uncmem = kmalloc(PAGE_SIZE, GFP_KERNEL);
-		if (!uncmem) {
-			pr_info("Error allocating temp memory!\n");
-			return -ENOMEM;
-		}
-	}
+	/* Decompress with the algorithm that stored this object */
+	comp = zram->comps[zram_get_comp(zram, index)];
+	zstrm = zcomp_strm_find(comp);
 
+	/*
+	 * A partial read decompresses into the second page of the stream
+	 * buffer: the first one is enough to bounce the object.
+	 */
 	user_mem = kmap_atomic(page, KM_USER0);
-	if (!is_partial_io(bvec))
+	if (is_partial_io(bvec))
+		uncmem = zstrm->buffer + PAGE_SIZE;
+	else
 		uncmem = user_mem;
-	clen = PAGE_SIZE;
 
-	cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-		zram->table[index].offset;
+	/* An object straddling two pages is assembled in the stream buffer */
+	cmem = zs_map_object(zram->mem_pool, zram->table[index].entry->handle,
+			zstrm->buffer);
 
-	ret = DECOMPRESS(
-			cmem + sizeof(*zheader),
-			xv_get_object_size(cmem) - sizeof(*zheader),
-			uncmem, &clen);
+	ret = zcomp_decompress(comp, zstrm, cmem + sizeof(*zheader),
+			zram->table[index].size, uncmem);
 
 	if (is_partial_io(bvec)) {
 		memcpy(user_mem + bvec->bv_offset, uncmem + offset,
 		       bvec->bv_len);
-		kfree(uncmem);
 	}
 
-	kunmap_atomic(cmem, KM_USER1);
+	zs_unmap_object(zram->mem_pool, cmem, zstrm->buffer);
 	kunmap_atomic(user_mem, KM_USER0);
+	zcomp_strm_release(comp, zstrm);
 
 	/* Should NEVER happen. Return bio error if it does. */
 	if (unlikely(ret)) {
@@ -309,33 +540,51 @@ static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
 	return 0;
 }
 
+/*
+ * Read page @index into @mem, which must be a lowmem page. Called with
+ * zram->lock held for reading.
+ */
 static int zram_read_before_write(struct zram *zram, char *mem, u32 index)
 {
 	int ret;
-	size_t clen = PAGE_SIZE;
 	struct zobj_header *zheader;
+	struct zcomp *comp;
+	struct zcomp_strm *zstrm;
 	unsigned char *cmem;
 
+	if (zram_test_flag(zram, index, ZRAM_SAME)) {
+		zram_fill_page(mem, PAGE_SIZE, zram->table[index].element);
+		return 0;
+	}
+
+	if (unlikely(zram_test_flag(zram, index, ZRAM_WB)))
+		return zram_read_from_bdev(zram, index, virt_to_page(mem));
+
 	if (zram_test_flag(zram, index, ZRAM_ZERO) ||
-	    !zram->table[index].page) {
+	    !zram->table[index].entry) {
 		memset(mem, 0, PAGE_SIZE);
 		return 0;
 	}
 
-	cmem = kmap_atomic(zram->table[index].page, KM_USER0) +
-		zram->table[index].offset;
-
 	/* Page is stored uncompressed since it's incompressible */
 	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
+		cmem = zs_map_object(zram->mem_pool,
+				zram->table[index].entry->handle, NULL);
 		memcpy(mem, cmem, PAGE_SIZE);
-		kunmap_atomic(cmem, KM_USER0);
+		zs_unmap_object(zram->mem_pool, cmem, NULL);
 		return 0;
 	}
 
-	ret = DECOMPRESS(cmem + sizeof(*zheader),
-			xv_get_object_size(cmem) - sizeof(*zheader),
-			mem, &clen);
-	kunmap_atomic(cmem, KM_USER0);
+	comp = zram->comps[zram_get_comp(zram, index)];
+	zstrm = zcomp_strm_find(comp);
+
+	cmem = zs_map_object(zram->mem_pool, zram->table[index].entry->handle,
+			zstrm->buffer);
+
+	ret = zcomp_decompress(comp, zstrm, cmem + sizeof(*zheader),
+			zram->table[index].size, mem);
+	zs_unmap_object(zram->mem_pool, cmem, zstrm->buffer);
+	zcomp_strm_release(comp, zstrm);
 
 	/* Should NEVER happen. Return bio error if it does. */
 	if (unlikely(ret)) {
@@ -347,71 +596,77 @@ static int zram_read_before_write(struct zram *zram, char *mem, u32 index)
 	return 0;
 }
 
-static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
-			   int offset)
+/*
+ * Writes are done in two steps, ZRAM_BATCH_PAGES pages at a time. Each
+ * page is first prepared with zram->lock held for reading, so that
+ * writers on different CPUs compress in parallel: the new contents are
+ * either recognized as same filled, matched to an existing object, or
+ * compressed into a new object that nothing points to yet. The whole
+ * batch is then installed in the table under a single write lock.
+ */
+enum zram_write_type {
+	ZRAM_WRITE_ZERO,
+	ZRAM_WRITE_SAME,
+	ZRAM_WRITE_DEDUP,	/* entry of an identical page, pinned */
+	ZRAM_WRITE_NEW,		/* new entry, not hashed yet */
+};
+
+struct zram_write_op {
+	u32 index;
+	enum zram_write_type type;
+	union {
+		struct zram_entry *entry;
+		unsigned long element;
+	};
+};
+
+/* Called with zram->lock held for reading */
+static int zram_prepare_write(struct zram *zram, unsigned char *uncmem,
+			      struct zram_write_op *op)
 {
 	int ret;
-	u32 store_offset;
+	int alg;
 	size_t clen;
-	struct zobj_header *zheader;
-	struct page *page, *page_store;
-	unsigned char *user_mem, *cmem, *src, *uncmem = NULL;
-
-	page = bvec->bv_page;
-	src = zram->compress_buffer;
-
-	if (is_partial_io(bvec)) {
-		/*
-		 * This is a partial IO. We need to read the full page
-		 * before to write the changes.
-		 */
-		uncmem = kmalloc(PAGE_SIZE, GFP_KERNEL);
-		if (!uncmem) {
-			pr_info("Error allocating temp memory!\n");
-			ret = -ENOMEM;
-			goto out;
-		}
-		ret = zram_read_before_write(zram, uncmem, index);
-		if (ret) {
-			kfree(uncmem);
-			goto out;
-		}
+	u32 checksum;
+	unsigned long handle, element;
+	struct zobj_header zheader;
+	struct zram_entry *entry;
+	struct zcomp *comp;
+	struct zcomp_strm *zstrm;
+	unsigned char *src;
+
+	if (page_same_filled(uncmem, &element)) {
+		op->type = element ? ZRAM_WRITE_SAME : ZRAM_WRITE_ZERO;
+		op->element = element;
+		return 0;
 	}
 
 	/*
-	 * System overwrites unused sectors. Free memory associated
-	 * with this sector now.
+	 * comp_algorithm may be changed at any time: the new pool is
+	 * published before the new id (see comp_algorithm_store()).
 	 */
-	if (zram->table[index].page ||
-	    zram_test_flag(zram, index, ZRAM_ZERO))
-		zram_free_page(zram, index);
+	alg = ACCESS_ONCE(zram->comp_alg);
+	smp_rmb();
+	comp = zram->comps[alg];
 
-	user_mem = kmap_atomic(page, KM_USER0);
+	/* This may sleep until another writer releases its stream */
+	zstrm = zcomp_strm_find(comp);
+	src = zstrm->buffer;
 
-	if (is_partial_io(bvec))
-		memcpy(uncmem + offset, user_mem + bvec->bv_offset,
-		       bvec->bv_len);
-	else
-		uncmem = user_mem;
-
-	if (page_zero_filled(uncmem)) {
-		kunmap_atomic(user_mem, KM_USER0);
-		if (is_partial_io(bvec))
-			kfree(uncmem);
-		zram_stat_inc(&zram->stats.pages_zero);
-		zram_set_flag(zram, index, ZRAM_ZERO);
-		ret = 0;
-		goto out;
+	/*
+	 * A page with the same contents may already be stored: then just
+	 * take a reference on its object and skip compression altogether.
+	 */
+	checksum = zram_checksum(uncmem);
+	entry = zram_dedup_find(zram, uncmem, checksum, alg, zstrm);
+	if (entry) {
+		zcomp_strm_release(comp, zstrm);
+		op->type = ZRAM_WRITE_DEDUP;
+		op->entry = entry;
+		return 0;
 	}
 
-	COMPRESS(uncmem, PAGE_SIZE, src, &clen,
-		zram->compress_workmem);
-	ret = 0;
-
-	kunmap_atomic(user_mem, KM_USER0);
-	if (is_partial_io(bvec))
-			kfree(uncmem);
-
+	ret = zcomp_compress(comp, zstrm, uncmem, &clen);
 	if (unlikely(ret != 0)) {
 		pr_err("Compression failed! err=%d\n", ret);
 		goto out;
@@ -421,85 +676,112 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 	 * Page is incompressible. Store it as-is (uncompressed)
 	 * since we do not want to return too many disk write
 	 * errors which has side effect of hanging the system.
+	 * The stream buffer is free again, so stage the page there.
 	 */
 	if (unlikely(clen > max_zpage_size)) {
 		clen = PAGE_SIZE;
-		page_store = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
-		if (unlikely(!page_store)) {
-			pr_info("Error allocating memory for "
-				"incompressible page: %u\n", index);
-			ret = -ENOMEM;
-			goto out;
-		}
-
-		store_offset = 0;
-		zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
-		zram_stat_inc(&zram->stats.pages_expand);
-		zram->table[index].page = page_store;
-		src = kmap_atomic(page, KM_USER0);
-		goto memstore;
+		memcpy(src, uncmem, PAGE_SIZE);
 	}
 
-	if (xv_malloc(zram->mem_pool, clen + sizeof(*zheader),
-		      &zram->table[index].page, &store_offset,
-		      GFP_NOIO | __GFP_HIGHMEM)) {
-		pr_info("Error allocating memory for compressed "
-			"page: %u, size=%zu\n", index, clen);
+	entry = kmem_cache_alloc(zram_entry_cache, GFP_NOIO);
+	if (unlikely(!entry)) {
 		ret = -ENOMEM;
 		goto out;
 	}
 
-memstore:
-	zram->table[index].offset = store_offset;
-
-	cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-		zram->table[index].offset;
+	/*
+	 * Compressed objects start with a back-reference to their entry,
+	 * so that zram_compact() can move them. Incompressible pages fill
+	 * a whole zspage on their own and are never moved.
+	 */
+	if (unlikely(clen == PAGE_SIZE))
+		handle = zs_malloc(zram->mem_pool, PAGE_SIZE,
+				GFP_NOIO | __GFP_HIGHMEM);
+	else
+		handle = zs_malloc(zram->mem_pool, clen + sizeof(zheader),
+				GFP_NOIO | __GFP_HIGHMEM);
 
-#if 0
-	/* Back-reference needed for memory defragmentation */
-	if (!zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)) {
-		zheader = (struct zobj_header *)cmem;
-		zheader->table_idx = index;
-		cmem += sizeof(*zheader);
+	if (unlikely(!handle)) {
+		pr_info("Error allocating memory for compressed "
+			"page: %u, size=%zu\n", op->index, clen);
+		kmem_cache_free(zram_entry_cache, entry);
+		ret = -ENOMEM;
+		goto out;
 	}
-#endif
-
-	memcpy(cmem, src, clen);
 
-	kunmap_atomic(cmem, KM_USER1);
-	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
-		kunmap_atomic(src, KM_USER0);
+	if (unlikely(clen == PAGE_SIZE)) {
+		entry->flags = BIT(ZRAM_UNCOMPRESSED);
+		zs_write_object(zram->mem_pool, handle, 0, src, PAGE_SIZE);
+	} else {
+		entry->flags = alg << ZRAM_COMP_SHIFT;
+		zheader.entry = entry;
+		zs_write_object(zram->mem_pool, handle, 0, &zheader,
+				sizeof(zheader));
+		zs_write_object(zram->mem_pool, handle, sizeof(zheader),
+				src, clen);
+	}
 
-	/* Update stats */
-	zram_stat64_add(zram, &zram->stats.compr_size, clen);
-	zram_stat_inc(&zram->stats.pages_stored);
-	if (clen <= PAGE_SIZE / 2)
-		zram_stat_inc(&zram->stats.good_compress);
+	entry->handle = handle;
+	entry->size = clen;
+	entry->checksum = checksum;
+	atomic_set(&entry->refcount, 1);
 
-	return 0;
+	op->type = ZRAM_WRITE_NEW;
+	op->entry = entry;
 
 out:
-	if (ret)
-		zram_stat64_inc(zram, &zram->stats.failed_writes);
+	zcomp_strm_release(comp, zstrm);
 	return ret;
 }
 
-static int zram_bvec_rw(struct zram *zram, struct bio_vec *bvec, u32 index,
-			int offset, struct bio *bio, int rw)
+/* Install prepared writes, freeing what the pages held before */
+static void zram_commit_writes(struct zram *zram, struct zram_write_op *ops,
+			       int nr)
 {
-	int ret;
+	int i;
+	struct zram_write_op *op;
 
-	if (rw == READ) {
-		down_read(&zram->lock);
-		ret = zram_bvec_read(zram, bvec, index, offset, bio);
-		up_read(&zram->lock);
-	} else {
-		down_write(&zram->lock);
-		ret = zram_bvec_write(zram, bvec, index, offset);
-		up_write(&zram->lock);
+	down_write(&zram->lock);
+	for (i = 0; i < nr; i++) {
+		op = &ops[i];
+
+		/* The slot was freed and reused before the free was done */
+		if (unlikely(test_bit(op->index, zram->pending_free)))
+			clear_bit(op->index, zram->pending_free);
+
+		/*
+		 * System overwrites unused sectors. Free memory associated
+		 * with this sector now.
+		 */
+		zram_free_page(zram, op->index);
+
+		switch (op->type) {
+		case ZRAM_WRITE_ZERO:
+			zram_stat_inc(&zram->stats.pages_zero);
+			zram_set_flag(zram, op->index, ZRAM_ZERO);
+			break;
+		case ZRAM_WRITE_SAME:
+			zram_stat_inc(&zram->stats.pages_same);
+			zram_set_flag(zram, op->index, ZRAM_SAME);
+			zram->table[op->index].element = op->element;
+			break;
+		case ZRAM_WRITE_DEDUP:
+			zram_set_entry(zram, op->index, op->entry);
+			zram_stat_inc(&zram->stats.pages_dedup);
+			break;
+		case ZRAM_WRITE_NEW:
+			hlist_add_head(&op->entry->node,
+				zram_dedup_bucket(zram, op->entry->checksum));
+			zram_set_entry(zram, op->index, op->entry);
+			zram_stat64_add(zram, &zram->stats.compr_size,
+					op->entry->size);
+			break;
+		}
 	}
+	up_write(&zram->lock);
 
-	return ret;
+	for (i = 0; i < nr; i++)
+		zram_touch(zram, ops[i].index);
 }
 
 static void update_position(u32 *index, int *offset, struct bio_vec *bvec)
@@ -509,61 +791,278 @@ static void update_position(u32 *index, int *offset, struct bio_vec *bvec)
 	*offset = (*offset + bvec->bv_len) % PAGE_SIZE;
 }
 
-static void __zram_make_request(struct zram *zram, struct bio *bio, int rw)
+/*
+ * zram_bvec_read() can only make operation on a single zram page: split
+ * bio vectors crossing a page boundary. Called with zram->lock held for
+ * reading, taken once for the whole bio.
+ */
+static int zram_read_bio(struct zram *zram, struct bio *bio)
 {
-	int i, offset;
+	int i, offset, ret = 0;
 	u32 index;
 	struct bio_vec *bvec;
 
-	switch (rw) {
-	case READ:
-		zram_stat64_inc(zram, &zram->stats.num_reads);
-		break;
-	case WRITE:
-		zram_stat64_inc(zram, &zram->stats.num_writes);
-		break;
+	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
+	offset = (bio->bi_sector & (SECTORS_PER_PAGE - 1)) << SECTOR_SHIFT;
+
+	bio_for_each_segment(bvec, bio, i) {
+		int max_transfer_size = PAGE_SIZE - offset;
+		struct bio_vec bv = *bvec;
+
+		if (bvec->bv_len > max_transfer_size) {
+			bv.bv_len = max_transfer_size;
+			ret = zram_bvec_read(zram, &bv, index, offset, bio);
+			if (ret < 0)
+				break;
+			zram_touch(zram, index);
+
+			bv.bv_len = bvec->bv_len - max_transfer_size;
+			bv.bv_offset += max_transfer_size;
+			ret = zram_bvec_read(zram, &bv, index + 1, 0, bio);
+			if (ret < 0)
+				break;
+			zram_touch(zram, index + 1);
+		} else {
+			ret = zram_bvec_read(zram, &bv, index, offset, bio);
+			if (ret < 0)
+				break;
+			zram_touch(zram, index);
+		}
+
+		update_position(&index, &offset, bvec);
+	}
+
+	return ret;
+}
+
+/*
+ * Write state of a bio: consecutive pieces of the same page are gathered
+ * in a bounce page (taken from zram_page_pool) before it is prepared.
+ */
+struct zram_write_ctx {
+	struct zram_write_op ops[ZRAM_BATCH_PAGES];
+	int nr_ops;
+	struct page *bounce;	/* page being assembled, if any */
+	u32 bounce_index;
+};
+
+static int zram_write_flush(struct zram *zram, struct zram_write_ctx *ctx)
+{
+	int ret;
+	struct zram_write_op *op = &ctx->ops[ctx->nr_ops];
+
+	op->index = ctx->bounce_index;
+	ret = zram_prepare_write(zram, page_address(ctx->bounce), op);
+	mempool_free(ctx->bounce, zram_page_pool);
+	ctx->bounce = NULL;
+
+	if (!ret)
+		ctx->nr_ops++;
+	return ret;
+}
+
+/*
+ * Add the piece of @bvec that falls in page @index, at @offset, to the
+ * batch. Called with zram->lock held for reading.
+ */
+static int zram_write_piece(struct zram *zram, struct zram_write_ctx *ctx,
+			    struct bio_vec *bvec, u32 index, int offset)
+{
+	int ret;
+	struct zram_write_op *op;
+	unsigned char *user_mem;
+
+	if (ctx->bounce && ctx->bounce_index != index) {
+		ret = zram_write_flush(zram, ctx);
+		if (ret)
+			return ret;
+	}
+
+	/* Room for the page is checked by our caller */
+	if (!is_partial_io(bvec)) {
+		op = &ctx->ops[ctx->nr_ops];
+		op->index = index;
+		user_mem = kmap(bvec->bv_page);
+		ret = zram_prepare_write(zram, user_mem, op);
+		kunmap(bvec->bv_page);
+		if (!ret)
+			ctx->nr_ops++;
+		return ret;
+	}
+
+	/*
+	 * This is a partial IO. We need to read the full page
+	 * before to write the changes.
+	 */
+	if (!ctx->bounce) {
+		ctx->bounce = mempool_alloc(zram_page_pool, GFP_NOIO);
+		ctx->bounce_index = index;
+		ret = zram_read_before_write(zram,
+				page_address(ctx->bounce), index);
+		if (ret) {
+			mempool_free(ctx->bounce, zram_page_pool);
+			ctx->bounce = NULL;
+			return ret;
+		}
 	}
 
+	user_mem = kmap_atomic(bvec->bv_page, KM_USER0);
+	memcpy(page_address(ctx->bounce) + offset,
+	       user_mem + bvec->bv_offset, bvec->bv_len);
+	kunmap_atomic(user_mem, KM_USER0);
+
+	return 0;
+}
+
+static int zram_write_bio(struct zram *zram, struct bio *bio)
+{
+	int i, offset, ret = 0;
+	u32 index;
+	struct bio_vec *bvec;
+	struct zram_write_ctx ctx;
+
+	ctx.nr_ops = 0;
+	ctx.bounce = NULL;
+
 	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
 	offset = (bio->bi_sector & (SECTORS_PER_PAGE - 1)) << SECTOR_SHIFT;
 
+	down_read(&zram->lock);
+
 	bio_for_each_segment(bvec, bio, i) {
 		int max_transfer_size = PAGE_SIZE - offset;
+		struct bio_vec bv = *bvec;
 
-		if (bvec->bv_len > max_transfer_size) {
-			/*
-			 * zram_bvec_rw() can only make operation on a single
-			 * zram page. Split the bio vector.
-			 */
-			struct bio_vec bv;
+		/*
+		 * A bvec adds at most two pages to the batch, the page being
+		 * assembled one more. That page is written out now as well:
+		 * the lock must not be waited for with a pool page held.
+		 */
+		if (ctx.nr_ops + 3 > ZRAM_BATCH_PAGES) {
+			if (ctx.bounce) {
+				ret = zram_write_flush(zram, &ctx);
+				if (ret)
+					break;
+			}
+			up_read(&zram->lock);
+			zram_commit_writes(zram, ctx.ops, ctx.nr_ops);
+			ctx.nr_ops = 0;
+			down_read(&zram->lock);
+		}
 
-			bv.bv_page = bvec->bv_page;
+		if (bvec->bv_len > max_transfer_size) {
 			bv.bv_len = max_transfer_size;
-			bv.bv_offset = bvec->bv_offset;
-
-			if (zram_bvec_rw(zram, &bv, index, offset, bio, rw) < 0)
-				goto out;
+			ret = zram_write_piece(zram, &ctx, &bv, index, offset);
+			if (ret)
+				break;
 
 			bv.bv_len = bvec->bv_len - max_transfer_size;
 			bv.bv_offset += max_transfer_size;
-			if (zram_bvec_rw(zram, &bv, index+1, 0, bio, rw) < 0)
-				goto out;
-		} else
-			if (zram_bvec_rw(zram, bvec, index, offset, bio, rw)
-			    < 0)
-				goto out;
+			ret = zram_write_piece(zram, &ctx, &bv, index + 1, 0);
+			if (ret)
+				break;
+		} else {
+			ret = zram_write_piece(zram, &ctx, &bv, index, offset);
+			if (ret)
+				break;
+		}
 
 		update_position(&index, &offset, bvec);
 	}
 
+	if (!ret && ctx.bounce)
+		ret = zram_write_flush(zram, &ctx);
+	else if (ctx.bounce)
+		mempool_free(ctx.bounce, zram_page_pool);
+
+	up_read(&zram->lock);
+
+	/* Even if we failed half way: what was prepared is written */
+	zram_commit_writes(zram, ctx.ops, ctx.nr_ops);
+
+	if (ret && ret != -EAGAIN)
+		zram_stat64_inc(zram, &zram->stats.failed_writes);
+	return ret;
+}
+
+/*
+ * Returns -EAGAIN, without completing the bio, if it needs to wait for
+ * backing_dev and must be deferred to zram_deferred_work(). Both reads
+ * and writes can simply be redone from the start then.
+ */
+static int __zram_make_request(struct zram *zram, struct bio *bio, int rw)
+{
+	int ret;
+
+	if (rw == READ) {
+		down_read(&zram->lock);
+		ret = zram_read_bio(zram, bio);
+		up_read(&zram->lock);
+	} else
+		ret = zram_write_bio(zram, bio);
+
+	if (ret == -EAGAIN)
+		return ret;
+
+	if (ret) {
+		bio_io_error(bio);
+		return ret;
+	}
+
 	set_bit(BIO_UPTODATE, &bio->bi_flags);
 	bio_endio(bio, 0);
-	return;
+	return 0;
+}
 
-out:
-	bio_io_error(bio);
+/* Free the swap slots zram_slot_free_notify() could not */
+static void zram_free_work(struct work_struct *work)
+{
+	struct zram *zram = container_of(work, struct zram, free_work);
+	unsigned long index, nr_pages = zram->disksize >> PAGE_SHIFT;
+
+	down_write(&zram->lock);
+	for (index = find_first_bit(zram->pending_free, nr_pages);
+	     index < nr_pages;
+	     index = find_next_bit(zram->pending_free, nr_pages, index + 1)) {
+		clear_bit(index, zram->pending_free);
+		zram_free_page(zram, index);
+		zram_stat64_inc(zram, &zram->stats.notify_free);
+	}
+	up_write(&zram->lock);
 }
 
+#ifdef CONFIG_ZRAM_WRITEBACK
+static void zram_deferred_work(struct work_struct *work)
+{
+	struct bio *bio;
+	struct zram *zram = container_of(work, struct zram, deferred_work);
+
+	while (1) {
+		spin_lock(&zram->deferred_lock);
+		bio = bio_list_pop(&zram->deferred_bios);
+		spin_unlock(&zram->deferred_lock);
+		if (!bio)
+			break;
+
+		__zram_make_request(zram, bio, bio_data_dir(bio));
+	}
+}
+
+static void zram_defer_bio(struct zram *zram, struct bio *bio)
+{
+	spin_lock(&zram->deferred_lock);
+	bio_list_add(&zram->deferred_bios, bio);
+	spin_unlock(&zram->deferred_lock);
+
+	queue_work(zram_wq, &zram->deferred_work);
+}
+#else
+static inline void zram_defer_bio(struct zram *zram, struct bio *bio)
+{
+	BUG();
+}
+#endif
+
 /*
  * Check if request is within bounds and aligned on zram logical blocks.
  */
@@ -599,46 +1098,311 @@ static int zram_make_request(struct request_queue *queue, struct bio *bio)
                 return 0;
        }
 
-        __zram_make_request(zram, bio, bio_data_dir(bio));
+	switch (bio_data_dir(bio)) {
+	case READ:
+		zram_stat64_inc(zram, &zram->stats.num_reads);
+		break;
+	case WRITE:
+		zram_stat64_inc(zram, &zram->stats.num_writes);
+		break;
+	}
+
+	if (__zram_make_request(zram, bio, bio_data_dir(bio)) == -EAGAIN)
+		zram_defer_bio(zram, bio);
 
 	return 0;
 }
 
-void zram_reset_device(struct zram *zram)
+static void zram_migrate_object(void *priv, void *obj,
+				unsigned long old_handle, unsigned long new_handle)
 {
-	size_t index;
+	struct zram *zram = priv;
+	struct zobj_header *zheader = obj;
+	struct zram_entry *entry = zheader->entry;
+
+	BUG_ON(entry->handle != old_handle);
+	entry->handle = new_handle;
+	zram_stat64_inc(zram, &zram->stats.num_migrated);
+}
+
+/*
+ * Move compressed objects out of sparsely used pages so that those pages
+ * can be freed. All I/O to the device is blocked while this runs.
+ */
+void zram_compact(struct zram *zram)
+{
+	unsigned long freed;
+	void *buf;
+
+	/*
+	 * Allocated before I/O is blocked: reclaim may have to swap to
+	 * this very device.
+	 */
+	buf = (void *)__get_free_page(GFP_KERNEL);
+	if (!buf)
+		return;
+
+	down_write(&zram->lock);
+	freed = zs_compact(zram->mem_pool, buf, zram_migrate_object, zram);
+	up_write(&zram->lock);
+
+	free_page((unsigned long)buf);
+
+	zram_stat64_add(zram, &zram->stats.pages_compacted, freed);
+}
+
+#ifdef CONFIG_ZRAM_WRITEBACK
+static void zram_reset_bdev(struct zram *zram)
+{
+	if (!zram->backing_bdev)
+		return;
+
+	close_bdev_exclusive(zram->backing_bdev, FMODE_READ | FMODE_WRITE);
+	vfree(zram->block_bitmap);
+	kfree(zram->backing_dev_path);
+
+	zram->backing_bdev = NULL;
+	zram->block_bitmap = NULL;
+	zram->backing_dev_path = NULL;
+	zram->nr_blocks = 0;
+}
+
+/*
+ * Use the block device at @buf (e.g. a spare partition, or a file through
+ * a loop device) for written back pages. Only allowed before the device
+ * is initialized.
+ */
+int zram_set_backing_dev(struct zram *zram, const char *buf)
+{
+	int ret;
+	char *path;
+	size_t bitmap_sz;
+	unsigned long nr_blocks, *bitmap;
+	struct block_device *bdev;
+
+	path = kstrndup(buf, PATH_MAX, GFP_KERNEL);
+	if (!path)
+		return -ENOMEM;
+	strim(path);
+
+	bdev = open_bdev_exclusive(path, FMODE_READ | FMODE_WRITE, zram);
+	if (IS_ERR(bdev)) {
+		pr_info("Cannot open backing device %s\n", path);
+		ret = PTR_ERR(bdev);
+		goto out_free_path;
+	}
+
+	nr_blocks = i_size_read(bdev->bd_inode) >> PAGE_SHIFT;
+	if (!nr_blocks) {
+		ret = -EINVAL;
+		goto out_close;
+	}
+
+	bitmap_sz = BITS_TO_LONGS(nr_blocks) * sizeof(long);
+	bitmap = vmalloc(bitmap_sz);
+	if (!bitmap) {
+		ret = -ENOMEM;
+		goto out_close;
+	}
+	memset(bitmap, 0, bitmap_sz);
 
 	mutex_lock(&zram->init_lock);
-	zram->init_done = 0;
+	if (zram->init_done) {
+		mutex_unlock(&zram->init_lock);
+		pr_info("Cannot change backing_dev for initialized device\n");
+		vfree(bitmap);
+		ret = -EBUSY;
+		goto out_close;
+	}
 
-	/* Free various per-device buffers */
-	kfree(zram->compress_workmem);
-	free_pages((unsigned long)zram->compress_buffer, 1);
+	zram_reset_bdev(zram);
+	zram->backing_bdev = bdev;
+	zram->backing_dev_path = path;
+	zram->nr_blocks = nr_blocks;
+	zram->block_bitmap = bitmap;
+	mutex_unlock(&zram->init_lock);
 
-	zram->compress_workmem = NULL;
-	zram->compress_buffer = NULL;
+	return 0;
 
-	/* Free all pages that are still in this zram device */
-	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
-		struct page *page;
-		u16 offset;
+out_close:
+	close_bdev_exclusive(bdev, FMODE_READ | FMODE_WRITE);
+out_free_path:
+	kfree(path);
+	return ret;
+}
 
-		page = zram->table[index].page;
-		offset = zram->table[index].offset;
+static int zram_wb_candidate(struct zram *zram, u32 index,
+			     enum zram_wb_mode mode, u32 now)
+{
+	struct zram_entry *entry = zram->table[index].entry;
 
-		if (!page)
-			continue;
+	if (zram->table[index].flags & (BIT(ZRAM_ZERO) | BIT(ZRAM_SAME) |
+			BIT(ZRAM_WB) | BIT(ZRAM_UNDER_WB)))
+		return 0;
+
+	/* Writing out a shared object would not free its memory */
+	if (!entry || atomic_read(&entry->refcount) != 1)
+		return 0;
+
+	if (mode == ZRAM_WB_HUGE)
+		return zram_test_flag(zram, index, ZRAM_UNCOMPRESSED);
+
+	return now - zram->table[index].ac_time >= zram->idle_age;
+}
+
+/*
+ * Move pages selected by @mode to backing_dev, freeing their memory.
+ * Pages go out ZRAM_WB_BATCH at a time, in a run of consecutive blocks,
+ * so the device sees large sequential writes. I/O to the device is only
+ * blocked while a batch is collected and when it is committed; a page
+ * rewritten or freed in between simply keeps its new contents.
+ *
+ * Called with init_lock held, which also serializes writebacks.
+ */
+int zram_writeback(struct zram *zram, enum zram_wb_mode mode)
+{
+	int i, nr, nr_blocks, ret = 0;
+	u32 now, index = 0, nr_pages = zram->disksize >> PAGE_SHIFT;
+	u32 indices[ZRAM_WB_BATCH];
+	struct page *pages[ZRAM_WB_BATCH] = { NULL };
+	unsigned long blk;
+
+	if (!zram->backing_bdev)
+		return -ENODEV;
+
+	for (i = 0; i < ZRAM_WB_BATCH; i++) {
+		pages[i] = alloc_page(GFP_KERNEL);
+		if (!pages[i]) {
+			ret = -ENOMEM;
+			goto out;
+		}
+	}
+
+	now = zram_now();
+
+	while (index < nr_pages) {
+		down_read(&zram->lock);
+
+		/* Fall back to shorter runs as backing_dev fills up */
+		nr_blocks = ZRAM_WB_BATCH;
+		do {
+			blk = bitmap_find_next_zero_area(zram->block_bitmap,
+					zram->nr_blocks, 0, nr_blocks, 0);
+			if (blk < zram->nr_blocks)
+				break;
+			nr_blocks /= 2;
+		} while (nr_blocks);
+
+		if (!nr_blocks) {
+			up_read(&zram->lock);
+			ret = -ENOSPC;
+			break;
+		}
+
+		for (nr = 0; nr < nr_blocks && index < nr_pages; index++) {
+			unsigned char *mem;
+			int err;
+
+			if (!zram_wb_candidate(zram, index, mode, now))
+				continue;
+
+			mem = kmap(pages[nr]);
+			err = zram_read_before_write(zram, mem, index);
+			kunmap(pages[nr]);
+			if (err)
+				continue;
+
+			/* Writeback holds zram->lock shared, only writers clear it */
+			zram_set_flag(zram, index, ZRAM_UNDER_WB);
+			indices[nr++] = index;
+		}
+
+		if (nr)
+			bitmap_set(zram->block_bitmap, blk, nr);
+		up_read(&zram->lock);
+
+		if (!nr)
+			break;
+
+		ret = zram_bdev_rw(zram, WRITE, pages, nr, blk);
 
-		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
-			__free_page(page);
-		else
-			xv_free(zram->mem_pool, page, offset);
+		down_write(&zram->lock);
+		for (i = 0; i < nr; i++) {
+			u32 idx = indices[i];
+
+			if (ret || !zram_test_flag(zram, idx, ZRAM_UNDER_WB)) {
+				zram_clear_flag(zram, idx, ZRAM_UNDER_WB);
+				clear_bit(blk + i, zram->block_bitmap);
+				continue;
+			}
+
+			zram_free_page(zram, idx);
+			zram_set_flag(zram, idx, ZRAM_WB);
+			zram->table[idx].blk = blk + i;
+			zram_stat_inc(&zram->stats.pages_wb);
+		}
+		up_write(&zram->lock);
+
+		if (ret) {
+			pr_err("Writeback failed! err=%d\n", ret);
+			break;
+		}
+		zram_stat64_add(zram, &zram->stats.num_wb_writes, nr);
+	}
+
+out:
+	for (i = 0; i < ZRAM_WB_BATCH; i++)
+		if (pages[i])
+			__free_page(pages[i]);
+
+	return ret;
+}
+#endif
+
+void zram_reset_device(struct zram *zram)
+{
+	int alg;
+
+	mutex_lock(&zram->init_lock);
+	zram->init_done = 0;
+
+	/* Pending slot frees use the table */
+	flush_work(&zram->free_work);
+	vfree(zram->pending_free);
+	zram->pending_free = NULL;
+
+#ifdef CONFIG_ZRAM_WRITEBACK
+	/* Deferred bios still use the table */
+	flush_work(&zram->deferred_work);
+	zram_reset_bdev(zram);
+#endif
+
+	/* Free various per-device buffers */
+	for (alg = 0; alg < ZCOMP_NR_ALGS; alg++) {
+		if (zram->comps[alg])
+			zcomp_destroy(zram->comps[alg]);
+		zram->comps[alg] = NULL;
 	}
 
 	vfree(zram->table);
 	zram->table = NULL;
 
-	xv_destroy_pool(zram->mem_pool);
+	if (zram->dedup_hash) {
+		size_t i;
+		struct zram_entry *entry;
+		struct hlist_node *pos, *n;
+
+		for (i = 0; i < (1 << zram->dedup_hash_bits); i++)
+			hlist_for_each_entry_safe(entry, pos, n,
+					&zram->dedup_hash[i], node)
+				kmem_cache_free(zram_entry_cache, entry);
+		vfree(zram->dedup_hash);
+	}
+	zram->dedup_hash = NULL;
+
+	/* Destroying the pool frees all pages still in this zram device */
+	if (zram->mem_pool)
+		zs_destroy_pool(zram->mem_pool);
 	zram->mem_pool = NULL;
 
 	/* Reset stats */
@@ -660,17 +1424,10 @@ int zram_init_device(struct zram *zram)
 		return 0;
 	}
 
-	zram->compress_workmem = kzalloc(WMSIZE, GFP_KERNEL);
-	if (!zram->compress_workmem) {
-		pr_err("Error allocating compressor working memory!\n");
-		ret = -ENOMEM;
-		goto fail_no_table;
-	}
-
-	zram->compress_buffer =
-		(void *)__get_free_pages(GFP_KERNEL | __GFP_ZERO, 1);
-	if (!zram->compress_buffer) {
-		pr_err("Error allocating compressor buffer space\n");
+	zram->comps[zram->comp_alg] = zcomp_create(zram->comp_alg,
+						zram->max_comp_streams);
+	if (!zram->comps[zram->comp_alg]) {
+		pr_err("Error allocating compression streams!\n");
 		ret = -ENOMEM;
 		goto fail_no_table;
 	}
@@ -684,10 +1441,31 @@ int zram_init_device(struct zram *zram)
 	}
 	memset(zram->table, 0, num_pages * sizeof(*zram->table));
 
+	zram->pending_free = vmalloc(BITS_TO_LONGS(num_pages) * sizeof(long));
+	if (!zram->pending_free) {
+		pr_err("Error allocating zram free bitmap\n");
+		ret = -ENOMEM;
+		goto fail;
+	}
+	memset(zram->pending_free, 0, BITS_TO_LONGS(num_pages) * sizeof(long));
+
+	/* Aim for chains of about four objects on a full device */
+	zram->dedup_hash_bits = ilog2(roundup_pow_of_two(
+					max_t(size_t, num_pages / 4, 1)));
+	zram->dedup_hash = vmalloc(sizeof(struct hlist_head) <<
+					zram->dedup_hash_bits);
+	if (!zram->dedup_hash) {
+		pr_err("Error allocating zram dedup table\n");
+		ret = -ENOMEM;
+		goto fail;
+	}
+	memset(zram->dedup_hash, 0,
+	       sizeof(struct hlist_head) << zram->dedup_hash_bits);
+
 	/* zram devices sort of resembles non-rotational disks */
 	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, zram->disk->queue);
 
-	zram->mem_pool = xv_create_pool();
+	zram->mem_pool = zs_create_pool();
 	if (!zram->mem_pool) {
 		pr_err("Error creating memory pool\n");
 		ret = -ENOMEM;
@@ -717,7 +1495,21 @@ static void zram_slot_free_notify(struct block_device *bdev,
 	struct zram *zram;
 
 	zram = bdev->bd_disk->private_data;
+
+	/*
+	 * We are called under swap_lock and cannot sleep. If the table is
+	 * busy (I/O or compaction in progress), the slot is freed later
+	 * by zram_free_work(). A bitmap needs no allocation here, and lets
+	 * a write to the reused slot cancel the free.
+	 */
+	if (!down_write_trylock(&zram->lock)) {
+		set_bit(index, zram->pending_free);
+		queue_work(zram_wq, &zram->free_work);
+		return;
+	}
+
 	zram_free_page(zram, index);
+	up_write(&zram->lock);
 	zram_stat64_inc(zram, &zram->stats.notify_free);
 }
 
@@ -769,6 +1561,18 @@ static int create_device(struct zram *zram, int device_id)
 	 */
 	zram_set_disksize(zram, zram_default_disksize_bytes());
 
+	/* One compression stream per online CPU unless told otherwise */
+	zram->max_comp_streams = num_online_cpus();
+	zram->comp_alg = ZRAM_DEFAULT_COMP;
+	INIT_WORK(&zram->free_work, zram_free_work);
+
+#ifdef CONFIG_ZRAM_WRITEBACK
+	zram->idle_age = default_idle_age;
+	bio_list_init(&zram->deferred_bios);
+	spin_lock_init(&zram->deferred_lock);
+	INIT_WORK(&zram->deferred_work, zram_deferred_work);
+#endif
+
 	/*
 	 * To ensure that we always get PAGE_SIZE aligned
 	 * and n*PAGE_SIZED sized I/O requests.
@@ -827,11 +1631,33 @@ static int __init zram_init(void)
 		goto out;
 	}
 
+	zram_entry_cache = kmem_cache_create("zram_entry",
+				sizeof(struct zram_entry), 0, 0, NULL);
+	if (!zram_entry_cache) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	zram_page_pool = mempool_create_page_pool(ZRAM_BOUNCE_PAGES, 0);
+	if (!zram_page_pool) {
+		kmem_cache_destroy(zram_entry_cache);
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	zram_wq = create_singlethread_workqueue("zram");
+	if (!zram_wq) {
+		mempool_destroy(zram_page_pool);
+		kmem_cache_destroy(zram_entry_cache);
+		ret = -ENOMEM;
+		goto out;
+	}
+
 	zram_major = register_blkdev(0, "zram");
 	if (zram_major <= 0) {
 		pr_warning("Unable to get major number\n");
 		ret = -EBUSY;
-		goto out;
+		goto free_cache;
 	}
 
 	/* Allocate the device array and initialize each one */
@@ -856,6 +1682,10 @@ free_devices:
 	kfree(devices);
 unregister:
 	unregister_blkdev(zram_major, "zram");
+free_cache:
+	destroy_workqueue(zram_wq);
+	mempool_destroy(zram_page_pool);
+	kmem_cache_destroy(zram_entry_cache);
 out:
 	return ret;
 }
@@ -871,11 +1701,18 @@ static void __exit zram_exit(void)
 		destroy_device(zram);
 		if (zram->init_done)
 			zram_reset_device(zram);
+#ifdef CONFIG_ZRAM_WRITEBACK
+		/* backing_dev may be set on a device that was never used */
+		zram_reset_bdev(zram);
+#endif
 	}
 
 	unregister_blkdev(zram_major, "zram");
 
 	kfree(devices);
+	destroy_workqueue(zram_wq);
+	mempool_destroy(zram_page_pool);
+	kmem_cache_destroy(zram_entry_cache);
 	pr_debug("Cleanup done!\n");
 }
 
@@ -17,8 +17,13 @@
 
 #include <linux/spinlock.h>
 #include <linux/mutex.h>
+#include <linux/list.h>
+#include <linux/bio.h>
+#include <linux/workqueue.h>
+#include <asm/atomic.h>
 
-#include "xvmalloc.h"
+#include "zsmalloc.h"
+#include "zcomp.h"
 
 /*
  * Some arbitrary value. This is just to catch
@@ -26,16 +31,16 @@
  */
 static const unsigned max_num_devices = 32;
 
+struct zram_entry;
+
 /*
  * Stored at beginning of each compressed object.
  *
- * It stores back-reference to table entry which points to this
+ * It stores back-reference to the entry which points to this
  * object. This is required to support memory defragmentation.
  */
 struct zobj_header {
-#if 0
-	u32 table_idx;
-#endif
+	struct zram_entry *entry;
 };
 
 /*-- Configurable parameters */
@@ -51,10 +56,16 @@ static const size_t max_zpage_size = PAGE_SIZE / 4 * 3;
 
 /*
  * NOTE: max_zpage_size must be less than or equal to:
- *   XV_MAX_ALLOC_SIZE - sizeof(struct zobj_header)
- * otherwise, xv_malloc() would always return failure.
+ *   ZS_MAX_ALLOC_SIZE - sizeof(struct zobj_header)
+ * otherwise, zs_malloc() would always return failure.
  */
 
+/*
+ * Pages not accessed for this many seconds are written back by
+ * "echo idle > writeback", unless changed through idle_age.
+ */
+static const unsigned default_idle_age = 60 * 60;
+
 /*-- End of configurable params */
 
 #define SECTOR_SHIFT		9
@@ -74,19 +85,80 @@ enum zram_pageflags {
 	/* Page consists entirely of zeros */
 	ZRAM_ZERO,
 
+	/* Page is one word repeated: table[page_no].element */
+	ZRAM_SAME,
+
+	/* Page lives on backing_dev, in block table[page_no].blk */
+	ZRAM_WB,
+
+	/* Page is being written to backing_dev */
+	ZRAM_UNDER_WB,
+
 	__NR_ZRAM_PAGEFLAGS,
 };
 
+/*
+ * The top bits of table[page_no].flags hold the id (enum zcomp_alg) of
+ * the algorithm that compressed the object, so that pages stored before
+ * comp_algorithm was changed can still be decompressed.
+ */
+#define ZRAM_COMP_SHIFT		6
+#define ZRAM_COMP_MASK		(3 << ZRAM_COMP_SHIFT)
+
+/* Algorithm used by a device unless changed through comp_algorithm */
+#if defined(CONFIG_ZRAM_SNAPPY)
+#define ZRAM_DEFAULT_COMP	ZCOMP_SNAPPY
+#elif defined(CONFIG_ZRAM_DEFLATE)
+#define ZRAM_DEFAULT_COMP	ZCOMP_DEFLATE
+#else
+#define ZRAM_DEFAULT_COMP	ZCOMP_LZO
+#endif
+
 /*-- Data structures */
 
+/*
+ * A stored object. Pages with identical contents share one entry: it is
+ * found through its checksum in zram->dedup_hash and freed when the last
+ * table entry pointing to it goes away.
+ */
+struct zram_entry {
+	struct hlist_node node;	/* in zram->dedup_hash */
+	unsigned long handle;	/* zsmalloc handle */
+	atomic_t refcount;	/* no. of table entries pointing here */
+	u32 checksum;		/* of the uncompressed page */
+	u16 size;		/* compressed size, or PAGE_SIZE if uncompressed */
+	u8 flags;		/* ZRAM_UNCOMPRESSED and algorithm bits */
+};
+
 /* Allocated for each disk page */
 struct table {
-	struct page *page;
-	u16 offset;
-	u8 count;	/* object ref count (not yet used) */
+	union {
+		struct zram_entry *entry;	/* NULL if nothing stored */
+		unsigned long element;		/* fill value of ZRAM_SAME pages */
+		unsigned long blk;		/* backing_dev block of ZRAM_WB pages */
+	};
+	u16 size;	/* compressed size, or PAGE_SIZE if uncompressed */
 	u8 flags;
+#ifdef CONFIG_ZRAM_WRITEBACK
+	u32 ac_time;	/* last access, in seconds of uptime */
+#endif
 } __attribute__((aligned(4)));
 
+/* Pages of a bio written with a single zram->lock acquisition */
+#define ZRAM_BATCH_PAGES	16
+
+/* Bounce pages kept for partial I/O, each request uses at most one */
+#define ZRAM_BOUNCE_PAGES	4
+
+/* Pages written to backing_dev with a single bio */
+#define ZRAM_WB_BATCH		32
+
+/* What zram_writeback() writes out */
+enum zram_wb_mode {
+	ZRAM_WB_HUGE,	/* incompressible pages */
+	ZRAM_WB_IDLE,	/* pages not accessed for idle_age seconds */
+};
+
 struct zram_stats {
 	u64 compr_size;		/* compressed size of pages stored */
 	u64 num_reads;		/* failed + successful */
@@ -95,20 +167,37 @@ struct zram_stats {
 	u64 failed_writes;	/* can happen when memory is too low */
 	u64 invalid_io;		/* non-page-aligned I/O requests */
 	u64 notify_free;	/* no. of swap slot free notifications */
+	u64 num_migrated;	/* no. of objects moved by compaction */
+	u64 pages_compacted;	/* no. of pages freed by compaction */
 	u32 pages_zero;		/* no. of zero filled pages */
+	u32 pages_same;		/* no. of other same filled pages */
+	u32 pages_dedup;	/* no. of pages sharing another's object */
+	u32 pages_wb;		/* no. of pages on backing_dev */
+	u64 num_wb_reads;	/* no. of pages read from backing_dev */
+	u64 num_wb_writes;	/* no. of pages written to backing_dev */
 	u32 pages_stored;	/* no. of pages currently stored */
 	u32 good_compress;	/* % of pages with compression ratio<=50% */
 	u32 pages_expand;	/* % of incompressible pages */
 };
 
 struct zram {
-	struct xv_pool *mem_pool;
-	void *compress_workmem;
-	void *compress_buffer;
+	struct zs_pool *mem_pool;
+	/* Stream pools, created when an algorithm is first selected */
+	struct zcomp *comps[ZCOMP_NR_ALGS];
+	int comp_alg;	/* algorithm used for new writes */
 	struct table *table;
+	/* Stored objects hashed by checksum, protected by lock */
+	struct hlist_head *dedup_hash;
+	unsigned int dedup_hash_bits;
 	spinlock_t stat64_lock;	/* protect 64-bit stats */
-        struct rw_semaphore lock; /* protect compression buffers and table
-                                   * against concurrent read and writes */
+	struct rw_semaphore lock; /* protect table against concurrent
+				   * read and writes */
+	/*
+	 * Swap slots freed while the table was busy, by page index. Bits
+	 * are set without the lock and cleared with it held for writing.
+	 */
+	unsigned long *pending_free;
+	struct work_struct free_work;
 	struct request_queue *queue;
 	struct gendisk *disk;
 	int init_done;
@@ -119,6 +208,20 @@ struct zram {
 	 * we can store in a disk.
 	 */
 	u64 disksize;	/* bytes */
+	/* Number of concurrent compression streams (set before init) */
+	int max_comp_streams;
+#ifdef CONFIG_ZRAM_WRITEBACK
+	/* Device receiving written back pages (set before init) */
+	struct block_device *backing_bdev;
+	char *backing_dev_path;
+	unsigned long nr_blocks;	/* PAGE_SIZE blocks on backing_bdev */
+	unsigned long *block_bitmap;	/* blocks in use */
+	u32 idle_age;			/* seconds, for ZRAM_WB_IDLE */
+	/* bios that must wait for backing_dev reads, see zram_make_request */
+	struct bio_list deferred_bios;
+	spinlock_t deferred_lock;
+	struct work_struct deferred_work;
+#endif
 
 	struct zram_stats stats;
 };
@@ -131,5 +234,10 @@ extern struct attribute_group zram_disk_attr_group;
 
 extern int zram_init_device(struct zram *zram);
 extern void zram_reset_device(struct zram *zram);
+extern void zram_compact(struct zram *zram);
+#ifdef CONFIG_ZRAM_WRITEBACK
+extern int zram_set_backing_dev(struct zram *zram, const char *path);
+extern int zram_writeback(struct zram *zram, enum zram_wb_mode mode);
+#endif
 
 #endif
@@ -0,0 +1,507 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ *
+ * Size-class allocator for compressed pages. Objects of a class are
+ * packed into zspages (groups of 0-order pages) and identified by an
+ * opaque handle. Unlike xvmalloc, objects can be relocated: zs_compact()
+ * moves objects out of sparsely used zspages and frees them, reporting
+ * every move to the owner so it can update its handles.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/bitops.h>
+#include <linux/errno.h>
+#include <linux/highmem.h>
+#include <linux/init.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#include "zsmalloc.h"
+#include "zsmalloc_int.h"
+
+static void stat_add(u64 *value, u64 inc)
+{
+	*value = *value + inc;
+}
+
+static void stat_sub(u64 *value, u64 dec)
+{
+	*value = *value - dec;
+}
+
+static int get_size_class_index(size_t size)
+{
+	if (size < ZS_MIN_ALLOC_SIZE)
+		size = ZS_MIN_ALLOC_SIZE;
+
+	return DIV_ROUND_UP(size - ZS_MIN_ALLOC_SIZE, ZS_SIZE_CLASS_DELTA);
+}
+
+/*
+ * Pick the number of pages per zspage (1..ZS_MAX_PAGES_PER_ZSPAGE) that
+ * wastes the smallest fraction of the zspage for objects of @size.
+ */
+static int get_pages_per_zspage(u32 size)
+{
+	int i, max_usedpc = 0, max_usedpc_order = 1;
+
+	for (i = 1; i <= ZS_MAX_PAGES_PER_ZSPAGE; i++) {
+		int zspage_size = i * PAGE_SIZE;
+		int waste = zspage_size % size;
+		int usedpc = (zspage_size - waste) * 100 / zspage_size;
+
+		if (usedpc > max_usedpc) {
+			max_usedpc = usedpc;
+			max_usedpc_order = i;
+		}
+	}
+
+	return max_usedpc_order;
+}
+
+static unsigned long obj_to_handle(struct zspage *zspage, unsigned int idx)
+{
+	unsigned long pfn = page_to_pfn(zspage->pages[0]);
+
+	return (pfn << (ZS_OBJ_INDEX_BITS + 1)) | (idx << 1) | ZS_HANDLE_TAG;
+}
+
+static struct zspage *handle_to_obj(unsigned long handle, unsigned int *idx)
+{
+	struct page *page;
+
+	*idx = (handle >> 1) & ZS_OBJ_INDEX_MASK;
+	page = pfn_to_page(handle >> (ZS_OBJ_INDEX_BITS + 1));
+
+	return (struct zspage *)page_private(page);
+}
+
+static struct zspage *alloc_zspage(struct size_class *class, u16 class_idx,
+				gfp_t flags)
+{
+	int i;
+	struct zspage *zspage;
+
+	zspage = kzalloc(sizeof(*zspage), flags & ~__GFP_HIGHMEM);
+	if (unlikely(!zspage))
+		return NULL;
+
+	for (i = 0; i < class->pages_per_zspage; i++) {
+		zspage->pages[i] = alloc_page(flags);
+		if (unlikely(!zspage->pages[i]))
+			goto fail;
+	}
+
+	set_page_private(zspage->pages[0], (unsigned long)zspage);
+	zspage->class_idx = class_idx;
+	INIT_LIST_HEAD(&zspage->list);
+
+	return zspage;
+
+fail:
+	while (i--)
+		__free_page(zspage->pages[i]);
+	kfree(zspage);
+	return NULL;
+}
+
+static void free_zspage(struct size_class *class, struct zspage *zspage)
+{
+	int i;
+
+	set_page_private(zspage->pages[0], 0);
+	for (i = 0; i < class->pages_per_zspage; i++)
+		__free_page(zspage->pages[i]);
+	kfree(zspage);
+}
+
+/*
+ * Take a free object from @zspage, which must have one.
+ * Called with pool->lock held.
+ */
+static unsigned long obj_alloc(struct size_class *class,
+				struct zspage *zspage)
+{
+	unsigned int idx;
+
+	idx = find_first_zero_bit(zspage->used, class->objs_per_zspage);
+	BUG_ON(idx >= class->objs_per_zspage);
+
+	__set_bit(idx, zspage->used);
+	if (++zspage->inuse == class->objs_per_zspage)
+		list_move(&zspage->list, &class->full);
+
+	return obj_to_handle(zspage, idx);
+}
+
+/*
+ * Release object @idx of @zspage, freeing the zspage once it is empty.
+ * Called with pool->lock held.
+ */
+static void obj_free(struct zs_pool *pool, struct size_class *class,
+			struct zspage *zspage, unsigned int idx)
+{
+	BUG_ON(!test_bit(idx, zspage->used));
+
+	__clear_bit(idx, zspage->used);
+	if (zspage->inuse-- == class->objs_per_zspage)
+		list_move(&zspage->list, &class->partial);
+
+	if (!zspage->inuse) {
+		list_del(&zspage->list);
+		free_zspage(class, zspage);
+		stat_sub(&pool->total_pages, class->pages_per_zspage);
+	}
+}
+
+/*
+ * Copy @len bytes between @buf and the object at @offset within it,
+ * one page of the zspage at a time.
+ */
+static void obj_copy(struct zs_pool *pool, unsigned long handle,
+			size_t offset, void *buf, size_t len, int write)
+{
+	unsigned int idx;
+	unsigned long off;
+	struct zspage *zspage;
+	struct size_class *class;
+
+	zspage = handle_to_obj(handle, &idx);
+	class = &pool->size_class[zspage->class_idx];
+	off = (unsigned long)idx * class->size + offset;
+
+	while (len) {
+		struct page *page = zspage->pages[off >> PAGE_SHIFT];
+		size_t pg_off = off & ~PAGE_MASK;
+		size_t n = min_t(size_t, len, PAGE_SIZE - pg_off);
+		unsigned char *addr;
+
+		addr = kmap_atomic(page, KM_USER1);
+		if (write)
+			memcpy(addr + pg_off, buf, n);
+		else
+			memcpy(buf, addr + pg_off, n);
+		kunmap_atomic(addr, KM_USER1);
+
+		buf += n;
+		off += n;
+		len -= n;
+	}
+}
+
+/**
+ * zs_create_pool - Create a memory pool.
+ *
+ * Returns the pool on success, NULL otherwise.
+ */
+struct zs_pool *zs_create_pool(void)
+{
+	int i;
+	struct zs_pool *pool;
+
+	pool = kzalloc(sizeof(*pool), GFP_KERNEL);
+	if (!pool)
+		return NULL;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->size_class[i];
+
+		class->size = ZS_MIN_ALLOC_SIZE + i * ZS_SIZE_CLASS_DELTA;
+		class->pages_per_zspage = get_pages_per_zspage(class->size);
+		class->objs_per_zspage = class->pages_per_zspage * PAGE_SIZE /
+					class->size;
+		INIT_LIST_HEAD(&class->partial);
+		INIT_LIST_HEAD(&class->full);
+	}
+
+	spin_lock_init(&pool->lock);
+
+	return pool;
+}
+EXPORT_SYMBOL_GPL(zs_create_pool);
+
+/**
+ * zs_destroy_pool - Free a pool and every object still allocated in it.
+ * @pool: pool to destroy
+ */
+void zs_destroy_pool(struct zs_pool *pool)
+{
+	int i;
+	struct zspage *zspage, *tmp;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->size_class[i];
+
+		list_for_each_entry_safe(zspage, tmp, &class->partial, list)
+			free_zspage(class, zspage);
+		list_for_each_entry_safe(zspage, tmp, &class->full, list)
+			free_zspage(class, zspage);
+	}
+
+	kfree(pool);
+}
+EXPORT_SYMBOL_GPL(zs_destroy_pool);
+
+/**
+ * zs_malloc - Allocate an object of given size from pool.
+ * @pool: pool to allocate from
+ * @size: size of object to allocate
+ * @flags: flags used if a new zspage has to be allocated
+ *
+ * Returns a handle to the object on success and 0 on failure.
+ * Allocation requests with size > ZS_MAX_ALLOC_SIZE will fail.
+ */
+unsigned long zs_malloc(struct zs_pool *pool, size_t size, gfp_t flags)
+{
+	int class_idx;
+	unsigned long handle;
+	struct size_class *class;
+	struct zspage *zspage;
+
+	if (unlikely(!size || size > ZS_MAX_ALLOC_SIZE))
+		return 0;
+
+	class_idx = get_size_class_index(size);
+	class = &pool->size_class[class_idx];
+
+	spin_lock(&pool->lock);
+	if (list_empty(&class->partial)) {
+		spin_unlock(&pool->lock);
+
+		zspage = alloc_zspage(class, class_idx, flags);
+		if (unlikely(!zspage))
+			return 0;
+
+		spin_lock(&pool->lock);
+		list_add(&zspage->list, &class->partial);
+		stat_add(&pool->total_pages, class->pages_per_zspage);
+	}
+
+	zspage = list_first_entry(&class->partial, struct zspage, list);
+	handle = obj_alloc(class, zspage);
+	spin_unlock(&pool->lock);
+
+	return handle;
+}
+EXPORT_SYMBOL_GPL(zs_malloc);
+
+/*
+ * Free object identified with handle.
+ */
+void zs_free(struct zs_pool *pool, unsigned long handle)
+{
+	unsigned int idx;
+	struct zspage *zspage;
+
+	if (unlikely(!handle))
+		return;
+
+	spin_lock(&pool->lock);
+	zspage = handle_to_obj(handle, &idx);
+	obj_free(pool, &pool->size_class[zspage->class_idx], zspage, idx);
+	spin_unlock(&pool->lock);
+}
+EXPORT_SYMBOL_GPL(zs_free);
+
+/**
+ * zs_map_object - Get a pointer to the contents of an object.
+ * @pool: pool the object belongs to
+ * @handle: handle returned by zs_malloc()
+ * @bounce: buffer of at least the object's class size
+ *
+ * If the object lies within a single page it is mapped in place with
+ * kmap_atomic(KM_USER1). If it straddles two pages its contents are
+ * copied to @bounce, which is returned instead. The mapping is read-only
+ * in the latter case: use zs_write_object() to modify objects.
+ * Must be paired with zs_unmap_object().
+ */
+void *zs_map_object(struct zs_pool *pool, unsigned long handle,
+			void *bounce)
+{
+	unsigned int idx;
+	unsigned long off;
+	struct zspage *zspage;
+	struct size_class *class;
+	unsigned char *addr;
+
+	zspage = handle_to_obj(handle, &idx);
+	class = &pool->size_class[zspage->class_idx];
+	off = (unsigned long)idx * class->size;
+
+	if ((off & ~PAGE_MASK) + class->size <= PAGE_SIZE) {
+		addr = kmap_atomic(zspage->pages[off >> PAGE_SHIFT], KM_USER1);
+		return addr + (off & ~PAGE_MASK);
+	}
+
+	obj_copy(pool, handle, 0, bounce, class->size, 0);
+	return bounce;
+}
+EXPORT_SYMBOL_GPL(zs_map_object);
+
+void zs_unmap_object(struct zs_pool *pool, void *addr, void *bounce)
+{
+	if (addr != bounce)
+		kunmap_atomic(addr, KM_USER1);
+}
+EXPORT_SYMBOL_GPL(zs_unmap_object);
+
+/*
+ * Copy @len bytes from @src to the object, starting @offset bytes into it.
+ */
+void zs_write_object(struct zs_pool *pool, unsigned long handle,
+			size_t offset, const void *src, size_t len)
+{
+	obj_copy(pool, handle, offset, (void *)src, len, 1);
+}
+EXPORT_SYMBOL_GPL(zs_write_object);
+
+/*
+ * Move every object of @src into other partial zspages of the class.
+ * Returns 0 if @src was emptied (and freed), -ENOSPC otherwise.
+ * Called with pool->lock held.
+ */
+static int zs_compact_zspage(struct zs_pool *pool, struct size_class *class,
+			struct zspage *src, void *buf,
+			zs_migrate_fn migrate, void *priv)
+{
+	unsigned int idx;
+	struct zspage *dst;
+	unsigned long old_handle, new_handle;
+
+	/* Keep src off the partial list so we never move into it */
+	list_del_init(&src->list);
+
+	for (idx = 0; idx < class->objs_per_zspage; idx++) {
+		if (!test_bit(idx, src->used))
+			continue;
+
+		if (list_empty(&class->partial)) {
+			list_add_tail(&src->list, &class->partial);
+			return -ENOSPC;
+		}
+
+		/* Fill the fullest zspage first: it was sorted to the head */
+		dst = list_first_entry(&class->partial, struct zspage, list);
+		old_handle = obj_to_handle(src, idx);
+		new_handle = obj_alloc(class, dst);
+
+		obj_copy(pool, old_handle, 0, buf, class->size, 0);
+		obj_copy(pool, new_handle, 0, buf, class->size, 1);
+		migrate(priv, buf, old_handle, new_handle);
+
+		__clear_bit(idx, src->used);
+		src->inuse--;
+	}
+
+	free_zspage(class, src);
+	stat_sub(&pool->total_pages, class->pages_per_zspage);
+
+	return 0;
+}
+
+/*
+ * Sort the partial list of @class by decreasing use, so that compaction
+ * drains the emptiest zspages (at the tail) into the fullest ones.
+ */
+static void zs_sort_partial(struct size_class *class)
+{
+	LIST_HEAD(sorted);
+	struct zspage *zspage, *pos;
+
+	while (!list_empty(&class->partial)) {
+		zspage = list_first_entry(&class->partial, struct zspage, list);
+		list_del(&zspage->list);
+
+		list_for_each_entry(pos, &sorted, list) {
+			if (pos->inuse < zspage->inuse)
+				break;
+		}
+		list_add_tail(&zspage->list, &pos->list);
+	}
+
+	list_splice(&sorted, &class->partial);
+}
+
+/**
+ * zs_compact - Relocate objects to free sparsely used zspages.
+ * @pool: pool to compact
+ * @buf: a page to copy objects through
+ * @migrate: called for every object moved
+ * @priv: passed to @migrate
+ *
+ * The caller must make sure no object of the pool is accessed or freed
+ * while this runs, since handles change under it. Whatever it does to
+ * ensure that is likely to block I/O, so nothing is allocated here: @buf
+ * must be allocated beforehand.
+ *
+ * Returns the number of pages freed.
+ */
+unsigned long zs_compact(struct zs_pool *pool, void *buf,
+			zs_migrate_fn migrate, void *priv)
+{
+	int i;
+	unsigned long freed = 0;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->size_class[i];
+		struct zspage *src;
+		unsigned long total_free = 0;
+
+		/* Single-object zspages are always full: nothing to gain */
+		if (class->objs_per_zspage == 1)
+			continue;
+
+		spin_lock(&pool->lock);
+		zs_sort_partial(class);
+
+		list_for_each_entry(src, &class->partial, list)
+			total_free += class->objs_per_zspage - src->inuse;
+
+		while (!list_empty(&class->partial)) {
+			unsigned long src_free;
+
+			src = list_entry(class->partial.prev,
+					struct zspage, list);
+			src_free = class->objs_per_zspage - src->inuse;
+
+			/* Stop unless the other zspages can absorb all of src */
+			if (total_free - src_free < src->inuse)
+				break;
+
+			if (zs_compact_zspage(pool, class, src, buf,
+					      migrate, priv))
+				break;
+
+			/* src's slots are gone, its objects used others' */
+			total_free -= class->objs_per_zspage;
+			freed += class->pages_per_zspage;
+		}
+		spin_unlock(&pool->lock);
+	}
+
+	return freed;
+}
+EXPORT_SYMBOL_GPL(zs_compact);
+
+/*
+ * Returns the number of bytes of memory used by the pool.
+ */
+u64 zs_get_total_size_bytes(struct zs_pool *pool)
+{
+	u64 ret;
+
+	spin_lock(&pool->lock);
+	ret = pool->total_pages << PAGE_SHIFT;
+	spin_unlock(&pool->lock);
+
+	return ret;
+}
+EXPORT_SYMBOL_GPL(zs_get_total_size_bytes);
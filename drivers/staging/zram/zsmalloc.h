@@ -0,0 +1,43 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _ZS_MALLOC_H_
+#define _ZS_MALLOC_H_
+
+#include <linux/types.h>
+
+struct zs_pool;
+
+/*
+ * Called by zs_compact() for every object it relocates, after the object
+ * has been copied to @new_handle and before @old_handle is freed. @obj
+ * points to a copy of the object contents.
+ */
+typedef void (*zs_migrate_fn)(void *priv, void *obj,
+			unsigned long old_handle, unsigned long new_handle);
+
+struct zs_pool *zs_create_pool(void);
+void zs_destroy_pool(struct zs_pool *pool);
+
+unsigned long zs_malloc(struct zs_pool *pool, size_t size, gfp_t flags);
+void zs_free(struct zs_pool *pool, unsigned long handle);
+
+void *zs_map_object(struct zs_pool *pool, unsigned long handle,
+			void *bounce);
+void zs_unmap_object(struct zs_pool *pool, void *addr, void *bounce);
+void zs_write_object(struct zs_pool *pool, unsigned long handle,
+			size_t offset, const void *src, size_t len);
+
+unsigned long zs_compact(struct zs_pool *pool, void *buf,
+			zs_migrate_fn migrate, void *priv);
+
+u64 zs_get_total_size_bytes(struct zs_pool *pool);
+
+#endif
@@ -0,0 +1,80 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _ZS_MALLOC_INT_H_
+#define _ZS_MALLOC_INT_H_
+
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/types.h>
+
+/* User configurable params */
+
+/*
+ * A zspage is a group of up to this many 0-order pages that are carved
+ * into objects of a single size class. Objects may straddle the boundary
+ * between two pages of a zspage, which is what keeps the tail waste low
+ * for classes that do not divide PAGE_SIZE.
+ */
+#define ZS_MAX_PAGES_PER_ZSPAGE	4
+
+/* Must be a multiple of ZS_SIZE_CLASS_DELTA */
+#define ZS_MIN_ALLOC_SIZE	32
+#define ZS_MAX_ALLOC_SIZE	PAGE_SIZE
+
+/* Granularity of size classes */
+#define ZS_SIZE_CLASS_DELTA	(PAGE_SIZE >> 8)
+
+/*-- End of user params */
+
+#define ZS_SIZE_CLASSES \
+	((ZS_MAX_ALLOC_SIZE - ZS_MIN_ALLOC_SIZE) / ZS_SIZE_CLASS_DELTA + 1)
+
+#define ZS_MAX_OBJS_PER_ZSPAGE \
+	(ZS_MAX_PAGES_PER_ZSPAGE * PAGE_SIZE / ZS_MIN_ALLOC_SIZE)
+
+/*
+ * A handle is <pfn of first zspage page, object index, 1>. The low bit
+ * is always set so that a valid handle is never 0. The index needs
+ * log2(ZS_MAX_OBJS_PER_ZSPAGE) bits: PAGE_SHIFT + 2 - 5.
+ */
+#define ZS_OBJ_INDEX_BITS	(PAGE_SHIFT - 3)
+#define ZS_OBJ_INDEX_MASK	((1UL << ZS_OBJ_INDEX_BITS) - 1)
+#define ZS_HANDLE_TAG		1UL
+
+struct zspage {
+	/* entry in size_class->partial or size_class->full */
+	struct list_head list;
+	struct page *pages[ZS_MAX_PAGES_PER_ZSPAGE];
+	u16 class_idx;
+	u16 inuse;		/* objects allocated */
+	/* bit set for each allocated object */
+	unsigned long used[BITS_TO_LONGS(ZS_MAX_OBJS_PER_ZSPAGE)];
+};
+
+struct size_class {
+	u32 size;		/* object size, bytes */
+	u16 pages_per_zspage;
+	u16 objs_per_zspage;
+	/* zspages with at least one free object */
+	struct list_head partial;
+	/* zspages with no free object */
+	struct list_head full;
+};
+
+struct zs_pool {
+	struct size_class size_class[ZS_SIZE_CLASSES];
+
+	u64 total_pages;	/* stats */
+	spinlock_t lock;
+};
+
+#endif
@@ -482,6 +482,8 @@ static int yaffs_get_erased_chunks(struct yaffs_dev *dev)
 
 	if (dev->alloc_block > 0)
 		n += (dev->param.chunks_per_block - dev->alloc_page);
+	if (dev->alt_alloc_block > 0)
+		n += (dev->param.chunks_per_block - dev->alt_alloc_page);
 
 	return n;
 
@@ -504,6 +506,124 @@ void yaffs_skip_rest_of_block(struct yaffs_dev *dev)
 	}
 }
 
+/*
+ * Hot and cold allocation heads.
+ * With hot_cold_alloc, chunks copied by gc go to a block of their own (the
+ * cold head) so that data which has survived a gc is not mixed again with
+ * data that is still being rewritten. The head in use lives in
+ * dev->alloc_block, alloc_page and sum_tags, the other one is parked in
+ * dev->alt_alloc_xxx.
+ *
+ * The scan keeps the copy of a chunk in the block with the highest sequence
+ * number, and the two heads do not fill in sequence number order. So a
+ * head must never receive a chunk that has a copy in a newer block: gc
+ * closes the head it copies into when the victim is newer, and the first
+ * write for an object after gc has put some of it in a cold block
+ * (obj->cold_seq) closes the hot head if that is older.
+ */
+static void yaffs_swap_alloc_heads(struct yaffs_dev *dev)
+{
+	int block = dev->alloc_block;
+	u32 page = dev->alloc_page;
+	struct yaffs_summary_tags *sum_tags = dev->sum_tags;
+
+	dev->alloc_block = dev->alt_alloc_block;
+	dev->alloc_page = dev->alt_alloc_page;
+	dev->sum_tags = dev->alt_sum_tags;
+	dev->alt_alloc_block = block;
+	dev->alt_alloc_page = page;
+	dev->alt_sum_tags = sum_tags;
+	dev->alloc_head_cold = !dev->alloc_head_cold;
+}
+
+static void yaffs_select_alloc_head(struct yaffs_dev *dev, int cold)
+{
+	if (cold) {
+		if (!dev->param.hot_cold_alloc || !dev->param.is_yaffs2)
+			return;
+		/* Don't open a second block when short of erased blocks */
+		if (dev->alt_alloc_block < 0 && dev->n_erased_blocks < 2)
+			return;
+	}
+	if (cold != dev->alloc_head_cold)
+		yaffs_swap_alloc_heads(dev);
+}
+
+/* Don't write into the current head a chunk from a block newer than it. */
+static void yaffs_alloc_after_seq(struct yaffs_dev *dev, u32 seq)
+{
+	if (dev->alloc_block > 0 &&
+	    yaffs_get_block_info(dev, dev->alloc_block)->seq_number < seq)
+		yaffs_skip_rest_of_block(dev);
+}
+
+/*
+ * Called before a write for obj. Only the first write after gc made the
+ * object cold needs to look at the hot head: any hot block opened after
+ * that is newer than obj->cold_seq.
+ */
+static void yaffs_alloc_after_obj(struct yaffs_obj *obj)
+{
+	if (!obj || !obj->cold_seq || obj->my_dev->alloc_head_cold)
+		return;
+
+	yaffs_alloc_after_seq(obj->my_dev, obj->cold_seq);
+	obj->cold_seq = 0;
+}
+
+/*
+ * yaffs_cold_head_dirty_before()
+ * Is the cold head open in a block older than seq that has had chunks
+ * discarded? The oldest dirty block search only counts full blocks, so
+ * such a block is missed by it until the cold head is closed.
+ */
+int yaffs_cold_head_dirty_before(struct yaffs_dev *dev, u32 seq)
+{
+	struct yaffs_block_info *bi;
+	int block = dev->alloc_head_cold ?
+			dev->alloc_block : dev->alt_alloc_block;
+	u32 pages = dev->alloc_head_cold ?
+			dev->alloc_page : dev->alt_alloc_page;
+
+	if (block <= 0)
+		return 0;
+
+	bi = yaffs_get_block_info(dev, block);
+	return bi->seq_number < seq &&
+	       (u32)(bi->pages_in_use - bi->soft_del_pages) < pages;
+}
+
+/*
+ * yaffs_close_cold_head()
+ * Close the cold head if its block is older than seq, so that the next gc
+ * copy starts a new block. Used before writing a checkpoint, which only
+ * records one allocation block, and before collecting a block holding a
+ * shrink header.
+ */
+void yaffs_close_cold_head(struct yaffs_dev *dev, u32 seq)
+{
+	struct yaffs_block_info *bi;
+	int block = dev->alloc_head_cold ?
+			dev->alloc_block : dev->alt_alloc_block;
+
+	if (block <= 0)
+		return;
+
+	bi = yaffs_get_block_info(dev, block);
+	if (bi->seq_number >= seq)
+		return;
+
+	if (dev->alloc_head_cold) {
+		yaffs_skip_rest_of_block(dev);
+	} else {
+		if (bi->block_state == YAFFS_BLOCK_STATE_ALLOCATING)
+			bi->block_state = YAFFS_BLOCK_STATE_FULL;
+		dev->alt_alloc_block = -1;
+	}
+	/* It now counts when looking for the oldest dirty block */
+	yaffs2_clear_oldest_dirty_seq(dev, NULL);
+}
+
 static int yaffs_write_new_chunk(struct yaffs_dev *dev,
 				 const u8 *data,
 				 struct yaffs_ext_tags *tags, int use_reserver)
@@ -593,6 +713,8 @@ static int yaffs_write_new_chunk(struct yaffs_dev *dev,
 
 	if (!write_ok)
 		chunk = -1;
+	else if (!dev->gc_disable)
+		dev->n_user_chunks++;
 
 	if (attempts > 1) {
 		yaffs_trace(YAFFS_TRACE_ERROR,
@@ -1364,20 +1486,74 @@ static int yaffs_change_obj_name(struct yaffs_obj *obj,
  *   In Linux, the page cache provides read buffering and the short op cache
  *   provides write buffering.
  *
- *   There are a small number (~10) of cache chunks per device so that we don't
- *   need a very intelligent search.
+ *   Cache chunks are found through a hash of (object, chunk id). Unused ones
+ *   sit on dev->cache_free, the others on one of two LRU lists, clean and
+ *   dirty, least recently used first. A chunk is taken from the free list,
+ *   else from the clean LRU, and only when everything is dirty is the least
+ *   recently used dirty chunk written out. The background thread writes out
+ *   dirty chunks that have gone idle (yaffs_cache_writeback()) so that this
+ *   is rare.
  */
 
+static inline int yaffs_cache_hash_fn(struct yaffs_dev *dev,
+				      const struct yaffs_obj *obj, int chunk_id)
+{
+	return (obj->obj_id * 31 + chunk_id) & (dev->cache_hash_size - 1);
+}
+
+/* Take the chunk out of the index and make it available for reuse. */
+static void yaffs_cache_free(struct yaffs_dev *dev, struct yaffs_cache *cache)
+{
+	if (cache->dirty)
+		dev->n_dirty_caches--;
+	cache->dirty = 0;
+	cache->object = NULL;
+	list_del_init(&cache->hash_link);
+	list_move(&cache->lru, &dev->cache_free);
+}
+
+/* Index a chunk grabbed with yaffs_grab_chunk_cache() for obj:chunk_id. */
+static void yaffs_cache_assign(struct yaffs_dev *dev, struct yaffs_cache *cache,
+			       struct yaffs_obj *obj, int chunk_id)
+{
+	cache->object = obj;
+	cache->chunk_id = chunk_id;
+	cache->dirty = 0;
+	cache->locked = 0;
+	cache->n_bytes = 0;
+	list_add(&cache->hash_link,
+		 &dev->cache_hash[yaffs_cache_hash_fn(dev, obj, chunk_id)]);
+	list_move_tail(&cache->lru, &dev->cache_clean);
+}
+
+/*
+ * Write a dirty chunk to NAND. It stays in the cache, clean.
+ * Returns the result of yaffs_wr_data_obj().
+ */
+static int yaffs_cache_write_out(struct yaffs_dev *dev,
+				 struct yaffs_cache *cache)
+{
+	int chunk_written;
+
+	chunk_written = yaffs_wr_data_obj(cache->object, cache->chunk_id,
+					  cache->data, cache->n_bytes, 1);
+	cache->dirty = 0;
+	dev->n_dirty_caches--;
+	list_move_tail(&cache->lru, &dev->cache_clean);
+
+	return chunk_written;
+}
+
 static int yaffs_obj_cache_dirty(struct yaffs_obj *obj)
 {
 	struct yaffs_dev *dev = obj->my_dev;
-	int i;
 	struct yaffs_cache *cache;
-	int n_caches = obj->my_dev->param.n_caches;
 
-	for (i = 0; i < n_caches; i++) {
-		cache = &dev->cache[i];
-		if (cache->object == obj && cache->dirty)
+	if (dev->param.n_caches < 1)
+		return 0;
+
+	list_for_each_entry(cache, &dev->cache_dirty, lru) {
+		if (cache->object == obj)
 			return 1;
 	}
 
@@ -1387,42 +1563,29 @@ static int yaffs_obj_cache_dirty(struct yaffs_obj *obj)
 static void yaffs_flush_file_cache(struct yaffs_obj *obj)
 {
 	struct yaffs_dev *dev = obj->my_dev;
-	int lowest = -99;	/* Stop compiler whining. */
-	int i;
-	struct yaffs_cache *cache;
+	struct yaffs_cache *cache, *lowest;
 	int chunk_written = 0;
-	int n_caches = obj->my_dev->param.n_caches;
 
-	if (n_caches < 1)
+	if (dev->param.n_caches < 1)
 		return;
 	do {
-		cache = NULL;
+		lowest = NULL;
 
 		/* Find the lowest dirty chunk for this object */
-		for (i = 0; i < n_caches; i++) {
-			if (dev->cache[i].object == obj &&
-			    dev->cache[i].dirty) {
-				if (!cache ||
-				    dev->cache[i].chunk_id < lowest) {
-					cache = &dev->cache[i];
-					lowest = cache->chunk_id;
-				}
-			}
+		list_for_each_entry(cache, &dev->cache_dirty, lru) {
+			if (cache->object == obj &&
+			    (!lowest || cache->chunk_id < lowest->chunk_id))
+				lowest = cache;
 		}
 
-		if (cache && !cache->locked) {
+		if (lowest && !lowest->locked) {
 			/* Write it out and free it up */
-			chunk_written =
-			    yaffs_wr_data_obj(cache->object,
-					      cache->chunk_id,
-					      cache->data,
-					      cache->n_bytes, 1);
-			cache->dirty = 0;
-			cache->object = NULL;
+			chunk_written = yaffs_cache_write_out(dev, lowest);
+			yaffs_cache_free(dev, lowest);
 		}
-	} while (cache && chunk_written > 0);
+	} while (lowest && chunk_written > 0);
 
-	if (cache)
+	if (lowest)
 		/* Hoosterman, disk full while writing cache out. */
 		yaffs_trace(YAFFS_TRACE_ERROR,
 			"yaffs tragedy: no space during cache write");
@@ -1435,91 +1598,113 @@ static void yaffs_flush_file_cache(struct yaffs_obj *obj)
 
 void yaffs_flush_whole_cache(struct yaffs_dev *dev)
 {
-	struct yaffs_obj *obj;
-	int n_caches = dev->param.n_caches;
-	int i;
+	struct yaffs_cache *cache;
 
-	/* Find a dirty object in the cache and flush it...
-	 * until there are no further dirty objects.
-	 */
-	do {
-		obj = NULL;
-		for (i = 0; i < n_caches && !obj; i++) {
-			if (dev->cache[i].object && dev->cache[i].dirty)
-				obj = dev->cache[i].object;
-		}
-		if (obj)
-			yaffs_flush_file_cache(obj);
-	} while (obj);
+	if (dev->param.n_caches < 1)
+		return;
 
+	/* Flush the object of the first dirty chunk...
+	 * until there are no further dirty chunks.
+	 */
+	while (!list_empty(&dev->cache_dirty)) {
+		cache = list_first_entry(&dev->cache_dirty,
+					 struct yaffs_cache, lru);
+		yaffs_flush_file_cache(cache->object);
+		/* Give up if it could not be written */
+		if (cache->dirty)
+			break;
+	}
 }
 
-/* Grab us a cache chunk for use.
- * First look for an empty one.
- * Then look for the least recently used non-dirty one.
- * Then look for the least recently used dirty one...., flush and look again.
+/*
+ * yaffs_cache_writeback(dev)
+ * Write out the dirty chunks that have not been used since the previous
+ * call, oldest first. Called periodically by the background thread.
+ * Returns the number of chunks written.
+ */
+/*
+ * The oldest unlocked dirty chunk not used since 'mark', or NULL. The dirty
+ * list is in use order, so the search stops at the first newer chunk.
  */
-static struct yaffs_cache *yaffs_grab_chunk_worker(struct yaffs_dev *dev)
+static struct yaffs_cache *yaffs_cache_wb_next(struct yaffs_dev *dev, int mark)
 {
-	int i;
+	struct yaffs_cache *cache;
 
-	if (dev->param.n_caches > 0) {
-		for (i = 0; i < dev->param.n_caches; i++) {
-			if (!dev->cache[i].object)
-				return &dev->cache[i];
-		}
+	list_for_each_entry(cache, &dev->cache_dirty, lru) {
+		if (cache->last_use > mark)
+			return NULL;
+		if (!cache->locked)
+			return cache;
 	}
+
 	return NULL;
 }
 
+int yaffs_cache_writeback(struct yaffs_dev *dev)
+{
+	struct yaffs_cache *cache;
+	int mark = dev->cache_wb_mark;
+	int written = 0;
+
+	if (dev->param.n_caches < 1 || dev->read_only)
+		return 0;
+
+	dev->cache_wb_mark = dev->cache_last_use;
+
+	/*
+	 * Writing a chunk out may run gc, which can invalidate other cached
+	 * chunks, so look the next one up afresh each time.
+	 */
+	while ((cache = yaffs_cache_wb_next(dev, mark)) != NULL) {
+		if (yaffs_cache_write_out(dev, cache) <= 0) {
+			yaffs_cache_free(dev, cache);
+			yaffs_trace(YAFFS_TRACE_ERROR,
+				"yaffs tragedy: no space during cache write");
+			break;
+		}
+		written++;
+	}
+	dev->cache_bg_writebacks += written;
+
+	return written;
+}
+
+/* Grab us a cache chunk for use.
+ * First look for an empty one.
+ * Then take the least recently used non-dirty one.
+ * Then write out the least recently used dirty one and take that.
+ */
 static struct yaffs_cache *yaffs_grab_chunk_cache(struct yaffs_dev *dev)
 {
 	struct yaffs_cache *cache;
-	struct yaffs_obj *the_obj;
-	int usage;
-	int i;
-	int pushout;
 
 	if (dev->param.n_caches < 1)
 		return NULL;
 
-	/* Try find a non-dirty one... */
-
-	cache = yaffs_grab_chunk_worker(dev);
-
-	if (!cache) {
-		/* They were all dirty, find the LRU object and flush
-		 * its cache, then  find again.
-		 * NB what's here is not very accurate,
-		 * we actually flush the object with the LRU chunk.
-		 */
+	if (!list_empty(&dev->cache_free))
+		return list_first_entry(&dev->cache_free,
+					struct yaffs_cache, lru);
 
-		/* With locking we can't assume we can use entry zero,
-		 * Set the_obj to a valid pointer for Coverity. */
-		the_obj = dev->cache[0].object;
-		usage = -1;
-		cache = NULL;
-		pushout = -1;
-
-		for (i = 0; i < dev->param.n_caches; i++) {
-			if (dev->cache[i].object &&
-			    !dev->cache[i].locked &&
-			    (dev->cache[i].last_use < usage ||
-			    !cache)) {
-				usage = dev->cache[i].last_use;
-				the_obj = dev->cache[i].object;
-				cache = &dev->cache[i];
-				pushout = i;
-			}
+	list_for_each_entry(cache, &dev->cache_clean, lru) {
+		if (!cache->locked) {
+			yaffs_cache_free(dev, cache);
+			return cache;
 		}
+	}
 
-		if (!cache || cache->dirty) {
-			/* Flush and try again */
-			yaffs_flush_file_cache(the_obj);
-			cache = yaffs_grab_chunk_worker(dev);
+	list_for_each_entry(cache, &dev->cache_dirty, lru) {
+		if (!cache->locked) {
+			if (yaffs_cache_write_out(dev, cache) <= 0)
+				/* Hoosterman, disk full while writing cache out. */
+				yaffs_trace(YAFFS_TRACE_ERROR,
+					"yaffs tragedy: no space during cache write");
+			dev->cache_sync_writebacks++;
+			yaffs_cache_free(dev, cache);
+			return cache;
 		}
 	}
-	return cache;
+
+	return NULL;
 }
 
 /* Find a cached chunk */
@@ -1527,17 +1712,18 @@ static struct yaffs_cache *yaffs_find_chunk_cache(const struct yaffs_obj *obj,
 						  int chunk_id)
 {
 	struct yaffs_dev *dev = obj->my_dev;
-	int i;
+	struct yaffs_cache *cache;
+	struct list_head *bucket;
 
 	if (dev->param.n_caches < 1)
 		return NULL;
 
-	for (i = 0; i < dev->param.n_caches; i++) {
-		if (dev->cache[i].object == obj &&
-		    dev->cache[i].chunk_id == chunk_id) {
+	bucket = &dev->cache_hash[yaffs_cache_hash_fn(dev, obj, chunk_id)];
+	list_for_each_entry(cache, bucket, hash_link) {
+		if (cache->object == obj && cache->chunk_id == chunk_id) {
 			dev->cache_hits++;
 
-			return &dev->cache[i];
+			return cache;
 		}
 	}
 	return NULL;
@@ -1547,24 +1733,30 @@ static struct yaffs_cache *yaffs_find_chunk_cache(const struct yaffs_obj *obj,
 static void yaffs_use_cache(struct yaffs_dev *dev, struct yaffs_cache *cache,
 			    int is_write)
 {
-	int i;
+	struct yaffs_cache *c;
 
 	if (dev->param.n_caches < 1)
 		return;
 
 	if (dev->cache_last_use < 0 ||
 		dev->cache_last_use > 100000000) {
-		/* Reset the cache usages */
-		for (i = 1; i < dev->param.n_caches; i++)
-			dev->cache[i].last_use = 0;
-
+		/* Reset the cache usages, keeping their order */
 		dev->cache_last_use = 0;
+		list_for_each_entry(c, &dev->cache_clean, lru)
+			c->last_use = 0;
+		list_for_each_entry(c, &dev->cache_dirty, lru)
+			c->last_use = ++dev->cache_last_use;
+		dev->cache_wb_mark = 0;
 	}
 	dev->cache_last_use++;
 	cache->last_use = dev->cache_last_use;
 
-	if (is_write)
+	if (is_write && !cache->dirty) {
 		cache->dirty = 1;
+		dev->n_dirty_caches++;
+	}
+	list_move_tail(&cache->lru,
+		       cache->dirty ? &dev->cache_dirty : &dev->cache_clean);
 }
 
 /* Invalidate a single cache page.
@@ -1579,7 +1771,7 @@ static void yaffs_invalidate_chunk_cache(struct yaffs_obj *object, int chunk_id)
 		cache = yaffs_find_chunk_cache(object, chunk_id);
 
 		if (cache)
-			cache->object = NULL;
+			yaffs_cache_free(object->my_dev, cache);
 	}
 }
 
@@ -1588,14 +1780,18 @@ static void yaffs_invalidate_chunk_cache(struct yaffs_obj *object, int chunk_id)
  */
 static void yaffs_invalidate_whole_cache(struct yaffs_obj *in)
 {
-	int i;
 	struct yaffs_dev *dev = in->my_dev;
+	struct yaffs_cache *cache, *next;
 
 	if (dev->param.n_caches > 0) {
 		/* Invalidate it. */
-		for (i = 0; i < dev->param.n_caches; i++) {
-			if (dev->cache[i].object == in)
-				dev->cache[i].object = NULL;
+		list_for_each_entry_safe(cache, next, &dev->cache_clean, lru) {
+			if (cache->object == in)
+				yaffs_cache_free(dev, cache);
+		}
+		list_for_each_entry_safe(cache, next, &dev->cache_dirty, lru) {
+			if (cache->object == in)
+				yaffs_cache_free(dev, cache);
 		}
 	}
 }
@@ -2269,6 +2465,7 @@ static int yaffs_init_blocks(struct yaffs_dev *dev)
 	dev->block_info = NULL;
 	dev->chunk_bits = NULL;
 	dev->alloc_block = -1;	/* force it to get a new one */
+	dev->alt_alloc_block = -1;
 
 	/* If the first allocation strategy fails, thry the alternate one */
 	dev->block_info =
@@ -2514,6 +2711,12 @@ static inline int yaffs_gc_process_chunk(struct yaffs_dev *dev,
 		if (new_chunk < 0) {
 			ret_val = YAFFS_FAIL;
 		} else {
+			if (dev->alloc_head_cold) {
+				dev->n_cold_chunks++;
+				object->cold_seq = yaffs_get_block_info(dev,
+					new_chunk / dev->param.chunks_per_block)->
+					seq_number;
+			}
 
 			/* Now fix up the Tnodes etc. */
 
@@ -2556,6 +2759,10 @@ static int yaffs_gc_block(struct yaffs_dev *dev, int block, int whole_block)
 	if (bi->block_state == YAFFS_BLOCK_STATE_FULL)
 		bi->block_state = YAFFS_BLOCK_STATE_COLLECTING;
 
+	/* An older, still open, cold block must not outlive the shrink header */
+	if (bi->has_shrink_hdr)
+		yaffs_close_cold_head(dev, bi->seq_number);
+
 	bi->has_shrink_hdr = 0;	/* clear the flag so that the block can erase */
 
 	dev->gc_disable = 1;
@@ -2576,6 +2783,9 @@ static int yaffs_gc_block(struct yaffs_dev *dev, int block, int whole_block)
 		max_copies = (whole_block) ? dev->param.chunks_per_block : 5;
 		old_chunk = block * dev->param.chunks_per_block + dev->gc_chunk;
 
+		yaffs_select_alloc_head(dev, 1);
+		yaffs_alloc_after_seq(dev, bi->seq_number);
+
 		for (/* init already done */ ;
 		     ret_val == YAFFS_OK &&
 		     dev->gc_chunk < dev->param.chunks_per_block &&
@@ -2589,6 +2799,7 @@ static int yaffs_gc_block(struct yaffs_dev *dev, int block, int whole_block)
 							old_chunk, buffer);
 			}
 		}
+		yaffs_select_alloc_head(dev, 0);
 		yaffs_release_temp_buffer(dev, buffer);
 	}
 
@@ -2634,6 +2845,69 @@ static int yaffs_gc_block(struct yaffs_dev *dev, int block, int whole_block)
 	return ret_val;
 }
 
+/*
+ * yaffs_find_gc_block_scored() is the victim search for the greedy and
+ * cost-benefit policies. Rather than sampling a window of blocks it looks at
+ * every full block with at most threshold chunks in use and takes the best.
+ * Greedy takes the one with the fewest chunks in use. Cost-benefit weighs
+ * the space reclaimed against the copying, scaled by age:
+ * age * (1 - u) / 2u, with u the fraction of the block in use and the
+ * sequence number as the age. That way old blocks which are mostly valid
+ * (cold data) still get collected, and recently written ones, which will
+ * shed more chunks if left alone, are given time.
+ */
+static unsigned yaffs_find_gc_block_scored(struct yaffs_dev *dev,
+					   int threshold)
+{
+	int i;
+	unsigned selected = 0;
+	struct yaffs_block_info *bi = dev->block_info;
+	int cost_benefit = (dev->param.gc_policy == YAFFS_GC_POLICY_COST_BENEFIT);
+	u64 best_benefit = 0;
+	u32 best_cost = 1;
+
+	for (i = dev->internal_start_block; i <= dev->internal_end_block;
+	     i++, bi++) {
+		int pages_used = bi->pages_in_use - bi->soft_del_pages;
+		u64 benefit;
+		u32 cost;
+		u32 age;
+
+		if (bi->block_state != YAFFS_BLOCK_STATE_FULL ||
+		    pages_used >= dev->param.chunks_per_block ||
+		    pages_used > threshold)
+			continue;
+
+		benefit = dev->param.chunks_per_block - pages_used;
+		cost = 1;
+		if (cost_benefit) {
+			age = dev->seq_number - bi->seq_number + 1;
+			if (age > 0xfffff)
+				age = 0xfffff;
+			benefit *= age;
+			cost = 2 * pages_used;
+		}
+
+		/* benefit / cost > best_benefit / best_cost ? */
+		if (selected && benefit * best_cost <= best_benefit * cost)
+			continue;
+		if (!yaffs_block_ok_for_gc(dev, bi))
+			continue;
+
+		selected = i;
+		best_benefit = benefit;
+		best_cost = cost;
+		if (pages_used == 0)
+			break;	/* Nothing beats free */
+	}
+
+	if (selected) {
+		bi = yaffs_get_block_info(dev, selected);
+		dev->gc_pages_in_use = bi->pages_in_use - bi->soft_del_pages;
+	}
+	return selected;
+}
+
 /*
  * find_gc_block() selects the dirtiest block (or close enough)
  * for garbage collection.
@@ -2717,6 +2991,9 @@ static unsigned yaffs_find_gc_block(struct yaffs_dev *dev,
 				iterations = 100;
 		}
 
+		if (dev->param.gc_policy != YAFFS_GC_POLICY_DEFAULT)
+			iterations = 0;
+
 		for (i = 0;
 		     i < iterations &&
 		     (dev->gc_dirtiest < 1 ||
@@ -2744,6 +3021,8 @@ static unsigned yaffs_find_gc_block(struct yaffs_dev *dev,
 
 		if (dev->gc_dirtiest > 0 && dev->gc_pages_in_use <= threshold)
 			selected = dev->gc_dirtiest;
+		else if (dev->param.gc_policy != YAFFS_GC_POLICY_DEFAULT)
+			selected = yaffs_find_gc_block_scored(dev, threshold);
 	}
 
 	/*
@@ -2794,6 +3073,27 @@ static unsigned yaffs_find_gc_block(struct yaffs_dev *dev,
 	return selected;
 }
 
+/*
+ * The number of erased blocks below which gc becomes aggressive: the
+ * reserve, room for a checkpoint and the block being written.
+ */
+int yaffs_gc_min_erased(struct yaffs_dev *dev)
+{
+	return dev->param.n_reserved_blocks +
+	    yaffs_calc_checkpt_blocks_required(dev) + 1;
+}
+
+static void yaffs_gc_stall(struct yaffs_dev *dev, int background, u32 us)
+{
+	int slot = 0;
+
+	while (us > 1 && slot < YAFFS_GC_STALL_SLOTS - 1) {
+		us >>= 1;
+		slot++;
+	}
+	dev->gc_stall_hist[background ? 1 : 0][slot]++;
+}
+
 /* New garbage collector
  * If we're very low on erased blocks then we do aggressive garbage collection
  * otherwise we do "leasurely" garbage collection.
@@ -2802,6 +3102,9 @@ static unsigned yaffs_find_gc_block(struct yaffs_dev *dev,
  *
  * The idea is to help clear out space in a more spread-out manner.
  * Dunno if it really does anything useful.
+ *
+ * When the background thread is collecting (YAFFS_GC_CONTROL_BG) the
+ * passive gc is left to it and writers only collect in an emergency.
  */
 static int yaffs_check_gc(struct yaffs_dev *dev, int background)
 {
@@ -2810,9 +3113,12 @@ static int yaffs_check_gc(struct yaffs_dev *dev, int background)
 	int max_tries = 0;
 	int min_erased;
 	int erased_chunks;
-	int checkpt_block_adjust;
+	unsigned gc_control = YAFFS_GC_CONTROL_ENABLE;
+	u64 t0;
 
-	if (dev->param.gc_control && (dev->param.gc_control(dev) & 1) == 0)
+	if (dev->param.gc_control)
+		gc_control = dev->param.gc_control(dev);
+	if (!(gc_control & YAFFS_GC_CONTROL_ENABLE))
 		return YAFFS_OK;
 
 	if (dev->gc_disable)
@@ -2826,10 +3132,7 @@ static int yaffs_check_gc(struct yaffs_dev *dev, int background)
 	do {
 		max_tries++;
 
-		checkpt_block_adjust = yaffs_calc_checkpt_blocks_required(dev);
-
-		min_erased =
-		    dev->param.n_reserved_blocks + checkpt_block_adjust + 1;
+		min_erased = yaffs_gc_min_erased(dev);
 		erased_chunks =
 		    dev->n_erased_blocks * dev->param.chunks_per_block;
 
@@ -2841,6 +3144,9 @@ static int yaffs_check_gc(struct yaffs_dev *dev, int background)
 			    && erased_chunks > (dev->n_free_chunks / 4))
 				break;
 
+			if (!background && (gc_control & YAFFS_GC_CONTROL_BG))
+				break;
+
 			if (dev->gc_skip > 20)
 				dev->gc_skip = 20;
 			if (erased_chunks < dev->n_free_chunks / 2 ||
@@ -2878,7 +3184,10 @@ static int yaffs_check_gc(struct yaffs_dev *dev, int background)
 				"yaffs: GC n_erased_blocks %d aggressive %d",
 				dev->n_erased_blocks, aggressive);
 
+			t0 = Y_TIME_US();
 			gc_ok = yaffs_gc_block(dev, dev->gc_block, aggressive);
+			yaffs_gc_stall(dev, background,
+				       (u32)(Y_TIME_US() - t0));
 		}
 
 		if (dev->n_erased_blocks < (dev->param.n_reserved_blocks) &&
@@ -3028,6 +3337,7 @@ static int yaffs_wr_data_obj(struct yaffs_obj *in, int inode_chunk,
 		BUG();
 	}
 
+	yaffs_alloc_after_obj(in);
 	new_chunk_id =
 	    yaffs_write_new_chunk(dev, buffer, &new_tags, use_reserve);
 
@@ -3380,6 +3690,11 @@ int yaffs_update_oh(struct yaffs_obj *in, const YCHAR *name, int force,
 	new_tags.extra_obj_type = in->variant_type;
 	yaffs_verify_oh(in, oh, &new_tags, 1);
 
+	yaffs_alloc_after_obj(in);
+	if (oh->shadows_obj > 0)
+		yaffs_alloc_after_obj(yaffs_find_by_number(dev,
+							   oh->shadows_obj));
+
 	/* Create new chunk in NAND */
 	new_chunk_id =
 	    yaffs_write_new_chunk(dev, buffer, &new_tags,
@@ -3462,13 +3777,10 @@ int yaffs_file_rd(struct yaffs_obj *in, u8 * buffer, loff_t offset, int n_bytes)
 				if (!cache) {
 					cache =
 					    yaffs_grab_chunk_cache(in->my_dev);
-					cache->object = in;
-					cache->chunk_id = chunk;
-					cache->dirty = 0;
-					cache->locked = 0;
+					yaffs_cache_assign(dev, cache, in,
+							   chunk);
 					yaffs_rd_data_obj(in, chunk,
 							  cache->data);
-					cache->n_bytes = 0;
 				}
 
 				yaffs_use_cache(dev, cache, 0);
@@ -3584,10 +3896,8 @@ int yaffs_do_file_wr(struct yaffs_obj *in, const u8 *buffer, loff_t offset,
 				if (!cache &&
 				    yaffs_check_alloc_available(dev, 1)) {
 					cache = yaffs_grab_chunk_cache(dev);
-					cache->object = in;
-					cache->chunk_id = chunk;
-					cache->dirty = 0;
-					cache->locked = 0;
+					yaffs_cache_assign(dev, cache, in,
+							   chunk);
 					yaffs_rd_data_obj(in, chunk,
 							  cache->data);
 				} else if (cache &&
@@ -3611,15 +3921,10 @@ int yaffs_do_file_wr(struct yaffs_obj *in, const u8 *buffer, loff_t offset,
 					cache->locked = 0;
 					cache->n_bytes = n_writeback;
 
-					if (write_trhrough) {
+					if (write_trhrough)
 						chunk_written =
-						    yaffs_wr_data_obj
-						    (cache->object,
-						     cache->chunk_id,
-						     cache->data,
-						     cache->n_bytes, 1);
-						cache->dirty = 0;
-					}
+						    yaffs_cache_write_out(dev,
+									  cache);
 				} else {
 					chunk_written = -1;	/* fail write */
 				}
@@ -4731,6 +5036,7 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 	dev->passive_gc_count = 0;
 	dev->oldest_dirty_gc_count = 0;
 	dev->bg_gcs = 0;
+	memset(dev->gc_stall_hist, 0, sizeof(dev->gc_stall_hist));
 	dev->gc_block_finder = 0;
 	dev->buffered_block = -1;
 	dev->doing_buffered_block_rewrite = 0;
@@ -4755,6 +5061,7 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 		init_failed = 1;
 
 	dev->cache = NULL;
+	dev->cache_hash = NULL;
 	dev->gc_cleanup_list = NULL;
 
 	if (!init_failed && dev->param.n_caches > 0) {
@@ -4765,6 +5072,7 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 
 		if (dev->param.n_caches > YAFFS_MAX_SHORT_OP_CACHES)
 			dev->param.n_caches = YAFFS_MAX_SHORT_OP_CACHES;
+		cache_bytes = dev->param.n_caches * sizeof(struct yaffs_cache);
 
 		dev->cache = kmalloc(cache_bytes, GFP_NOFS);
 
@@ -4773,20 +5081,42 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 		if (dev->cache)
 			memset(dev->cache, 0, cache_bytes);
 
+		INIT_LIST_HEAD(&dev->cache_free);
+		INIT_LIST_HEAD(&dev->cache_clean);
+		INIT_LIST_HEAD(&dev->cache_dirty);
 		for (i = 0; i < dev->param.n_caches && buf; i++) {
 			dev->cache[i].object = NULL;
 			dev->cache[i].last_use = 0;
 			dev->cache[i].dirty = 0;
+			INIT_LIST_HEAD(&dev->cache[i].hash_link);
+			list_add_tail(&dev->cache[i].lru, &dev->cache_free);
 			dev->cache[i].data = buf =
 			    kmalloc(dev->param.total_bytes_per_chunk, GFP_NOFS);
 		}
-		if (!buf)
+
+		/* About one chunk per bucket */
+		dev->cache_hash_size = 1;
+		while (dev->cache_hash_size < dev->param.n_caches)
+			dev->cache_hash_size <<= 1;
+		dev->cache_hash = NULL;
+		if (buf)
+			dev->cache_hash =
+			    kmalloc(dev->cache_hash_size *
+				    sizeof(struct list_head), GFP_NOFS);
+		if (dev->cache_hash)
+			for (i = 0; i < dev->cache_hash_size; i++)
+				INIT_LIST_HEAD(&dev->cache_hash[i]);
+		else
 			init_failed = 1;
 
 		dev->cache_last_use = 0;
+		dev->cache_wb_mark = 0;
+		dev->n_dirty_caches = 0;
 	}
 
 	dev->cache_hits = 0;
+	dev->cache_bg_writebacks = 0;
+	dev->cache_sync_writebacks = 0;
 
 	if (!init_failed) {
 		dev->gc_cleanup_list =
@@ -4812,10 +5142,24 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 		!yaffs_summary_init(dev))
 		init_failed = 1;
 
+	dev->mount_checkpt_us = 0;
+	dev->mount_block_state_us = 0;
+	dev->mount_summary_us = 0;
+	dev->mount_full_scan_us = 0;
+	dev->mount_fixup_us = 0;
+	dev->mount_summary_blocks = 0;
+	dev->mount_full_scan_blocks = 0;
+
 	if (!init_failed) {
+		s64 t0;
+		int restored;
+
 		/* Now scan the flash. */
 		if (dev->param.is_yaffs2) {
-			if (yaffs2_checkpt_restore(dev)) {
+			t0 = Y_TIME_US();
+			restored = yaffs2_checkpt_restore(dev);
+			dev->mount_checkpt_us = Y_TIME_US() - t0;
+			if (restored) {
 				yaffs_check_obj_details_loaded(dev->root_dir);
 				yaffs_trace(YAFFS_TRACE_CHECKPOINT |
 					YAFFS_TRACE_MOUNT,
@@ -4854,10 +5198,12 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 			init_failed = 1;
 		}
 
+		t0 = Y_TIME_US();
 		yaffs_strip_deleted_objs(dev);
 		yaffs_fix_hanging_objs(dev);
 		if (dev->param.empty_lost_n_found)
 			yaffs_empty_l_n_f(dev);
+		dev->mount_fixup_us += Y_TIME_US() - t0;
 	}
 
 	if (init_failed) {
@@ -4908,6 +5254,8 @@ void yaffs_deinitialise(struct yaffs_dev *dev)
 
 			kfree(dev->cache);
 			dev->cache = NULL;
+			kfree(dev->cache_hash);
+			dev->cache_hash = NULL;
 		}
 
 		kfree(dev->gc_cleanup_list);
@@ -4951,21 +5299,14 @@ int yaffs_get_n_free_chunks(struct yaffs_dev *dev)
 {
 	/* This is what we report to the outside world */
 	int n_free;
-	int n_dirty_caches;
 	int blocks_for_checkpt;
 	int i;
 
 	n_free = dev->n_free_chunks;
 	n_free += dev->n_deleted_files;
 
-	/* Now count and subtract the number of dirty chunks in the cache. */
-
-	for (n_dirty_caches = 0, i = 0; i < dev->param.n_caches; i++) {
-		if (dev->cache[i].dirty)
-			n_dirty_caches++;
-	}
-
-	n_free -= n_dirty_caches;
+	/* Now subtract the number of dirty chunks in the cache. */
+	n_free -= dev->n_dirty_caches;
 
 	n_free -=
 	    ((dev->param.n_reserved_blocks + 1) * dev->param.chunks_per_block);
@@ -86,10 +86,25 @@
 #define YAFFS_OBJECTID_CHECKPOINT_DATA	0x20
 #define YAFFS_SEQUENCE_CHECKPOINT_DATA	0x21
 
-#define YAFFS_MAX_SHORT_OP_CACHES	20
+#define YAFFS_MAX_SHORT_OP_CACHES	1024
 
 #define YAFFS_N_TEMP_BUFFERS		6
 
+/* Garbage collection victim selection, see yaffs_find_gc_block() */
+#define YAFFS_GC_POLICY_DEFAULT		0
+#define YAFFS_GC_POLICY_GREEDY		1
+#define YAFFS_GC_POLICY_COST_BENEFIT	2
+
+/* gc_control() flags: bit 0 enables gc at all; when bit 1 is set a
+ * background thread does the passive gc and the write path only collects
+ * once the erased blocks run into the reserve.
+ */
+#define YAFFS_GC_CONTROL_ENABLE		1
+#define YAFFS_GC_CONTROL_BG		2
+
+/* gc stall histograms: slot n counts collections of [2^n, 2^(n+1)) us */
+#define YAFFS_GC_STALL_SLOTS		16
+
 /* We limit the number attempts at sucessfully saving a chunk of data.
  * Small-page devices have 32 pages per block; large-page devices have 64.
  * Default to something in the order of 5 to 10 blocks worth of chunks.
@@ -111,6 +126,8 @@
 
 /* ChunkCache is used for short read/write operations.*/
 struct yaffs_cache {
+	struct list_head hash_link;	/* In dev->cache_hash while in use */
+	struct list_head lru;	/* On cache_free, cache_clean or cache_dirty */
 	struct yaffs_obj *object;
 	int chunk_id;
 	int last_use;
@@ -429,6 +446,9 @@ struct yaffs_obj {
 
 	int n_data_chunks;	/* Number of data chunks for this file. */
 
+	u32 cold_seq;		/* Cold block gc copied a chunk into since
+				 * the last write, or 0 */
+
 	u32 obj_id;		/* the object id value */
 
 	u32 yst_mode;
@@ -588,6 +608,9 @@ struct yaffs_param {
 	int always_check_erased;	/* Force chunk erased check always on */
 
 	int disable_summary;
+
+	int gc_policy;		/* YAFFS_GC_POLICY_xxx */
+	int hot_cold_alloc;	/* Write gc copies to their own block (yaffs2) */
 };
 
 struct yaffs_dev {
@@ -661,6 +684,14 @@ struct yaffs_dev {
 	u32 alloc_page;
 	int alloc_block_finder;	/* Used to search for next allocation block */
 
+	/* The allocation head not in use. With hot_cold_alloc, gc copies are
+	 * written to the cold head and everything else to the hot one.
+	 */
+	int alt_alloc_block;
+	u32 alt_alloc_page;
+	struct yaffs_summary_tags *alt_sum_tags;
+	int alloc_head_cold;	/* dev->alloc_block is the cold head */
+
 	/* Object and Tnode memory management */
 	void *allocator;
 	int n_obj;
@@ -698,6 +729,13 @@ struct yaffs_dev {
 
 	struct yaffs_cache *cache;
 	int cache_last_use;
+	struct list_head *cache_hash;	/* Buckets indexed by (obj, chunk) */
+	int cache_hash_size;		/* Power of two */
+	struct list_head cache_free;
+	struct list_head cache_clean;	/* LRU, least recently used first */
+	struct list_head cache_dirty;	/* LRU, least recently used first */
+	int n_dirty_caches;
+	int cache_wb_mark;	/* cache_last_use at the last writeback pass */
 
 	/* Stuff for background deletion and unlinked files. */
 	struct yaffs_obj *unlinked_dir;	/* Directory where unlinked and deleted
@@ -743,11 +781,14 @@ struct yaffs_dev {
 	u32 n_erasures;
 	u32 n_erase_failures;
 	u32 n_gc_copies;
+	u32 n_user_chunks;	/* Chunks written other than by gc */
+	u32 n_cold_chunks;	/* gc copies written to the cold head */
 	u32 all_gcs;
 	u32 passive_gc_count;
 	u32 oldest_dirty_gc_count;
 	u32 n_gc_blocks;
 	u32 bg_gcs;
+	u32 gc_stall_hist[2][YAFFS_GC_STALL_SLOTS];	/* [background] */
 	u32 n_retired_writes;
 	u32 n_retired_blocks;
 	u32 n_ecc_fixed;
@@ -758,9 +799,20 @@ struct yaffs_dev {
 	u32 n_unmarked_deletions;
 	u32 refresh_count;
 	u32 cache_hits;
+	u32 cache_bg_writebacks;
+	u32 cache_sync_writebacks;
 	u32 tags_used;
 	u32 summary_used;
 
+	/* Where the last mount spent its time, in microseconds */
+	u32 mount_checkpt_us;		/* checkpoint read, even if it failed */
+	u32 mount_block_state_us;	/* first pass over the block states */
+	u32 mount_summary_us;		/* reading and applying summaries */
+	u32 mount_full_scan_us;		/* blocks scanned chunk by chunk */
+	u32 mount_fixup_us;		/* hard links, deleted/hanging objects */
+	u32 mount_summary_blocks;
+	u32 mount_full_scan_blocks;
+
 };
 
 /* The CheckpointDevice structure holds the device information that changes
@@ -884,6 +936,10 @@ void yaffs_handle_defered_free(struct yaffs_obj *obj);
 void yaffs_update_dirty_dirs(struct yaffs_dev *dev);
 
 int yaffs_bg_gc(struct yaffs_dev *dev, unsigned urgency);
+int yaffs_gc_min_erased(struct yaffs_dev *dev);
+int yaffs_cache_writeback(struct yaffs_dev *dev);
+void yaffs_close_cold_head(struct yaffs_dev *dev, u32 seq);
+int yaffs_cold_head_dirty_before(struct yaffs_dev *dev, u32 seq);
 
 /* Debug dump  */
 int yaffs_dump_obj(struct yaffs_obj *obj);
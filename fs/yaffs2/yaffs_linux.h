@@ -24,6 +24,8 @@ struct yaffs_linux_context {
 	struct super_block *super;
 	struct task_struct *bg_thread;	/* Background thread for this device */
 	int bg_running;
+	unsigned long bg_expires;	/* When the thread next wakes itself */
+	unsigned long last_io;	/* jiffies of the last foreground access */
 	struct mutex gross_lock;	/* Gross locking mutex*/
 	u8 *spare_buffer;	/* For mtdif2 use. Don't know the buffer size
 				 * at compile time so we have to allocate it.
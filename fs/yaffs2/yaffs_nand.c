@@ -58,7 +58,13 @@ int yaffs_wr_chunk_tags_nand(struct yaffs_dev *dev,
 	dev->n_page_writes++;
 
 	if (tags) {
-		tags->seq_number = dev->seq_number;
+		/* Not dev->seq_number: with hot_cold_alloc, two blocks are
+		 * open at once and the older one must keep its own number.
+		 */
+		tags->seq_number = dev->param.is_yaffs2 ?
+		    yaffs_get_block_info(dev, nand_chunk /
+					 dev->param.chunks_per_block)->seq_number :
+		    dev->seq_number;
 		tags->chunk_used = 1;
 		yaffs_trace(YAFFS_TRACE_WRITE,
 			"Writing chunk %d tags %d %d",
@@ -59,9 +59,19 @@ int yaffs_summary_init(struct yaffs_dev *dev)
 				dev->chunks_per_summary, GFP_NOFS);
 	dev->gc_sum_tags = kmalloc(sizeof(struct yaffs_summary_tags) *
 				dev->chunks_per_summary, GFP_NOFS);
-	if(!dev->sum_tags || !dev->gc_sum_tags) {
+	/* The second allocation head needs its own summary */
+	dev->alt_sum_tags = NULL;
+	if (dev->param.hot_cold_alloc)
+		dev->alt_sum_tags = kmalloc(sizeof(struct yaffs_summary_tags) *
+					dev->chunks_per_summary, GFP_NOFS);
+	if(!dev->sum_tags || !dev->gc_sum_tags ||
+	   (dev->param.hot_cold_alloc && !dev->alt_sum_tags)) {
 		kfree(dev->sum_tags);
 		kfree(dev->gc_sum_tags);
+		kfree(dev->alt_sum_tags);
+		dev->sum_tags = NULL;
+		dev->gc_sum_tags = NULL;
+		dev->alt_sum_tags = NULL;
 		return YAFFS_FAIL;
 	}
 
@@ -76,6 +86,8 @@ void yaffs_summary_deinit(struct yaffs_dev *dev)
 	dev->sum_tags = NULL;
 	kfree(dev->gc_sum_tags);
 	dev->gc_sum_tags = NULL;
+	kfree(dev->alt_sum_tags);
+	dev->alt_sum_tags = NULL;
 	dev->chunks_per_summary = 0;
 }
 
@@ -140,14 +152,11 @@ int yaffs_summary_read(struct yaffs_dev *dev,
 	int n_bytes;
 	int chunk_id;
 	int chunk_in_nand;
-	int chunk_in_block;
 	int result;
 	int this_tx;
-	struct yaffs_block_info *bi = yaffs_get_block_info(dev, blk);
 
 	buffer = yaffs_get_temp_buffer(dev);
 	n_bytes = sizeof(struct yaffs_summary_tags) * dev->chunks_per_summary;
-	chunk_in_block = dev->chunks_per_summary;
 	chunk_in_nand = blk * dev->param.chunks_per_block +
 							dev->chunks_per_summary;
 	chunk_id = 1;
@@ -167,26 +176,32 @@ int yaffs_summary_read(struct yaffs_dev *dev,
 		if (result != YAFFS_OK)
 			break;
 
-		if (st == dev->sum_tags) {
-			/* If we're scanning then update the block info */
-			yaffs_set_chunk_bit(dev, blk, chunk_in_block);
-			bi->pages_in_use++;
-		}
-
 		memcpy(sum_buffer, buffer, this_tx);
 		n_bytes -= this_tx;
 		sum_buffer += this_tx;
 		chunk_in_nand++;
-		chunk_in_block++;
 		chunk_id++;
 	} while (result == YAFFS_OK && n_bytes > 0);
 	yaffs_release_temp_buffer(dev, buffer);
 
-	if (st == dev->sum_tags && result == YAFFS_OK)
-		bi->has_summary = 1;
-
 	return result;
 }
+
+/* The scan found a good summary in blk: account for the chunks holding it. */
+static void yaffs_summary_claim(struct yaffs_dev *dev, int blk)
+{
+	struct yaffs_block_info *bi = yaffs_get_block_info(dev, blk);
+	int n_bytes;
+	int i;
+
+	n_bytes = sizeof(struct yaffs_summary_tags) * dev->chunks_per_summary;
+	for (i = dev->chunks_per_summary; n_bytes > 0; i++) {
+		n_bytes -= dev->data_bytes_per_chunk;
+		yaffs_set_chunk_bit(dev, blk, i);
+		bi->pages_in_use++;
+	}
+	bi->has_summary = 1;
+}
 int yaffs_summary_add(struct yaffs_dev *dev,
 			struct yaffs_ext_tags *tags,
 			int chunk_in_nand)
@@ -250,3 +265,80 @@ void yaffs_summary_gc(struct yaffs_dev *dev, int blk)
 	}
 
 }
+
+void yaffs_summary_window_init(struct yaffs_dev *dev,
+				struct yaffs_summary_window *w)
+{
+	w->n = 0;
+	w->st = NULL;
+	if (dev->sum_tags)
+		w->st = kmalloc(YAFFS_SUMMARY_WINDOW * dev->chunks_per_summary *
+				sizeof(struct yaffs_summary_tags), GFP_NOFS);
+}
+
+void yaffs_summary_window_deinit(struct yaffs_summary_window *w)
+{
+	kfree(w->st);
+	w->st = NULL;
+}
+
+/* Read the summaries of blocks[0..n-1], lowest block number first. */
+void yaffs_summary_window_fill(struct yaffs_dev *dev,
+				struct yaffs_summary_window *w,
+				const int *blocks, int n)
+{
+	int order[YAFFS_SUMMARY_WINDOW];
+	int i, j, k;
+
+	if (n > YAFFS_SUMMARY_WINDOW)
+		n = YAFFS_SUMMARY_WINDOW;
+	w->n = n;
+
+	for (i = 0; i < n; i++) {
+		w->blk[i] = blocks[i];
+		w->ok[i] = YAFFS_FAIL;
+		k = i;
+		for (j = i; j > 0 && blocks[order[j - 1]] > blocks[k]; j--)
+			order[j] = order[j - 1];
+		order[j] = k;
+	}
+
+	if (!w->st)
+		return;
+
+	for (i = 0; i < n; i++) {
+		k = order[i];
+		w->ok[k] = yaffs_summary_read(dev,
+				w->st + k * dev->chunks_per_summary, w->blk[k]);
+	}
+}
+
+/*
+ * Make the summary of window slot i the current one for
+ * yaffs_summary_fetch(). Returns YAFFS_OK if the block has a summary.
+ */
+int yaffs_summary_window_load(struct yaffs_dev *dev,
+				struct yaffs_summary_window *w, int i)
+{
+	int blk = w->blk[i];
+	int result;
+
+	if (!dev->sum_tags)
+		return YAFFS_FAIL;
+
+	if (w->st) {
+		result = w->ok[i];
+		if (result == YAFFS_OK)
+			memcpy(dev->sum_tags, w->st + i * dev->chunks_per_summary,
+			       dev->chunks_per_summary *
+			       sizeof(struct yaffs_summary_tags));
+	} else {
+		/* No window memory, read it now */
+		result = yaffs_summary_read(dev, dev->sum_tags, blk);
+	}
+
+	if (result == YAFFS_OK)
+		yaffs_summary_claim(dev, blk);
+
+	return result;
+}
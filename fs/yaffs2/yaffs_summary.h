@@ -19,6 +19,21 @@
 #include "yaffs_packedtags2.h"
 
 
+/*
+ * Summary read-ahead for the mount scan. The scan visits blocks in
+ * sequence number order, which jumps around the device, so the summaries
+ * of the next few blocks are read in physical block order into a window
+ * and handed to the scan one block at a time.
+ */
+#define YAFFS_SUMMARY_WINDOW	16
+
+struct yaffs_summary_window {
+	int n;
+	int blk[YAFFS_SUMMARY_WINDOW];
+	int ok[YAFFS_SUMMARY_WINDOW];
+	struct yaffs_summary_tags *st;	/* YAFFS_SUMMARY_WINDOW summaries */
+};
+
 int yaffs_summary_init(struct yaffs_dev *dev);
 void yaffs_summary_deinit(struct yaffs_dev *dev);
 
@@ -33,5 +48,14 @@ int yaffs_summary_read(struct yaffs_dev *dev,
 			int blk);
 void yaffs_summary_gc(struct yaffs_dev *dev, int blk);
 
+void yaffs_summary_window_init(struct yaffs_dev *dev,
+				struct yaffs_summary_window *w);
+void yaffs_summary_window_deinit(struct yaffs_summary_window *w);
+void yaffs_summary_window_fill(struct yaffs_dev *dev,
+				struct yaffs_summary_window *w,
+				const int *blocks, int n);
+int yaffs_summary_window_load(struct yaffs_dev *dev,
+				struct yaffs_summary_window *w, int i);
+
 
 #endif
@@ -181,6 +181,9 @@ unsigned int yaffs_auto_checkpoint = 1;
 unsigned int yaffs_gc_control = 1;
 unsigned int yaffs_bg_enable = 1;
 unsigned int yaffs_auto_select = 1;
+unsigned int yaffs_bg_gc_idle_ms = 100;
+unsigned int yaffs_bg_gc_slice_ms = 4;
+unsigned int yaffs_bg_gc_low = 4;
 /* Module Parameters */
 #if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 5, 0))
 module_param(yaffs_trace_mask, uint, 0644);
@@ -188,6 +191,9 @@ module_param(yaffs_wr_attempts, uint, 0644);
 module_param(yaffs_auto_checkpoint, uint, 0644);
 module_param(yaffs_gc_control, uint, 0644);
 module_param(yaffs_bg_enable, uint, 0644);
+module_param(yaffs_bg_gc_idle_ms, uint, 0644);
+module_param(yaffs_bg_gc_slice_ms, uint, 0644);
+module_param(yaffs_bg_gc_low, uint, 0644);
 #else
 MODULE_PARM(yaffs_trace_mask, "i");
 MODULE_PARM(yaffs_wr_attempts, "i");
@@ -497,22 +503,46 @@ static int yaffs_vfs_setsize(struct inode *inode, loff_t newsize)
 
 }
 
+static unsigned yaffs_bg_gc_urgency(struct yaffs_dev *dev);
+
 static unsigned yaffs_gc_control_callback(struct yaffs_dev *dev)
 {
-	return yaffs_gc_control;
+	unsigned control = yaffs_gc_control;
+
+	/* Passive gc is left to the background thread while it runs */
+	if (yaffs_bg_enable && yaffs_dev_to_lc(dev)->bg_running)
+		control |= YAFFS_GC_CONTROL_BG;
+	return control;
 }
 
 static void yaffs_gross_lock(struct yaffs_dev *dev)
 {
+	struct yaffs_linux_context *lc = yaffs_dev_to_lc(dev);
+
 	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs locking %p", current);
-	mutex_lock(&(yaffs_dev_to_lc(dev)->gross_lock));
+	mutex_lock(&lc->gross_lock);
 	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs locked %p", current);
+	if (current != lc->bg_thread)
+		lc->last_io = jiffies;
 }
 
 static void yaffs_gross_unlock(struct yaffs_dev *dev)
 {
+	struct yaffs_linux_context *lc = yaffs_dev_to_lc(dev);
+
+	/*
+	 * A writer that has pushed the device below the low watermark
+	 * wakes a background thread that is in one of its long sleeps.
+	 */
+	if (lc->bg_running && lc->bg_thread &&
+	    current != lc->bg_thread &&
+	    time_after(lc->bg_expires, jiffies + HZ / 20) &&
+	    yaffs_bg_gc_urgency(dev) > 1) {
+		lc->bg_expires = jiffies;
+		wake_up_process(lc->bg_thread);
+	}
 	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs unlocking %p", current);
-	mutex_unlock(&(yaffs_dev_to_lc(dev)->gross_lock));
+	mutex_unlock(&lc->gross_lock);
 }
 
 #ifdef YAFFS_COMPILE_EXPORTFS
@@ -2184,12 +2214,21 @@ static void yaffs_flush_super(struct super_block *sb, int do_checkpoint)
 		yaffs_checkpoint_save(dev);
 }
 
+/*
+ * Background gc urgency, from the erased block watermarks:
+ * 0 - at least half the free space is erased, nothing to do.
+ * 1 - below the high watermark: collect while the device is idle.
+ * 2 - below a quarter, or within yaffs_bg_gc_low blocks of the reserve:
+ *     collect steadily even while it is busy.
+ * 3 - in the reserve, writers are collecting themselves: collect flat out.
+ */
 static unsigned yaffs_bg_gc_urgency(struct yaffs_dev *dev)
 {
 	unsigned erased_chunks =
 	    dev->n_erased_blocks * dev->param.chunks_per_block;
 	struct yaffs_linux_context *context = yaffs_dev_to_lc(dev);
 	unsigned scattered = 0;	/* Free chunks not in an erased block */
+	int min_erased;
 
 	if (erased_chunks < dev->n_free_chunks)
 		scattered = (dev->n_free_chunks - erased_chunks);
@@ -2198,6 +2237,12 @@ static unsigned yaffs_bg_gc_urgency(struct yaffs_dev *dev)
 		return 0;
 	else if (scattered < (dev->param.chunks_per_block * 2))
 		return 0;
+
+	min_erased = yaffs_gc_min_erased(dev);
+	if (dev->n_erased_blocks < min_erased)
+		return 3;
+	else if (dev->n_erased_blocks < min_erased + (int)yaffs_bg_gc_low)
+		return 2;
 	else if (erased_chunks > dev->n_free_chunks / 2)
 		return 0;
 	else if (erased_chunks > dev->n_free_chunks / 4)
@@ -2255,6 +2300,63 @@ void yaffs_background_waker(unsigned long data)
 	wake_up_process((struct task_struct *)data);
 }
 
+static int yaffs_bg_io_idle(struct yaffs_linux_context *context,
+			    unsigned long now)
+{
+	return time_after_eq(now, context->last_io +
+			     msecs_to_jiffies(yaffs_bg_gc_idle_ms));
+}
+
+/*
+ * Run gc steps for up to yaffs_bg_gc_slice_ms. The gross lock is dropped
+ * between steps so writers are never held up for more than one step.
+ * Idle-only collection stops as soon as a writer has got in.
+ * Called with the gross lock held.
+ */
+static void yaffs_bg_gc_slice(struct yaffs_dev *dev, unsigned urgency)
+{
+	struct yaffs_linux_context *context = yaffs_dev_to_lc(dev);
+	unsigned long last_io = context->last_io;
+	u64 end = Y_TIME_US() + yaffs_bg_gc_slice_ms * 1000;
+
+	while (!yaffs_bg_gc(dev, urgency)) {
+		if (Y_TIME_US() >= end)
+			break;
+		yaffs_gross_unlock(dev);
+		cond_resched();
+		yaffs_gross_lock(dev);
+		if (!context->bg_running || kthread_should_stop() ||
+		    dev->is_checkpointed || !yaffs_bg_enable)
+			break;
+		if (urgency < 2 && context->last_io != last_io)
+			break;
+		urgency = yaffs_bg_gc_urgency(dev);
+		if (!urgency)
+			break;
+	}
+}
+
+/* When the next gc slice is due, given the one that just ran at last_gc */
+static unsigned long yaffs_bg_next_gc(struct yaffs_linux_context *context,
+				      unsigned urgency, unsigned long last_gc,
+				      unsigned long now)
+{
+	switch (urgency) {
+	case 3:
+		return now;
+	case 2:
+		return last_gc + HZ / 20 + 1;
+	case 1:
+		/* Only once the device has been quiet for a while */
+		if (!yaffs_bg_io_idle(context, now))
+			return context->last_io +
+			    msecs_to_jiffies(yaffs_bg_gc_idle_ms) + 1;
+		return last_gc + HZ / 10 + 1;
+	default:
+		return now + HZ * 2;
+	}
+}
+
 static int yaffs_bg_thread_fn(void *data)
 {
 	struct yaffs_dev *dev = (struct yaffs_dev *)data;
@@ -2262,10 +2364,10 @@ static int yaffs_bg_thread_fn(void *data)
 	unsigned long now = jiffies;
 	unsigned long next_dir_update = now;
 	unsigned long next_gc = now;
+	unsigned long last_gc = now;
 	unsigned long expires;
 	unsigned int urgency;
 
-	int gc_result;
 	struct timer_list timer;
 
 	yaffs_trace(YAFFS_TRACE_BACKGROUND,
@@ -2290,41 +2392,54 @@ static int yaffs_bg_thread_fn(void *data)
 
 		if (time_after(now, next_dir_update) && yaffs_bg_enable) {
 			yaffs_update_dirty_dirs(dev);
+			yaffs_cache_writeback(dev);
 			next_dir_update = now + HZ;
 		}
 
-		if (time_after(now, next_gc) && yaffs_bg_enable) {
-			if (!dev->is_checkpointed) {
+		if (yaffs_bg_enable && !dev->is_checkpointed) {
+			/*
+			 * The urgency is rechecked on every wake up, a writer
+			 * may have pulled the next slice in.
+			 */
+			urgency = yaffs_bg_gc_urgency(dev);
+			next_gc = yaffs_bg_next_gc(context, urgency,
+						   last_gc, now);
+			if (urgency && !time_before(now, next_gc)) {
+				yaffs_bg_gc_slice(dev, urgency);
+				now = jiffies;
+				last_gc = now;
 				urgency = yaffs_bg_gc_urgency(dev);
-				gc_result = yaffs_bg_gc(dev, urgency);
-				if (urgency > 1)
-					next_gc = now + HZ / 20 + 1;
-				else if (urgency > 0)
-					next_gc = now + HZ / 10 + 1;
-				else
-					next_gc = now + HZ * 2;
-			} else	{
-			        /*
-				 * gc not running so set to next_dir_update
-				 * to cut down on wake ups
-				 */
-				next_gc = next_dir_update;
-                        }
+				next_gc = yaffs_bg_next_gc(context, urgency,
+							   last_gc, now);
+			}
+		} else {
+			/*
+			 * gc not running so set to next_dir_update
+			 * to cut down on wake ups
+			 */
+			next_gc = next_dir_update;
 		}
-		yaffs_gross_unlock(dev);
-#if 1
 		expires = next_dir_update;
 		if (time_before(next_gc, expires))
 			expires = next_gc;
 		if (time_before(expires, now))
 			expires = now + HZ;
+		if (!time_after(expires, now))
+			expires = now + 1;
+		context->bg_expires = expires;
+		/*
+		 * Sleeping from before the unlock, so a writer that wakes us
+		 * as soon as it gets the lock is not lost.
+		 */
+		set_current_state(TASK_INTERRUPTIBLE);
+		yaffs_gross_unlock(dev);
+#if 1
 
 		Y_INIT_TIMER(&timer);
 		timer.expires = expires + 1;
 		timer.data = (unsigned long)current;
 		timer.function = yaffs_background_waker;
 
-		set_current_state(TASK_INTERRUPTIBLE);
 		add_timer(&timer);
 		schedule();
 		del_timer_sync(&timer);
@@ -2545,6 +2660,7 @@ struct yaffs_options {
 	int skip_checkpoint_read;
 	int skip_checkpoint_write;
 	int no_cache;
+	int n_caches;
 	int tags_ecc_on;
 	int tags_ecc_overridden;
 	int lazy_loading_enabled;
@@ -2552,6 +2668,8 @@ struct yaffs_options {
 	int empty_lost_and_found;
 	int empty_lost_and_found_overridden;
 	int disable_summary;
+	int gc_policy;
+	int hot_cold_alloc;
 	int create_encrypted_filesystem;
 	int unlock_encrypted_filesystem;
 	char password[MAX_OPT_LEN+1];
@@ -2617,6 +2735,14 @@ static int yaffs_parse_options(struct yaffs_options *options,
 			options->lazy_loading_overridden = 1;
 		} else if (!strcmp(cur_opt, "disable-summary")) {
 			options->disable_summary = 1;
+		} else if (!strcmp(cur_opt, "gc-policy=default")) {
+			options->gc_policy = YAFFS_GC_POLICY_DEFAULT;
+		} else if (!strcmp(cur_opt, "gc-policy=greedy")) {
+			options->gc_policy = YAFFS_GC_POLICY_GREEDY;
+		} else if (!strcmp(cur_opt, "gc-policy=cost-benefit")) {
+			options->gc_policy = YAFFS_GC_POLICY_COST_BENEFIT;
+		} else if (!strcmp(cur_opt, "hot-cold-alloc")) {
+			options->hot_cold_alloc = 1;
 		} else if (!strcmp(cur_opt, "empty-lost-and-found-off")) {
 			options->empty_lost_and_found = 0;
 			options->empty_lost_and_found_overridden = 1;
@@ -2625,6 +2751,9 @@ static int yaffs_parse_options(struct yaffs_options *options,
 			options->empty_lost_and_found_overridden = 1;
 		} else if (!strcmp(cur_opt, "no-cache")) {
 			options->no_cache = 1;
+		} else if (!strncmp(cur_opt, "cache-size=", 11)) {
+			options->n_caches =
+			    simple_strtoul(cur_opt + 11, NULL, 0);
 		} else if (!strcmp(cur_opt, "no-checkpoint-read")) {
 			options->skip_checkpoint_read = 1;
 		} else if (!strcmp(cur_opt, "no-checkpoint-write")) {
@@ -3091,7 +3220,8 @@ static struct super_block *yaffs_internal_read_super(int yaffs_version,
 	param->chunks_per_block = YAFFS_CHUNKS_PER_BLOCK;
 	param->total_bytes_per_chunk = YAFFS_BYTES_PER_CHUNK;
 	param->n_reserved_blocks = 5;
-	param->n_caches = (options.no_cache) ? 0 : 10;
+	param->n_caches = (options.no_cache) ? 0 :
+			  (options.n_caches ? options.n_caches : 10);
 	param->inband_tags = options.inband_tags;
 
 	param->enable_xattr = 1;
@@ -3108,6 +3238,8 @@ static struct super_block *yaffs_internal_read_super(int yaffs_version,
 	param->empty_lost_n_found = 1;
 	param->refresh_period = 500;
 	param->disable_summary = options.disable_summary;
+	param->gc_policy = options.gc_policy;
+	param->hot_cold_alloc = options.hot_cold_alloc;
 
 	if (options.empty_lost_and_found_overridden)
 		param->empty_lost_n_found = options.empty_lost_and_found;
@@ -3398,6 +3530,9 @@ static char *yaffs_dump_dev_part0(char *buf, struct yaffs_dev *dev)
 	buf += sprintf(buf, "refresh_period....... %d\n",
 				param->refresh_period);
 	buf += sprintf(buf, "n_caches............. %d\n", param->n_caches);
+	buf += sprintf(buf, "gc_policy............ %d\n", param->gc_policy);
+	buf += sprintf(buf, "hot_cold_alloc....... %d\n",
+				param->hot_cold_alloc);
 	buf += sprintf(buf, "n_reserved_blocks.... %d\n",
 				param->n_reserved_blocks);
 	buf += sprintf(buf, "always_check_erased.. %d\n",
@@ -3407,8 +3542,22 @@ static char *yaffs_dump_dev_part0(char *buf, struct yaffs_dev *dev)
 	return buf;
 }
 
+/* One line of counts, slot n being gc steps of [2^n, 2^(n+1)) us */
+static char *yaffs_dump_gc_stalls(char *buf, const char *name, u32 *hist)
+{
+	int i;
+
+	buf += sprintf(buf, "%s", name);
+	for (i = 0; i < YAFFS_GC_STALL_SLOTS; i++)
+		buf += sprintf(buf, " %u", hist[i]);
+	buf += sprintf(buf, "\n");
+	return buf;
+}
+
 static char *yaffs_dump_dev_part1(char *buf, struct yaffs_dev *dev)
 {
+	u64 write_amp;
+
 	buf += sprintf(buf, "data_bytes_per_chunk. %d\n",
 				dev->data_bytes_per_chunk);
 	buf += sprintf(buf, "chunk_grp_bits....... %d\n", dev->chunk_grp_bits);
@@ -3425,6 +3574,15 @@ static char *yaffs_dump_dev_part1(char *buf, struct yaffs_dev *dev)
 	buf += sprintf(buf, "n_page_reads......... %u\n", dev->n_page_reads);
 	buf += sprintf(buf, "n_erasures........... %u\n", dev->n_erasures);
 	buf += sprintf(buf, "n_gc_copies.......... %u\n", dev->n_gc_copies);
+	buf += sprintf(buf, "n_user_chunks........ %u\n", dev->n_user_chunks);
+	buf += sprintf(buf, "n_cold_chunks........ %u\n", dev->n_cold_chunks);
+	/* (user + gc) chunks written per user chunk, times 100 */
+	write_amp = ((u64)dev->n_user_chunks + dev->n_gc_copies) * 100;
+	if (dev->n_user_chunks)
+		do_div(write_amp, dev->n_user_chunks);
+	else
+		write_amp = 0;
+	buf += sprintf(buf, "write_amp_x100....... %u\n", (u32)write_amp);
 	buf += sprintf(buf, "all_gcs.............. %u\n", dev->all_gcs);
 	buf += sprintf(buf, "passive_gc_count..... %u\n",
 				dev->passive_gc_count);
@@ -3432,6 +3590,10 @@ static char *yaffs_dump_dev_part1(char *buf, struct yaffs_dev *dev)
 				dev->oldest_dirty_gc_count);
 	buf += sprintf(buf, "n_gc_blocks.......... %u\n", dev->n_gc_blocks);
 	buf += sprintf(buf, "bg_gcs............... %u\n", dev->bg_gcs);
+	buf = yaffs_dump_gc_stalls(buf, "fg_gc_stall_hist.....",
+				   dev->gc_stall_hist[0]);
+	buf = yaffs_dump_gc_stalls(buf, "bg_gc_stall_hist.....",
+				   dev->gc_stall_hist[1]);
 	buf += sprintf(buf, "n_retired_writes..... %u\n",
 				dev->n_retired_writes);
 	buf += sprintf(buf, "n_retired_blocks..... %u\n",
@@ -3443,6 +3605,11 @@ static char *yaffs_dump_dev_part1(char *buf, struct yaffs_dev *dev)
 	buf += sprintf(buf, "n_tags_ecc_unfixed... %u\n",
 				dev->n_tags_ecc_unfixed);
 	buf += sprintf(buf, "cache_hits........... %u\n", dev->cache_hits);
+	buf += sprintf(buf, "n_dirty_caches....... %d\n", dev->n_dirty_caches);
+	buf += sprintf(buf, "cache_bg_writebacks.. %u\n",
+		       dev->cache_bg_writebacks);
+	buf += sprintf(buf, "cache_sync_writebacks %u\n",
+		       dev->cache_sync_writebacks);
 	buf += sprintf(buf, "n_deleted_files...... %u\n", dev->n_deleted_files);
 	buf += sprintf(buf, "n_unlinked_files..... %u\n",
 				dev->n_unlinked_files);
@@ -3451,6 +3618,15 @@ static char *yaffs_dump_dev_part1(char *buf, struct yaffs_dev *dev)
 	buf += sprintf(buf, "n_bg_deletions....... %u\n", dev->n_bg_deletions);
 	buf += sprintf(buf, "tags_used............ %u\n", dev->tags_used);
 	buf += sprintf(buf, "summary_used......... %u\n", dev->summary_used);
+	buf += sprintf(buf, "mount_checkpt_us..... %u\n",
+		       dev->mount_checkpt_us);
+	buf += sprintf(buf, "mount_block_state_us. %u\n",
+		       dev->mount_block_state_us);
+	buf += sprintf(buf, "mount_summary_us..... %u (%u blocks)\n",
+		       dev->mount_summary_us, dev->mount_summary_blocks);
+	buf += sprintf(buf, "mount_full_scan_us... %u (%u blocks)\n",
+		       dev->mount_full_scan_us, dev->mount_full_scan_blocks);
+	buf += sprintf(buf, "mount_fixup_us....... %u\n", dev->mount_fixup_us);
 
 	return buf;
 }
@@ -130,7 +130,15 @@ int yaffs_block_ok_for_gc(struct yaffs_dev *dev, struct yaffs_block_info *bi)
 	/* Can't do gc of this block if there are any blocks older than this
 	 * one that have discarded pages.
 	 */
-	return (bi->seq_number <= dev->oldest_dirty_seq);
+	if (bi->seq_number > dev->oldest_dirty_seq)
+		return 0;
+
+	/*
+	 * Nor while the cold head is open in an older block with discarded
+	 * pages, which the search above does not see. yaffs_gc_block()
+	 * closes an older cold head for the block it collects.
+	 */
+	return !yaffs_cold_head_dirty_before(dev, bi->seq_number);
 }
 
 /*
@@ -795,6 +803,8 @@ int yaffs_checkpoint_save(struct yaffs_dev *dev)
 
 	if (!dev->is_checkpointed) {
 		yaffs2_checkpt_invalidate(dev);
+		/* The checkpoint records a single allocation block */
+		yaffs_close_cold_head(dev, dev->seq_number + 1);
 		yaffs2_wr_checkpt_data(dev);
 	}
 
@@ -1360,6 +1370,11 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 	struct yaffs_block_index *block_index = NULL;
 	int alt_block_index = 0;
 	int summary_available;
+	struct yaffs_summary_window window;
+	int window_blocks[YAFFS_SUMMARY_WINDOW];
+	int window_pos;
+	int i;
+	s64 t0, t1;
 
 	yaffs_trace(YAFFS_TRACE_SCAN,
 		"yaffs2_scan_backwards starts  intstartblk %d intendblk %d...",
@@ -1387,6 +1402,8 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 
 	chunk_data = yaffs_get_temp_buffer(dev);
 
+	t0 = Y_TIME_US();
+
 	/* Scan all the blocks to determine their state */
 	bi = dev->block_info;
 	for (blk = dev->internal_start_block; blk <= dev->internal_end_block;
@@ -1451,6 +1468,13 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 
 	yaffs_trace(YAFFS_TRACE_SCAN, "...done");
 
+	t1 = Y_TIME_US();
+	dev->mount_block_state_us += t1 - t0;
+	t0 = t1;
+
+	yaffs_summary_window_init(dev, &window);
+	window_pos = 0;
+
 	/* Now scan the blocks looking at the data. */
 	start_iter = 0;
 	end_iter = n_to_scan - 1;
@@ -1464,12 +1488,27 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 		   long that watchdog timers expire. */
 		cond_resched();
 
+		/* Read ahead the summaries of the next few blocks */
+		if (window_pos >= window.n) {
+			for (i = 0; i < YAFFS_SUMMARY_WINDOW &&
+			     block_iter - i >= start_iter; i++)
+				window_blocks[i] =
+					block_index[block_iter - i].block;
+			yaffs_summary_window_fill(dev, &window,
+						  window_blocks, i);
+			window_pos = 0;
+			t1 = Y_TIME_US();
+			dev->mount_summary_us += t1 - t0;
+			t0 = t1;
+		}
+
 		/* get the block to scan in the correct order */
 		blk = block_index[block_iter].block;
 		bi = yaffs_get_block_info(dev, blk);
 		deleted = 0;
 
-		summary_available = yaffs_summary_read(dev, dev->sum_tags, blk);
+		summary_available =
+			yaffs_summary_window_load(dev, &window, window_pos++);
 
 		/* For each chunk in each block that needs scanning.... */
 		found_chunks = 0;
@@ -1505,8 +1544,20 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 		    bi->block_state == YAFFS_BLOCK_STATE_FULL) {
 			yaffs_block_became_dirty(dev, blk);
 		}
+
+		t1 = Y_TIME_US();
+		if (summary_available) {
+			dev->mount_summary_us += t1 - t0;
+			dev->mount_summary_blocks++;
+		} else {
+			dev->mount_full_scan_us += t1 - t0;
+			dev->mount_full_scan_blocks++;
+		}
+		t0 = t1;
 	}
 
+	yaffs_summary_window_deinit(&window);
+
 	yaffs_skip_rest_of_block(dev);
 
 	if (alt_block_index)
@@ -1520,6 +1571,7 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 	 * hardlinks.
 	 */
 	yaffs_link_fixup(dev, &hard_list);
+	dev->mount_fixup_us += Y_TIME_US() - t0;
 
 	yaffs_release_temp_buffer(dev, chunk_data);
 
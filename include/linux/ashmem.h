@@ -52,4 +52,19 @@ int get_ashmem_file(int fd, struct file **filp, struct file **vm_file,
 			unsigned long *len);
 void put_ashmem_file(struct file *file);
 
+struct task_struct;
+
+#ifdef CONFIG_ASHMEM
+void ashmem_task_footprint(struct task_struct *tsk, unsigned long *pinned,
+			   unsigned long *unpinned);
+#else
+static inline void ashmem_task_footprint(struct task_struct *tsk,
+					 unsigned long *pinned,
+					 unsigned long *unpinned)
+{
+	*pinned = 0;
+	*unpinned = 0;
+}
+#endif
+
 #endif	/* _LINUX_ASHMEM_H */
@@ -193,6 +193,10 @@ struct request {
 
 	struct gendisk *rq_disk;
 	unsigned long start_time;
+#ifdef CONFIG_ELV_LATENCY_HIST
+	u64 elv_insert_ns;	/* handed to the elevator */
+	u64 elv_issue_ns;	/* first seen by the driver */
+#endif
 
 	/* Number of scatter-gather DMA addr+len pairs after
 	 * physical address coalescing is performed.
@@ -189,6 +189,26 @@ extern int __cpufreq_driver_target(struct cpufreq_policy *policy,
 				   unsigned int target_freq,
 				   unsigned int relation);
 
+/* A target request the cpufreq driver is carrying out, for the statistics */
+struct cpufreq_request {
+	const char *governor;	/* name of the policy's governor, or NULL */
+	void *caller;		/* where the request was made */
+	unsigned int target;	/* requested frequency, kHz */
+	unsigned int relation;
+	int load;		/* load that led to it, percent; -1 unknown */
+	unsigned int boosted:1;	/* made during an input boost */
+	unsigned int active:1;
+};
+
+#ifdef CONFIG_CPU_FREQ_STAT_TRACE
+extern const struct cpufreq_request *cpufreq_get_request(unsigned int cpu);
+#else
+static inline const struct cpufreq_request *
+cpufreq_get_request(unsigned int cpu)
+{
+	return NULL;
+}
+#endif
 
 extern int __cpufreq_driver_getavg(struct cpufreq_policy *policy,
 				   unsigned int cpu);
@@ -0,0 +1,64 @@
+/*
+ * include/linux/cpufreq_sampling.h
+ *
+ * Load sampling shared by the cpufreq governors.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#ifndef _LINUX_CPUFREQ_SAMPLING_H
+#define _LINUX_CPUFREQ_SAMPLING_H
+
+#include <linux/types.h>
+
+struct cpufreq_policy;
+
+/* One sampling window of a policy, as handed to its governor */
+struct cpufreq_sample {
+	u64 time_us;		/* end of the window */
+	unsigned int window_us;	/* length of the window on the busiest CPU */
+	unsigned int idle_us;	/* time that CPU was idle within it */
+	unsigned int load;	/* busy share of the window, percent */
+	unsigned int boosted:1;	/* an input boost is in effect */
+};
+
+/*
+ * What a governor hands to cpufreq_sampling_start(). The fields other than
+ * ->sample may be changed while sampling runs and take effect from the
+ * next sample on.
+ */
+struct cpufreq_sampler {
+	/*
+	 * Called once per window on the policy's CPU, from process context,
+	 * so it may change the frequency with __cpufreq_driver_target().
+	 */
+	void (*sample)(struct cpufreq_policy *policy,
+		       const struct cpufreq_sample *s);
+	unsigned int rate_us;		/* sampling period */
+	unsigned int ignore_nice:1;	/* count niced time as idle */
+	unsigned int io_is_busy:1;	/* count iowait as busy */
+};
+
+#ifdef CONFIG_CPU_FREQ_SAMPLING
+int cpufreq_sampling_start(struct cpufreq_policy *policy,
+			   struct cpufreq_sampler *sampler);
+void cpufreq_sampling_stop(struct cpufreq_policy *policy);
+void cpufreq_sampling_reset(struct cpufreq_policy *policy);
+unsigned int cpufreq_sampling_load(unsigned int cpu);
+const struct cpufreq_sample *cpufreq_sampling_current(unsigned int cpu);
+#else
+static inline unsigned int cpufreq_sampling_load(unsigned int cpu)
+{
+	return 0;
+}
+
+static inline const struct cpufreq_sample *
+cpufreq_sampling_current(unsigned int cpu)
+{
+	return NULL;
+}
+#endif
+
+#endif /* _LINUX_CPUFREQ_SAMPLING_H */
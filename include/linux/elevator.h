@@ -78,6 +78,27 @@ struct elevator_type
 	struct module *elevator_owner;
 };
 
+#ifdef CONFIG_ELV_LATENCY_HIST
+/*
+ * Request latencies, by class. Bucket i counts requests that took
+ * [2^i, 2^(i+1)) microseconds, the first and last buckets being open.
+ */
+#define ELV_LAT_BUCKETS		20
+
+enum {
+	ELV_LAT_ASYNC_READ,
+	ELV_LAT_ASYNC_WRITE,
+	ELV_LAT_SYNC_READ,
+	ELV_LAT_SYNC_WRITE,
+	ELV_LAT_NR_CLASSES,
+};
+
+struct elv_latency_hist {
+	unsigned long count[ELV_LAT_NR_CLASSES][ELV_LAT_BUCKETS];
+	u64 total_us[ELV_LAT_NR_CLASSES];
+};
+#endif
+
 /*
  * each queue has an elevator_queue associated with it
  */
@@ -89,6 +110,12 @@ struct elevator_queue
 	struct elevator_type *elevator_type;
 	struct mutex sysfs_lock;
 	struct hlist_head *hash;
+#ifdef CONFIG_ELV_LATENCY_HIST
+	/* protected by the queue lock of @queue */
+	struct request_queue *queue;
+	struct elv_latency_hist queue_lat;	/* insert to dispatch */
+	struct elv_latency_hist dispatch_lat;	/* dispatch to completion */
+#endif
 };
 
 /*
@@ -44,6 +44,36 @@ static inline void oom_killer_enable(void)
 
 extern struct task_struct *find_lock_task_mm(struct task_struct *p);
 
+/*
+ * The Android lowmemorykiller keeps thread group leaders indexed by
+ * oom_adj. These are called with tasklist_lock held for writing, except
+ * lowmem_task_adj_changed() which is called with the task's siglock held.
+ */
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER
+extern void lowmem_task_add(struct task_struct *tsk);
+extern void lowmem_task_del(struct task_struct *tsk);
+extern void lowmem_task_replace(struct task_struct *old,
+				struct task_struct *new);
+extern void lowmem_task_adj_changed(struct task_struct *tsk);
+#else
+static inline void lowmem_task_add(struct task_struct *tsk)
+{
+}
+
+static inline void lowmem_task_del(struct task_struct *tsk)
+{
+}
+
+static inline void lowmem_task_replace(struct task_struct *old,
+				       struct task_struct *new)
+{
+}
+
+static inline void lowmem_task_adj_changed(struct task_struct *tsk)
+{
+}
+#endif
+
 
 #endif /* __KERNEL__*/
 #endif /* _INCLUDE_LINUX_OOM_H */
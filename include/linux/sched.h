@@ -1268,6 +1268,10 @@ struct task_struct {
 #endif
 
 	struct list_head tasks;
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER
+	/* thread group leaders only, in the lowmemorykiller's oom_adj index */
+	struct list_head lowmem_node;
+#endif
 	struct plist_node pushable_tasks;
 
 	struct mm_struct *mm, *active_mm;
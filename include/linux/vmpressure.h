@@ -0,0 +1,31 @@
+#ifndef _LINUX_VMPRESSURE_H
+#define _LINUX_VMPRESSURE_H
+
+#include <linux/types.h>
+#include <linux/gfp.h>
+
+struct notifier_block;
+
+/*
+ * Memory pressure levels, passed as the event of vmpressure notifiers.
+ * The pressure itself (0..100) is passed as data.
+ */
+enum vmpressure_levels {
+	VMPRESSURE_LOW,		/* reclaim is active but efficient */
+	VMPRESSURE_MEDIUM,	/* reclaim is finding it hard to free pages */
+	VMPRESSURE_CRITICAL,	/* reclaim is barely freeing anything */
+};
+
+#ifdef CONFIG_VMPRESSURE
+extern void vmpressure(gfp_t gfp, unsigned long scanned,
+		       unsigned long reclaimed);
+extern int vmpressure_register_notifier(struct notifier_block *nb);
+extern int vmpressure_unregister_notifier(struct notifier_block *nb);
+#else
+static inline void vmpressure(gfp_t gfp, unsigned long scanned,
+			      unsigned long reclaimed)
+{
+}
+#endif
+
+#endif /* _LINUX_VMPRESSURE_H */
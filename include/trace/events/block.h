@@ -172,6 +172,39 @@ TRACE_EVENT(block_rq_complete,
 		  __entry->nr_sector, __entry->errors)
 );
 
+/*
+ * Emitted when a request that went through the I/O scheduler completes,
+ * with the time it spent queued and the time the device took, in usecs.
+ */
+TRACE_EVENT(block_rq_latency,
+
+	TP_PROTO(struct request_queue *q, struct request *rq,
+		 unsigned long queue_us, unsigned long service_us),
+
+	TP_ARGS(q, rq, queue_us, service_us),
+
+	TP_STRUCT__entry(
+		__field(  dev_t,	dev			)
+		__field(  int,		write			)
+		__field(  int,		sync			)
+		__field(  unsigned long, queue_us		)
+		__field(  unsigned long, service_us		)
+	),
+
+	TP_fast_assign(
+		__entry->dev	    = rq->rq_disk ? disk_devt(rq->rq_disk) : 0;
+		__entry->write	    = rq_data_dir(rq) == WRITE;
+		__entry->sync	    = rq_is_sync(rq) != 0;
+		__entry->queue_us   = queue_us;
+		__entry->service_us = service_us;
+	),
+
+	TP_printk("%d,%d %s%s queue %lu service %lu",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  __entry->write ? "W" : "R", __entry->sync ? "S" : "",
+		  __entry->queue_us, __entry->service_us)
+);
+
 TRACE_EVENT(block_bio_bounce,
 
 	TP_PROTO(struct request_queue *q, struct bio *bio),
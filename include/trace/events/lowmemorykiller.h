@@ -0,0 +1,77 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM lowmemorykiller
+
+#if !defined(_TRACE_LOWMEMORYKILLER_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_LOWMEMORYKILLER_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(lowmem_kill,
+	TP_PROTO(struct task_struct *tsk, int oom_adj, unsigned long rss,
+		 unsigned long swap, unsigned long ashmem_pinned,
+		 unsigned long ashmem_unpinned, unsigned long expected),
+	TP_ARGS(tsk, oom_adj, rss, swap, ashmem_pinned, ashmem_unpinned,
+		expected),
+
+	TP_STRUCT__entry(
+		__array(char,		comm,	TASK_COMM_LEN	)
+		__field(pid_t,		pid			)
+		__field(int,		oom_adj			)
+		__field(unsigned long,	rss			)
+		__field(unsigned long,	swap			)
+		__field(unsigned long,	ashmem_pinned		)
+		__field(unsigned long,	ashmem_unpinned		)
+		__field(unsigned long,	expected		)
+	),
+
+	TP_fast_assign(
+		memcpy(__entry->comm, tsk->comm, TASK_COMM_LEN);
+		__entry->pid		= tsk->pid;
+		__entry->oom_adj	= oom_adj;
+		__entry->rss		= rss;
+		__entry->swap		= swap;
+		__entry->ashmem_pinned	= ashmem_pinned;
+		__entry->ashmem_unpinned = ashmem_unpinned;
+		__entry->expected	= expected;
+	),
+
+	TP_printk("comm=%s pid=%d oom_adj=%d rss=%lu swap=%lu ashmem_pinned=%lu ashmem_unpinned=%lu expected=%lu",
+		  __entry->comm, __entry->pid, __entry->oom_adj,
+		  __entry->rss, __entry->swap, __entry->ashmem_pinned,
+		  __entry->ashmem_unpinned, __entry->expected)
+);
+
+/*
+ * Emitted when a victim is reaped. freed is the growth of free memory
+ * plus free swap since the kill, so it also reflects other activity.
+ */
+TRACE_EVENT(lowmem_reaped,
+	TP_PROTO(struct task_struct *tsk, unsigned long expected, long freed,
+		 unsigned int msecs),
+	TP_ARGS(tsk, expected, freed, msecs),
+
+	TP_STRUCT__entry(
+		__array(char,		comm,	TASK_COMM_LEN	)
+		__field(pid_t,		pid			)
+		__field(unsigned long,	expected		)
+		__field(long,		freed			)
+		__field(unsigned int,	msecs			)
+	),
+
+	TP_fast_assign(
+		memcpy(__entry->comm, tsk->comm, TASK_COMM_LEN);
+		__entry->pid		= tsk->pid;
+		__entry->expected	= expected;
+		__entry->freed		= freed;
+		__entry->msecs		= msecs;
+	),
+
+	TP_printk("comm=%s pid=%d expected=%lu freed=%ld msecs=%u",
+		  __entry->comm, __entry->pid, __entry->expected,
+		  __entry->freed, __entry->msecs)
+);
+
+#endif /* _TRACE_LOWMEMORYKILLER_H */
+
+/* This part must be outside protection */
+#include <trace/define_trace.h>
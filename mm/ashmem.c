@@ -27,6 +27,8 @@
 #include <linux/personality.h>
 #include <linux/bitops.h>
 #include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/fdtable.h>
 #include <linux/shmem_fs.h>
 #include <linux/ashmem.h>
 #include <asm/cacheflush.h>
@@ -38,10 +40,11 @@
 /*
  * ashmem_area - anonymous shared memory area
  * Lifecycle: From our parent file's open() until its release()
- * Locking: Protected by `ashmem_mutex'
+ * Locking: Protected by its `mutex'
  * Big Note: Mappings do NOT pin this structure; it dies on close()
  */
 struct ashmem_area {
+	struct mutex mutex;		/* protects the area and its ranges */
 	char name[ASHMEM_FULL_NAME_LEN];/* optional name for /proc/pid/maps */
 	struct list_head unpinned_list;	/* list of all ashmem areas */
 	struct file *file;		/* the shmem-based backing file */
@@ -49,12 +52,13 @@ struct ashmem_area {
 	unsigned long vm_start;		/* Start address of vm_area
 					 * which maps this ashmem */
 	unsigned long prot_mask;	/* allowed prot bits, as vm_flags */
+	unsigned long lru_pages;	/* unpinned pages on the LRU list */
 };
 
 /*
  * ashmem_range - represents an interval of unpinned (evictable) pages
  * Lifecycle: From unpin to pin
- * Locking: Protected by `ashmem_mutex'
+ * Locking: Protected by its area's `mutex', lru also by `ashmem_lru_lock'
  */
 struct ashmem_range {
 	struct list_head lru;		/* entry in LRU list */
@@ -65,18 +69,26 @@ struct ashmem_range {
 	unsigned int purged;		/* ASHMEM_NOT or ASHMEM_WAS_PURGED */
 };
 
-/* LRU list of unpinned pages, protected by ashmem_mutex */
+/* LRU list of unpinned pages, protected by ashmem_lru_lock */
 static LIST_HEAD(ashmem_lru_list);
 
-/* Count of pages on our LRU list, protected by ashmem_mutex */
-static unsigned long lru_count;
+/*
+ * Count of pages on our LRU list, changed under ashmem_lru_lock and read
+ * without it
+ */
+static atomic_long_t lru_count = ATOMIC_LONG_INIT(0);
 
 /*
- * ashmem_mutex - protects the list of and each individual ashmem_area
+ * ashmem_lru_lock - protects the LRU list, and adding and removing pages
+ * from it
+ *
+ * Lock Ordering: asma->mutex -> i_mutex -> i_alloc_sem
+ *                asma->mutex -> ashmem_lru_lock
  *
- * Lock Ordering: ashmex_mutex -> i_mutex -> i_alloc_sem
+ * The shrinker walks the LRU under ashmem_lru_lock, so it only trylocks the
+ * areas it finds there.
  */
-static DEFINE_MUTEX(ashmem_mutex);
+static DEFINE_SPINLOCK(ashmem_lru_lock);
 
 static struct kmem_cache *ashmem_area_cachep __read_mostly;
 static struct kmem_cache *ashmem_range_cachep __read_mostly;
@@ -107,14 +119,20 @@ static struct kmem_cache *ashmem_range_cachep __read_mostly;
 
 static inline void lru_add(struct ashmem_range *range)
 {
+	spin_lock(&ashmem_lru_lock);
 	list_add_tail(&range->lru, &ashmem_lru_list);
-	lru_count += range_size(range);
+	spin_unlock(&ashmem_lru_lock);
+	atomic_long_add(range_size(range), &lru_count);
+	range->asma->lru_pages += range_size(range);
 }
 
 static inline void lru_del(struct ashmem_range *range)
 {
+	spin_lock(&ashmem_lru_lock);
 	list_del(&range->lru);
-	lru_count -= range_size(range);
+	spin_unlock(&ashmem_lru_lock);
+	atomic_long_sub(range_size(range), &lru_count);
+	range->asma->lru_pages -= range_size(range);
 }
 
 /*
@@ -125,16 +143,17 @@ static inline void lru_del(struct ashmem_range *range)
  * 'purged' - initial purge value (ASMEM_NOT_PURGED or ASHMEM_WAS_PURGED)
  * 'start' - starting page, inclusive
  * 'end' - ending page, inclusive
+ * 'gfp' - allocation flags
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static int range_alloc(struct ashmem_area *asma,
 		       struct ashmem_range *prev_range, unsigned int purged,
-		       size_t start, size_t end)
+		       size_t start, size_t end, gfp_t gfp)
 {
 	struct ashmem_range *range;
 
-	range = kmem_cache_zalloc(ashmem_range_cachep, GFP_KERNEL);
+	range = kmem_cache_zalloc(ashmem_range_cachep, gfp);
 	if (unlikely(!range))
 		return -ENOMEM;
 
@@ -162,7 +181,7 @@ static void range_del(struct ashmem_range *range)
 /*
  * range_shrink - shrinks a range
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static inline void range_shrink(struct ashmem_range *range,
 				size_t start, size_t end)
@@ -172,8 +191,10 @@ static inline void range_shrink(struct ashmem_range *range,
 	range->pgstart = start;
 	range->pgend = end;
 
-	if (range_on_lru(range))
-		lru_count -= pre - range_size(range);
+	if (range_on_lru(range)) {
+		atomic_long_sub(pre - range_size(range), &lru_count);
+		range->asma->lru_pages -= pre - range_size(range);
+	}
 }
 
 static int ashmem_open(struct inode *inode, struct file *file)
@@ -189,6 +210,7 @@ static int ashmem_open(struct inode *inode, struct file *file)
 	if (unlikely(!asma))
 		return -ENOMEM;
 
+	mutex_init(&asma->mutex);
 	INIT_LIST_HEAD(&asma->unpinned_list);
 	memcpy(asma->name, ASHMEM_NAME_PREFIX, ASHMEM_NAME_PREFIX_LEN);
 	asma->prot_mask = PROT_MASK;
@@ -202,10 +224,10 @@ static int ashmem_release(struct inode *ignored, struct file *file)
 	struct ashmem_area *asma = file->private_data;
 	struct ashmem_range *range, *next;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 	list_for_each_entry_safe(range, next, &asma->unpinned_list, unpinned)
 		range_del(range);
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 
 	if (asma->file)
 		fput(asma->file);
@@ -220,7 +242,7 @@ static ssize_t ashmem_read(struct file *file, char __user *buf,
 	struct ashmem_area *asma = file->private_data;
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	/* If size is not set, or set to 0, always return EOF. */
 	if (asma->size == 0) {
@@ -241,7 +263,7 @@ static ssize_t ashmem_read(struct file *file, char __user *buf,
 	asma->file->f_pos = *pos;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
@@ -250,7 +272,7 @@ static loff_t ashmem_llseek(struct file *file, loff_t offset, int origin)
 	struct ashmem_area *asma = file->private_data;
 	int ret;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	if (asma->size == 0) {
 		ret = -EINVAL;
@@ -271,7 +293,7 @@ static loff_t ashmem_llseek(struct file *file, loff_t offset, int origin)
 	file->f_pos = asma->file->f_pos;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
@@ -288,7 +310,7 @@ static int ashmem_mmap(struct file *file, struct vm_area_struct *vma)
 	struct ashmem_area *asma = file->private_data;
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	/* user needs to SET_SIZE before mapping */
 	if (unlikely(!asma->size)) {
@@ -332,7 +354,7 @@ static int ashmem_mmap(struct file *file, struct vm_area_struct *vma)
 	asma->vm_start = vma->vm_start;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
@@ -349,38 +371,60 @@ out:
  *
  * We approximate LRU via least-recently-unpinned, jettisoning unpinned partial
  * chunks of ashmem regions LRU-wise one-at-a-time until we hit 'nr_to_scan'
- * pages freed.
+ * pages freed. The last chunk is split so that exactly 'nr_to_scan' pages go.
  */
 static int ashmem_shrink(int nr_to_scan, gfp_t gfp_mask)
 {
-	struct ashmem_range *range, *next;
-
 	/* We might recurse into filesystem code, so bail out if necessary */
 	if (nr_to_scan && !(gfp_mask & __GFP_FS))
 		return -1;
-	if (!nr_to_scan)
-		return lru_count;
 
-	/* Avoid deadlock caused by recursive locking  */
-	if (unlikely(!mutex_trylock(&ashmem_mutex)))
-		return -1;
+	while (nr_to_scan > 0) {
+		struct ashmem_range *range;
+		struct ashmem_area *asma = NULL;
+		struct inode *inode;
+		size_t pgstart, pgend;
 
-	list_for_each_entry_safe(range, next, &ashmem_lru_list, lru) {
-		struct inode *inode = range->asma->file->f_dentry->d_inode;
-		loff_t start = range->pgstart * PAGE_SIZE;
-		loff_t end = (range->pgend + 1) * PAGE_SIZE - 1;
+		/*
+		 * Avoid deadlock caused by recursive locking, and don't wait
+		 * for areas that are busy: skip the ones we can't lock. A
+		 * range stays on the LRU until its area's mutex is taken, so
+		 * holding it keeps both alive.
+		 */
+		spin_lock(&ashmem_lru_lock);
+		list_for_each_entry(range, &ashmem_lru_list, lru) {
+			if (mutex_trylock(&range->asma->mutex)) {
+				asma = range->asma;
+				break;
+			}
+		}
+		spin_unlock(&ashmem_lru_lock);
+		if (!asma)
+			break;
 
-		vmtruncate_range(inode, start, end);
-		range->purged = ASHMEM_WAS_PURGED;
-		lru_del(range);
+		inode = asma->file->f_dentry->d_inode;
+		pgend = range->pgend;
+		if (range_size(range) > nr_to_scan &&
+		    !range_alloc(asma, range, ASHMEM_WAS_PURGED,
+				 pgend - nr_to_scan + 1, pgend,
+				 GFP_NOWAIT | __GFP_NOWARN)) {
+			/* purge the tail, the rest stays on the LRU */
+			pgstart = pgend - nr_to_scan + 1;
+			range_shrink(range, range->pgstart, pgstart - 1);
+		} else {
+			pgstart = range->pgstart;
+			lru_del(range);
+			range->purged = ASHMEM_WAS_PURGED;
+		}
 
-		nr_to_scan -= range_size(range);
-		if (nr_to_scan <= 0)
-			break;
+		vmtruncate_range(inode, pgstart * PAGE_SIZE,
+				 (pgend + 1) * PAGE_SIZE - 1);
+		mutex_unlock(&asma->mutex);
+
+		nr_to_scan -= pgend - pgstart + 1;
 	}
-	mutex_unlock(&ashmem_mutex);
 
-	return lru_count;
+	return atomic_long_read(&lru_count);
 }
 
 static struct shrinker ashmem_shrinker = {
@@ -392,7 +436,7 @@ static int set_prot_mask(struct ashmem_area *asma, unsigned long prot)
 {
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	/* the user can only remove, not add, protection bits */
 	if (unlikely((asma->prot_mask & prot) != prot)) {
@@ -407,7 +451,7 @@ static int set_prot_mask(struct ashmem_area *asma, unsigned long prot)
 	asma->prot_mask = prot;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
@@ -415,7 +459,7 @@ static int set_name(struct ashmem_area *asma, void __user *name)
 {
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	/* cannot change an existing mapping's name */
 	if (unlikely(asma->file)) {
@@ -429,7 +473,7 @@ static int set_name(struct ashmem_area *asma, void __user *name)
 	asma->name[ASHMEM_FULL_NAME_LEN-1] = '\0';
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 
 	return ret;
 }
@@ -438,7 +482,7 @@ static int get_name(struct ashmem_area *asma, void __user *name)
 {
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 	if (asma->name[ASHMEM_NAME_PREFIX_LEN] != '\0') {
 		size_t len;
 
@@ -455,7 +499,7 @@ static int get_name(struct ashmem_area *asma, void __user *name)
 					  sizeof(ASHMEM_NAME_DEF))))
 			ret = -EFAULT;
 	}
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 
 	return ret;
 }
@@ -464,7 +508,7 @@ static int get_name(struct ashmem_area *asma, void __user *name)
  * ashmem_pin - pin the given ashmem region, returning whether it was
  * previously purged (ASHMEM_WAS_PURGED) or not (ASHMEM_NOT_PURGED).
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static int ashmem_pin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 {
@@ -518,7 +562,7 @@ static int ashmem_pin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 			 * second half and adjust the first chunk's endpoint.
 			 */
 			range_alloc(asma, range, range->purged,
-				    pgend + 1, range->pgend);
+				    pgend + 1, range->pgend, GFP_KERNEL);
 			range_shrink(range, range->pgstart, pgstart - 1);
 			break;
 		}
@@ -530,7 +574,7 @@ static int ashmem_pin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 /*
  * ashmem_unpin - unpin the given range of pages. Returns zero on success.
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static int ashmem_unpin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 {
@@ -558,14 +602,14 @@ restart:
 		}
 	}
 
-	return range_alloc(asma, range, purged, pgstart, pgend);
+	return range_alloc(asma, range, purged, pgstart, pgend, GFP_KERNEL);
 }
 
 /*
  * ashmem_get_pin_status - Returns ASHMEM_IS_UNPINNED if _any_ pages in the
  * given interval are unpinned and ASHMEM_IS_PINNED otherwise.
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static int ashmem_get_pin_status(struct ashmem_area *asma, size_t pgstart,
 				 size_t pgend)
@@ -614,7 +658,7 @@ static int ashmem_pin_unpin(struct ashmem_area *asma, unsigned long cmd,
 	pgstart = pin.offset / PAGE_SIZE;
 	pgend = pgstart + (pin.len / PAGE_SIZE) - 1;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	switch (cmd) {
 	case ASHMEM_PIN:
@@ -628,7 +672,7 @@ static int ashmem_pin_unpin(struct ashmem_area *asma, unsigned long cmd,
 		break;
 	}
 
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 
 	return ret;
 }
@@ -676,10 +720,11 @@ static int ashmem_cache_op(struct ashmem_area *asma,
 	void (*cache_func)(unsigned long vstart, unsigned long length,
 				unsigned long pstart))
 {
+	int ret = 0;
 #ifdef CONFIG_OUTER_CACHE
 	unsigned long vaddr;
 #endif
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 #ifndef CONFIG_OUTER_CACHE
 	cache_func(asma->vm_start, asma->size, 0);
 #else
@@ -688,14 +733,16 @@ static int ashmem_cache_op(struct ashmem_area *asma,
 
 		unsigned long physaddr;
 		physaddr = virtaddr_to_physaddr(vaddr);
-		if (!physaddr)
-			return -EINVAL;
+		if (!physaddr) {
+			ret = -EINVAL;
+			break;
+		}
 		cache_func(vaddr, PAGE_SIZE, physaddr);
 	}
 
 #endif
-	mutex_unlock(&ashmem_mutex);
-	return 0;
+	mutex_unlock(&asma->mutex);
+	return ret;
 }
 
 static long ashmem_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
@@ -822,6 +869,56 @@ static struct miscdevice ashmem_misc = {
 	.fops = &ashmem_fops,
 };
 
+/*
+ * ashmem_task_footprint - pages released along with @tsk's ashmem areas
+ *
+ * Counts the resident pages of the areas @tsk holds the only reference to,
+ * split into pinned and unpinned (evictable, not yet purged) pages. Runs
+ * without the areas' locks and is only an estimate, meant for ranking victims
+ * in the lowmemorykiller.
+ */
+void ashmem_task_footprint(struct task_struct *tsk, unsigned long *pinned,
+			   unsigned long *unpinned)
+{
+	struct files_struct *files;
+	struct fdtable *fdt;
+	unsigned int fd;
+
+	*pinned = 0;
+	*unpinned = 0;
+
+	files = get_files_struct(tsk);
+	if (!files)
+		return;
+
+	/* An area stays alive at least as long as its fd is installed */
+	spin_lock(&files->file_lock);
+	fdt = files_fdtable(files);
+	for (fd = 0; fd < fdt->max_fds; fd++) {
+		struct file *file = fdt->fd[fd];
+		struct ashmem_area *asma;
+		struct file *vmfile;
+		unsigned long resident, lru;
+
+		if (!file || file->f_op != &ashmem_fops ||
+		    file_count(file) != 1)
+			continue;
+
+		asma = file->private_data;
+		vmfile = ACCESS_ONCE(asma->file);
+		if (!vmfile)
+			continue;
+
+		resident = vmfile->f_mapping->nrpages;
+		lru = min(ACCESS_ONCE(asma->lru_pages), resident);
+		*unpinned += lru;
+		*pinned += resident - lru;
+	}
+	spin_unlock(&files->file_lock);
+
+	put_files_struct(files);
+}
+
 static int __init ashmem_init(void)
 {
 	int ret;
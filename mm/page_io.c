@@ -96,8 +96,7 @@ void end_swap_bio_read(struct bio *bio, int err)
  */
 int swap_writepage(struct page *page, struct writeback_control *wbc)
 {
-	struct bio *bio;
-	int ret = 0, rw = WRITE;
+	int ret = 0;
 
 	if (try_to_free_swap(page)) {
 		unlock_page(page);
@@ -110,7 +109,22 @@ int swap_writepage(struct page *page, struct writeback_control *wbc)
 		end_page_writeback(page); 
 		goto out; 
 	}
-	
+
+	ret = __swap_writepage(page, wbc);
+out:
+	return ret;
+}
+
+/*
+ * Writes a locked swap cache page to the swap device, without offering
+ * it to frontswap first. Frontswap backends use this to write back the
+ * pages they can no longer keep.
+ */
+int __swap_writepage(struct page *page, struct writeback_control *wbc)
+{
+	struct bio *bio;
+	int ret = 0, rw = WRITE;
+
 	bio = get_swap_bio(GFP_NOIO, page_private(page), page,
 				end_swap_bio_write);
 	if (bio == NULL) {
@@ -0,0 +1,126 @@
+/*
+ * Memory pressure notifications
+ *
+ * The share of scanned pages that reclaim fails to free tells how hard the
+ * VM struggles to satisfy allocations. It is computed over windows of
+ * vmpressure_win scanned pages, and every completed window is reported to
+ * the registered notifiers, from process context, as one of the
+ * vmpressure_levels. This lets policies such as the Android
+ * lowmemorykiller act on pressure changes instead of being called from
+ * every shrinker pass.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/notifier.h>
+#include <linux/spinlock.h>
+#include <linux/swap.h>
+#include <linux/workqueue.h>
+#include <linux/vmpressure.h>
+
+/*
+ * Pages scanned per window: large enough to smooth out single reclaim
+ * passes, small enough to report pressure within a few of them.
+ */
+static const unsigned long vmpressure_win = SWAP_CLUSTER_MAX * 16;
+
+/* Pressure, in percent, at which each level starts */
+static const unsigned int vmpressure_level_med = 60;
+static const unsigned int vmpressure_level_critical = 95;
+
+static BLOCKING_NOTIFIER_HEAD(vmpressure_notifier);
+
+static DEFINE_SPINLOCK(vmpressure_lock);
+/* Window being accumulated */
+static unsigned long vmpressure_scanned;
+static unsigned long vmpressure_reclaimed;
+/* Completed windows not yet reported */
+static unsigned long vmpressure_work_scanned;
+static unsigned long vmpressure_work_reclaimed;
+
+static enum vmpressure_levels vmpressure_level(unsigned int pressure)
+{
+	if (pressure >= vmpressure_level_critical)
+		return VMPRESSURE_CRITICAL;
+	else if (pressure >= vmpressure_level_med)
+		return VMPRESSURE_MEDIUM;
+	return VMPRESSURE_LOW;
+}
+
+static void vmpressure_work_fn(struct work_struct *work)
+{
+	unsigned long scanned, reclaimed;
+	unsigned int pressure;
+
+	spin_lock(&vmpressure_lock);
+	scanned = vmpressure_work_scanned;
+	reclaimed = vmpressure_work_reclaimed;
+	vmpressure_work_scanned = 0;
+	vmpressure_work_reclaimed = 0;
+	spin_unlock(&vmpressure_lock);
+
+	if (!scanned)
+		return;
+
+	/* Reclaim may free more than it scanned, e.g. through slab */
+	reclaimed = min(reclaimed, scanned);
+	pressure = 100 - reclaimed * 100 / scanned;
+
+	blocking_notifier_call_chain(&vmpressure_notifier,
+			vmpressure_level(pressure), (void *)(long)pressure);
+}
+
+static DECLARE_WORK(vmpressure_work, vmpressure_work_fn);
+
+/**
+ * vmpressure() - Account reclaim efficiency
+ * @gfp:	reclaimer's gfp mask
+ * @scanned:	number of pages scanned
+ * @reclaimed:	number of pages reclaimed
+ *
+ * Called by reclaim after each zone is shrunk. Notifiers are run from a
+ * workqueue once a window of vmpressure_win pages has been scanned, so
+ * this is cheap and never sleeps.
+ */
+void vmpressure(gfp_t gfp, unsigned long scanned, unsigned long reclaimed)
+{
+	/*
+	 * Allocations that cannot do I/O or enter the filesystem get
+	 * little out of reclaim, which says nothing about the system.
+	 */
+	if (!(gfp & (__GFP_IO | __GFP_FS)))
+		return;
+
+	if (!scanned)
+		return;
+
+	spin_lock(&vmpressure_lock);
+	vmpressure_scanned += scanned;
+	vmpressure_reclaimed += reclaimed;
+	if (vmpressure_scanned < vmpressure_win) {
+		spin_unlock(&vmpressure_lock);
+		return;
+	}
+
+	vmpressure_work_scanned += vmpressure_scanned;
+	vmpressure_work_reclaimed += vmpressure_reclaimed;
+	vmpressure_scanned = 0;
+	vmpressure_reclaimed = 0;
+	spin_unlock(&vmpressure_lock);
+
+	schedule_work(&vmpressure_work);
+}
+
+int vmpressure_register_notifier(struct notifier_block *nb)
+{
+	return blocking_notifier_chain_register(&vmpressure_notifier, nb);
+}
+EXPORT_SYMBOL_GPL(vmpressure_register_notifier);
+
+int vmpressure_unregister_notifier(struct notifier_block *nb)
+{
+	return blocking_notifier_chain_unregister(&vmpressure_notifier, nb);
+}
+EXPORT_SYMBOL_GPL(vmpressure_unregister_notifier);
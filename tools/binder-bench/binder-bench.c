@@ -0,0 +1,545 @@
+/*
+ * binder-bench - binder transaction throughput as client/server pairs
+ * are added
+ *
+ * Every pair is a server process that registers a binder object with
+ * the context manager and a client process that looks it up and then
+ * calls it in a loop, waiting for each reply. The benchmark becomes the
+ * context manager itself, so it has to run while no servicemanager is
+ * running (e.g. after "stop"), as root:
+ *
+ *	binder-bench -p 8 -t 5 -s 128
+ *
+ * runs 1, 2, ... 8 pairs for 5 seconds each with 128 byte calls and
+ * prints the total and per-pair transactions per second. With a global
+ * driver lock the total stays flat as pairs are added, with per-process
+ * locking it should scale with the number of CPUs.
+ *
+ * Licensed under the terms of the GNU GPL, version 2.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "binder.h"
+
+#define MAP_SIZE	(128 * 1024)
+#define MAX_PAIRS	256
+#define MAX_DATA	4096
+
+enum {
+	CODE_ADD_SERVER = 1,	/* manager: register pair id -> binder */
+	CODE_GET_SERVER,	/* manager: look up pair id */
+	CODE_PING,		/* server: echo */
+};
+
+struct bdev {
+	int fd;
+	void *map;
+};
+
+/* CODE_ADD_SERVER data, obj must be pointer aligned */
+struct add_server {
+	uint32_t id;
+	struct flat_binder_object obj;
+};
+
+struct reply {
+	struct binder_transaction_data txn;
+	int status;		/* 0, or the BR_ code of a failed call */
+};
+
+struct result {
+	uint64_t calls;
+	uint64_t ns;
+};
+
+static struct {
+	int max_pairs;
+	int seconds;
+	size_t size;
+	int mgr_fd;
+	uint32_t handles[(MAX_PAIRS + 1) * MAX_PAIRS];	/* manager table */
+} bench = {
+	.max_pairs = 4,
+	.seconds = 5,
+	.size = 64,
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void bdev_open(struct bdev *b)
+{
+	struct binder_version vers;
+
+	b->fd = open("/dev/binder", O_RDWR);
+	if (b->fd < 0) {
+		perror("/dev/binder");
+		exit(1);
+	}
+	if (ioctl(b->fd, BINDER_VERSION, &vers) < 0 ||
+	    vers.protocol_version != BINDER_CURRENT_PROTOCOL_VERSION) {
+		fprintf(stderr, "binder: protocol version mismatch\n");
+		exit(1);
+	}
+	b->map = mmap(NULL, MAP_SIZE, PROT_READ, MAP_PRIVATE, b->fd, 0);
+	if (b->map == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+}
+
+static void bdev_write(struct bdev *b, void *data, size_t len)
+{
+	struct binder_write_read bwr = {
+		.write_size = len,
+		.write_buffer = (unsigned long)data,
+	};
+
+	while (ioctl(b->fd, BINDER_WRITE_READ, &bwr) < 0) {
+		if (errno != EINTR) {
+			perror("binder write");
+			exit(1);
+		}
+	}
+}
+
+static void free_buffer(struct bdev *b, const void *data)
+{
+	struct {
+		uint32_t cmd;
+		const void *data;
+	} __attribute__((packed)) cmd = { BC_FREE_BUFFER, data };
+
+	bdev_write(b, &cmd, sizeof(cmd));
+}
+
+static void send_reply(struct bdev *b, const void *data, size_t len,
+		       const void *offsets, size_t offsets_len)
+{
+	struct {
+		uint32_t cmd;
+		struct binder_transaction_data txn;
+	} __attribute__((packed)) cmd;
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.cmd = BC_REPLY;
+	cmd.txn.data_size = len;
+	cmd.txn.data.ptr.buffer = data;
+	cmd.txn.offsets_size = offsets_len;
+	cmd.txn.data.ptr.offsets = offsets;
+	bdev_write(b, &cmd, sizeof(cmd));
+}
+
+/*
+ * Handles the commands in a read buffer that need an answer from user
+ * space. Returns the first transaction or reply in *txn, with its type
+ * in the return value, or 0 if there was none.
+ */
+static uint32_t parse(struct bdev *b, const char *ptr, const char *end,
+		      struct binder_transaction_data *txn)
+{
+	uint32_t found = 0;
+
+	while (ptr < end) {
+		uint32_t cmd = *(const uint32_t *)ptr;
+
+		ptr += sizeof(uint32_t);
+		switch (cmd) {
+		case BR_NOOP:
+		case BR_TRANSACTION_COMPLETE:
+		case BR_SPAWN_LOOPER:
+			break;
+		case BR_INCREFS:
+		case BR_ACQUIRE: {
+			struct {
+				uint32_t cmd;
+				struct binder_ptr_cookie pc;
+			} __attribute__((packed)) done;
+
+			done.cmd = cmd == BR_INCREFS ? BC_INCREFS_DONE :
+						       BC_ACQUIRE_DONE;
+			memcpy(&done.pc, ptr, sizeof(done.pc));
+			bdev_write(b, &done, sizeof(done));
+			ptr += sizeof(struct binder_ptr_cookie);
+			break;
+		}
+		case BR_RELEASE:
+		case BR_DECREFS:
+			ptr += sizeof(struct binder_ptr_cookie);
+			break;
+		case BR_TRANSACTION:
+		case BR_REPLY:
+			memcpy(txn, ptr, sizeof(*txn));
+			ptr += sizeof(*txn);
+			found = cmd;
+			break;
+		case BR_DEAD_REPLY:
+		case BR_FAILED_REPLY:
+			return cmd;
+		default:
+			fprintf(stderr, "binder: unexpected command %x\n",
+				cmd);
+			exit(1);
+		}
+	}
+	return found;
+}
+
+static uint32_t bdev_read(struct bdev *b, struct binder_transaction_data *txn)
+{
+	uint32_t buf[64];
+	struct binder_write_read bwr = {
+		.read_size = sizeof(buf),
+		.read_buffer = (unsigned long)buf,
+	};
+
+	while (ioctl(b->fd, BINDER_WRITE_READ, &bwr) < 0) {
+		if (errno != EINTR) {
+			perror("binder read");
+			exit(1);
+		}
+	}
+	return parse(b, (char *)buf, (char *)buf + bwr.read_consumed, txn);
+}
+
+/*
+ * Calls handle and waits for the reply. The caller frees the reply
+ * buffer with free_buffer() unless the call failed.
+ */
+static void call(struct bdev *b, uint32_t handle, uint32_t code,
+		 const void *data, size_t len,
+		 const void *offsets, size_t offsets_len, struct reply *r)
+{
+	struct {
+		uint32_t cmd;
+		struct binder_transaction_data txn;
+	} __attribute__((packed)) cmd;
+	uint32_t type;
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.cmd = BC_TRANSACTION;
+	cmd.txn.target.handle = handle;
+	cmd.txn.code = code;
+	cmd.txn.data_size = len;
+	cmd.txn.data.ptr.buffer = data;
+	cmd.txn.offsets_size = offsets_len;
+	cmd.txn.data.ptr.offsets = offsets;
+	bdev_write(b, &cmd, sizeof(cmd));
+
+	do {
+		type = bdev_read(b, &r->txn);
+	} while (!type);
+	r->status = type == BR_REPLY ? 0 : type;
+	if (type == BR_TRANSACTION) {
+		fprintf(stderr, "binder: nested call not expected\n");
+		exit(1);
+	}
+}
+
+static void acquire(struct bdev *b, uint32_t handle)
+{
+	struct {
+		uint32_t cmd;
+		uint32_t handle;
+	} __attribute__((packed)) cmd = { BC_ACQUIRE, handle };
+
+	bdev_write(b, &cmd, sizeof(cmd));
+}
+
+static void enter_looper(struct bdev *b)
+{
+	uint32_t cmd = BC_ENTER_LOOPER;
+
+	bdev_write(b, &cmd, sizeof(cmd));
+}
+
+/* Serves CODE_ADD_SERVER and CODE_GET_SERVER for the pairs. */
+static void *manager(void *arg)
+{
+	struct bdev *b = arg;
+
+	enter_looper(b);
+	for (;;) {
+		struct binder_transaction_data txn;
+		const char *data;
+		uint32_t id;
+		struct flat_binder_object obj;
+		size_t offset = 0;
+
+		if (bdev_read(b, &txn) != BR_TRANSACTION)
+			continue;
+		data = txn.data.ptr.buffer;
+		id = *(const uint32_t *)data;
+		if (id >= sizeof(bench.handles) / sizeof(bench.handles[0])) {
+			free_buffer(b, data);
+			send_reply(b, NULL, 0, NULL, 0);
+			continue;
+		}
+		if (txn.code == CODE_ADD_SERVER) {
+			memcpy(&obj, data + offsetof(struct add_server, obj),
+			       sizeof(obj));
+			/* keep the ref when the buffer is freed */
+			acquire(b, obj.handle);
+			bench.handles[id] = obj.handle;
+			free_buffer(b, data);
+			send_reply(b, NULL, 0, NULL, 0);
+		} else if (bench.handles[id]) {
+			free_buffer(b, data);
+			memset(&obj, 0, sizeof(obj));
+			obj.type = BINDER_TYPE_HANDLE;
+			obj.handle = bench.handles[id];
+			send_reply(b, &obj, sizeof(obj), &offset,
+				   sizeof(offset));
+		} else {
+			free_buffer(b, data);
+			send_reply(b, NULL, 0, NULL, 0);
+		}
+	}
+	return NULL;
+}
+
+static void server(uint32_t id)
+{
+	struct bdev b;
+	struct add_server add;
+	size_t offset = offsetof(struct add_server, obj);
+	struct reply r;
+	static char echo[MAX_DATA];
+
+	close(bench.mgr_fd);
+	bdev_open(&b);
+	memset(&add, 0, sizeof(add));
+	add.id = id;
+	add.obj.type = BINDER_TYPE_BINDER;
+	add.obj.binder = &add;
+	add.obj.cookie = &add;
+	call(&b, 0, CODE_ADD_SERVER, &add, sizeof(add), &offset,
+	     sizeof(offset), &r);
+	if (r.status) {
+		fprintf(stderr, "server %u: register failed\n", id);
+		exit(1);
+	}
+	free_buffer(&b, r.txn.data.ptr.buffer);
+
+	enter_looper(&b);
+	for (;;) {
+		struct binder_transaction_data txn;
+		size_t len;
+
+		if (bdev_read(&b, &txn) != BR_TRANSACTION)
+			continue;
+		len = txn.data_size < MAX_DATA ? txn.data_size : MAX_DATA;
+		free_buffer(&b, txn.data.ptr.buffer);
+		send_reply(&b, echo, len, NULL, 0);
+	}
+}
+
+static void client(uint32_t id, int ready_fd, int start_fd, int result_fd)
+{
+	struct bdev b;
+	struct reply r;
+	struct result res = { 0, 0 };
+	static char data[MAX_DATA];
+	uint32_t handle = 0;
+	uint64_t start, end;
+	char c;
+
+	close(bench.mgr_fd);
+	bdev_open(&b);
+	while (!handle) {
+		const struct flat_binder_object *obj;
+
+		call(&b, 0, CODE_GET_SERVER, &id, sizeof(id), NULL, 0, &r);
+		if (r.status) {
+			fprintf(stderr, "client %u: lookup failed\n", id);
+			exit(1);
+		}
+		obj = r.txn.data.ptr.buffer;
+		if (r.txn.data_size >= sizeof(*obj) &&
+		    obj->type == BINDER_TYPE_HANDLE) {
+			handle = obj->handle;
+			acquire(&b, handle);
+		}
+		free_buffer(&b, r.txn.data.ptr.buffer);
+		if (!handle)
+			usleep(10000);
+	}
+
+	if (write(ready_fd, &c, 1) != 1 || read(start_fd, &c, 1) != 1)
+		exit(1);
+
+	start = now_ns();
+	end = start + bench.seconds * 1000000000ULL;
+	do {
+		int i;
+
+		for (i = 0; i < 64; i++) {
+			call(&b, handle, CODE_PING, data, bench.size, NULL, 0,
+			     &r);
+			if (r.status) {
+				fprintf(stderr, "client %u: call failed %x\n",
+					id, r.status);
+				exit(1);
+			}
+			free_buffer(&b, r.txn.data.ptr.buffer);
+		}
+		res.calls += 64;
+		res.ns = now_ns() - start;
+	} while (start + res.ns < end);
+
+	if (write(result_fd, &res, sizeof(res)) != sizeof(res))
+		exit(1);
+	exit(0);
+}
+
+static void run(int nr_pairs, uint32_t first_id)
+{
+	pid_t servers[MAX_PAIRS], clients[MAX_PAIRS];
+	int ready[2], start[2], results[2];
+	double total = 0, min = 0, max = 0;
+	uint64_t calls = 0, ns = 0;
+	int i;
+	char c = 0;
+
+	fflush(stdout);
+	if (pipe(ready) || pipe(start) || pipe(results)) {
+		perror("pipe");
+		exit(1);
+	}
+
+	for (i = 0; i < nr_pairs; i++) {
+		servers[i] = fork();
+		if (servers[i] == 0)
+			server(first_id + i);
+		clients[i] = fork();
+		if (clients[i] == 0)
+			client(first_id + i, ready[1], start[0], results[1]);
+		if (servers[i] < 0 || clients[i] < 0) {
+			perror("fork");
+			exit(1);
+		}
+	}
+
+	/* start the clients together once all of them found their server */
+	for (i = 0; i < nr_pairs; i++) {
+		if (read(ready[0], &c, 1) != 1) {
+			perror("ready");
+			exit(1);
+		}
+	}
+	for (i = 0; i < nr_pairs; i++) {
+		if (write(start[1], &c, 1) != 1) {
+			perror("start");
+			exit(1);
+		}
+	}
+
+	for (i = 0; i < nr_pairs; i++) {
+		struct result res;
+		double rate;
+
+		if (read(results[0], &res, sizeof(res)) != sizeof(res)) {
+			fprintf(stderr, "client failed\n");
+			exit(1);
+		}
+		rate = res.calls * 1e9 / res.ns;
+		total += rate;
+		if (!i || rate < min)
+			min = rate;
+		if (!i || rate > max)
+			max = rate;
+		calls += res.calls;
+		ns += res.ns;
+	}
+
+	for (i = 0; i < nr_pairs; i++) {
+		kill(servers[i], SIGKILL);
+		waitpid(servers[i], NULL, 0);
+		waitpid(clients[i], NULL, 0);
+	}
+	close(ready[0]);
+	close(ready[1]);
+	close(start[0]);
+	close(start[1]);
+	close(results[0]);
+	close(results[1]);
+
+	printf("%5d %12.0f %12.0f %12.0f %12.0f %10.1f\n", nr_pairs, total,
+	       total / nr_pairs, min, max, (double)ns / calls / 1000);
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: binder-bench [-p max_pairs] [-t seconds] [-s bytes]\n"
+		"  -p  run 1 up to max_pairs client/server pairs (default 4)\n"
+		"  -t  seconds per run (default 5)\n"
+		"  -s  bytes per call and reply (default 64)\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct bdev mgr;
+	pthread_t thread;
+	int opt, i;
+
+	while ((opt = getopt(argc, argv, "p:t:s:")) != -1) {
+		switch (opt) {
+		case 'p':
+			bench.max_pairs = atoi(optarg);
+			break;
+		case 't':
+			bench.seconds = atoi(optarg);
+			break;
+		case 's':
+			bench.size = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc || bench.max_pairs < 1 ||
+	    bench.max_pairs > MAX_PAIRS || bench.seconds < 1 ||
+	    bench.size > MAX_DATA)
+		usage();
+
+	bdev_open(&mgr);
+	if (ioctl(mgr.fd, BINDER_SET_CONTEXT_MGR, 0) < 0) {
+		perror("BINDER_SET_CONTEXT_MGR (is servicemanager running?)");
+		exit(1);
+	}
+	if (pthread_create(&thread, NULL, manager, &mgr)) {
+		perror("pthread_create");
+		exit(1);
+	}
+	/* the children close it and open their own */
+	bench.mgr_fd = mgr.fd;
+
+	printf("pairs     total/s     per pair/s       min/s       max/s  avg call us\n");
+	for (i = 1; i <= bench.max_pairs; i++) {
+		run(i, i * MAX_PAIRS);
+		fflush(stdout);
+	}
+	return 0;
+}
@@ -0,0 +1,656 @@
+/*
+ * cpufreq-bench - replay recorded CPU load under each cpufreq governor
+ *
+ * Replays jobs, pieces of work recorded on a device, on the CPUs they were
+ * recorded on, once for every governor. It runs on the simulated cpufreq
+ * driver (CONFIG_CPU_FREQ_SIM): a job is turned into busy time at the
+ * simulated frequency, which the replayer rereads as it goes, so the
+ * governor sees the load its own choices cause. A trace has one job per
+ * line,
+ *
+ *	<start_us> <cpu> <busy_us> <khz> [<deadline_us>]
+ *
+ * for work that kept <cpu> busy for <busy_us> at <khz> when recorded, e.g.
+ * the frames of a UI thread taken from a systrace. It has to be done
+ * within <deadline_us> of its start, by default before the next job on the
+ * same CPU starts (16667us for the last one). Lines starting with '#' are
+ * skipped. Instead of traces, -p replays built-in patterns:
+ *
+ *	scroll	10s of 60fps frames of varying cost on cpu0
+ *	launch	5 bursts of 300ms near full load on cpu0, 1s apart
+ *
+ * For every governor it prints:
+ *
+ *	energy	cycles all CPUs were clocked for, the sum of frequency x time,
+ *		from the driver
+ *	work	cycles of replayed work, and the share of energy they are
+ *	misses	jobs that finished after their deadline, and the worst lateness
+ *	ramp	for jobs that needed more than the frequency they started at,
+ *		the time until the frequency was high enough (to within -q),
+ *		and how many never got there
+ *
+ *	insmod cpufreq_sim.ko transition_us=100
+ *	cpufreq-bench -g ondemand,interactive,smartass2 -p scroll,launch
+ *
+ * Licensed under the terms of the GNU GPL, version 2.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_CPUS		32
+#define DEFAULT_DEADLINE_US	16667
+#define SYSFS_CPU		"/sys/devices/system/cpu/cpu%d/cpufreq/%s"
+
+struct job {
+	uint64_t start_us;	/* since the start of the trace */
+	uint64_t deadline_us;	/* since the start of the job */
+	uint64_t cycles;
+	int cpu;
+};
+
+struct trace {
+	const char *name;
+	struct job *jobs;
+	size_t nr;
+};
+
+struct latencies {
+	unsigned long *us;
+	size_t nr, size;
+};
+
+/* The replayer of one CPU */
+struct cpu_run {
+	int cpu;
+	int freq_fd;		/* scaling_cur_freq */
+	struct job *jobs;	/* this CPU's jobs, in order */
+	size_t nr;
+	pthread_t thread;
+
+	/* results */
+	unsigned long misses;
+	unsigned long max_late_us;
+	struct latencies ramp;
+	unsigned long ramp_never;
+};
+
+/* What one governor did on one trace, for the summary */
+struct result {
+	const char *trace;
+	const char *governor;
+	double energy, work;	/* Mcycles */
+	unsigned long jobs, misses;
+	unsigned long ramp_p50, ramp_p95;	/* us */
+	unsigned long ramp_never;
+};
+
+static struct {
+	int cpus[MAX_CPUS];	/* CPUs on the simulated driver */
+	int nr_cpus;
+	unsigned int max_khz;
+	uint64_t quantum_ns;
+	unsigned int settle_ms;
+	uint64_t t0;		/* start of the run */
+	struct result *results;
+	size_t nr_results;
+} bench;
+
+static uint64_t clock_ns(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t now_ns(void)
+{
+	return clock_ns(CLOCK_MONOTONIC);
+}
+
+static void sleep_until(uint64_t ns)
+{
+	struct timespec ts = {
+		.tv_sec = ns / 1000000000ULL,
+		.tv_nsec = ns % 1000000000ULL,
+	};
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+	       EINTR)
+		;
+}
+
+static void *xrealloc(void *ptr, size_t size)
+{
+	ptr = realloc(ptr, size);
+	if (!ptr) {
+		perror("realloc");
+		exit(1);
+	}
+	return ptr;
+}
+
+static int sysfs_read(int cpu, const char *file, char *buf, size_t size)
+{
+	char path[PATH_MAX];
+	ssize_t len;
+	int fd;
+
+	snprintf(path, sizeof(path), SYSFS_CPU, cpu, file);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	len = read(fd, buf, size - 1);
+	close(fd);
+	if (len < 0)
+		return -1;
+	buf[len] = '\0';
+	buf[strcspn(buf, "\n")] = '\0';
+	return 0;
+}
+
+static int sysfs_write(int cpu, const char *file, const char *val)
+{
+	char path[PATH_MAX];
+	int fd, ret = 0;
+
+	snprintf(path, sizeof(path), SYSFS_CPU, cpu, file);
+	fd = open(path, O_WRONLY);
+	if (fd < 0 || write(fd, val, strlen(val)) < 0)
+		ret = -1;
+	if (fd >= 0)
+		close(fd);
+	return ret;
+}
+
+static uint64_t sysfs_read_u64(int cpu, const char *file)
+{
+	char buf[64];
+
+	if (sysfs_read(cpu, file, buf, sizeof(buf)))
+		return 0;
+	return strtoull(buf, NULL, 10);
+}
+
+static void add_job(struct trace *t, size_t *size, uint64_t start_us,
+		    int cpu, uint64_t busy_us, unsigned int khz,
+		    uint64_t deadline_us)
+{
+	struct job *j;
+
+	if (t->nr == *size) {
+		*size = *size ? *size * 2 : 1024;
+		t->jobs = xrealloc(t->jobs, *size * sizeof(*t->jobs));
+	}
+	j = &t->jobs[t->nr++];
+	j->start_us = start_us;
+	j->cpu = cpu;
+	j->cycles = busy_us * khz / 1000;
+	j->deadline_us = deadline_us;
+}
+
+static int cmp_job(const void *a, const void *b)
+{
+	const struct job *x = a, *y = b;
+
+	if (x->cpu != y->cpu)
+		return x->cpu - y->cpu;
+	return x->start_us < y->start_us ? -1 : x->start_us > y->start_us;
+}
+
+/* Sorts the jobs by CPU and start, and fills in default deadlines */
+static void finish_trace(struct trace *t)
+{
+	size_t i;
+
+	if (!t->nr) {
+		fprintf(stderr, "%s: no jobs found\n", t->name);
+		exit(1);
+	}
+	qsort(t->jobs, t->nr, sizeof(*t->jobs), cmp_job);
+	for (i = 0; i < t->nr; i++) {
+		struct job *j = &t->jobs[i];
+		struct job *next = i + 1 < t->nr ? j + 1 : NULL;
+
+		if (j->deadline_us)
+			continue;
+		if (next && next->cpu == j->cpu && next->start_us > j->start_us)
+			j->deadline_us = next->start_us - j->start_us;
+		else
+			j->deadline_us = DEFAULT_DEADLINE_US;
+	}
+}
+
+static void load_trace(struct trace *t, const char *path)
+{
+	char line[256];
+	size_t size = 0;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f) {
+		perror(path);
+		exit(1);
+	}
+
+	t->name = path;
+	while (fgets(line, sizeof(line), f)) {
+		unsigned long long start_us, busy_us, deadline_us = 0;
+		unsigned int khz;
+		int cpu;
+
+		if (line[0] == '#')
+			continue;
+		if (sscanf(line, "%llu %d %llu %u %llu", &start_us, &cpu,
+			   &busy_us, &khz, &deadline_us) < 4)
+			continue;
+		if (cpu < 0 || cpu >= MAX_CPUS) {
+			fprintf(stderr, "%s: bad cpu %d\n", path, cpu);
+			exit(1);
+		}
+		add_job(t, &size, start_us, cpu, busy_us, khz, deadline_us);
+	}
+	fclose(f);
+	finish_trace(t);
+}
+
+/* Frames of 20 to 50% of a frame at the top frequency, a heavy one every 8 */
+static void make_scroll(struct trace *t)
+{
+	unsigned int seed = 1;
+	size_t size = 0;
+	int i;
+
+	t->name = "scroll";
+	for (i = 0; i < 600; i++) {
+		unsigned int pct;
+
+		seed = seed * 1103515245 + 12345;
+		pct = 20 + (seed >> 16) % 31;
+		if (i % 8 == 7)
+			pct = 85;
+		add_job(t, &size, (uint64_t)i * DEFAULT_DEADLINE_US, 0,
+			DEFAULT_DEADLINE_US * pct / 100, bench.max_khz,
+			DEFAULT_DEADLINE_US);
+	}
+	finish_trace(t);
+}
+
+/* Idle, then 30 back to back 10ms jobs at 90% of the top frequency */
+static void make_launch(struct trace *t)
+{
+	size_t size = 0;
+	int burst, i;
+
+	t->name = "launch";
+	for (burst = 0; burst < 5; burst++) {
+		uint64_t start = 1000000 + (uint64_t)burst * 1300000;
+
+		for (i = 0; i < 30; i++)
+			add_job(t, &size, start + i * 10000, 0, 9000,
+				bench.max_khz, 10000);
+	}
+	finish_trace(t);
+}
+
+static void lat_add(struct latencies *l, unsigned long us)
+{
+	if (l->nr == l->size) {
+		l->size = l->size ? l->size * 2 : 1024;
+		l->us = xrealloc(l->us, l->size * sizeof(*l->us));
+	}
+	l->us[l->nr++] = us;
+}
+
+static unsigned int read_freq(struct cpu_run *r)
+{
+	char buf[32];
+	ssize_t len;
+
+	len = pread(r->freq_fd, buf, sizeof(buf) - 1, 0);
+	if (len <= 0)
+		return bench.max_khz;
+	buf[len] = '\0';
+	return strtoul(buf, NULL, 10);
+}
+
+/*
+ * Works off a job's cycles at whatever the simulated frequency is, one
+ * quantum of CPU time at a time. Only time the replayer actually ran
+ * counts as work done.
+ */
+static void run_job(struct cpu_run *r, struct job *j)
+{
+	uint64_t start = bench.t0 + j->start_us * 1000;
+	uint64_t deadline = start + j->deadline_us * 1000;
+	uint64_t left = j->cycles, need, end;
+	unsigned int khz, target = 0;
+
+	sleep_until(start);
+
+	khz = read_freq(r);
+	need = j->cycles * 1000 / j->deadline_us;
+	if (need > khz)
+		target = need < bench.max_khz ? need : bench.max_khz;
+
+	while (left) {
+		uint64_t slice, cpu_start, ran, done;
+
+		if (target && khz >= target) {
+			lat_add(&r->ramp, (now_ns() - start) / 1000);
+			target = 0;
+		}
+		slice = left * 1000000 / (khz ? khz : 1);
+		if (slice > bench.quantum_ns)
+			slice = bench.quantum_ns;
+		if (!slice)
+			slice = 1;
+		cpu_start = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+		do
+			ran = clock_ns(CLOCK_THREAD_CPUTIME_ID) - cpu_start;
+		while (ran < slice);
+
+		done = ran * khz / 1000000;
+		left = done >= left ? 0 : left - done;
+		khz = read_freq(r);
+	}
+
+	end = now_ns();
+	if (target)
+		r->ramp_never++;
+	if (end > deadline) {
+		unsigned long late = (end - deadline) / 1000;
+
+		r->misses++;
+		if (late > r->max_late_us)
+			r->max_late_us = late;
+	}
+}
+
+static void *replayer(void *arg)
+{
+	struct cpu_run *r = arg;
+	cpu_set_t set;
+	size_t i;
+
+	CPU_ZERO(&set);
+	CPU_SET(r->cpu, &set);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) {
+		fprintf(stderr, "cannot run on cpu%d\n", r->cpu);
+		exit(1);
+	}
+	for (i = 0; i < r->nr; i++)
+		run_job(r, &r->jobs[i]);
+	return NULL;
+}
+
+static int cmp_ulong(const void *a, const void *b)
+{
+	unsigned long x = *(const unsigned long *)a;
+	unsigned long y = *(const unsigned long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static int has_cpu(int cpu)
+{
+	int i;
+
+	for (i = 0; i < bench.nr_cpus; i++)
+		if (bench.cpus[i] == cpu)
+			return 1;
+	return 0;
+}
+
+static void sim_totals(uint64_t *cycles, uint64_t *transitions)
+{
+	int i;
+
+	*cycles = *transitions = 0;
+	for (i = 0; i < bench.nr_cpus; i++) {
+		*cycles += sysfs_read_u64(bench.cpus[i], "sim_cycles");
+		*transitions += sysfs_read_u64(bench.cpus[i],
+					       "sim_transitions");
+	}
+}
+
+static void replay(struct trace *t, const char *gov)
+{
+	struct cpu_run runs[MAX_CPUS];
+	uint64_t cycles0, trans0, cycles1, trans1, start, work = 0;
+	struct latencies ramp = { NULL, 0, 0 };
+	unsigned long misses = 0, max_late = 0, never = 0;
+	struct result *res;
+	int nr_runs = 0, i;
+	size_t n;
+
+	for (i = 0; i < bench.nr_cpus; i++) {
+		if (sysfs_write(bench.cpus[i], "scaling_governor", gov)) {
+			fprintf(stderr, "cannot select governor %s on cpu%d\n",
+				gov, bench.cpus[i]);
+			return;
+		}
+	}
+
+	/* One replayer per CPU the trace uses */
+	memset(runs, 0, sizeof(runs));
+	for (n = 0; n < t->nr; n++) {
+		struct job *j = &t->jobs[n];
+		struct cpu_run *r = nr_runs ? &runs[nr_runs - 1] : NULL;
+		char path[PATH_MAX];
+
+		work += j->cycles;
+		if (r && r->cpu == j->cpu) {
+			r->nr++;
+			continue;
+		}
+		if (!has_cpu(j->cpu)) {
+			fprintf(stderr, "%s: cpu%d is not on cpufreq-sim\n",
+				t->name, j->cpu);
+			exit(1);
+		}
+		r = &runs[nr_runs++];
+		r->cpu = j->cpu;
+		r->jobs = j;
+		r->nr = 1;
+		snprintf(path, sizeof(path), SYSFS_CPU, r->cpu,
+			 "scaling_cur_freq");
+		r->freq_fd = open(path, O_RDONLY);
+		if (r->freq_fd < 0) {
+			perror(path);
+			exit(1);
+		}
+	}
+
+	/* Let the governor settle from the previous run */
+	usleep(bench.settle_ms * 1000);
+
+	sim_totals(&cycles0, &trans0);
+	start = now_ns();
+	bench.t0 = start + 10000000;
+	for (i = 0; i < nr_runs; i++)
+		pthread_create(&runs[i].thread, NULL, replayer, &runs[i]);
+	for (i = 0; i < nr_runs; i++)
+		pthread_join(runs[i].thread, NULL);
+	sim_totals(&cycles1, &trans1);
+
+	for (i = 0; i < nr_runs; i++) {
+		struct cpu_run *r = &runs[i];
+
+		misses += r->misses;
+		if (r->max_late_us > max_late)
+			max_late = r->max_late_us;
+		never += r->ramp_never;
+		for (n = 0; n < r->ramp.nr; n++)
+			lat_add(&ramp, r->ramp.us[n]);
+		free(r->ramp.us);
+		close(r->freq_fd);
+	}
+
+	res = &bench.results[bench.nr_results++];
+	res->trace = t->name;
+	res->governor = gov;
+	res->energy = (cycles1 - cycles0) / 1e6;
+	res->work = work / 1e6;
+	res->jobs = t->nr;
+	res->misses = misses;
+	res->ramp_never = never;
+	if (ramp.nr) {
+		qsort(ramp.us, ramp.nr, sizeof(*ramp.us), cmp_ulong);
+		res->ramp_p50 = ramp.us[ramp.nr * 50 / 100];
+		res->ramp_p95 = ramp.us[ramp.nr * 95 / 100];
+	}
+
+	printf("%s on %s:\n", t->name, gov);
+	printf("  elapsed %.3fs, %llu transitions\n",
+	       (now_ns() - start) / 1e9,
+	       (unsigned long long)(trans1 - trans0));
+	printf("  energy %.1f Mcycles, work %.1f Mcycles (%.1f%%)\n",
+	       res->energy, res->work,
+	       res->energy ? 100 * res->work / res->energy : 0);
+	printf("  jobs %zu, deadline misses %lu (%.1f%%), worst %.1fms late\n",
+	       t->nr, misses, 100.0 * misses / t->nr, max_late / 1e3);
+	if (ramp.nr)
+		printf("  ramp %zu jobs: p50 %.1fms p95 %.1fms max %.1fms, "
+		       "%lu never\n", ramp.nr, res->ramp_p50 / 1e3,
+		       res->ramp_p95 / 1e3, ramp.us[ramp.nr - 1] / 1e3,
+		       never);
+	else
+		printf("  ramp: no jobs needed a higher frequency, %lu never\n",
+		       never);
+	printf("\n");
+	free(ramp.us);
+}
+
+static void summary(void)
+{
+	size_t i;
+
+	printf("%-10s %-14s %10s %6s %7s %6s %9s %9s %6s\n", "trace",
+	       "governor", "energy(Mc)", "work%", "misses", "miss%",
+	       "ramp_p50", "ramp_p95", "never");
+	for (i = 0; i < bench.nr_results; i++) {
+		struct result *r = &bench.results[i];
+
+		printf("%-10s %-14s %10.1f %6.1f %7lu %6.1f %7.1fms %7.1fms "
+		       "%6lu\n", r->trace, r->governor, r->energy,
+		       r->energy ? 100 * r->work / r->energy : 0, r->misses,
+		       100.0 * r->misses / r->jobs, r->ramp_p50 / 1e3,
+		       r->ramp_p95 / 1e3, r->ramp_never);
+	}
+}
+
+/* Finds the CPUs on the simulated driver and the top frequency */
+static void find_cpus(void)
+{
+	char buf[64];
+	int cpu;
+
+	for (cpu = 0; cpu < MAX_CPUS; cpu++) {
+		if (sysfs_read(cpu, "scaling_driver", buf, sizeof(buf)) ||
+		    strcmp(buf, "cpufreq-sim"))
+			continue;
+		bench.cpus[bench.nr_cpus++] = cpu;
+	}
+	if (!bench.nr_cpus) {
+		fprintf(stderr, "no CPU is on the cpufreq-sim driver "
+			"(CONFIG_CPU_FREQ_SIM)\n");
+		exit(1);
+	}
+	bench.max_khz = sysfs_read_u64(bench.cpus[0], "cpuinfo_max_freq");
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: cpufreq-bench [-g governor,...] [-p pattern,...] [-q quantum_us] [-s settle_ms] [trace...]\n"
+		"  -g  governors to compare (default ondemand,interactive,conservative)\n"
+		"  -p  built-in patterns to replay: scroll, launch\n"
+		"  -q  CPU time between frequency checks (default 1000us)\n"
+		"  -s  idle time before each run (default 2000ms)\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	char *govs = strdup("ondemand,interactive,conservative");
+	char *patterns = NULL, *gov, *pat, *save;
+	char *saved_gov[MAX_CPUS];
+	struct trace *traces;
+	int nr_traces = 0, nr_govs = 0, opt, i;
+
+	bench.quantum_ns = 1000000;
+	bench.settle_ms = 2000;
+	while ((opt = getopt(argc, argv, "g:p:q:s:")) != -1) {
+		switch (opt) {
+		case 'g':
+			govs = strdup(optarg);
+			break;
+		case 'p':
+			patterns = strdup(optarg);
+			break;
+		case 'q':
+			bench.quantum_ns = strtoull(optarg, NULL, 10) * 1000;
+			break;
+		case 's':
+			bench.settle_ms = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if ((optind == argc && !patterns) || !bench.quantum_ns)
+		usage();
+
+	find_cpus();
+
+	traces = calloc(argc - optind + 2, sizeof(*traces));
+	for (i = optind; i < argc; i++)
+		load_trace(&traces[nr_traces++], argv[i]);
+	for (pat = patterns ? strtok_r(patterns, ",", &save) : NULL; pat;
+	     pat = strtok_r(NULL, ",", &save)) {
+		if (!strcmp(pat, "scroll"))
+			make_scroll(&traces[nr_traces++]);
+		else if (!strcmp(pat, "launch"))
+			make_launch(&traces[nr_traces++]);
+		else
+			usage();
+	}
+
+	for (i = 0; i < bench.nr_cpus; i++) {
+		char buf[64];
+
+		sysfs_read(bench.cpus[i], "scaling_governor", buf,
+			   sizeof(buf));
+		saved_gov[i] = strdup(buf);
+	}
+	for (gov = govs; *gov; gov++)
+		nr_govs += *gov == ',';
+	bench.results = calloc((nr_govs + 1) * nr_traces,
+			       sizeof(*bench.results));
+
+	for (i = 0; i < nr_traces; i++) {
+		char *list = strdup(govs);
+
+		for (gov = strtok_r(list, ",", &save); gov;
+		     gov = strtok_r(NULL, ",", &save))
+			replay(&traces[i], strdup(gov));
+		free(list);
+	}
+	summary();
+
+	for (i = 0; i < bench.nr_cpus; i++)
+		sysfs_write(bench.cpus[i], "scaling_governor", saved_gov[i]);
+	return 0;
+}
@@ -0,0 +1,471 @@
+/*
+ * iosched-bench - replay block traces against each I/O scheduler
+ *
+ * Reads blkparse text output, e.g. captured during boot or an app launch
+ * with
+ *
+ *	blktrace -d /dev/block/mmcblk0 -o - | blkparse -i - > launch.trace
+ *
+ * and replays its queue (Q) events against a block device at their
+ * original pace, once for every scheduler. Reads and sync writes are
+ * issued with O_DIRECT, async writes go through the page cache and are
+ * written back by the kernel, so that requests reach the scheduler with
+ * their original class. For each run it prints the latencies seen by the
+ * replayer and the kernel's queue and dispatch latency histograms
+ * (CONFIG_ELV_LATENCY_HIST). The data of the device is overwritten, so
+ * use the null_blk driver (CONFIG_BLK_DEV_NULL_BLK) or a scratch device.
+ *
+ *	modprobe null_blk completion_nsec=100000 read_kbps=40000
+ *	iosched-bench -d /dev/nullb0 -s noop,deadline,cfq,sio boot.trace
+ *
+ * Licensed under the terms of the GNU GPL, version 2.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+#include <linux/fs.h>
+
+#define MAX_IO_BYTES	(1024 * 1024)
+#define QUEUE_SIZE	4096
+
+enum {
+	CLASS_READ,
+	CLASS_SYNC_WRITE,
+	CLASS_ASYNC_WRITE,
+	NR_CLASSES,
+};
+
+static const char *class_names[NR_CLASSES] = {
+	"read", "sync_write", "async_write",
+};
+
+struct event {
+	uint64_t time_ns;	/* since the start of the trace */
+	uint64_t offset;	/* bytes */
+	uint32_t len;		/* bytes */
+	int class;
+};
+
+struct trace {
+	const char *name;
+	struct event *events;
+	size_t nr;
+};
+
+struct latencies {
+	unsigned long *us;
+	size_t nr, size;
+};
+
+static struct {
+	int direct_fd;
+	int buffered_fd;
+	uint64_t dev_size;
+	double speed;
+	int nr_workers;
+	char sysfs_queue[PATH_MAX];
+
+	/* dispatcher to workers */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct event *queue[QUEUE_SIZE];
+	unsigned int head, tail;
+	int done;
+
+	/* per run results, under lock */
+	struct latencies lat[NR_CLASSES];
+	unsigned long late;	/* events issued more than 1ms late */
+	unsigned long errors;
+} bench;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t ns)
+{
+	struct timespec ts = {
+		.tv_sec = ns / 1000000000ULL,
+		.tv_nsec = ns % 1000000000ULL,
+	};
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+	       EINTR)
+		;
+}
+
+static void *xrealloc(void *ptr, size_t size)
+{
+	ptr = realloc(ptr, size);
+	if (!ptr) {
+		perror("realloc");
+		exit(1);
+	}
+	return ptr;
+}
+
+/*
+ * Parses the default blkparse output format:
+ *   maj,min cpu seq secs.nsecs pid action rwbs sector + nr_sectors [comm]
+ */
+static void load_trace(struct trace *t, const char *path)
+{
+	char line[512];
+	size_t size = 0;
+	uint64_t first = 0;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f) {
+		perror(path);
+		exit(1);
+	}
+
+	t->name = path;
+	while (fgets(line, sizeof(line), f)) {
+		unsigned int maj, min, cpu, seq, pid, nr_sectors;
+		unsigned long secs, nsecs;
+		unsigned long long sector;
+		char action[8], rwbs[8];
+		struct event *e;
+		uint64_t ns;
+
+		if (sscanf(line, "%u,%u %u %u %lu.%lu %u %7s %7s %llu + %u",
+			   &maj, &min, &cpu, &seq, &secs, &nsecs, &pid,
+			   action, rwbs, &sector, &nr_sectors) != 11)
+			continue;
+		if (strcmp(action, "Q") || !nr_sectors ||
+		    strchr(rwbs, 'D') || (!strchr(rwbs, 'R') &&
+					  !strchr(rwbs, 'W')))
+			continue;
+
+		ns = (uint64_t)secs * 1000000000ULL + nsecs;
+		if (!t->nr)
+			first = ns;
+
+		if (t->nr == size) {
+			size = size ? size * 2 : 1024;
+			t->events = xrealloc(t->events,
+					     size * sizeof(*t->events));
+		}
+		e = &t->events[t->nr++];
+		e->time_ns = ns - first;
+		e->offset = sector * 512;
+		e->len = nr_sectors * 512;
+		if (e->len > MAX_IO_BYTES)
+			e->len = MAX_IO_BYTES;
+		if (strchr(rwbs, 'R'))
+			e->class = CLASS_READ;
+		else if (strchr(rwbs, 'S'))
+			e->class = CLASS_SYNC_WRITE;
+		else
+			e->class = CLASS_ASYNC_WRITE;
+	}
+	fclose(f);
+
+	if (!t->nr) {
+		fprintf(stderr, "%s: no queue events found\n", path);
+		exit(1);
+	}
+}
+
+static void lat_add(struct latencies *l, unsigned long us)
+{
+	if (l->nr == l->size) {
+		l->size = l->size ? l->size * 2 : 1024;
+		l->us = xrealloc(l->us, l->size * sizeof(*l->us));
+	}
+	l->us[l->nr++] = us;
+}
+
+static void do_io(struct event *e, char *buf)
+{
+	uint64_t offset = e->offset % (bench.dev_size - MAX_IO_BYTES);
+	uint64_t start = now_ns();
+	ssize_t ret;
+
+	offset &= ~4095ULL;
+	switch (e->class) {
+	case CLASS_READ:
+		ret = pread(bench.direct_fd, buf, e->len, offset);
+		break;
+	case CLASS_SYNC_WRITE:
+		ret = pwrite(bench.direct_fd, buf, e->len, offset);
+		break;
+	default:
+		ret = pwrite(bench.buffered_fd, buf, e->len, offset);
+		break;
+	}
+
+	pthread_mutex_lock(&bench.lock);
+	if (ret != (ssize_t)e->len)
+		bench.errors++;
+	else
+		lat_add(&bench.lat[e->class], (now_ns() - start) / 1000);
+	pthread_mutex_unlock(&bench.lock);
+}
+
+static void *worker(void *arg)
+{
+	char *buf;
+
+	if (posix_memalign((void **)&buf, 4096, MAX_IO_BYTES)) {
+		perror("posix_memalign");
+		exit(1);
+	}
+	memset(buf, 0x5a, MAX_IO_BYTES);
+
+	for (;;) {
+		struct event *e;
+
+		pthread_mutex_lock(&bench.lock);
+		while (bench.head == bench.tail && !bench.done)
+			pthread_cond_wait(&bench.cond, &bench.lock);
+		if (bench.head == bench.tail) {
+			pthread_mutex_unlock(&bench.lock);
+			break;
+		}
+		e = bench.queue[bench.tail++ % QUEUE_SIZE];
+		pthread_cond_broadcast(&bench.cond);
+		pthread_mutex_unlock(&bench.lock);
+
+		do_io(e, buf);
+	}
+
+	free(buf);
+	return NULL;
+}
+
+static int sysfs_write(const char *file, const char *val)
+{
+	char path[PATH_MAX + 64];
+	int fd, ret = 0;
+
+	snprintf(path, sizeof(path), "%s/%s", bench.sysfs_queue, file);
+	fd = open(path, O_WRONLY);
+	if (fd < 0 || write(fd, val, strlen(val)) < 0)
+		ret = -1;
+	if (fd >= 0)
+		close(fd);
+	return ret;
+}
+
+static void sysfs_dump(const char *file)
+{
+	char path[PATH_MAX + 64], buf[4096];
+	ssize_t len;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", bench.sysfs_queue, file);
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		printf("  %s: not available\n", file);
+		return;
+	}
+	printf("  %s:\n", file);
+	while ((len = read(fd, buf, sizeof(buf) - 1)) > 0) {
+		buf[len] = '\0';
+		fputs(buf, stdout);
+	}
+	close(fd);
+}
+
+static int cmp_ulong(const void *a, const void *b)
+{
+	unsigned long x = *(const unsigned long *)a;
+	unsigned long y = *(const unsigned long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void report(uint64_t elapsed_ns, uint64_t flush_ns)
+{
+	int c;
+
+	printf("  elapsed %.3fs, writeback flush %.3fs, %lu late, %lu errors\n",
+	       elapsed_ns / 1e9, flush_ns / 1e9, bench.late, bench.errors);
+	printf("  %-12s %8s %10s %10s %10s %10s (usecs)\n",
+	       "class", "ios", "p50", "p95", "p99", "max");
+	for (c = 0; c < NR_CLASSES; c++) {
+		struct latencies *l = &bench.lat[c];
+
+		if (!l->nr)
+			continue;
+		qsort(l->us, l->nr, sizeof(*l->us), cmp_ulong);
+		printf("  %-12s %8zu %10lu %10lu %10lu %10lu\n",
+		       class_names[c], l->nr, l->us[l->nr * 50 / 100],
+		       l->us[l->nr * 95 / 100], l->us[l->nr * 99 / 100],
+		       l->us[l->nr - 1]);
+	}
+	sysfs_dump("iosched/queue_latency");
+	sysfs_dump("iosched/dispatch_latency");
+}
+
+static void replay(struct trace *t, const char *sched)
+{
+	pthread_t *threads;
+	uint64_t start, flushed;
+	size_t i;
+	int c;
+
+	if (sysfs_write("scheduler", sched)) {
+		fprintf(stderr, "cannot select scheduler %s\n", sched);
+		return;
+	}
+	/* drop what earlier runs left in the page cache */
+	fsync(bench.buffered_fd);
+	posix_fadvise(bench.buffered_fd, 0, 0, POSIX_FADV_DONTNEED);
+	sysfs_write("iosched/queue_latency", "0");
+
+	for (c = 0; c < NR_CLASSES; c++)
+		bench.lat[c].nr = 0;
+	bench.late = bench.errors = 0;
+	bench.head = bench.tail = 0;
+	bench.done = 0;
+
+	threads = calloc(bench.nr_workers, sizeof(*threads));
+	for (i = 0; i < (size_t)bench.nr_workers; i++)
+		pthread_create(&threads[i], NULL, worker, NULL);
+
+	start = now_ns();
+	for (i = 0; i < t->nr; i++) {
+		struct event *e = &t->events[i];
+		uint64_t due = start + (uint64_t)(e->time_ns / bench.speed);
+
+		sleep_until(due);
+
+		pthread_mutex_lock(&bench.lock);
+		while (bench.head - bench.tail == QUEUE_SIZE)
+			pthread_cond_wait(&bench.cond, &bench.lock);
+		if (now_ns() > due + 1000000)
+			bench.late++;
+		bench.queue[bench.head++ % QUEUE_SIZE] = e;
+		pthread_cond_signal(&bench.cond);
+		pthread_mutex_unlock(&bench.lock);
+	}
+
+	pthread_mutex_lock(&bench.lock);
+	bench.done = 1;
+	pthread_cond_broadcast(&bench.cond);
+	pthread_mutex_unlock(&bench.lock);
+	for (i = 0; i < (size_t)bench.nr_workers; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+
+	flushed = now_ns();
+	fsync(bench.buffered_fd);
+
+	printf("%s on %s:\n", t->name, sched);
+	report(flushed - start, now_ns() - flushed);
+	printf("\n");
+}
+
+/* The queue directory of the disk @dev is, or is a partition of */
+static void find_sysfs_queue(const char *dev)
+{
+	struct stat st;
+
+	if (stat(dev, &st) || !S_ISBLK(st.st_mode)) {
+		fprintf(stderr, "%s: not a block device\n", dev);
+		exit(1);
+	}
+	snprintf(bench.sysfs_queue, sizeof(bench.sysfs_queue),
+		 "/sys/dev/block/%u:%u/queue", major(st.st_rdev),
+		 minor(st.st_rdev));
+	if (access(bench.sysfs_queue, F_OK))
+		snprintf(bench.sysfs_queue, sizeof(bench.sysfs_queue),
+			 "/sys/dev/block/%u:%u/../queue", major(st.st_rdev),
+			 minor(st.st_rdev));
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: iosched-bench [-d device] [-s sched,...] [-j workers] [-x speed] trace...\n"
+		"  -d  device to replay on (default /dev/nullb0), its data is overwritten\n"
+		"  -s  schedulers to compare (default noop,deadline,cfq,sio)\n"
+		"  -j  concurrent requests in flight (default 8)\n"
+		"  -x  replay speed factor (default 1.0)\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	const char *dev = "/dev/nullb0";
+	char *scheds = strdup("noop,deadline,cfq,sio");
+	struct trace *traces;
+	int nr_traces, opt, i;
+	char *sched, *save;
+
+	bench.speed = 1.0;
+	bench.nr_workers = 8;
+	while ((opt = getopt(argc, argv, "d:s:j:x:")) != -1) {
+		switch (opt) {
+		case 'd':
+			dev = optarg;
+			break;
+		case 's':
+			scheds = strdup(optarg);
+			break;
+		case 'j':
+			bench.nr_workers = atoi(optarg);
+			break;
+		case 'x':
+			bench.speed = atof(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind == argc || bench.nr_workers < 1 || bench.speed <= 0)
+		usage();
+
+	nr_traces = argc - optind;
+	traces = calloc(nr_traces, sizeof(*traces));
+	for (i = 0; i < nr_traces; i++)
+		load_trace(&traces[i], argv[optind + i]);
+
+	find_sysfs_queue(dev);
+	bench.direct_fd = open(dev, O_RDWR | O_DIRECT);
+	bench.buffered_fd = open(dev, O_RDWR);
+	if (bench.direct_fd < 0 || bench.buffered_fd < 0) {
+		perror(dev);
+		return 1;
+	}
+	if (ioctl(bench.direct_fd, BLKGETSIZE64, &bench.dev_size) ||
+	    bench.dev_size <= 2 * MAX_IO_BYTES) {
+		fprintf(stderr, "%s: device too small\n", dev);
+		return 1;
+	}
+
+	pthread_mutex_init(&bench.lock, NULL);
+	pthread_cond_init(&bench.cond, NULL);
+
+	for (i = 0; i < nr_traces; i++) {
+		char *list = strdup(scheds);
+
+		for (sched = strtok_r(list, ",", &save); sched;
+		     sched = strtok_r(NULL, ",", &save))
+			replay(&traces[i], sched);
+		free(list);
+	}
+
+	return 0;
+}
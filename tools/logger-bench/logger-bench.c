@@ -0,0 +1,210 @@
+/*
+ * logger-bench - logger write throughput as concurrent writers are added
+ *
+ * Every writer is a thread with its own descriptor for the log that
+ * writes entries in the liblog format (priority, tag, message) in a loop.
+ *
+ *	logger-bench -w 8 -t 5 -s 100 -d /dev/log/radio
+ *
+ * runs 1, 2, ... 8 writers for 5 seconds each with 100 byte messages and
+ * prints the total and per-writer entries per second, followed by the
+ * log's counters over the run: how often a writer found the log lock
+ * taken or waited for an earlier writer to commit, and how many entries
+ * were dropped or overwritten. The log is flooded, so pick one whose
+ * contents can be lost.
+ *
+ * Licensed under the terms of the GNU GPL, version 2.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+
+#include "logger.h"
+
+#define MAX_WRITERS	256
+#define TAG		"logger-bench"
+
+struct writer {
+	pthread_t thread;
+	int fd;
+	uint64_t entries;
+	uint64_t ns;
+};
+
+static struct {
+	int max_writers;
+	int seconds;
+	size_t size;
+	const char *dev;
+	pthread_barrier_t start;
+} bench = {
+	.max_writers = 4,
+	.seconds = 5,
+	.size = 64,
+	.dev = "/dev/log/main",
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int log_open(void)
+{
+	int fd = open(bench.dev, O_WRONLY);
+
+	if (fd < 0) {
+		perror(bench.dev);
+		exit(1);
+	}
+	return fd;
+}
+
+static void get_stats(int fd, struct logger_stats *stats)
+{
+	if (ioctl(fd, LOGGER_GET_STATS, stats) < 0) {
+		perror("LOGGER_GET_STATS");
+		exit(1);
+	}
+}
+
+static void *writer(void *arg)
+{
+	struct writer *w = arg;
+	static char msg[LOGGER_ENTRY_MAX_PAYLOAD];
+	unsigned char prio = 4;		/* ANDROID_LOG_INFO */
+	struct iovec iov[3] = {
+		{ &prio, 1 },
+		{ TAG, sizeof(TAG) },
+		{ msg, bench.size },
+	};
+	uint64_t start, end;
+
+	pthread_barrier_wait(&bench.start);
+	start = now_ns();
+	end = start + bench.seconds * 1000000000ULL;
+	do {
+		int i;
+
+		for (i = 0; i < 256; i++) {
+			if (writev(w->fd, iov, 3) < 0 && errno != EINTR) {
+				perror("writev");
+				exit(1);
+			}
+		}
+		w->entries += 256;
+		w->ns = now_ns() - start;
+	} while (start + w->ns < end);
+
+	return NULL;
+}
+
+static void run(int nr_writers, int stats_fd)
+{
+	static struct writer writers[MAX_WRITERS];
+	struct logger_stats before, after;
+	double total = 0, min = 0, max = 0;
+	double secs;
+	int i;
+
+	memset(writers, 0, sizeof(writers));
+	if (pthread_barrier_init(&bench.start, NULL, nr_writers + 1)) {
+		perror("pthread_barrier_init");
+		exit(1);
+	}
+	for (i = 0; i < nr_writers; i++) {
+		writers[i].fd = log_open();
+		if (pthread_create(&writers[i].thread, NULL, writer,
+				   &writers[i])) {
+			perror("pthread_create");
+			exit(1);
+		}
+	}
+
+	get_stats(stats_fd, &before);
+	pthread_barrier_wait(&bench.start);
+	for (i = 0; i < nr_writers; i++)
+		pthread_join(writers[i].thread, NULL);
+	get_stats(stats_fd, &after);
+	pthread_barrier_destroy(&bench.start);
+
+	for (i = 0; i < nr_writers; i++) {
+		double rate = writers[i].entries * 1e9 / writers[i].ns;
+
+		total += rate;
+		if (!i || rate < min)
+			min = rate;
+		if (!i || rate > max)
+			max = rate;
+		close(writers[i].fd);
+	}
+
+	secs = bench.seconds;
+	printf("%7d %11.0f %11.0f %11.0f %11.0f %11.0f %11.0f %11llu %11.0f\n",
+	       nr_writers, total, total / nr_writers, min, max,
+	       (after.contended - before.contended) / secs,
+	       (after.commit_waits - before.commit_waits) / secs,
+	       (unsigned long long)(after.dropped - before.dropped),
+	       (after.overwritten - before.overwritten) / secs);
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: logger-bench [-w max_writers] [-t seconds] [-s bytes] [-d log]\n"
+		"  -w  run 1 up to max_writers writers (default 4)\n"
+		"  -t  seconds per run (default 5)\n"
+		"  -s  bytes per message (default 64)\n"
+		"  -d  log device (default /dev/log/main)\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int opt, i, fd;
+
+	while ((opt = getopt(argc, argv, "w:t:s:d:")) != -1) {
+		switch (opt) {
+		case 'w':
+			bench.max_writers = atoi(optarg);
+			break;
+		case 't':
+			bench.seconds = atoi(optarg);
+			break;
+		case 's':
+			bench.size = strtoul(optarg, NULL, 0);
+			break;
+		case 'd':
+			bench.dev = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc || bench.max_writers < 1 ||
+	    bench.max_writers > MAX_WRITERS || bench.seconds < 1 ||
+	    bench.size > LOGGER_ENTRY_MAX_PAYLOAD - 1 - sizeof(TAG))
+		usage();
+
+	fd = log_open();
+	printf("%7s %11s %11s %11s %11s %11s %11s %11s %11s\n", "writers",
+	       "total/s", "writer/s", "min/s", "max/s", "contended/s",
+	       "waits/s", "dropped", "overwrit./s");
+	for (i = 1; i <= bench.max_writers; i++) {
+		run(i, fd);
+		fflush(stdout);
+	}
+	return 0;
+}